@@ -24,83 +24,1076 @@
 #include "Arduino.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <fstream>
 #include <string>
 
-#include "serial/serial.h"
+Arduino::Arduino(std::string dev_path) : Arduino(dev_path, std::unique_ptr<Link>(new SerialLink(BAUD))) {}
 
-Arduino::Arduino(std::string dev_path) {
-    auto timeout = serial::Timeout::simpleTimeout(1000);
+Arduino::Arduino(std::string dev_path, std::unique_ptr<Link> link)
+    : dev_(std::move(link)), port_(dev_path), keep_outputs_on_close_(false), link_lost_(false), telemetry_rate_(0), state_interval_ms_(0),
+      analog_dirty_(0), digital_values_(0), digital_dirty_(0), running_(false), sending_(false),
+      writer_sleeping_(false), flush_waiters_(0),
+      telemetry_on_(false), telemetry_ring_(new TelemetrySlot[TELEMETRY_RING_SIZE]), telemetry_count_(0),
+      in_flight_(0), board_stats_time_us_(0), board_stats_requested_(false), board_commands_per_second_(0),
+      board_buffer_peak_(0), bytes_sent_(0), errors_count_(0), resyncs_(0) {
+    for (size_t i = 0; i < TELEMETRY_RING_SIZE; ++i) telemetry_ring_[i].index = UINT64_MAX;
+    for (auto &slot : analog_slots_) slot = 0;
+    for (auto &time : analog_written_us_) time = 0;
+    for (auto &time : digital_written_us_) time = 0;
+    frame_decoder_reset(&reply_decoder_);
+
+    // Reads only block briefly; how long to wait for a reply is decided by ReadReplies().
     try {
-        dev_.setTimeout(timeout);
-        dev_.setBaudrate(BAUD);
-        dev_.setPort(dev_path);
+        dev_->setTimeout(READ_TIMEOUT);
     } catch (...) {}
 }
 
 Arduino::~Arduino() {
+    if (running_) {
+        Flush();
+        running_ = false;
+        WakeWriter();
+        writer_.join();
+        { std::lock_guard<std::mutex> lock(reader_mutex_); }
+        reader_wake_.notify_one();
+        reader_.join();
+    }
+
     try {
-        dev_.write(std::vector<uint8_t>({CODE_CLOSE, CODE_END_SEQUENCE}));
-        dev_.close();
+        if (dev_->isOpen() && !link_lost_) {
+            std::lock_guard<std::mutex> lock(io_mutex_);
+            SendCommand(message_close(keep_outputs_on_close_ ? CLOSE_KEEP_OUTPUTS : 0));
+            ReadReplies(0, true);
+        }
+        dev_->close();
     } catch(...) {}
 }
 
+// Ports of the USB serial devices with the vendor and product ID of the board. The format of
+// the hardware ID differs between the platforms.
+std::vector<std::string> Arduino::FindPorts() {
+    char linux_id[32], windows_id[32];
+    snprintf(linux_id, sizeof(linux_id), "VID:PID=%04X:%04X", USB_VENDOR_ID, USB_PRODUCT_ID);
+    snprintf(windows_id, sizeof(windows_id), "VID_%04X&PID_%04X", USB_VENDOR_ID, USB_PRODUCT_ID);
+
+    std::vector<std::string> ports;
+    try {
+        for (const auto &info : serial::list_ports()) {
+            std::string id = info.hardware_id;
+            std::transform(id.begin(), id.end(), id.begin(), [](unsigned char c) { return (char)toupper(c); });
+            if (id.find(linux_id) != std::string::npos || id.find(windows_id) != std::string::npos) {
+                ports.push_back(info.port);
+            }
+        }
+    } catch (...) {}
+    return ports;
+}
+
 int Arduino::Open() {
+    std::vector<std::string> ports;
+    if (port_ == AUTO_PORT) {
+        ports = FindPorts();
+        if (ports.empty()) AddError("No Arduino Nano 33 BLE was found.");
+    } else {
+        ports.push_back(port_);
+    }
+
+    // The first port with the program running is used. Its outputs are read back and stay as
+    // they are until they are written.
+    bool attached = false;
+    {
+        std::lock_guard<std::mutex> lock(io_mutex_);
+        for (const auto &port : ports) {
+            bool host_state;
+            if (Attach(port, host_state) == 0 && QueryBoardInfo() == 0 && QueryOutputState() == 0) {
+                attached = true;
+                break;
+            }
+            try {
+                dev_->close();
+            } catch (...) {}
+        }
+    }
+    if (!attached) return 1;
+
+    for (unsigned int ch = 0; ch < number_of_channels_; ++ch) {
+        analog_slots_[ch] = (uint16_t)(output_state_.relative_values[ch] * 65535 + 0.5);
+    }
+    digital_values_ = output_state_.enable_mask;
+
+    running_ = true;
+    writer_ = std::thread(&Arduino::WriterThread, this);
+    reader_ = std::thread(&Arduino::ReaderThread, this);
+
+    return 0;
+}
+
+// Opens port and makes sure the program on the Arduino is running. The port is opened without
+// resetting the board, so host_state tells whether the board still has the outputs set by the
+// previous connection. Must be called while holding io_mutex_.
+int Arduino::Attach(const std::string &port, bool &host_state) {
     try {
-        dev_.open(); // This guarantess is_open==true after so we only need to catch exceptions.
-        dev_.write(std::vector<uint8_t>({CODE_OPEN, CODE_END_SEQUENCE}));
+        dev_->setPort(port);
+        dev_->open(); // This guarantess is_open==true after so we only need to catch exceptions.
+        dev_->flushInput();
     } catch (...) {
         return 1;
     }
+    frame_decoder_reset(&reply_decoder_);
+    pending_count_ = 0;
+    in_flight_ = 0;
+
+    // Other devices with the same USB IDs do not answer, so the timeout is short.
+    size_t failed = failed_commands_;
+    reply_payload_.clear();
+    if (SendCommand(message_begin(CODE_IDENTIFY)) != 0 || ReadReplies(0, true, IDENTIFY_TIMEOUT) != 0
+        || failed_commands_ != failed || reply_payload_.size() < FIRMWARE_ID_LENGTH + 2
+        || std::string(reply_payload_.begin(), reply_payload_.begin() + FIRMWARE_ID_LENGTH) != FIRMWARE_ID) {
+        AddError("The program on the Arduino at " + port + " did not identify itself. Please update the Arduino program.");
+        return 1;
+    }
+    if (reply_payload_[FIRMWARE_ID_LENGTH] != PROTOCOL_VERSION) {
+        AddError("The Arduino program uses protocol version " + std::to_string(reply_payload_[FIRMWARE_ID_LENGTH])
+                 + " but version " + std::to_string(PROTOCOL_VERSION) + " is required.");
+        return 1;
+    }
+    host_state = reply_payload_[FIRMWARE_ID_LENGTH + 1] != 0;
+
+    if (SendCommand(message_begin(CODE_OPEN)) != 0 || ReadReplies(0, true) != 0) return 1;
+    link_lost_ = false;
+    return 0;
+}
 
+// Reads the protocol version, channels and buffer sizes of the board. Fails if the board speaks
+// a different protocol version.
+int Arduino::QueryBoardInfo() {
+    reply_payload_.clear();
+    if (SendCommand(message_begin(CODE_GET_INFO)) != 0 || ReadReplies(0, true) != 0) return 1;
+    if (reply_payload_.size() < INFO_CHANNELS_OFFSET) {
+        AddError("The Arduino did not report its channels. Please update the Arduino program.");
+        return 1;
+    }
+    if (reply_payload_[0] != PROTOCOL_VERSION) {
+        AddError("The Arduino program uses protocol version " + std::to_string(reply_payload_[0])
+                 + " but version " + std::to_string(PROTOCOL_VERSION) + " is required.");
+        return 1;
+    }
+
+    unsigned int channels = reply_payload_[1];
+    if (channels > MAX_CHANNELS || reply_payload_.size() < INFO_CHANNELS_OFFSET + 2 * channels) {
+        AddError("Received malformed board information.");
+        return 1;
+    }
+    number_of_channels_ = channels;
+    max_sequence_length_ = get_u16(&reply_payload_[2]);
+    max_waveform_events_ = get_u16(&reply_payload_[4]);
+    calibration_size_ = get_u16(&reply_payload_[8]);
+    number_of_monitors_ = std::min<unsigned int>(reply_payload_[10], MAX_MONITOR_INPUTS);
+    number_of_modulators_ = reply_payload_[11];
+    channel_outputs_.clear();
+    for (unsigned int ch = 0; ch < channels; ++ch) {
+        channel_outputs_.emplace_back(reply_payload_[INFO_CHANNELS_OFFSET + 2 * ch],
+                                      reply_payload_[INFO_CHANNELS_OFFSET + 1 + 2 * ch]);
+    }
+    return 0;
+}
+
+// Reads the outputs as the board has them. Must be called after QueryBoardInfo().
+int Arduino::QueryOutputState() {
+    reply_payload_.clear();
+    if (SendCommand(message_begin(CODE_GET_STATE)) != 0 || ReadReplies(0, true) != 0) return 1;
+    if (reply_payload_.size() < STATE_CHANNELS_OFFSET + 2 * number_of_channels_) {
+        AddError("Received malformed output state.");
+        return 1;
+    }
+    output_state_.enable_mask = get_u16(&reply_payload_[0]);
+    output_state_.blanking_mask = get_u16(&reply_payload_[2]);
+    output_state_.blanking_active_low = reply_payload_[4] != 0;
+    output_state_.relative_values.clear();
+    for (unsigned int ch = 0; ch < number_of_channels_; ++ch) {
+        output_state_.relative_values.push_back(get_u16(&reply_payload_[STATE_CHANNELS_OFFSET + 2 * ch]) / 65535.0);
+    }
+    return 0;
+}
+
+int Arduino::GetOutputState(OutputState &state) {
+    if (!running_) return 1;
+    state = output_state_;
+    return 0;
+}
+
+void Arduino::SetKeepOutputsOnClose(bool keep) {
+    keep_outputs_on_close_ = keep;
+}
+
+// Called by the thread that noticed the failure while holding io_mutex_.
+void Arduino::ConnectionLost() {
+    if (!link_lost_.exchange(true)) {
+        AddError("Lost the connection to the Arduino.");
+        WakeWriter();
+    }
+}
+
+// Reopens the port after the connection was lost and resends the outputs and the telemetry
+// settings. If the board restarted in the meantime, everything else the host had set up on it
+// is gone, which is reported as an error.
+int Arduino::Reconnect() {
+    std::lock_guard<std::mutex> lock(io_mutex_);
+    try {
+        dev_->close();
+    } catch (...) {}
+    pending_count_ = 0;
+    in_flight_ = 0;
+    NotifyIdle();
+
+    std::vector<std::string> ports;
+    if (port_ == AUTO_PORT) ports = FindPorts();
+    else ports.push_back(port_);
+
+    for (const auto &port : ports) {
+        bool host_state;
+        if (Attach(port, host_state) != 0) {
+            try {
+                dev_->close();
+            } catch (...) {}
+            link_lost_ = true;
+            continue;
+        }
+        if (!host_state) {
+            AddError("The Arduino restarted while it was disconnected. Calibration, blanking, modulation, sequences and waveforms have to be set up again.");
+        }
+
+        uint32_t all_channels = (1u << number_of_channels_) - 1;
+        analog_dirty_ |= all_channels;
+        digital_dirty_ |= all_channels;
+        unsigned int rate = telemetry_rate_, interval = state_interval_ms_;
+        if (rate != 0 || interval != 0) {
+            SendCommand(message_set_telemetry(rate, interval));
+        }
+        return 0;
+    }
+    return 1;
+}
+
+unsigned int Arduino::GetNumberOfChannels() const {
+    return number_of_channels_;
+}
+
+int Arduino::GetChannelOutput(unsigned int channel, uint8_t &dac_address, uint8_t &dac_output) const {
+    if (channel >= channel_outputs_.size()) return 1;
+    dac_address = channel_outputs_[channel].first;
+    dac_output = channel_outputs_[channel].second;
     return 0;
 }
 
 bool Arduino::DeviceIsOpen() const {
     try {
-        return dev_.isOpen();
+        return dev_->isOpen();
     } catch (...) {
         return false;
     }
 }
 
-int Arduino::WriteAnalogRelative(unsigned int channel, double relative_value) {
-    std::string value_string = std::to_string(relative_value);
+// The order of the checks matters: the writer clears the dirty masks before it sets in_flight_
+// and only then clears sending_.
+bool Arduino::Busy() {
+    return analog_dirty_ != 0 || digital_dirty_ != 0 || sending_ || in_flight_ != 0;
+}
 
-    std::vector<uint8_t> sendbuf;
+int Arduino::Flush() {
+    if (!Busy()) return 0;
+    std::unique_lock<std::mutex> lock(flush_mutex_);
+    ++flush_waiters_;
+    bool idle = flushed_.wait_for(lock, std::chrono::milliseconds(FLUSH_TIMEOUT), [this] { return !Busy(); });
+    --flush_waiters_;
+    return idle ? 0 : 1;
+}
 
-    uint16_t value = (unsigned short)(relative_value * 65535);
+// Wakes Flush() once the writes are done. Called after every change that can make Busy() false;
+// Flush() registers as a waiter before it checks Busy(), so either it sees the change or it is
+// notified.
+void Arduino::NotifyIdle() {
+    if (flush_waiters_ == 0 || Busy()) return;
+    { std::lock_guard<std::mutex> lock(flush_mutex_); }
+    flushed_.notify_all();
+}
 
-    sendbuf.push_back(CODE_WRITE_ANALOG);
-    sendbuf.push_back(channel);
-    sendbuf.push_back((uint8_t)value);
-    sendbuf.push_back((uint8_t)(value >> 8));
-    sendbuf.push_back(CODE_END_SEQUENCE);
+int Arduino::SetMaxPendingCommands(unsigned int count) {
+    if (count == 0 || count > MAX_PENDING_COMMANDS) return 1;
+    std::lock_guard<std::mutex> lock(io_mutex_);
+    max_pending_ = count;
+    return 0;
+}
 
+// Switches the port to the low latency mode of the serial library (Linux only): writes go to
+// the non-blocking port without waiting for it first, reads do not wait for byte times that do
+// not apply to USB, and replies are processed as soon as the port becomes readable.
+int Arduino::SetLowLatency(bool low_latency) {
+    if (running_) return 1;
     try {
-        dev_.write(sendbuf);
+        dev_->setLowLatency(low_latency);
     } catch (...) {
         return 1;
     }
+    low_latency_ = low_latency;
+    return 0;
+}
+
+std::string Arduino::PopError() {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    if (errors_.empty()) return "";
+    std::string error = errors_.front();
+    errors_.pop_front();
+    return error;
+}
+
+void Arduino::AddError(const std::string &error) {
+    errors_count_++;
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    errors_.push_back(error);
+    if (errors_.size() > MAX_QUEUED_ERRORS) errors_.pop_front();
+}
+
+// Microseconds on the steady clock, used for all latency measurements
+static uint64_t NowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static unsigned int CountBits(uint32_t mask) {
+    unsigned int count = 0;
+    for (; mask != 0; mask &= mask - 1) ++count;
+    return count;
+}
+
+void Arduino::GetStatistics(BoardStatistics &stats) {
+    stats.write_latency_p50_us = write_latency_.Percentile(0.5);
+    stats.write_latency_p99_us = write_latency_.Percentile(0.99);
+    stats.write_latency_max_us = write_latency_.Max();
+    stats.send_latency_p50_us = send_latency_.Percentile(0.5);
+    stats.send_latency_p99_us = send_latency_.Percentile(0.99);
+    stats.commands = write_latency_.Count();
+    stats.bytes_sent = bytes_sent_;
+    stats.queue_depth = CountBits(analog_dirty_) + CountBits(digital_dirty_) + in_flight_;
+    stats.errors = errors_count_;
+    stats.resyncs = resyncs_;
+
+    RequestBoardStatistics();
+    stats.board_commands_per_second = board_commands_per_second_;
+    stats.board_buffer_peak = board_buffer_peak_;
+}
+
+// Has the writer ask the Arduino for its statistics, at most once per BOARD_STATS_INTERVAL.
+void Arduino::RequestBoardStatistics() {
+    if (!running_ || link_lost_) return;
+    uint64_t now_us = NowUs();
+    uint64_t last_us = board_stats_time_us_;
+    if (now_us - last_us < BOARD_STATS_INTERVAL * 1000ull) return;
+    if (!board_stats_time_us_.compare_exchange_strong(last_us, now_us)) return; // Another caller asked
+    board_stats_requested_ = true;
+    WakeWriter();
+}
+
+void Arduino::HandleBoardStatistics(const uint8_t *payload, size_t length) {
+    if (length < 14) return;
+    auto read32 = [payload](size_t pos) {
+        return (uint32_t)payload[pos] | ((uint32_t)payload[pos + 1] << 8) | ((uint32_t)payload[pos + 2] << 16)
+            | ((uint32_t)payload[pos + 3] << 24);
+    };
+    uint32_t commands = read32(0);
+    uint32_t processing_us = read32(4);
+    board_commands_per_second_ = processing_us ? (uint64_t)commands * 1000000 / processing_us : 0;
+    board_buffer_peak_ = payload[12] | (payload[13] << 8);
+}
+
+void Arduino::ResetStatistics() {
+    write_latency_.Reset();
+    send_latency_.Reset();
+    bytes_sent_ = 0;
+    errors_count_ = 0;
+    resyncs_ = 0;
+}
+
+void Arduino::WakeWriter() {
+    // The writer sets writer_sleeping_ before it checks for work, so if it is not set, the writer
+    // will see the new values. Otherwise, taking the mutex makes sure it is waiting.
+    if (!writer_sleeping_) return;
+    { std::lock_guard<std::mutex> lock(wake_mutex_); }
+    wake_.notify_one();
+}
+
+void Arduino::WriterThread() {
+    while (running_) {
+        if (link_lost_ && Reconnect() != 0) {
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            writer_sleeping_ = true;
+            wake_.wait_for(lock, std::chrono::milliseconds(RECONNECT_INTERVAL), [this] { return !running_; });
+            writer_sleeping_ = false;
+            continue;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            auto has_work = [this] {
+                return !running_ || link_lost_ || analog_dirty_ != 0 || digital_dirty_ != 0 || board_stats_requested_;
+            };
+            writer_sleeping_ = true;
+            if (in_flight_ == 0 || low_latency_) {
+                wake_.wait(lock, has_work);
+            } else {
+                // Acknowledgements are outstanding; poll for them in between.
+                wake_.wait_for(lock, std::chrono::microseconds(200), has_work);
+            }
+            writer_sleeping_ = false;
+        }
+
+        std::lock_guard<std::mutex> lock(io_mutex_);
+        SendQueued();
+        if (board_stats_requested_.exchange(false)) SendCommand(message_begin(CODE_GET_STATS));
+        ReadReplies(0, false);
+    }
+}
+
+// Collects telemetry while it is on. Acknowledgements are still read by the threads waiting
+// for them; the reader only processes what has arrived in between.
+void Arduino::ReaderThread() {
+    while (running_) {
+        if (low_latency_) {
+            // Waiting does not take the read lock, so the port is only locked once data is there.
+            if (link_lost_) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(READ_TIMEOUT));
+                continue;
+            }
+            try {
+                if (!dev_->waitReadable()) continue;
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(io_mutex_);
+                ConnectionLost();
+                continue;
+            }
+        } else {
+            {
+                std::unique_lock<std::mutex> lock(reader_mutex_);
+                reader_wake_.wait(lock, [this] { return !running_ || telemetry_on_; });
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(TELEMETRY_POLL_INTERVAL));
+        }
+
+        std::lock_guard<std::mutex> lock(io_mutex_);
+        try {
+            uint8_t buf[256];
+            for (size_t available = dev_->available(); available > 0; available = dev_->available()) {
+                size_t count = dev_->read(buf, std::min(available, sizeof(buf)));
+                if (count == 0) break;
+                ProcessReplyBytes(buf, count);
+            }
+        } catch (...) {
+            ConnectionLost();
+        }
+    }
+}
+
+// Sends the contents of the slots. Channels written together are sent in a single frame.
+int Arduino::SendQueued() {
+    sending_ = true;
+
+    while (batch_lock_.test_and_set(std::memory_order_acquire)) std::this_thread::yield();
+    uint32_t analog_mask = analog_dirty_.exchange(0);
+    uint16_t analog_values[MAX_CHANNELS];
+    uint64_t analog_written_us = UINT64_MAX;
+    for (unsigned int ch = 0; ch < MAX_CHANNELS; ++ch) {
+        if (!(analog_mask & (1u << ch))) continue;
+        analog_values[ch] = analog_slots_[ch];
+        analog_written_us = std::min(analog_written_us, analog_written_us_[ch].load());
+    }
+    uint32_t digital_mask = digital_dirty_.exchange(0);
+    uint32_t digital_values = digital_values_;
+    uint64_t digital_written_us = UINT64_MAX;
+    for (unsigned int ch = 0; ch < MAX_CHANNELS; ++ch) {
+        if (digital_mask & (1u << ch)) digital_written_us = std::min(digital_written_us, digital_written_us_[ch].load());
+    }
+    batch_lock_.clear(std::memory_order_release);
+
+    // The messages are encoded on the stack, so sending writes does not allocate. Analog and
+    // digital writes go out with a single write to the port.
+    Message messages[2];
+    uint64_t written_us[2];
+    size_t count = 0;
+    if (analog_mask != 0) {
+        if ((analog_mask & (analog_mask - 1)) == 0) { // Single channel
+            unsigned int ch = 0;
+            while (!(analog_mask & (1u << ch))) ++ch;
+            messages[count] = message_write_analog(ch, analog_values[ch]);
+        } else {
+            messages[count] = message_write_analog_multi(analog_mask, analog_values);
+        }
+        written_us[count++] = analog_written_us;
+    }
+
+    if (digital_mask != 0) {
+        if ((digital_mask & (digital_mask - 1)) == 0) { // Single channel
+            unsigned int ch = 0;
+            while (!(digital_mask & (1u << ch))) ++ch;
+            messages[count] = message_write_digital(ch, (digital_values >> ch) & 0x01);
+        } else {
+            messages[count] = message_write_digital_multi(digital_mask, digital_values);
+        }
+        written_us[count++] = digital_written_us;
+    }
 
+    int ret = count > 0 ? SendCommands(messages, written_us, count) : 0;
+    sending_ = false;
+    NotifyIdle();
+    return ret;
+}
+
+// Sends commands that must not be reordered with or coalesced into other writes. Everything
+// written before is sent first and the call returns once all frames have been acknowledged.
+// Fails if any of the commands failed. payload receives the data returned by the last command.
+int Arduino::SendOrdered(const std::vector<Message> &messages, std::vector<uint8_t> *payload) {
+    if (!running_ || link_lost_ || Flush() != 0) return 1;
+
+    std::lock_guard<std::mutex> lock(io_mutex_);
+    size_t failed = failed_commands_;
+    reply_payload_.clear();
+    const uint64_t written_us[MAX_GATHER_FRAMES] = {};
+    for (size_t first = 0; first < messages.size(); first += MAX_GATHER_FRAMES) {
+        size_t count = std::min<size_t>(messages.size() - first, MAX_GATHER_FRAMES);
+        if (SendCommands(&messages[first], written_us, count) != 0) return 1;
+    }
+    if (ReadReplies(0, true) != 0 || failed_commands_ != failed) return 1;
+    if (payload) *payload = reply_payload_;
     return 0;
-};
+}
 
-int Arduino::WriteDigital(unsigned int channel, bool value) {
-    std::vector<uint8_t> sendbuf;
-    sendbuf.push_back(CODE_WRITE_DIGITAL);
-    sendbuf.push_back(channel);
+int Arduino::SendCommand(const Message &message, uint64_t written_us) {
+    return SendCommands(&message, &written_us, 1);
+}
 
-    if (value) sendbuf.push_back(0x01);
-    else sendbuf.push_back(0x00);
+// Sends messages, at most MAX_GATHER_FRAMES of them with a single write. The sequence numbers
+// are filled in here. Blocks only while the maximum number of unacknowledged commands is
+// reached. written_us holds the time the caller wrote the values each command carries; 0 means
+// now.
+int Arduino::SendCommands(const Message *messages, const uint64_t *written_us, size_t count) {
+    uint64_t now_us = NowUs();
+    while (count > 0) {
+        size_t batch = std::min<size_t>(std::min<size_t>(count, MAX_GATHER_FRAMES), max_pending_);
+        if (ReadReplies(max_pending_ - batch, true) != 0) return 1;
 
-    sendbuf.push_back(CODE_END_SEQUENCE);
+        uint8_t encoded[MAX_GATHER_FRAMES][FRAME_MAX_ENCODED];
+        serial::WriteBuffer buffers[MAX_GATHER_FRAMES];
+        uint8_t seqs[MAX_GATHER_FRAMES];
+        size_t length = 0;
+        for (size_t i = 0; i < batch; ++i) {
+            Message message = messages[i];
+            seqs[i] = next_seq_++;
+            message.data[1] = seqs[i];
+            buffers[i].data = encoded[i];
+            buffers[i].size = frame_encode(message.data, message.length, encoded[i]);
+            length += buffers[i].size;
+        }
 
+        try {
+            dev_->writeGather(buffers, batch);
+        } catch (...) {
+            AddError("Could not write to the device.");
+            ConnectionLost();
+            return 1;
+        }
+
+        bytes_sent_ += length;
+        uint64_t sent_us = NowUs();
+        for (size_t i = 0; i < batch; ++i) {
+            uint64_t written = written_us[i] != 0 ? written_us[i] : now_us;
+            send_latency_.Record(sent_us - written);
+            pending_[(pending_first_ + pending_count_) % MAX_PENDING_COMMANDS] = {seqs[i], messages[i].data[0], written};
+            in_flight_ = ++pending_count_;
+        }
+
+        messages += batch;
+        written_us += batch;
+        count -= batch;
+    }
+    return 0;
+}
+
+// Processes replies until at most max_pending commands are unacknowledged. Without block, only
+// bytes that have already been received are processed. Returns 1 on timeout, which also occurs
+// if telemetry keeps arriving but no acknowledgement does.
+int Arduino::ReadReplies(size_t max_pending, bool block, unsigned int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
     try {
-        dev_.write(sendbuf);
+        while (pending_count_ > max_pending) {
+            size_t available = dev_->available();
+            if (available == 0) {
+                if (!block) return 0;
+                available = 1; // Wait for the next byte until the read times out
+            }
+
+            uint8_t buf[64];
+            size_t count = dev_->read(buf, std::min(available, sizeof(buf)));
+            size_t pending = pending_count_;
+            ProcessReplyBytes(buf, count);
+            if (pending_count_ < pending) {
+                deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+            } else if (std::chrono::steady_clock::now() > deadline) {
+                AddError("Timeout while waiting for acknowledgement.");
+                resyncs_++;
+                pending_count_ = 0;
+                in_flight_ = 0;
+                NotifyIdle();
+                return 1;
+            }
+        }
     } catch (...) {
+        ConnectionLost();
         return 1;
     }
 
+    return 0;
+}
+
+void Arduino::ProcessReplyBytes(const uint8_t *bytes, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        int length = frame_decoder_push(&reply_decoder_, bytes[i]);
+        if (length >= 0) {
+            HandleReply(reply_decoder_.message, length);
+        } else if (length == FRAME_INVALID) {
+            AddError("Received corrupted reply.");
+            resyncs_++;
+        }
+    }
+}
+
+void Arduino::HandleReply(const uint8_t *reply, size_t length) {
+    if (length >= 1 && reply[0] == CODE_TELEMETRY_SAMPLES) {
+        HandleMonitorSamples(reply, length);
+        return;
+    }
+    if (length >= 1 && reply[0] == CODE_TELEMETRY_STATE) {
+        HandleBoardState(reply, length);
+        return;
+    }
+
+    if (length == 1 && reply[0] == CODE_FRAME_ERROR) {
+        AddError("The Arduino received a corrupted frame.");
+        resyncs_++;
+        return;
+    }
+
+    if (length < 3 || reply[0] != CODE_ACK) {
+        AddError("Received malformed reply.");
+        return;
+    }
+
+    uint8_t seq = reply[1];
+    uint8_t status = reply[2];
+
+    // Replies arrive in order; commands before the acknowledged one were lost.
+    size_t position = 0;
+    while (position < pending_count_ && pending_[(pending_first_ + position) % MAX_PENDING_COMMANDS].seq != seq) {
+        position++;
+    }
+    if (position == pending_count_) {
+        AddError("Received unexpected acknowledgement.");
+        return;
+    }
+    if (position != 0) {
+        AddError(std::to_string(position) + " command(s) were not acknowledged.");
+        resyncs_++;
+    }
+    const PendingCommand &command = pending_[(pending_first_ + position) % MAX_PENDING_COMMANDS];
+    write_latency_.Record(NowUs() - command.written_us);
+    // Statistics queries are sent by the writer between other commands, so their reply must not
+    // end up as the payload of a command that somebody waits for.
+    if (command.code == CODE_GET_STATS) HandleBoardStatistics(reply + 3, length - 3);
+    else if (length > 3) reply_payload_.assign(reply + 3, reply + length);
+    pending_first_ = (pending_first_ + position + 1) % MAX_PENDING_COMMANDS;
+    pending_count_ -= position + 1;
+    in_flight_ = pending_count_;
+    NotifyIdle();
+
+    if (status != STATUS_OK) {
+        failed_commands_++;
+        AddError("Command " + std::to_string(seq) + " failed with status " + std::to_string(status) + ".");
+    }
+}
+
+// Converts a relative value in [0, 1] to the 16-bit value sent to the Arduino.
+static uint16_t RelativeToRaw(double relative_value) {
+    return (unsigned short)(relative_value * 65535);
+}
+
+int Arduino::WriteAnalogRelative(unsigned int channel, double relative_value) {
+    if (!running_ || channel >= number_of_channels_) return 1;
+
+    analog_slots_[channel] = RelativeToRaw(relative_value);
+    analog_written_us_[channel] = NowUs();
+    analog_dirty_ |= 1u << channel;
+    WakeWriter();
+    return 0;
+};
+
+int Arduino::WriteDigital(unsigned int channel, bool value) {
+    if (!running_ || channel >= number_of_channels_) return 1;
+
+    if (value) digital_values_ |= 1u << channel;
+    else digital_values_ &= ~(1u << channel);
+    digital_written_us_[channel] = NowUs();
+    digital_dirty_ |= 1u << channel;
+    WakeWriter();
     return 0;
 };
+
+int Arduino::WriteAnalogRelativeMulti(uint32_t channel_mask, const std::vector<double> &relative_values) {
+    if (!running_ || (channel_mask >> number_of_channels_)) return 1;
+    for (unsigned int ch = 0; (channel_mask >> ch) != 0; ++ch) {
+        if ((channel_mask & (1u << ch)) && ch >= relative_values.size()) return 1;
+    }
+
+    uint64_t now = NowUs();
+    while (batch_lock_.test_and_set(std::memory_order_acquire)) std::this_thread::yield();
+    for (unsigned int ch = 0; (channel_mask >> ch) != 0; ++ch) {
+        if (!(channel_mask & (1u << ch))) continue;
+        analog_slots_[ch] = RelativeToRaw(relative_values[ch]);
+        analog_written_us_[ch] = now;
+    }
+    analog_dirty_ |= channel_mask;
+    batch_lock_.clear(std::memory_order_release);
+
+    WakeWriter();
+    return 0;
+}
+
+int Arduino::WriteDigitalMulti(uint32_t channel_mask, uint32_t values) {
+    if (!running_ || (channel_mask >> number_of_channels_)) return 1;
+
+    uint64_t now = NowUs();
+    while (batch_lock_.test_and_set(std::memory_order_acquire)) std::this_thread::yield();
+    digital_values_ = (digital_values_ & ~channel_mask) | (values & channel_mask);
+    for (unsigned int ch = 0; ch < MAX_CHANNELS; ++ch) {
+        if (channel_mask & (1u << ch)) digital_written_us_[ch] = now;
+    }
+    digital_dirty_ |= channel_mask;
+    batch_lock_.clear(std::memory_order_release);
+
+    WakeWriter();
+    return 0;
+}
+
+unsigned int Arduino::GetMaxSequenceLength() const {
+    return max_sequence_length_;
+}
+
+int Arduino::WriteSequenceCommand(uint8_t code, unsigned int channel, uint8_t type) {
+    return SendOrdered({message_sequence(code, channel, type)});
+}
+
+int Arduino::LoadSequence(unsigned int channel, uint8_t type, const std::vector<uint16_t> &values) {
+    unsigned int channels = type == SEQUENCE_MODULATION ? number_of_modulators_ : number_of_channels_;
+    if (channel >= channels || values.size() > max_sequence_length_) return 1;
+
+    std::vector<Message> messages;
+    messages.push_back(message_sequence(CODE_CLEAR_SEQUENCE, channel, type));
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (i % SEQUENCE_VALUES_PER_FRAME == 0) {
+            messages.push_back(message_sequence(CODE_LOAD_SEQUENCE, channel, type));
+        }
+        message_put_u16(messages.back(), values[i]);
+    }
+
+    return SendOrdered(messages);
+}
+
+int Arduino::LoadAnalogSequence(unsigned int channel, const std::vector<double> &relative_values) {
+    std::vector<uint16_t> values;
+    for (double relative_value : relative_values) {
+        values.push_back(RelativeToRaw(relative_value));
+    }
+    return LoadSequence(channel, SEQUENCE_ANALOG, values);
+}
+
+int Arduino::LoadDigitalSequence(unsigned int channel, const std::vector<bool> &values) {
+    std::vector<uint16_t> raw_values;
+    for (bool value : values) {
+        raw_values.push_back(value ? 0x01 : 0x00);
+    }
+    return LoadSequence(channel, SEQUENCE_DIGITAL, raw_values);
+}
+
+int Arduino::StartAnalogSequence(unsigned int channel) {
+    return WriteSequenceCommand(CODE_START_SEQUENCE, channel, SEQUENCE_ANALOG);
+}
+
+int Arduino::StopAnalogSequence(unsigned int channel) {
+    return WriteSequenceCommand(CODE_STOP_SEQUENCE, channel, SEQUENCE_ANALOG);
+}
+
+int Arduino::StartDigitalSequence(unsigned int channel) {
+    return WriteSequenceCommand(CODE_START_SEQUENCE, channel, SEQUENCE_DIGITAL);
+}
+
+int Arduino::StopDigitalSequence(unsigned int channel) {
+    return WriteSequenceCommand(CODE_STOP_SEQUENCE, channel, SEQUENCE_DIGITAL);
+}
+
+unsigned int Arduino::GetMaxWaveformEvents() const {
+    return max_waveform_events_;
+}
+
+int Arduino::LoadWaveform(const std::vector<WaveformEvent> &events) {
+    if (events.size() > max_waveform_events_) return 1;
+
+    std::vector<Message> messages;
+    messages.push_back(message_begin(CODE_WAVEFORM_CLEAR));
+    for (size_t i = 0; i < events.size(); ++i) {
+        const WaveformEvent &event = events[i];
+        if ((event.on_mask | event.off_mask) >> number_of_channels_ || event.power_channel >= (int)number_of_channels_) return 1;
+
+        if (i % WAVEFORM_EVENTS_PER_FRAME == 0) messages.push_back(message_begin(CODE_WAVEFORM_LOAD));
+        uint16_t power = event.power_channel < 0 ? 0 : RelativeToRaw(event.relative_power);
+        message_put_waveform_event(messages.back(), event.time_us, event.on_mask, event.off_mask,
+                                   event.power_channel < 0 ? WAVEFORM_NO_CHANNEL : (uint8_t)event.power_channel, power);
+    }
+
+    return SendOrdered(messages);
+}
+
+int Arduino::StartWaveform(uint32_t channel_mask, uint32_t period_us, unsigned int repetitions, bool on_trigger) {
+    if ((channel_mask >> number_of_channels_) || repetitions > WAVEFORM_MAX_REPETITIONS) return 1;
+
+    uint8_t flags = on_trigger ? WAVEFORM_START_ON_TRIGGER : 0;
+    return SendOrdered({message_waveform_start(channel_mask, repetitions, period_us, flags)});
+}
+
+int Arduino::StopWaveform() {
+    return SendOrdered({message_begin(CODE_WAVEFORM_STOP)});
+}
+
+int Arduino::GetWaveformStatus(bool &running, uint32_t &periods) {
+    std::vector<uint8_t> payload;
+    if (SendOrdered({message_begin(CODE_WAVEFORM_STATUS)}, &payload) != 0 || payload.size() < 5) return 1;
+    running = payload[0] != 0;
+    periods = get_u32(&payload[1]);
+    return 0;
+}
+
+int Arduino::SetBlanking(uint32_t channel_mask, bool active_low) {
+    if (channel_mask >> number_of_channels_) return 1;
+
+    return SendOrdered({message_set_blanking(channel_mask, active_low)});
+}
+
+int Arduino::Ramp(unsigned int channel, double relative_value, uint32_t duration_us, bool exponential) {
+    if (channel >= number_of_channels_) return 1;
+
+    uint8_t curve = exponential ? RAMP_EXPONENTIAL : RAMP_LINEAR;
+    return SendOrdered({message_ramp(channel, RelativeToRaw(relative_value), duration_us, curve)});
+}
+
+unsigned int Arduino::GetNumberOfModulators() const {
+    return number_of_modulators_;
+}
+
+// Period word and high time of a frequency and duty cycle at a prescaler. Fails if the period
+// does not fit into the PWM's counter at that prescaler.
+static bool ModulationWords(double frequency_hz, double duty_cycle, int prescaler, uint16_t &period, uint16_t &high) {
+    if (!(frequency_hz > 0) || !(duty_cycle >= 0 && duty_cycle <= 1)) return false;
+    long top = std::lround(MODULATION_CLOCK / (double)(1 << prescaler) / frequency_hz);
+    if (top < MODULATION_MIN_TOP || top > MODULATION_MAX_TOP) return false;
+    period = (uint16_t)((prescaler << MODULATION_PRESCALER_SHIFT) | top);
+    high = (uint16_t)std::lround(duty_cycle * top);
+    return true;
+}
+
+// Smallest prescaler, and so the finest resolution, at which a frequency fits, or -1 if it is out
+// of range.
+static int ModulationPrescaler(double frequency_hz) {
+    uint16_t period, high;
+    for (int prescaler = 0; prescaler <= MODULATION_MAX_PRESCALER; ++prescaler) {
+        if (ModulationWords(frequency_hz, 0.0, prescaler, period, high)) return prescaler;
+    }
+    return -1;
+}
+
+int Arduino::SetModulation(unsigned int output, double frequency_hz, double duty_cycle) {
+    if (output >= number_of_modulators_) return 1;
+
+    uint16_t period, high;
+    int prescaler = ModulationPrescaler(frequency_hz);
+    if (prescaler < 0 || !ModulationWords(frequency_hz, duty_cycle, prescaler, period, high)) return 1;
+    return SendOrdered({message_set_modulation(output, period, high)});
+}
+
+// The board cannot change the prescaler between entries, so all of them use the one of the
+// lowest frequency.
+int Arduino::LoadModulationSequence(unsigned int output, const std::vector<double> &frequencies_hz,
+                                    const std::vector<double> &duty_cycles) {
+    if (frequencies_hz.size() != duty_cycles.size()) return 1;
+
+    int prescaler = 0;
+    for (double frequency_hz : frequencies_hz) {
+        int needed = ModulationPrescaler(frequency_hz);
+        if (needed < 0) return 1;
+        prescaler = std::max(prescaler, needed);
+    }
+    std::vector<uint16_t> values;
+    for (size_t i = 0; i < frequencies_hz.size(); ++i) {
+        uint16_t period, high;
+        if (!ModulationWords(frequencies_hz[i], duty_cycles[i], prescaler, period, high)) return 1;
+        values.push_back(period);
+        values.push_back(high);
+    }
+    return LoadSequence(output, SEQUENCE_MODULATION, values);
+}
+
+int Arduino::StartModulationSequence(unsigned int output) {
+    return WriteSequenceCommand(CODE_START_SEQUENCE, output, SEQUENCE_MODULATION);
+}
+
+int Arduino::StopModulationSequence(unsigned int output) {
+    return WriteSequenceCommand(CODE_STOP_SEQUENCE, output, SEQUENCE_MODULATION);
+}
+
+unsigned int Arduino::GetCalibrationSize() const {
+    return calibration_size_;
+}
+
+// The table is converted to DAC codes here, so the Arduino only needs to look them up.
+int Arduino::LoadCalibration(unsigned int channel, const std::vector<double> &relative_outputs) {
+    if (channel >= number_of_channels_) return 1;
+    if (!relative_outputs.empty() && relative_outputs.size() != calibration_size_) return 1;
+
+    std::vector<Message> messages;
+    messages.push_back(message_calibration(CODE_CLEAR_CALIBRATION, channel));
+    for (size_t i = 0; i < relative_outputs.size(); ++i) {
+        double relative_output = std::min(std::max(relative_outputs[i], 0.0), 1.0);
+        uint16_t code = (uint16_t)(relative_output * DAC_MAX_CODE + 0.5);
+        if (i % CALIBRATION_VALUES_PER_FRAME == 0) {
+            messages.push_back(message_calibration(CODE_LOAD_CALIBRATION, channel));
+        }
+        message_put_u16(messages.back(), code);
+    }
+
+    return SendOrdered(messages);
+}
+
+unsigned int Arduino::GetNumberOfMonitors() const {
+    return number_of_monitors_;
+}
+
+int Arduino::SetTelemetry(unsigned int sample_rate, unsigned int state_interval_ms) {
+    if (sample_rate > TELEMETRY_MAX_RATE || state_interval_ms > 0xFFFF) return 1;
+    if (sample_rate != 0 && number_of_monitors_ == 0) return 1;
+
+    if (SendOrdered({message_set_telemetry(sample_rate, state_interval_ms)}) != 0) {
+        return 1;
+    }
+
+    telemetry_rate_ = sample_rate;
+    state_interval_ms_ = state_interval_ms;
+    {
+        std::lock_guard<std::mutex> lock(reader_mutex_);
+        telemetry_on_ = sample_rate != 0 || state_interval_ms != 0;
+    }
+    reader_wake_.notify_one();
+    return 0;
+}
+
+// Message: code, number of monitors, number of samples, then per sample its time (32 bit) and the
+// reading of every monitor (16 bit). Only called while holding io_mutex_, so there is a single
+// writer to the ring.
+void Arduino::HandleMonitorSamples(const uint8_t *message, size_t length) {
+    if (length < 3) return;
+    unsigned int monitors = message[1];
+    unsigned int count = message[2];
+    size_t sample_size = 4 + 2 * monitors;
+    if (length != 3 + count * sample_size) {
+        AddError("Received malformed telemetry.");
+        return;
+    }
+
+    for (unsigned int i = 0; i < count; ++i) {
+        const uint8_t *sample = message + 3 + i * sample_size;
+        uint64_t index = telemetry_count_.load(std::memory_order_relaxed);
+        TelemetrySlot &slot = telemetry_ring_[index % TELEMETRY_RING_SIZE];
+
+        slot.index.store(UINT64_MAX, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.time_us.store(get_u32(sample), std::memory_order_relaxed);
+        for (unsigned int m = 0; m < MAX_MONITOR_INPUTS; ++m) {
+            uint16_t value = m < monitors ? get_u16(sample + 4 + 2 * m) : 0;
+            slot.values[m].store(value, std::memory_order_relaxed);
+        }
+        slot.index.store(index, std::memory_order_release);
+        telemetry_count_.store(index + 1, std::memory_order_release);
+    }
+}
+
+// Message: code, time in us (32 bit), number of channels, enable states, enable pin levels, PWM
+// duty and top (16 bit each), then the DAC code of every channel (16 bit).
+void Arduino::HandleBoardState(const uint8_t *message, size_t length) {
+    if (length < 14 || length != 14 + 2 * (size_t)message[5]) {
+        AddError("Received malformed telemetry.");
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    board_state_.board_time_us = get_u32(message + 1);
+    board_state_.enable_mask = get_u16(message + 6);
+    board_state_.level_mask = get_u16(message + 8);
+    board_state_.pwm_duty = get_u16(message + 10);
+    board_state_.pwm_top = get_u16(message + 12);
+    board_state_.relative_outputs.resize(message[5]);
+    for (size_t ch = 0; ch < board_state_.relative_outputs.size(); ++ch) {
+        board_state_.relative_outputs[ch] = (double)get_u16(message + 14 + 2 * ch) / DAC_MAX_CODE;
+    }
+    board_state_valid_ = true;
+}
+
+uint64_t Arduino::GetMonitorSampleCount() const {
+    return telemetry_count_.load(std::memory_order_acquire);
+}
+
+// Samples are copied without a lock; a sample overwritten while it was copied counts as lost.
+size_t Arduino::GetMonitorSamples(uint64_t &cursor, std::vector<MonitorSample> &samples) {
+    uint64_t end = telemetry_count_.load(std::memory_order_acquire);
+    uint64_t index = std::min(cursor, end);
+    size_t lost = 0;
+    if (end - index > TELEMETRY_RING_SIZE) {
+        lost = end - index - TELEMETRY_RING_SIZE;
+        index = end - TELEMETRY_RING_SIZE;
+    }
+
+    for (; index < end; ++index) {
+        const TelemetrySlot &slot = telemetry_ring_[index % TELEMETRY_RING_SIZE];
+        if (slot.index.load(std::memory_order_acquire) != index) {
+            lost++;
+            continue;
+        }
+        MonitorSample sample;
+        sample.board_time_us = slot.time_us.load(std::memory_order_relaxed);
+        sample.count = number_of_monitors_;
+        for (unsigned int m = 0; m < MAX_MONITOR_INPUTS; ++m) {
+            sample.values[m] = (double)slot.values[m].load(std::memory_order_relaxed) / MONITOR_FULL_SCALE;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.index.load(std::memory_order_relaxed) != index) {
+            lost++;
+            continue;
+        }
+        samples.push_back(sample);
+    }
+
+    cursor = end;
+    return lost;
+}
+
+int Arduino::GetBoardState(BoardState &state) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    if (!board_state_valid_) return 1;
+    state = board_state_;
+    return 0;
+}
@@ -26,31 +26,248 @@
 
 #include "InterfaceBoard.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 
-#include "serial/serial.h"
+#include "Framing.h"
+#include "Link.h"
+#include "Protocol.h"
 
-#define BAUD 115200
+// Port name that selects the first port with an Arduino running the program. Candidates are the
+// USB serial ports of Arduino Nano 33 BLE boards.
+#define AUTO_PORT "Auto"
+#define USB_VENDOR_ID 0x2341
+#define USB_PRODUCT_ID 0x805A
 
-// Codes for communication via Serial
-#define CODE_OPEN 0x00
-#define CODE_CLOSE 0x01
-#define CODE_WRITE_ANALOG 0x02
-#define CODE_WRITE_DIGITAL 0x03
-#define CODE_END_SEQUENCE 0x0A
+// Default and upper limit for the number of unacknowledged commands
+#define DEFAULT_MAX_PENDING_COMMANDS 16
+#define MAX_PENDING_COMMANDS 128
+
+// Largest number of frames passed to a single write
+#define MAX_GATHER_FRAMES 8
+
+// Number of channels that can be addressed by the channel masks. The number of channels of the
+// board, its buffer sizes and which DAC output drives each channel are reported by CODE_GET_INFO
+// when the connection is opened.
+#define MAX_CHANNELS PROTOCOL_MAX_CHANNELS
+
+// Number of monitor samples kept for GetMonitorSamples()
+#define TELEMETRY_RING_SIZE 16384
+
+// Interval in which the reader thread collects telemetry in ms
+#define TELEMETRY_POLL_INTERVAL 1
+
+#define WAVEFORM_MAX_REPETITIONS 65535
+
+// Timeout of Flush() in ms
+#define FLUSH_TIMEOUT 2000
+
+// Time without an acknowledgement after which outstanding commands are considered lost in ms
+#define ACK_TIMEOUT 1000
+
+// Time a port may take to answer CODE_IDENTIFY in ms
+#define IDENTIFY_TIMEOUT 100
+
+// Longest blocking read from the port in ms
+#define READ_TIMEOUT 20
+
+// Interval between attempts to reconnect after the connection was lost in ms
+#define RECONNECT_INTERVAL 500
+
+// Minimum interval between two queries of the Arduino's statistics in ms. The query is sent by
+// the writer thread and its reply processed by whichever thread reads it, so GetStatistics()
+// returns the figures of the previous query without waiting for the board.
+#define BOARD_STATS_INTERVAL 1000
 
 class Arduino : public InterfaceBoard {
     public:
+        // dev_path is the serial port or AUTO_PORT. With a link other than the serial port, it
+        // is the address that link connects to.
         Arduino(std::string dev_path);
+        Arduino(std::string dev_path, std::unique_ptr<Link> link);
         ~Arduino();
+        static std::vector<std::string> FindPorts();
         int Open();
         int WriteAnalogRelative(unsigned int channel, double relative_value);
         int WriteDigital(unsigned int channel, bool value);
         bool DeviceIsOpen() const;
+        unsigned int GetNumberOfChannels() const;
+        int GetChannelOutput(unsigned int channel, uint8_t &dac_address, uint8_t &dac_output) const;
+        int WriteAnalogRelativeMulti(uint32_t channel_mask, const std::vector<double> &relative_values);
+        int WriteDigitalMulti(uint32_t channel_mask, uint32_t values);
+        unsigned int GetMaxSequenceLength() const;
+        int LoadAnalogSequence(unsigned int channel, const std::vector<double> &relative_values);
+        int LoadDigitalSequence(unsigned int channel, const std::vector<bool> &values);
+        int StartAnalogSequence(unsigned int channel);
+        int StopAnalogSequence(unsigned int channel);
+        int StartDigitalSequence(unsigned int channel);
+        int StopDigitalSequence(unsigned int channel);
+        unsigned int GetMaxWaveformEvents() const;
+        int LoadWaveform(const std::vector<WaveformEvent> &events);
+        int StartWaveform(uint32_t channel_mask, uint32_t period_us, unsigned int repetitions, bool on_trigger);
+        int StopWaveform();
+        int GetWaveformStatus(bool &running, uint32_t &periods);
+        int SetBlanking(uint32_t channel_mask, bool active_low);
+        int Ramp(unsigned int channel, double relative_value, uint32_t duration_us, bool exponential);
+        unsigned int GetNumberOfModulators() const;
+        int SetModulation(unsigned int output, double frequency_hz, double duty_cycle);
+        int LoadModulationSequence(unsigned int output, const std::vector<double> &frequencies_hz,
+                                   const std::vector<double> &duty_cycles);
+        int StartModulationSequence(unsigned int output);
+        int StopModulationSequence(unsigned int output);
+        unsigned int GetCalibrationSize() const;
+        int LoadCalibration(unsigned int channel, const std::vector<double> &relative_outputs);
+        unsigned int GetNumberOfMonitors() const;
+        int SetTelemetry(unsigned int sample_rate, unsigned int state_interval_ms);
+        uint64_t GetMonitorSampleCount() const;
+        size_t GetMonitorSamples(uint64_t &cursor, std::vector<MonitorSample> &samples);
+        int GetBoardState(BoardState &state);
+        int GetOutputState(OutputState &state);
+        void SetKeepOutputsOnClose(bool keep);
+        bool Busy();
+        int Flush();
+        int SetMaxPendingCommands(unsigned int count);
+        int SetLowLatency(bool low_latency);
+        std::string PopError();
+        void GetStatistics(BoardStatistics &stats);
+        void ResetStatistics();
     private:
-        serial::Serial dev_;
+        // An unacknowledged command and the time its oldest value was written by the caller
+        struct PendingCommand {
+            uint8_t seq;
+            uint8_t code;
+            uint64_t written_us;
+        };
+
+        // Slot of the telemetry ring. index is the number of the sample it holds and is
+        // invalidated while the slot is written, so readers can detect overwritten samples
+        // without taking a lock.
+        struct TelemetrySlot {
+            std::atomic<uint64_t> index;
+            std::atomic<uint32_t> time_us;
+            std::atomic<uint16_t> values[MAX_MONITOR_INPUTS];
+        };
+
+        void WriterThread();
+        void ReaderThread();
+        void WakeWriter();
+        void NotifyIdle();
+        int SendQueued();
+        int SendOrdered(const std::vector<Message> &messages, std::vector<uint8_t> *payload = nullptr);
+        int SendCommand(const Message &message, uint64_t written_us = 0);
+        int SendCommands(const Message *messages, const uint64_t *written_us, size_t count);
+        int ReadReplies(size_t max_pending, bool block, unsigned int timeout_ms = ACK_TIMEOUT);
+        void ProcessReplyBytes(const uint8_t *bytes, size_t count);
+        void HandleReply(const uint8_t *reply, size_t length);
+        void HandleMonitorSamples(const uint8_t *message, size_t length);
+        void HandleBoardState(const uint8_t *message, size_t length);
+        int Attach(const std::string &port, bool &host_state);
+        int Reconnect();
+        void ConnectionLost();
+        int QueryBoardInfo();
+        int QueryOutputState();
+        void RequestBoardStatistics();
+        void HandleBoardStatistics(const uint8_t *payload, size_t length);
+        void AddError(const std::string &error);
+        int WriteSequenceCommand(uint8_t code, unsigned int channel, uint8_t type);
+        int LoadSequence(unsigned int channel, uint8_t type, const std::vector<uint16_t> &values);
+
+        std::unique_ptr<Link> dev_;
         bool is_open_ = false;
+        std::string port_; // Port given by the user, AUTO_PORT to search for the board
+        bool low_latency_ = false;
+        std::atomic<bool> keep_outputs_on_close_;
+
+        // Set when reading or writing fails. The writer thread then reopens the port, resends
+        // the outputs and restores telemetry; writes made in the meantime are kept in the slots.
+        std::atomic<bool> link_lost_;
+        std::atomic<unsigned int> telemetry_rate_;
+        std::atomic<unsigned int> state_interval_ms_;
+
+        // Reported by the board when it was opened
+        unsigned int number_of_channels_ = 0;
+        unsigned int max_sequence_length_ = 0;
+        unsigned int max_waveform_events_ = 0;
+        unsigned int calibration_size_ = 0;
+        unsigned int number_of_monitors_ = 0;
+        unsigned int number_of_modulators_ = 0;
+        std::vector<std::pair<uint8_t, uint8_t>> channel_outputs_; // DAC address and output per channel
+        OutputState output_state_;
+
+        // Analog and digital writes are not sent by the caller but stored in per-channel slots
+        // which the writer thread sends to the Arduino. Only the newest value of each channel is
+        // kept, so values that were overwritten before the writer got to them are never sent.
+        // Writing a slot is lock-free; batched writes additionally hold batch_lock_ so the writer
+        // never sees half of a batch.
+        std::atomic<uint16_t> analog_slots_[MAX_CHANNELS];
+        std::atomic<uint32_t> analog_dirty_;
+        std::atomic<uint32_t> digital_values_;
+        std::atomic<uint32_t> digital_dirty_;
+        std::atomic_flag batch_lock_ = ATOMIC_FLAG_INIT;
+        std::atomic<uint64_t> analog_written_us_[MAX_CHANNELS]; // Time of the last write per slot
+        std::atomic<uint64_t> digital_written_us_[MAX_CHANNELS];
+
+        std::thread writer_;
+        std::atomic<bool> running_;
+        std::atomic<bool> sending_; // The writer has taken values from the slots but not sent them yet
+        std::mutex wake_mutex_;
+        std::condition_variable wake_;
+        std::atomic<bool> writer_sleeping_; // The writer waits on wake_, so writes have to notify it
+
+        // Flush() waits on flushed_ until Busy() is false. The threads that make it false only
+        // take flush_mutex_ while somebody waits.
+        std::mutex flush_mutex_;
+        std::condition_variable flushed_;
+        std::atomic<unsigned int> flush_waiters_;
+
+        // Telemetry is decoded by whichever thread reads from the port. While it is on, the
+        // reader thread collects it when no acknowledgements are awaited. In low latency mode
+        // the reader waits for the port to become readable and also collects acknowledgements,
+        // so nobody polls for them.
+        std::thread reader_;
+        std::atomic<bool> telemetry_on_;
+        std::mutex reader_mutex_;
+        std::condition_variable reader_wake_;
+        std::unique_ptr<TelemetrySlot[]> telemetry_ring_;
+        std::atomic<uint64_t> telemetry_count_;
+        std::mutex state_mutex_;
+        BoardState board_state_;
+        bool board_state_valid_ = false;
+
+        // Everything below is only used while holding io_mutex_.
+        std::mutex io_mutex_;
+        uint8_t next_seq_ = 0;
+        PendingCommand pending_[MAX_PENDING_COMMANDS]; // Ring of unacknowledged commands, oldest first
+        size_t pending_first_ = 0;
+        size_t pending_count_ = 0;
+        std::atomic<size_t> in_flight_; // pending_count_ for Busy()
+        unsigned int max_pending_ = DEFAULT_MAX_PENDING_COMMANDS;
+        FrameDecoder reply_decoder_;
+        std::vector<uint8_t> reply_payload_; // Payload of the last acknowledgement that had one
+        size_t failed_commands_ = 0;         // Commands acknowledged with an error status
+
+        // Statistics of the board from the last CODE_GET_STATS reply
+        std::atomic<uint64_t> board_stats_time_us_; // Time of the last query
+        std::atomic<bool> board_stats_requested_;   // The writer has yet to send the query
+        std::atomic<uint64_t> board_commands_per_second_;
+        std::atomic<uint64_t> board_buffer_peak_;
+
+        std::mutex error_mutex_;
+        std::deque<std::string> errors_;
+
+        LatencyHistogram write_latency_;
+        LatencyHistogram send_latency_;
+        std::atomic<uint64_t> bytes_sent_;
+        std::atomic<uint64_t> errors_count_;
+        std::atomic<uint64_t> resyncs_;
 };
 
 #endif // ARDUINO_H_
@@ -24,7 +24,58 @@
 #ifndef _INTERFACEBOARD_H_
 #define _INTERFACEBOARD_H_
 
+#include <cstdint>
 #include <string>
+#include <vector>
+
+#include "Statistics.h"
+
+// Event of a waveform played back by the board. time_us after the start of each period, the
+// enable outputs in on_mask are switched on and those in off_mask off. If power_channel is not
+// negative, the power of that channel is set as well; power changes may lag by the time the board
+// needs to write its DACs.
+struct WaveformEvent
+{
+    uint32_t time_us = 0;
+    uint32_t on_mask = 0;
+    uint32_t off_mask = 0;
+    int power_channel = -1;
+    double relative_power = 0.0;
+};
+
+// Unreported errors kept by PopError(); beyond that, the oldest ones are dropped
+#define MAX_QUEUED_ERRORS 64
+
+// Largest number of monitor inputs in a MonitorSample
+#define MAX_MONITOR_INPUTS 8
+
+// Readings of the board's monitor inputs, e.g. photodiodes, relative to their full scale
+struct MonitorSample
+{
+    uint32_t board_time_us = 0; // Board clock, wraps after about 71 minutes
+    unsigned int count = 0;
+    double values[MAX_MONITOR_INPUTS] = {};
+};
+
+// Snapshot of the board's outputs
+struct BoardState
+{
+    uint32_t board_time_us = 0;
+    uint32_t enable_mask = 0; // Enable outputs switched on by commands, sequences and waveforms
+    uint32_t level_mask = 0;  // Enable outputs that are high, i.e. not blanked
+    std::vector<double> relative_outputs; // Analog output of every channel
+    unsigned int pwm_duty = 0; // Counts the first modulation output is high in each period
+    unsigned int pwm_top = 0;  // Period of the first modulation output in counts
+};
+
+// Outputs of the board as set by the host that was attached before
+struct OutputState
+{
+    uint32_t enable_mask = 0;
+    uint32_t blanking_mask = 0;
+    bool blanking_active_low = false;
+    std::vector<double> relative_values; // Relative value of every channel before calibration
+};
 
 class InterfaceBoard
 {
@@ -34,6 +85,108 @@ class InterfaceBoard
         virtual int WriteAnalogRelative(unsigned int channel, double relative_value) = 0;
         virtual int WriteDigital(unsigned int channel, bool value) = 0;
         virtual bool DeviceIsOpen() const = 0;
+
+        // Channels reported by the board when it was opened, and the address of the DAC and its
+        // output that drive each of them.
+        virtual unsigned int GetNumberOfChannels() const = 0;
+        virtual int GetChannelOutput(unsigned int channel, uint8_t &dac_address, uint8_t &dac_output) const = 0;
+
+        // Writes may be queued and sent asynchronously. Commands are acknowledged by the board
+        // after they have been executed. Busy() is true while writes are queued or
+        // unacknowledged, Flush() waits until that is no longer the case, and at most
+        // SetMaxPendingCommands() commands are sent ahead of their acknowledgements. PopError()
+        // returns the oldest unreported failure of an already sent command or an empty string;
+        // only the last MAX_QUEUED_ERRORS failures are kept.
+        // SetLowLatency() must be called before Open() and selects a connection mode that
+        // trades CPU time for shorter round trips where the board supports one.
+        virtual bool Busy() = 0;
+        virtual int Flush() = 0;
+        virtual int SetMaxPendingCommands(unsigned int count) = 0;
+        virtual int SetLowLatency(bool low_latency) = 0;
+        virtual std::string PopError() = 0;
+
+        // Latency and throughput counters since the last call of ResetStatistics().
+        virtual void GetStatistics(BoardStatistics &stats) = 0;
+        virtual void ResetStatistics() = 0;
+
+        // Batched writes. Bit n of channel_mask selects channel n; relative_values and the bits of
+        // values hold one entry per channel and are ignored for unselected channels. All selected
+        // outputs change at the same time.
+        virtual int WriteAnalogRelativeMulti(uint32_t channel_mask, const std::vector<double> &relative_values) = 0;
+        virtual int WriteDigitalMulti(uint32_t channel_mask, uint32_t values) = 0;
+
+        // Hardware-triggered sequences. A started sequence outputs its first value right away and
+        // advances by one value on every trigger edge seen by the board.
+        virtual unsigned int GetMaxSequenceLength() const = 0;
+        virtual int LoadAnalogSequence(unsigned int channel, const std::vector<double> &relative_values) = 0;
+        virtual int LoadDigitalSequence(unsigned int channel, const std::vector<bool> &values) = 0;
+        virtual int StartAnalogSequence(unsigned int channel) = 0;
+        virtual int StopAnalogSequence(unsigned int channel) = 0;
+        virtual int StartDigitalSequence(unsigned int channel) = 0;
+        virtual int StopDigitalSequence(unsigned int channel) = 0;
+
+        // Waveforms played back by the board with microsecond timing. LoadWaveform() replaces the
+        // waveform; its events must be sorted by time. StartWaveform() plays it for the given
+        // number of periods, or until StopWaveform() if repetitions is 0. When it ends, the enable
+        // outputs in channel_mask are switched off. With on_trigger, the waveform is armed and
+        // starts at the next trigger edge seen by the board instead of right away; it counts as
+        // running while armed. GetWaveformStatus() also returns the number of completed periods.
+        virtual unsigned int GetMaxWaveformEvents() const = 0;
+        virtual int LoadWaveform(const std::vector<WaveformEvent> &events) = 0;
+        virtual int StartWaveform(uint32_t channel_mask, uint32_t period_us, unsigned int repetitions, bool on_trigger) = 0;
+        virtual int StopWaveform() = 0;
+        virtual int GetWaveformStatus(bool &running, uint32_t &periods) = 0;
+
+        // Exposure-gated blanking. The enable outputs in channel_mask are only switched on while
+        // the board's exposure input is active (low if active_low is set), without any
+        // communication with the host. Their enable state is kept while they are blanked.
+        virtual int SetBlanking(uint32_t channel_mask, bool active_low) = 0;
+
+        // Ramps run by the board. Ramp() moves the analog output of a channel from its current
+        // value to relative_value over duration_us, updated by the board every millisecond.
+        // Linear ramps change it by the same amount at every update, exponential ones by the same
+        // factor. Several channels can ramp at once. A write, a sequence or a waveform power change
+        // of the channel ends its ramp where it is; a duration of 0 writes the value right away.
+        virtual int Ramp(unsigned int channel, double relative_value, uint32_t duration_us, bool exponential) = 0;
+
+        // Modulation outputs of the board, e.g. for the modulation inputs of pulsed laser diodes,
+        // each with its own frequency and duty cycle in [0, 1]. A change takes effect at the end
+        // of the running period, so no shortened or merged pulses are emitted; only a change to a
+        // frequency that needs another clock divider restarts the output. Modulation sequences
+        // hold a frequency and a duty cycle per entry and advance on trigger edges like the other
+        // sequences; they have at most half of GetMaxSequenceLength() entries.
+        virtual unsigned int GetNumberOfModulators() const = 0;
+        virtual int SetModulation(unsigned int output, double frequency_hz, double duty_cycle) = 0;
+        virtual int LoadModulationSequence(unsigned int output, const std::vector<double> &frequencies_hz,
+                                           const std::vector<double> &duty_cycles) = 0;
+        virtual int StartModulationSequence(unsigned int output) = 0;
+        virtual int StopModulationSequence(unsigned int output) = 0;
+
+        // Power calibration. LoadCalibration() replaces the linear mapping of a channel's relative
+        // values to its analog output with a table of GetCalibrationSize() entries, entry i
+        // holding the relative output for the relative value i / (size - 1). The board applies it
+        // to every analog write of the channel, including batched writes, sequences and
+        // waveforms. An empty table restores the linear mapping.
+        virtual unsigned int GetCalibrationSize() const = 0;
+        virtual int LoadCalibration(unsigned int channel, const std::vector<double> &relative_outputs) = 0;
+
+        // Telemetry sent by the board on its own and received in the background. SetTelemetry()
+        // asks for sample_rate monitor samples per second and a state snapshot every
+        // state_interval_ms; 0 turns either off. GetMonitorSamples() appends the samples from
+        // number cursor on, up to the GetMonitorSampleCount() samples received so far, advances
+        // cursor and returns how many of them were no longer buffered. GetBoardState() returns
+        // the latest snapshot and fails if none was received. None of them blocks writes.
+        virtual unsigned int GetNumberOfMonitors() const = 0;
+        virtual int SetTelemetry(unsigned int sample_rate, unsigned int state_interval_ms) = 0;
+        virtual uint64_t GetMonitorSampleCount() const = 0;
+        virtual size_t GetMonitorSamples(uint64_t &cursor, std::vector<MonitorSample> &samples) = 0;
+        virtual int GetBoardState(BoardState &state) = 0;
+
+        // Attaching to a running board. GetOutputState() returns the outputs the board had when
+        // it was opened; they are left as they are, so a new connection can take them over.
+        // Unless SetKeepOutputsOnClose() is set, closing the connection turns all lasers off.
+        virtual int GetOutputState(OutputState &state) = 0;
+        virtual void SetKeepOutputsOnClose(bool keep) = 0;
 };
 
 #endif // _INTERFACEBOARD_H_
\ No newline at end of file
@@ -0,0 +1,287 @@
+/* Journal.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "Journal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+#include "Protocol.h"
+
+namespace {
+
+float bits_float(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Reads count values of type T from the payload
+template <typename T>
+std::vector<T> payload_values(const std::vector<uint8_t> &payload) {
+    std::vector<T> values(payload.size() / sizeof(T));
+    if (!values.empty()) memcpy(values.data(), payload.data(), values.size() * sizeof(T));
+    return values;
+}
+
+} // namespace
+
+int JournalReader::Open(const std::string &path, std::string &error) {
+    file_.open(path, std::ios::binary);
+    if (!file_) {
+        error = "Could not open " + path + ": " + strerror(errno);
+        return 1;
+    }
+    JournalHeader header;
+    if (!file_.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != JOURNAL_MAGIC) {
+        error = path + " is not a journal.";
+        return 1;
+    }
+    if (header.version < JOURNAL_MIN_VERSION || header.version > JOURNAL_VERSION || header.header_size != JOURNAL_HEADER_SIZE ||
+        header.record_size != JOURNAL_RECORD_SIZE) {
+        error = path + " was written by an incompatible version.";
+        return 1;
+    }
+    position_ = JOURNAL_HEADER_SIZE;
+    used_ = header.used;
+    return 0;
+}
+
+bool JournalReader::Next(JournalRecord &record, std::vector<uint8_t> &payload) {
+    if (position_ + JOURNAL_RECORD_SIZE > used_) return false;
+    if (!file_.read(reinterpret_cast<char *>(&record), sizeof(record))) return false;
+    position_ += JOURNAL_RECORD_SIZE;
+
+    payload.clear();
+    if (!journal_has_payload(record.type)) return true;
+    size_t padded = journal_padded_size(record.value);
+    if (position_ + padded > used_) return false;
+    payload.resize(padded);
+    if (padded > 0 && !file_.read(reinterpret_cast<char *>(payload.data()), padded)) return false;
+    payload.resize(record.value);
+    position_ += padded;
+    return true;
+}
+
+JournalDose::JournalDose() {}
+
+double JournalDose::Level(const Channel &channel, double relative, bool enabled) {
+    double value = channel.analog_sequence ? channel.analog_sequence_mean : relative;
+    double on = channel.digital_sequence ? channel.digital_sequence_mean : (enabled ? 1.0 : 0.0);
+    return value * on;
+}
+
+// Time integral of the relative value of a ramping channel from from_ns to to_ns in s, both
+// within the ramp. Exponential ramps are floored like on the board.
+double JournalDose::RampIntegral(const Channel &channel, uint64_t from_ns, uint64_t to_ns) {
+    double duration = (channel.ramp_end_ns - channel.ramp_start_ns) * 1e-9;
+    double x0 = (from_ns - channel.ramp_start_ns) * 1e-9 / duration;
+    double x1 = (to_ns - channel.ramp_start_ns) * 1e-9 / duration;
+    if (channel.ramp_exponential) {
+        double floor = RAMP_EXPONENTIAL_FLOOR / 65535.0;
+        double from = std::max(channel.ramp_from, floor);
+        double log_ratio = std::log(std::max(channel.relative, floor) / from);
+        if (std::abs(log_ratio) < 1e-9) return from * (x1 - x0) * duration;
+        return from * (std::exp(log_ratio * x1) - std::exp(log_ratio * x0)) / log_ratio * duration;
+    }
+    double step = channel.relative - channel.ramp_from;
+    return (channel.ramp_from * (x1 - x0) + step * (x1 * x1 - x0 * x0) / 2) * duration;
+}
+
+// Dose of a channel from the last record up to time_ns in s
+double JournalDose::Accrued(const Channel &channel, uint64_t time_ns) const {
+    if (time_ns <= time_ns_) return 0.0;
+    if (channel.ramp && time_ns_ < channel.ramp_end_ns) {
+        uint64_t end_ns = std::min(time_ns, channel.ramp_end_ns);
+        return Level(channel, 1.0, channel.enabled) * RampIntegral(channel, time_ns_, end_ns) +
+               Level(channel, channel.relative, channel.enabled) * (time_ns - end_ns) * 1e-9;
+    }
+    if (channel.waveform && waveform_running_) {
+        if (time_ns <= waveform_end_ns_) return channel.waveform_level * (time_ns - time_ns_) * 1e-9;
+        uint64_t end_ns = std::max(waveform_end_ns_, time_ns_);
+        return (channel.waveform_level * (end_ns - time_ns_) +
+                Level(channel, channel.after_relative, channel.after_enabled) * (time_ns - end_ns)) * 1e-9;
+    }
+    return Level(channel, channel.relative, channel.enabled) * (time_ns - time_ns_) * 1e-9;
+}
+
+void JournalDose::Advance(uint64_t time_ns) {
+    // Records of different threads may be a little out of order.
+    if (time_ns < time_ns_) return;
+    for (Channel &channel : channels_) {
+        channel.dose += Accrued(channel, time_ns);
+        if (channel.ramp && time_ns >= channel.ramp_end_ns) channel.ramp = false;
+    }
+    time_ns_ = time_ns;
+    if (waveform_running_ && time_ns >= waveform_end_ns_) EndWaveform();
+}
+
+// Leaves the channels of the waveform as they are at the end of a period, with the enable outputs
+// of the waveform off.
+void JournalDose::EndWaveform() {
+    for (Channel &channel : channels_) {
+        if (!channel.waveform) continue;
+        channel.relative = channel.after_relative;
+        channel.enabled = channel.after_enabled;
+        channel.waveform = false;
+    }
+    waveform_running_ = false;
+}
+
+// Plays two periods of the waveform for every channel it controls and takes the mean level of
+// the second one, when the waveform repeats.
+void JournalDose::StartWaveform(const JournalWaveformStart &start, uint64_t time_ns) {
+    if (waveform_running_) EndWaveform();
+
+    uint32_t controlled = start.channel_mask;
+    for (const JournalWaveformEvent &event : waveform_) {
+        if (event.power_channel >= 0 && event.power_channel < JOURNAL_MAX_CHANNELS) {
+            controlled |= 1u << event.power_channel;
+        }
+    }
+    for (int i = 0; i < JOURNAL_MAX_CHANNELS; ++i) {
+        if (!(controlled & (1u << i))) continue;
+        Channel &channel = channels_[i];
+        channel.ramp = false; // The waveform is taken to start at the ramp's target
+        double relative = channel.relative;
+        bool enabled = channel.enabled;
+        double integral = 0.0;
+        for (int period = 0; period < 2; ++period) {
+            uint32_t previous_us = 0;
+            for (const JournalWaveformEvent &event : waveform_) {
+                uint32_t time_us = std::min(std::max(event.time_us, previous_us), start.period_us);
+                if (period == 1) integral += Level(channel, relative, enabled) * (time_us - previous_us);
+                if (event.on_mask & (1u << i)) enabled = true;
+                if (event.off_mask & (1u << i)) enabled = false;
+                if (event.power_channel == i) relative = event.relative_power;
+                previous_us = time_us;
+            }
+            if (period == 1) integral += Level(channel, relative, enabled) * (start.period_us - previous_us);
+        }
+        channel.waveform = true;
+        channel.waveform_level = start.period_us > 0 ? integral / start.period_us : Level(channel, relative, enabled);
+        channel.after_relative = relative;
+        channel.after_enabled = enabled && !(start.channel_mask & (1u << i));
+    }
+    waveform_running_ = true;
+    waveform_end_ns_ = start.repetitions == 0 ? UINT64_MAX
+                                              : time_ns + (uint64_t)start.repetitions * start.period_us * 1000;
+}
+
+void JournalDose::Add(const JournalRecord &record, const std::vector<uint8_t> &payload) {
+    if (record.type == JOURNAL_SESSION) {
+        // The outputs of a new session are recorded right after it starts.
+        for (Channel &channel : channels_) {
+            double dose = channel.dose;
+            channel = Channel();
+            channel.dose = dose;
+        }
+        waveform_.clear();
+        waveform_running_ = false;
+        time_ns_ = 0;
+        return;
+    }
+
+    Advance(record.time_ns);
+    Channel *channel = record.channel < JOURNAL_MAX_CHANNELS ? &channels_[record.channel] : nullptr;
+    switch (record.type) {
+        case JOURNAL_ANALOG:
+            if (channel == nullptr) break;
+            channel->relative = bits_float(record.value);
+            channel->after_relative = channel->relative;
+            channel->ramp = false;
+            break;
+        case JOURNAL_DIGITAL:
+            if (channel == nullptr) break;
+            channel->enabled = record.value != 0;
+            channel->after_enabled = channel->enabled;
+            break;
+        case JOURNAL_LOAD_ANALOG_SEQUENCE: {
+            if (channel == nullptr) break;
+            std::vector<float> values = payload_values<float>(payload);
+            double sum = 0.0;
+            for (float value : values) sum += value;
+            channel->analog_sequence_mean = values.empty() ? 0.0 : sum / values.size();
+            break;
+        }
+        case JOURNAL_LOAD_DIGITAL_SEQUENCE: {
+            if (channel == nullptr) break;
+            size_t on = std::count_if(payload.begin(), payload.end(), [](uint8_t value) { return value != 0; });
+            channel->digital_sequence_mean = payload.empty() ? 0.0 : (double)on / payload.size();
+            break;
+        }
+        case JOURNAL_START_ANALOG_SEQUENCE:
+        case JOURNAL_STOP_ANALOG_SEQUENCE:
+            if (channel == nullptr) break;
+            channel->analog_sequence = record.type == JOURNAL_START_ANALOG_SEQUENCE;
+            if (channel->analog_sequence) channel->ramp = false;
+            break;
+        case JOURNAL_START_DIGITAL_SEQUENCE:
+        case JOURNAL_STOP_DIGITAL_SEQUENCE:
+            if (channel != nullptr) channel->digital_sequence = record.type == JOURNAL_START_DIGITAL_SEQUENCE;
+            break;
+        case JOURNAL_LOAD_WAVEFORM:
+            waveform_ = payload_values<JournalWaveformEvent>(payload);
+            break;
+        case JOURNAL_START_WAVEFORM: {
+            std::vector<JournalWaveformStart> start = payload_values<JournalWaveformStart>(payload);
+            if (!start.empty()) StartWaveform(start[0], record.time_ns);
+            break;
+        }
+        case JOURNAL_STOP_WAVEFORM:
+            if (waveform_running_) EndWaveform();
+            break;
+        case JOURNAL_RAMP: {
+            std::vector<JournalRamp> ramp = payload_values<JournalRamp>(payload);
+            if (channel == nullptr || ramp.empty()) break;
+            channel->ramp = ramp[0].duration_us > 0;
+            channel->ramp_from = channel->relative;
+            channel->ramp_start_ns = record.time_ns;
+            channel->ramp_end_ns = record.time_ns + (uint64_t)ramp[0].duration_us * 1000;
+            channel->ramp_exponential = ramp[0].exponential != 0;
+            channel->relative = ramp[0].relative_value;
+            channel->after_relative = channel->relative;
+            break;
+        }
+        case JOURNAL_CLOSE:
+            if (waveform_running_) EndWaveform();
+            if (record.value == 0) {
+                for (Channel &each : channels_) {
+                    each.enabled = false;
+                    each.ramp = false;
+                    each.analog_sequence = false;
+                    each.digital_sequence = false;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+double JournalDose::Get(unsigned int channel, uint64_t time_ns) const {
+    if (channel >= JOURNAL_MAX_CHANNELS) return 0.0;
+    return channels_[channel].dose + Accrued(channels_[channel], time_ns);
+}
@@ -0,0 +1,225 @@
+/* Journal.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Binary journal of the commands given to an interface board, written by JournalBoard and read by
+// the replay tool in tools/replay. A journal file starts with a JournalHeader followed by records
+// of JOURNAL_RECORD_SIZE bytes. Records of the types that carry data are followed by value bytes
+// of payload, padded with zeros to a multiple of JOURNAL_RECORD_SIZE. Files are only appended to:
+// every time the board is opened, a session starts with a JOURNAL_SESSION record, and the times
+// of the records that follow count from it. Only the first used bytes of a file are valid; data
+// after them may be incomplete if the writing process was terminated. Numbers are stored in the
+// byte order of the host, little endian on all supported platforms.
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "InterfaceBoard.h"
+
+#define JOURNAL_MAGIC 0x4C44444A // "LDDJ"
+#define JOURNAL_VERSION 3
+
+// Oldest version that is read and appended to. Later versions only added record types.
+#define JOURNAL_MIN_VERSION 1
+
+#define JOURNAL_HEADER_SIZE 64
+#define JOURNAL_RECORD_SIZE 16
+
+// Channels that can be addressed by the 32-bit channel masks
+#define JOURNAL_MAX_CHANNELS 32
+
+// Record types. Unless noted otherwise, channel is the channel and value is unused.
+#define JOURNAL_SESSION 1                // Payload: JournalSession
+#define JOURNAL_ANALOG 2                 // value: relative value as the bits of a float
+#define JOURNAL_DIGITAL 3                // value: 1 for on, 0 for off
+#define JOURNAL_LOAD_ANALOG_SEQUENCE 4   // Payload: relative values as floats
+#define JOURNAL_LOAD_DIGITAL_SEQUENCE 5  // Payload: one byte per value
+#define JOURNAL_START_ANALOG_SEQUENCE 6
+#define JOURNAL_STOP_ANALOG_SEQUENCE 7
+#define JOURNAL_START_DIGITAL_SEQUENCE 8
+#define JOURNAL_STOP_DIGITAL_SEQUENCE 9
+#define JOURNAL_LOAD_WAVEFORM 10         // Payload: JournalWaveformEvents
+#define JOURNAL_START_WAVEFORM 11        // Payload: JournalWaveformStart
+#define JOURNAL_STOP_WAVEFORM 12
+#define JOURNAL_BLANKING 13              // value: channel mask, channel: 1 if active low
+#define JOURNAL_LOAD_CALIBRATION 14      // Payload: relative outputs as floats
+#define JOURNAL_LOST 15                  // value: records that were lost since the previous one
+#define JOURNAL_CLOSE 16                 // value: 1 if the outputs were kept on, 0 if turned off
+#define JOURNAL_RAMP 17                  // Payload: JournalRamp
+#define JOURNAL_MODULATION 18            // channel: modulation output, payload: JournalModulation
+#define JOURNAL_LOAD_MODULATION_SEQUENCE 19  // channel: modulation output, payload: JournalModulations
+#define JOURNAL_START_MODULATION_SEQUENCE 20 // channel: modulation output
+#define JOURNAL_STOP_MODULATION_SEQUENCE 21  // channel: modulation output
+
+// Flag of analog and digital writes that are applied at the same time as the next record, i.e.
+// batched writes
+#define JOURNAL_FLAG_BATCHED 0x0001
+
+struct JournalHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint64_t used; // Valid bytes of the file including the header
+    uint8_t reserved[JOURNAL_HEADER_SIZE - 24];
+};
+
+struct JournalRecord {
+    uint64_t time_ns; // Since the start of the session
+    uint8_t type;     // JOURNAL_*
+    uint8_t channel;
+    uint16_t flags;   // JOURNAL_FLAG_*
+    uint32_t value;   // Depends on the type; bytes of payload for the types that carry data
+};
+
+struct JournalSession {
+    uint64_t unix_time_ns; // Wall-clock time of the start of the session
+    uint32_t channels;     // Channels of the board
+    uint32_t reserved;
+};
+
+struct JournalWaveformEvent {
+    uint32_t time_us;
+    uint32_t on_mask;
+    uint32_t off_mask;
+    int32_t power_channel;
+    float relative_power;
+};
+
+struct JournalWaveformStart {
+    uint32_t channel_mask;
+    uint32_t period_us;
+    uint32_t repetitions;
+    uint32_t on_trigger;
+};
+
+struct JournalRamp {
+    float relative_value;
+    uint32_t duration_us;
+    uint32_t exponential;
+    uint32_t reserved;
+};
+
+struct JournalModulation {
+    float frequency_hz;
+    float duty_cycle;
+};
+
+static_assert(sizeof(JournalHeader) == JOURNAL_HEADER_SIZE, "The journal header must not be padded.");
+static_assert(sizeof(JournalRecord) == JOURNAL_RECORD_SIZE, "Journal records must not be padded.");
+static_assert(sizeof(JournalWaveformEvent) == 20, "Journal waveform events must not be padded.");
+
+// Whether records of the type carry data
+inline bool journal_has_payload(uint8_t type) {
+    return type == JOURNAL_SESSION || type == JOURNAL_LOAD_ANALOG_SEQUENCE || type == JOURNAL_LOAD_DIGITAL_SEQUENCE ||
+           type == JOURNAL_LOAD_WAVEFORM || type == JOURNAL_START_WAVEFORM || type == JOURNAL_LOAD_CALIBRATION ||
+           type == JOURNAL_RAMP || type == JOURNAL_MODULATION || type == JOURNAL_LOAD_MODULATION_SEQUENCE;
+}
+
+// Bytes of payload following a record, including the padding
+inline size_t journal_padded_size(size_t size) {
+    return (size + JOURNAL_RECORD_SIZE - 1) / JOURNAL_RECORD_SIZE * JOURNAL_RECORD_SIZE;
+}
+
+// Reads the records of a journal file one after the other.
+class JournalReader {
+    public:
+        // Fails if the file can not be read or is not a journal.
+        int Open(const std::string &path, std::string &error);
+
+        // Returns the next record and its payload without padding, false at the end of the valid
+        // data.
+        bool Next(JournalRecord &record, std::vector<uint8_t> &payload);
+    private:
+        std::ifstream file_;
+        uint64_t position_ = 0;
+        uint64_t used_ = 0;
+};
+
+// Light dose of every channel, accumulated from the records of a journal in the order they were
+// written. The dose is the time integral of the relative value while the channel is on, in
+// seconds at full power. It is an estimate where the host can not know the outputs:
+//
+// - blanked channels count as on while their enable output is on, and armed waveforms count as
+//   started, so both give an upper bound,
+// - sequences count with the mean of their values, since they advance on external triggers,
+// - waveforms count with the mean output over a period once they repeat,
+// - ramps count as starting when they were acknowledged,
+// - modulation is not accounted for, since the journal does not know which lasers the
+//   modulation outputs drive.
+//
+// Records lost because the journal could not keep up are not accounted for, and neither is the
+// time between sessions, during which outputs kept on when the board was closed stay on.
+class JournalDose {
+    public:
+        JournalDose();
+
+        // Records must be added in the order of the journal, with their payload.
+        void Add(const JournalRecord &record, const std::vector<uint8_t> &payload);
+
+        // Dose of a channel accumulated up to time_ns of the current session
+        double Get(unsigned int channel, uint64_t time_ns) const;
+    private:
+        struct Channel {
+            double dose = 0.0;
+            double relative = 0.0;
+            bool enabled = false;
+            double analog_sequence_mean = 0.0;  // Of the loaded sequences
+            double digital_sequence_mean = 0.0;
+            bool analog_sequence = false;       // Whether the sequences run
+            bool digital_sequence = false;
+
+            // While the waveform runs: mean level and state after its end
+            bool waveform = false;
+            double waveform_level = 0.0;
+            double after_relative = 0.0;
+            bool after_enabled = false;
+
+            // While a ramp runs: the value it started at, its times and its curve. relative holds
+            // the value it ends at.
+            bool ramp = false;
+            double ramp_from = 0.0;
+            uint64_t ramp_start_ns = 0;
+            uint64_t ramp_end_ns = 0;
+            bool ramp_exponential = false;
+        };
+
+        static double Level(const Channel &channel, double relative, bool enabled);
+        static double RampIntegral(const Channel &channel, uint64_t from_ns, uint64_t to_ns);
+        double Accrued(const Channel &channel, uint64_t time_ns) const;
+        void Advance(uint64_t time_ns);
+        void StartWaveform(const JournalWaveformStart &start, uint64_t time_ns);
+        void EndWaveform();
+
+        Channel channels_[JOURNAL_MAX_CHANNELS];
+        uint64_t time_ns_ = 0;         // Time of the last record
+        std::vector<JournalWaveformEvent> waveform_;
+        bool waveform_running_ = false;
+        uint64_t waveform_end_ns_ = 0; // UINT64_MAX if the waveform repeats until stopped
+};
+
+#endif // JOURNAL_H_
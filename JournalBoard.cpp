@@ -0,0 +1,618 @@
+/* JournalBoard.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "JournalBoard.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+uint32_t float_bits(double value) {
+    float single = (float)value;
+    uint32_t bits;
+    memcpy(&bits, &single, sizeof(bits));
+    return bits;
+}
+
+JournalRecord make_record(uint8_t type, unsigned int channel, uint32_t value) {
+    JournalRecord record;
+    record.time_ns = 0;
+    record.type = type;
+    record.channel = (uint8_t)channel;
+    record.flags = 0;
+    record.value = value;
+    return record;
+}
+
+} // namespace
+
+JournalBoard::JournalBoard(std::unique_ptr<InterfaceBoard> board, std::string path)
+    : board_(std::move(board)), path_(path) {
+    for (uint64_t i = 0; i < JOURNAL_RING_SIZE; ++i) {
+        ring_[i].sequence.store(i, std::memory_order_relaxed);
+        ring_[i].payload = nullptr;
+    }
+}
+
+JournalBoard::~JournalBoard() {
+    if (thread_.joinable()) {
+        Record(JOURNAL_CLOSE, 0, keep_outputs_ ? 1 : 0);
+        {
+            std::lock_guard<std::mutex> lock(thread_mutex_);
+            stop_ = true;
+        }
+        thread_wakeup_.notify_one();
+        thread_.join();
+    }
+    CloseFile();
+    for (Slot &slot : ring_) delete slot.payload;
+}
+
+// The journal is opened before the board, so that nothing is done with the lasers that could not
+// be recorded.
+int JournalBoard::Open() {
+    if (OpenFile() != 0) return 1;
+    int ret = board_->Open();
+    if (!board_->DeviceIsOpen()) return ret != 0 ? ret : 1;
+
+    origin_ = std::chrono::steady_clock::now();
+    JournalSession session;
+    memset(&session, 0, sizeof(session));
+    session.unix_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    session.channels = board_->GetNumberOfChannels();
+    Record(JOURNAL_SESSION, 0, &session, sizeof(session));
+
+    OutputState outputs;
+    if (board_->GetOutputState(outputs) == 0) {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < outputs.relative_values.size() && i < JOURNAL_MAX_CHANNELS; ++i) mask |= 1u << i;
+        RecordOutputs(mask, outputs.relative_values, mask, outputs.enable_mask);
+        if (outputs.blanking_mask != 0) {
+            Record(JOURNAL_BLANKING, outputs.blanking_active_low ? 1 : 0, outputs.blanking_mask);
+        }
+    }
+
+    thread_ = std::thread(&JournalBoard::Run, this);
+    return ret;
+}
+
+// Appends to an existing journal. Only one process can write a journal at a time.
+int JournalBoard::OpenFile() {
+    fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        AddError("The journal " + path_ + " could not be opened: " + strerror(errno));
+        return 1;
+    }
+    if (flock(fd_, LOCK_EX | LOCK_NB) != 0) {
+        AddError("The journal " + path_ + " is written by another process.");
+        CloseFile();
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        AddError("The journal " + path_ + " could not be read: " + strerror(errno));
+        CloseFile();
+        return 1;
+    }
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    if (st.st_size == 0) {
+        header.magic = JOURNAL_MAGIC;
+        header.version = JOURNAL_VERSION;
+        header.header_size = JOURNAL_HEADER_SIZE;
+        header.record_size = JOURNAL_RECORD_SIZE;
+        header.used = JOURNAL_HEADER_SIZE;
+    } else if (st.st_size < JOURNAL_HEADER_SIZE || pread(fd_, &header, sizeof(header), 0) != sizeof(header) ||
+               header.magic != JOURNAL_MAGIC) {
+        AddError(path_ + " exists and is not a journal.");
+        CloseFile();
+        return 1;
+    } else if (header.version < JOURNAL_MIN_VERSION || header.version > JOURNAL_VERSION || header.header_size != JOURNAL_HEADER_SIZE ||
+               header.record_size != JOURNAL_RECORD_SIZE || header.used < JOURNAL_HEADER_SIZE ||
+               header.used > (uint64_t)st.st_size) {
+        AddError("The journal " + path_ + " was written by an incompatible version or is damaged.");
+        CloseFile();
+        return 1;
+    }
+
+    // The dose of earlier sessions is taken from the journal.
+    if (header.used > JOURNAL_HEADER_SIZE) {
+        JournalReader reader;
+        std::string error;
+        if (reader.Open(path_, error) != 0) {
+            AddError(error);
+            CloseFile();
+            return 1;
+        }
+        JournalRecord record;
+        std::vector<uint8_t> payload;
+        while (reader.Next(record, payload)) dose_.Add(record, payload);
+    }
+
+    header.version = JOURNAL_VERSION;
+    used_ = header.used;
+    size_t size = std::max((size_t)st.st_size, (size_t)used_ + JOURNAL_GROWTH);
+    void *map = MAP_FAILED;
+    if (ftruncate(fd_, size) == 0) map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED) {
+        AddError("The journal " + path_ + " could not be mapped: " + strerror(errno));
+        ftruncate(fd_, st.st_size);
+        CloseFile();
+        return 1;
+    }
+    map_ = static_cast<uint8_t *>(map);
+    map_size_ = size;
+    memcpy(map_, &header, sizeof(header));
+    return 0;
+}
+
+// Cuts off the space reserved for growth and makes sure the journal is on disk.
+void JournalBoard::CloseFile() {
+    if (map_ != nullptr) {
+        Commit();
+        msync(map_, map_size_, MS_SYNC);
+        munmap(map_, map_size_);
+        map_ = nullptr;
+        if (ftruncate(fd_, used_) != 0 || fsync(fd_) != 0) {
+            AddError("The journal " + path_ + " could not be completed: " + strerror(errno));
+        }
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+int JournalBoard::Append(const void *data, size_t size) {
+    if (map_ == nullptr) return 1;
+    if (used_ + size > map_size_) {
+        size_t new_size = map_size_ + std::max((size_t)JOURNAL_GROWTH, size);
+        Commit();
+        munmap(map_, map_size_);
+        void *map = MAP_FAILED;
+        if (ftruncate(fd_, new_size) == 0) map = mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (map == MAP_FAILED) {
+            map_ = nullptr;
+            AddError("The journal " + path_ + " could not be extended: " + strerror(errno));
+            return 1;
+        }
+        map_ = static_cast<uint8_t *>(map);
+        map_size_ = new_size;
+    }
+    if (data != nullptr) memcpy(map_ + used_, data, size);
+    else memset(map_ + used_, 0, size);
+    used_ += size;
+    return 0;
+}
+
+// Makes what was appended part of the journal. Readers see the records complete or not at all.
+void JournalBoard::Commit() {
+    if (map_ == nullptr) return;
+    __atomic_store_n(&reinterpret_cast<JournalHeader *>(map_)->used, used_, __ATOMIC_RELEASE);
+}
+
+uint64_t JournalBoard::Now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin_).count();
+}
+
+void JournalBoard::Record(uint8_t type, unsigned int channel, uint32_t value) {
+    JournalRecord record = make_record(type, channel, value);
+    Record(&record, 1, nullptr);
+}
+
+void JournalBoard::Record(uint8_t type, unsigned int channel, const void *payload, size_t size) {
+    JournalRecord record = make_record(type, channel, (uint32_t)size);
+    auto data = new std::vector<uint8_t>(static_cast<const uint8_t *>(payload), static_cast<const uint8_t *>(payload) + size);
+    Record(&record, 1, data);
+}
+
+// Places consecutive records in the ring, all or none of them, so batched writes of different
+// threads do not interleave. The payload belongs to the last record.
+void JournalBoard::Record(const JournalRecord *records, size_t count, std::vector<uint8_t> *payload) {
+    uint64_t position = ring_head_.load(std::memory_order_relaxed);
+    std::chrono::steady_clock::time_point full_since;
+    bool full = false;
+    for (;;) {
+        // The journal thread frees the slots in order, so the others are free if the last is.
+        uint64_t last = position + count - 1;
+        if (ring_[last % JOURNAL_RING_SIZE].sequence.load(std::memory_order_acquire) != last) {
+            uint64_t head = ring_head_.load(std::memory_order_relaxed);
+            if (head != position) {
+                position = head;
+                continue;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (!full) {
+                full = true;
+                full_since = now;
+            } else if (now - full_since > std::chrono::milliseconds(JOURNAL_FULL_TIMEOUT)) {
+                lost_.fetch_add(count, std::memory_order_relaxed);
+                lost_total_.fetch_add(count, std::memory_order_relaxed);
+                delete payload;
+                return;
+            }
+            Wake();
+            std::this_thread::yield();
+            continue;
+        }
+        if (ring_head_.compare_exchange_weak(position, position + count, std::memory_order_relaxed)) break;
+    }
+
+    uint64_t time_ns = Now();
+    for (size_t i = 0; i < count; ++i) {
+        Slot &slot = ring_[(position + i) % JOURNAL_RING_SIZE];
+        slot.record = records[i];
+        slot.record.time_ns = time_ns;
+        slot.payload = i == count - 1 ? payload : nullptr;
+        slot.sequence.store(position + i + 1, std::memory_order_release);
+    }
+    if (position % (JOURNAL_RING_SIZE / 2) + count > JOURNAL_RING_SIZE / 2) Wake();
+}
+
+// Asks the journal thread to drain the ring now instead of at its next interval.
+void JournalBoard::Wake() {
+    if (!wakeup_pending_.exchange(true, std::memory_order_relaxed)) thread_wakeup_.notify_one();
+}
+
+// Records the selected outputs as a single batch.
+void JournalBoard::RecordOutputs(uint32_t analog_mask, const std::vector<double> &relative_values,
+                                 uint32_t digital_mask, uint32_t digital_values) {
+    JournalRecord records[2 * JOURNAL_MAX_CHANNELS];
+    size_t count = 0;
+    for (unsigned int i = 0; i < JOURNAL_MAX_CHANNELS; ++i) {
+        if ((analog_mask & (1u << i)) && i < relative_values.size()) {
+            records[count++] = make_record(JOURNAL_ANALOG, i, float_bits(relative_values[i]));
+        }
+    }
+    for (unsigned int i = 0; i < JOURNAL_MAX_CHANNELS; ++i) {
+        if (digital_mask & (1u << i)) records[count++] = make_record(JOURNAL_DIGITAL, i, (digital_values >> i) & 1);
+    }
+    if (count == 0) return;
+    for (size_t i = 0; i + 1 < count; ++i) records[i].flags |= JOURNAL_FLAG_BATCHED;
+    Record(records, count, nullptr);
+}
+
+// Moves the ring to the file every JOURNAL_DRAIN_INTERVAL ms until the board is closed.
+void JournalBoard::Run() {
+    for (;;) {
+        bool stop;
+        {
+            std::unique_lock<std::mutex> lock(thread_mutex_);
+            thread_wakeup_.wait_for(lock, std::chrono::milliseconds(JOURNAL_DRAIN_INTERVAL),
+                                    [this] { return stop_ || wakeup_pending_.load(std::memory_order_relaxed); });
+            stop = stop_;
+        }
+        wakeup_pending_.store(false, std::memory_order_relaxed);
+        Drain();
+        if (stop) break;
+    }
+}
+
+void JournalBoard::Drain() {
+    bool drained = false;
+    std::vector<uint8_t> none;
+    for (;; ++ring_tail_) {
+        Slot &slot = ring_[ring_tail_ % JOURNAL_RING_SIZE];
+        if (slot.sequence.load(std::memory_order_acquire) != ring_tail_ + 1) break;
+        JournalRecord record = slot.record;
+        std::unique_ptr<std::vector<uint8_t>> payload(slot.payload);
+        slot.payload = nullptr;
+        slot.sequence.store(ring_tail_ + JOURNAL_RING_SIZE, std::memory_order_release);
+
+        Append(&record, sizeof(record));
+        if (payload) {
+            Append(payload->data(), payload->size());
+            Append(nullptr, journal_padded_size(payload->size()) - payload->size());
+        }
+        std::lock_guard<std::mutex> lock(dose_mutex_);
+        dose_.Add(record, payload ? *payload : none);
+        drained = true;
+    }
+
+    uint64_t lost = lost_.exchange(0, std::memory_order_relaxed);
+    if (lost > 0) {
+        JournalRecord record = make_record(JOURNAL_LOST, 0, (uint32_t)std::min(lost, (uint64_t)UINT32_MAX));
+        record.time_ns = Now();
+        Append(&record, sizeof(record));
+        drained = true;
+    }
+    if (drained) Commit();
+}
+
+double JournalBoard::GetDose(unsigned int channel) {
+    std::lock_guard<std::mutex> lock(dose_mutex_);
+    return dose_.Get(channel, Now());
+}
+
+uint64_t JournalBoard::GetLostRecords() const {
+    return lost_total_.load(std::memory_order_relaxed);
+}
+
+void JournalBoard::AddError(const std::string &error) {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    errors_.push_back(error);
+    if (errors_.size() > MAX_QUEUED_ERRORS) errors_.pop_front();
+}
+
+std::string JournalBoard::PopError() {
+    {
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (!errors_.empty()) {
+            std::string error = errors_.front();
+            errors_.pop_front();
+            return error;
+        }
+    }
+    return board_->PopError();
+}
+
+bool JournalBoard::DeviceIsOpen() const {
+    return fd_ >= 0 && board_->DeviceIsOpen();
+}
+
+int JournalBoard::WriteAnalogRelative(unsigned int channel, double relative_value) {
+    int ret = board_->WriteAnalogRelative(channel, relative_value);
+    if (ret == 0) Record(JOURNAL_ANALOG, channel, float_bits(relative_value));
+    return ret;
+}
+
+int JournalBoard::WriteDigital(unsigned int channel, bool value) {
+    int ret = board_->WriteDigital(channel, value);
+    if (ret == 0) Record(JOURNAL_DIGITAL, channel, value ? 1 : 0);
+    return ret;
+}
+
+int JournalBoard::WriteAnalogRelativeMulti(uint32_t channel_mask, const std::vector<double> &relative_values) {
+    int ret = board_->WriteAnalogRelativeMulti(channel_mask, relative_values);
+    if (ret == 0) RecordOutputs(channel_mask, relative_values, 0, 0);
+    return ret;
+}
+
+int JournalBoard::WriteDigitalMulti(uint32_t channel_mask, uint32_t values) {
+    int ret = board_->WriteDigitalMulti(channel_mask, values);
+    if (ret == 0) RecordOutputs(0, std::vector<double>(), channel_mask, values);
+    return ret;
+}
+
+int JournalBoard::LoadAnalogSequence(unsigned int channel, const std::vector<double> &relative_values) {
+    int ret = board_->LoadAnalogSequence(channel, relative_values);
+    if (ret == 0) {
+        std::vector<float> values(relative_values.begin(), relative_values.end());
+        Record(JOURNAL_LOAD_ANALOG_SEQUENCE, channel, values.data(), values.size() * sizeof(float));
+    }
+    return ret;
+}
+
+int JournalBoard::LoadDigitalSequence(unsigned int channel, const std::vector<bool> &values) {
+    int ret = board_->LoadDigitalSequence(channel, values);
+    if (ret == 0) {
+        std::vector<uint8_t> bytes(values.begin(), values.end());
+        Record(JOURNAL_LOAD_DIGITAL_SEQUENCE, channel, bytes.data(), bytes.size());
+    }
+    return ret;
+}
+
+int JournalBoard::StartAnalogSequence(unsigned int channel) {
+    int ret = board_->StartAnalogSequence(channel);
+    if (ret == 0) Record(JOURNAL_START_ANALOG_SEQUENCE, channel, 0);
+    return ret;
+}
+
+int JournalBoard::StopAnalogSequence(unsigned int channel) {
+    int ret = board_->StopAnalogSequence(channel);
+    if (ret == 0) Record(JOURNAL_STOP_ANALOG_SEQUENCE, channel, 0);
+    return ret;
+}
+
+int JournalBoard::StartDigitalSequence(unsigned int channel) {
+    int ret = board_->StartDigitalSequence(channel);
+    if (ret == 0) Record(JOURNAL_START_DIGITAL_SEQUENCE, channel, 0);
+    return ret;
+}
+
+int JournalBoard::StopDigitalSequence(unsigned int channel) {
+    int ret = board_->StopDigitalSequence(channel);
+    if (ret == 0) Record(JOURNAL_STOP_DIGITAL_SEQUENCE, channel, 0);
+    return ret;
+}
+
+int JournalBoard::LoadWaveform(const std::vector<WaveformEvent> &events) {
+    int ret = board_->LoadWaveform(events);
+    if (ret == 0) {
+        std::vector<JournalWaveformEvent> recorded(events.size());
+        for (size_t i = 0; i < events.size(); ++i) {
+            recorded[i].time_us = events[i].time_us;
+            recorded[i].on_mask = events[i].on_mask;
+            recorded[i].off_mask = events[i].off_mask;
+            recorded[i].power_channel = events[i].power_channel;
+            recorded[i].relative_power = (float)events[i].relative_power;
+        }
+        Record(JOURNAL_LOAD_WAVEFORM, 0, recorded.data(), recorded.size() * sizeof(JournalWaveformEvent));
+    }
+    return ret;
+}
+
+int JournalBoard::StartWaveform(uint32_t channel_mask, uint32_t period_us, unsigned int repetitions, bool on_trigger) {
+    int ret = board_->StartWaveform(channel_mask, period_us, repetitions, on_trigger);
+    if (ret == 0) {
+        JournalWaveformStart start = {channel_mask, period_us, repetitions, on_trigger ? 1u : 0u};
+        Record(JOURNAL_START_WAVEFORM, 0, &start, sizeof(start));
+    }
+    return ret;
+}
+
+int JournalBoard::StopWaveform() {
+    int ret = board_->StopWaveform();
+    if (ret == 0) Record(JOURNAL_STOP_WAVEFORM, 0, 0);
+    return ret;
+}
+
+int JournalBoard::SetBlanking(uint32_t channel_mask, bool active_low) {
+    int ret = board_->SetBlanking(channel_mask, active_low);
+    if (ret == 0) Record(JOURNAL_BLANKING, active_low ? 1 : 0, channel_mask);
+    return ret;
+}
+
+int JournalBoard::LoadCalibration(unsigned int channel, const std::vector<double> &relative_outputs) {
+    int ret = board_->LoadCalibration(channel, relative_outputs);
+    if (ret == 0) {
+        std::vector<float> values(relative_outputs.begin(), relative_outputs.end());
+        Record(JOURNAL_LOAD_CALIBRATION, channel, values.data(), values.size() * sizeof(float));
+    }
+    return ret;
+}
+
+void JournalBoard::SetKeepOutputsOnClose(bool keep) {
+    keep_outputs_ = keep;
+    board_->SetKeepOutputsOnClose(keep);
+}
+
+// Everything else does not change the outputs and is passed on as it is.
+
+unsigned int JournalBoard::GetNumberOfChannels() const {
+    return board_->GetNumberOfChannels();
+}
+
+int JournalBoard::GetChannelOutput(unsigned int channel, uint8_t &dac_address, uint8_t &dac_output) const {
+    return board_->GetChannelOutput(channel, dac_address, dac_output);
+}
+
+unsigned int JournalBoard::GetMaxSequenceLength() const {
+    return board_->GetMaxSequenceLength();
+}
+
+unsigned int JournalBoard::GetMaxWaveformEvents() const {
+    return board_->GetMaxWaveformEvents();
+}
+
+int JournalBoard::GetWaveformStatus(bool &running, uint32_t &periods) {
+    return board_->GetWaveformStatus(running, periods);
+}
+
+int JournalBoard::Ramp(unsigned int channel, double relative_value, uint32_t duration_us, bool exponential) {
+    int ret = board_->Ramp(channel, relative_value, duration_us, exponential);
+    if (ret == 0) {
+        JournalRamp ramp = {(float)relative_value, duration_us, exponential ? 1u : 0u, 0};
+        Record(JOURNAL_RAMP, channel, &ramp, sizeof(ramp));
+    }
+    return ret;
+}
+
+unsigned int JournalBoard::GetNumberOfModulators() const {
+    return board_->GetNumberOfModulators();
+}
+
+int JournalBoard::SetModulation(unsigned int output, double frequency_hz, double duty_cycle) {
+    int ret = board_->SetModulation(output, frequency_hz, duty_cycle);
+    if (ret == 0) {
+        JournalModulation modulation = {(float)frequency_hz, (float)duty_cycle};
+        Record(JOURNAL_MODULATION, output, &modulation, sizeof(modulation));
+    }
+    return ret;
+}
+
+int JournalBoard::LoadModulationSequence(unsigned int output, const std::vector<double> &frequencies_hz,
+                                         const std::vector<double> &duty_cycles) {
+    int ret = board_->LoadModulationSequence(output, frequencies_hz, duty_cycles);
+    if (ret == 0) {
+        std::vector<JournalModulation> entries;
+        for (size_t i = 0; i < frequencies_hz.size(); ++i) {
+            entries.push_back({(float)frequencies_hz[i], (float)duty_cycles[i]});
+        }
+        Record(JOURNAL_LOAD_MODULATION_SEQUENCE, output, entries.data(), entries.size() * sizeof(JournalModulation));
+    }
+    return ret;
+}
+
+int JournalBoard::StartModulationSequence(unsigned int output) {
+    int ret = board_->StartModulationSequence(output);
+    if (ret == 0) Record(JOURNAL_START_MODULATION_SEQUENCE, output, 0);
+    return ret;
+}
+
+int JournalBoard::StopModulationSequence(unsigned int output) {
+    int ret = board_->StopModulationSequence(output);
+    if (ret == 0) Record(JOURNAL_STOP_MODULATION_SEQUENCE, output, 0);
+    return ret;
+}
+
+unsigned int JournalBoard::GetCalibrationSize() const {
+    return board_->GetCalibrationSize();
+}
+
+unsigned int JournalBoard::GetNumberOfMonitors() const {
+    return board_->GetNumberOfMonitors();
+}
+
+int JournalBoard::SetTelemetry(unsigned int sample_rate, unsigned int state_interval_ms) {
+    return board_->SetTelemetry(sample_rate, state_interval_ms);
+}
+
+uint64_t JournalBoard::GetMonitorSampleCount() const {
+    return board_->GetMonitorSampleCount();
+}
+
+size_t JournalBoard::GetMonitorSamples(uint64_t &cursor, std::vector<MonitorSample> &samples) {
+    return board_->GetMonitorSamples(cursor, samples);
+}
+
+int JournalBoard::GetBoardState(BoardState &state) {
+    return board_->GetBoardState(state);
+}
+
+int JournalBoard::GetOutputState(OutputState &state) {
+    return board_->GetOutputState(state);
+}
+
+bool JournalBoard::Busy() {
+    return board_->Busy();
+}
+
+int JournalBoard::Flush() {
+    return board_->Flush();
+}
+
+int JournalBoard::SetMaxPendingCommands(unsigned int count) {
+    return board_->SetMaxPendingCommands(count);
+}
+
+int JournalBoard::SetLowLatency(bool low_latency) {
+    return board_->SetLowLatency(low_latency);
+}
+
+void JournalBoard::GetStatistics(BoardStatistics &stats) {
+    board_->GetStatistics(stats);
+}
+
+void JournalBoard::ResetStatistics() {
+    board_->ResetStatistics();
+}
@@ -0,0 +1,173 @@
+/* JournalBoard.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef JOURNAL_BOARD_H_
+#define JOURNAL_BOARD_H_
+
+#include "InterfaceBoard.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Journal.h"
+
+// Slots of the ring between the callers and the journal thread, a power of two
+#define JOURNAL_RING_SIZE 4096
+
+// Interval at which the journal thread moves the ring to the file in ms
+#define JOURNAL_DRAIN_INTERVAL 5
+
+// Time a caller waits for space in a full ring before its record is dropped in ms
+#define JOURNAL_FULL_TIMEOUT 100
+
+// The journal file grows by this many bytes at a time
+#define JOURNAL_GROWTH (4 << 20)
+
+// Interface board that records the commands given to another one in a journal file, see
+// Journal.h (Linux only). Every command that changes the outputs is recorded with a timestamp
+// once the board accepted it. Recording does not wait for the file: the record is placed in a
+// bounded lock-free ring that any number of threads can write, and a thread moves the ring into
+// the memory-mapped file every JOURNAL_DRAIN_INTERVAL ms, or as soon as the ring is half full,
+// and accumulates the dose of every channel. A caller that finds the ring full waits for the
+// thread; only if the file does not keep up for JOURNAL_FULL_TIMEOUT ms, the record is dropped
+// and a JOURNAL_LOST record tells how many were lost. The file is synced to disk when the board is closed; until then, a crash of the
+// process loses nothing that was moved to the file, a crash of the system may.
+//
+// The outputs the board had when it was opened are recorded as the first writes of a session.
+class JournalBoard : public InterfaceBoard {
+    public:
+        JournalBoard(std::unique_ptr<InterfaceBoard> board, std::string path);
+        ~JournalBoard();
+
+        // Dose of a channel recorded in the journal file so far, see JournalDose
+        double GetDose(unsigned int channel);
+
+        // Records dropped because the ring was full
+        uint64_t GetLostRecords() const;
+
+        int Open();
+        int WriteAnalogRelative(unsigned int channel, double relative_value);
+        int WriteDigital(unsigned int channel, bool value);
+        bool DeviceIsOpen() const;
+        unsigned int GetNumberOfChannels() const;
+        int GetChannelOutput(unsigned int channel, uint8_t &dac_address, uint8_t &dac_output) const;
+        int WriteAnalogRelativeMulti(uint32_t channel_mask, const std::vector<double> &relative_values);
+        int WriteDigitalMulti(uint32_t channel_mask, uint32_t values);
+        unsigned int GetMaxSequenceLength() const;
+        int LoadAnalogSequence(unsigned int channel, const std::vector<double> &relative_values);
+        int LoadDigitalSequence(unsigned int channel, const std::vector<bool> &values);
+        int StartAnalogSequence(unsigned int channel);
+        int StopAnalogSequence(unsigned int channel);
+        int StartDigitalSequence(unsigned int channel);
+        int StopDigitalSequence(unsigned int channel);
+        unsigned int GetMaxWaveformEvents() const;
+        int LoadWaveform(const std::vector<WaveformEvent> &events);
+        int StartWaveform(uint32_t channel_mask, uint32_t period_us, unsigned int repetitions, bool on_trigger);
+        int StopWaveform();
+        int GetWaveformStatus(bool &running, uint32_t &periods);
+        int SetBlanking(uint32_t channel_mask, bool active_low);
+        int Ramp(unsigned int channel, double relative_value, uint32_t duration_us, bool exponential);
+        unsigned int GetNumberOfModulators() const;
+        int SetModulation(unsigned int output, double frequency_hz, double duty_cycle);
+        int LoadModulationSequence(unsigned int output, const std::vector<double> &frequencies_hz,
+                                   const std::vector<double> &duty_cycles);
+        int StartModulationSequence(unsigned int output);
+        int StopModulationSequence(unsigned int output);
+        unsigned int GetCalibrationSize() const;
+        int LoadCalibration(unsigned int channel, const std::vector<double> &relative_outputs);
+        unsigned int GetNumberOfMonitors() const;
+        int SetTelemetry(unsigned int sample_rate, unsigned int state_interval_ms);
+        uint64_t GetMonitorSampleCount() const;
+        size_t GetMonitorSamples(uint64_t &cursor, std::vector<MonitorSample> &samples);
+        int GetBoardState(BoardState &state);
+        int GetOutputState(OutputState &state);
+        void SetKeepOutputsOnClose(bool keep);
+        bool Busy();
+        int Flush();
+        int SetMaxPendingCommands(unsigned int count);
+        int SetLowLatency(bool low_latency);
+        std::string PopError();
+        void GetStatistics(BoardStatistics &stats);
+        void ResetStatistics();
+    private:
+        // A record in the ring. sequence equals the slot's position while the slot is free and
+        // position + 1 once it was filled. The payload belongs to the slot until it was drained.
+        struct Slot {
+            std::atomic<uint64_t> sequence;
+            JournalRecord record;
+            std::vector<uint8_t> *payload;
+        };
+
+        int OpenFile();
+        void CloseFile();
+        int Append(const void *data, size_t size);
+        void Commit();
+        void Record(uint8_t type, unsigned int channel, uint32_t value);
+        void Record(uint8_t type, unsigned int channel, const void *payload, size_t size);
+        void Record(const JournalRecord *records, size_t count, std::vector<uint8_t> *payload);
+        void RecordOutputs(uint32_t analog_mask, const std::vector<double> &relative_values, uint32_t digital_mask,
+                           uint32_t digital_values);
+        uint64_t Now() const;
+        void Wake();
+        void Run();
+        void Drain();
+        void AddError(const std::string &error);
+
+        std::unique_ptr<InterfaceBoard> board_;
+        std::string path_;
+        bool keep_outputs_ = false;
+        std::chrono::steady_clock::time_point origin_; // Start of the session
+
+        Slot ring_[JOURNAL_RING_SIZE];
+        std::atomic<uint64_t> ring_head_{0}; // Next position a caller writes to
+        uint64_t ring_tail_ = 0;             // Next position the journal thread reads
+        std::atomic<uint64_t> lost_{0};
+        std::atomic<uint64_t> lost_total_{0};
+
+        // Owned by the journal thread while it runs
+        int fd_ = -1;
+        uint8_t *map_ = nullptr;
+        size_t map_size_ = 0;
+        uint64_t used_ = 0;
+
+        std::thread thread_;
+        std::mutex thread_mutex_;
+        std::condition_variable thread_wakeup_;
+        std::atomic<bool> wakeup_pending_{false};
+        bool stop_ = false;
+
+        std::mutex dose_mutex_;
+        JournalDose dose_;
+
+        std::mutex error_mutex_;
+        std::deque<std::string> errors_;
+};
+
+#endif // JOURNAL_BOARD_H_
@@ -23,25 +23,89 @@
 
 #include "LaserDiodeDriver.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 
 // Always include Arduino-board commit 1d16c1119ba8a6349a982ad88a5b6d78bc918a21
 #include "Arduino.h"
+#include "MultiBoard.h"
 const char* g_BoardArduino = "Arduino";
 
+#ifdef BUILD_SHARED_MEMORY
+#include "SharedMemoryBoard.h"
+const char* g_BoardSharedMemory = "Shared Memory";
+#endif
+
+#ifdef BUILD_JOURNAL
+#include "JournalBoard.h"
+#endif
+
+#ifdef BUILD_NETWORK
+#include "TcpLink.h"
+const char* g_BoardNetwork = "Network";
+#endif
+
 const char* const g_Msg_DEVICE_INVALID_BOARD_TYPE = "Please choose a valid device Type!";
 
 const char* g_LaserDiodeDriverName = "LaserDiodeDriver";
+const char* g_LaserDiodeShutterName = "LaserDiodeShutter";
+const char* g_LaserDiodeLaserName = "LaserDiodeLaser-"; // followed by the laser number
 
 const char* ON = "On";
 const char* OFF = "Off";
 
+const char* g_StatisticNames[NUMBER_OF_STATISTICS] = {
+   "Stat. Write Latency p50 (us)",
+   "Stat. Write Latency p99 (us)",
+   "Stat. Write Latency Max. (us)",
+   "Stat. Send Latency p50 (us)",
+   "Stat. Send Latency p99 (us)",
+   "Stat. Commands/s",
+   "Stat. Bytes Sent",
+   "Stat. Queue Depth",
+   "Stat. Errors",
+   "Stat. Resyncs",
+   "Stat. Board Commands/s",
+   "Stat. Board Buffer Peak (bytes)",
+};
+const char* g_StatisticsIdle = "Idle";
+const char* g_StatisticsReset = "Reset";
+
+const char* g_WaveformNone = "None";
+const char* g_WaveformStopped = "Stopped";
+const char* g_WaveformRunning = "Running";
+const char* g_BlankingActiveHigh = "Active High";
+const char* g_BlankingActiveLow = "Active Low";
+const char* g_RampLinear = "Linear";
+const char* g_RampExponential = "Exponential";
+const char* g_ReadbackUnknown = "Unknown";
+const char* g_ShutdownOff = "Off";
+const char* g_ShutdownKeep = "Keep";
+const char* g_SerialStandard = "Standard";
+const char* g_SerialLowLatency = "Low Latency";
+const char* g_TriggerPerBoard = "Per Board";
+const char* g_TriggerShared = "Shared";
+const char* const g_Msg_ERR_WAVEFORM_FILE = "The waveform file could not be read. See the log for details.";
+const char* const g_Msg_ERR_WAVEFORM = "The waveform could not be loaded to or started on the device.";
+const char* const g_Msg_ERR_NO_LASER = "The device has no output for this laser.";
+const char* const g_Msg_ERR_CALIBRATION = "The calibration file could not be read or loaded to the device. See the log for details.";
+
 #define DEVICE_INVALID_BOARD_TYPE 142
 
 MODULE_API void InitializeModuleData()
 {
-   RegisterDevice(g_LaserDiodeDriverName, MM::GenericDevice, "Laser diode driver device adapter.");
+   RegisterDevice(g_LaserDiodeDriverName, MM::HubDevice, "Laser diode driver device adapter.");
+   RegisterDevice(g_LaserDiodeShutterName, MM::ShutterDevice, "Shutter switching lasers of the laser diode driver.");
+   for (int i = 0; i < MAX_LASERS; ++i) {
+      std::string name = g_LaserDiodeLaserName + std::to_string(i+1);
+      RegisterDevice(name.c_str(), MM::GenericDevice, "Single laser of the laser diode driver.");
+   }
 }
 
 MODULE_API MM::Device* CreateDevice(const char* deviceName)
@@ -55,6 +119,16 @@ MODULE_API MM::Device* CreateDevice(const char* deviceName)
       // create camera
       return new LaserDiodeDriver();
    }
+   else if (strcmp(deviceName, g_LaserDiodeShutterName) == 0)
+   {
+      return new LaserDiodeShutter();
+   }
+   else if (strncmp(deviceName, g_LaserDiodeLaserName, strlen(g_LaserDiodeLaserName)) == 0)
+   {
+      int number = atoi(deviceName + strlen(g_LaserDiodeLaserName));
+      if (number >= 1 && number <= MAX_LASERS)
+         return new LaserDiodeLaser(number - 1);
+   }
 
    // ...supplied name not recognized
    return 0;
@@ -67,9 +141,17 @@ MODULE_API void DeleteDevice(MM::Device* pDevice)
 
 LaserDiodeDriver::LaserDiodeDriver()
 {
+   for (int i = 0; i < MAX_LASERS; ++i) {
+      laserDevices_[i] = nullptr;
+   }
+
    // call the base class method to set-up default error codes/messages
    InitializeDefaultErrorMessages();
    SetErrorText(DEVICE_INVALID_BOARD_TYPE, g_Msg_DEVICE_INVALID_BOARD_TYPE);
+   SetErrorText(ERR_WAVEFORM_FILE, g_Msg_ERR_WAVEFORM_FILE);
+   SetErrorText(ERR_WAVEFORM, g_Msg_ERR_WAVEFORM);
+   SetErrorText(ERR_NO_LASER, g_Msg_ERR_NO_LASER);
+   SetErrorText(ERR_CALIBRATION, g_Msg_ERR_CALIBRATION);
 
    int ret;
    CPropertyAction* pAct = new CPropertyAction(this, &LaserDiodeDriver::OnBoardType);
@@ -82,29 +164,54 @@ LaserDiodeDriver::LaserDiodeDriver()
 #endif
 #ifdef BUILD_ARDUINO
    AddAllowedValue("Device Type", g_BoardArduino);
+#endif
+#ifdef BUILD_SHARED_MEMORY
+   AddAllowedValue("Device Type", g_BoardSharedMemory);
+#endif
+#ifdef BUILD_NETWORK
+   AddAllowedValue("Device Type", g_BoardNetwork);
 #endif
    pAct = new CPropertyAction(this, &LaserDiodeDriver::OnPort);
-   ret = CreateStringProperty("Device Port", "Undefined", false, pAct, true);
-
-   for (int i = 0; i < NUMBER_OF_LASERS; ++i) {
-      CPropertyAction* pActLaserMinPower = new CPropertyAction (this, &LaserDiodeDriver::OnLaserMinPower);
-      CPropertyAction* pActLaserMaxPower = new CPropertyAction (this, &LaserDiodeDriver::OnLaserMaxPower);
-
-      char p_name[64];
-
-      // Laser label
-      sprintf(p_name, "Laser Label %d", i+1);
-      ret = CreateStringProperty(p_name, "", false, nullptr, true);
-
-      // Laser limits
-      sprintf(p_name, "Min. Laser Power %d (%%)", i+1);
-      ret = CreateFloatProperty(p_name, 0.0, false, pActLaserMinPower, true);
-      ret = SetPropertyLimits(p_name, 0.0, 100.0);
+   ret = CreateStringProperty("Device Port", AUTO_PORT, false, pAct, true);
+
+   // Whether the lasers are turned off when the device is shut down. With "Keep", they stay as
+   // they are and are taken over by the next initialization.
+   ret = CreateStringProperty("Lasers On Shutdown", g_ShutdownOff, false, nullptr, true);
+   AddAllowedValue("Lasers On Shutdown", g_ShutdownOff);
+   AddAllowedValue("Lasers On Shutdown", g_ShutdownKeep);
+
+   // With "Low Latency", replies are read as soon as they arrive instead of being polled for and
+   // the serial port skips the waits meant for real UARTs (Linux only).
+   ret = CreateStringProperty("Serial Mode", g_SerialStandard, false, nullptr, true);
+   AddAllowedValue("Serial Mode", g_SerialStandard);
+   AddAllowedValue("Serial Mode", g_SerialLowLatency);
+
+   // Several boards are combined by giving their ports separated by commas; their lasers are
+   // numbered one after the other. With "Shared", the trigger inputs of all boards are wired to
+   // the same line and waveforms wait for its next edge, so that all boards start together.
+   ret = CreateStringProperty("Trigger Line", g_TriggerPerBoard, false, nullptr, true);
+   AddAllowedValue("Trigger Line", g_TriggerPerBoard);
+   AddAllowedValue("Trigger Line", g_TriggerShared);
+
+   // Number of commands that may be sent before the board has acknowledged the previous ones
+   ret = CreateIntegerProperty("Max. Commands In Flight", DEFAULT_COMMANDS_IN_FLIGHT, false, nullptr, true);
+   ret = SetPropertyLimits("Max. Commands In Flight", 1, 128);
+
+   // Power calibration of the lasers, see LoadCalibrationFile() for the file format
+   ret = CreateStringProperty("Calibration File", "", false, nullptr, true);
+
+#ifdef BUILD_JOURNAL
+   // Binary journal of all commands that change the lasers, appended to if the file exists, see
+   // Journal.h. Empty to record nothing.
+   ret = CreateStringProperty("Journal File", "", false, nullptr, true);
+#endif
 
-      sprintf(p_name, "Max. Laser Power %d (%%)", i+1);
-      ret = CreateFloatProperty(p_name, 100.0, false, pActLaserMaxPower, true);
-      ret = SetPropertyLimits(p_name, 0.0, 100.0);
-   }
+   // Labels and power limits of the lasers in laser order, separated by commas, e.g. "405 nm,488 nm".
+   // The number of lasers is only known once the board is opened, so these are lists rather than
+   // one property per laser. Empty or missing entries keep the defaults, no label and 0 to 100 %.
+   ret = CreateStringProperty("Laser Labels", "", false, nullptr, true);
+   ret = CreateStringProperty("Min. Laser Powers (%)", "", false, nullptr, true);
+   ret = CreateStringProperty("Max. Laser Powers (%)", "", false, nullptr, true);
 }
 
 LaserDiodeDriver::~LaserDiodeDriver()
@@ -146,16 +253,99 @@ int LaserDiodeDriver::Initialize()
       char dir[MM::MaxStrLength];
       GetProperty("Device Port", dir);
    
-      std::string deviceDir = std::string(dir);
-      
-      interface_ = new Arduino(deviceDir);
+      std::vector<std::string> ports;
+      std::istringstream portList(dir);
+      for (std::string port; std::getline(portList, port, ',');) {
+         port.erase(0, port.find_first_not_of(" \t"));
+         port.erase(port.find_last_not_of(" \t") + 1);
+         if (!port.empty()) ports.push_back(port);
+      }
+
+      if (ports.size() > 1) {
+         char triggerLine[MM::MaxStrLength];
+         GetProperty("Trigger Line", triggerLine);
+
+         std::vector<std::unique_ptr<InterfaceBoard>> boards;
+         for (const std::string& port : ports) {
+            boards.push_back(std::unique_ptr<InterfaceBoard>(new Arduino(port)));
+         }
+         interface_ = new MultiBoard(std::move(boards), strcmp(triggerLine, g_TriggerShared) == 0);
+      } else {
+         interface_ = new Arduino(ports.empty() ? std::string(AUTO_PORT) : ports[0]);
+      }
+   } else 
+#endif
+#ifdef BUILD_SHARED_MEMORY
+   if (strcmp(boardType_.c_str(), g_BoardSharedMemory) == 0) {
+      // The port is the name of the broker's shared memory
+      char name[MM::MaxStrLength];
+      GetProperty("Device Port", name);
+
+      std::string brokerName = std::string(name);
+      if (brokerName == AUTO_PORT) {
+         brokerName = SHARED_MEMORY_DEFAULT_NAME;
+      } else if (brokerName[0] != '/') {
+         brokerName = "/" + brokerName;
+      }
+
+      interface_ = new SharedMemoryBoard(brokerName);
+   } else 
+#endif
+#ifdef BUILD_NETWORK
+   if (strcmp(boardType_.c_str(), g_BoardNetwork) == 0) {
+      // The port is the address of the server in tools/server, "host" or "host:port". Several
+      // servers are combined like several ports of the Arduino type.
+      char dir[MM::MaxStrLength];
+      GetProperty("Device Port", dir);
+
+      std::vector<std::string> addresses;
+      std::istringstream addressList(dir);
+      for (std::string address; std::getline(addressList, address, ',');) {
+         address.erase(0, address.find_first_not_of(" \t"));
+         address.erase(address.find_last_not_of(" \t") + 1);
+         if (address == AUTO_PORT) address = "localhost";
+         if (!address.empty()) addresses.push_back(address);
+      }
+      if (addresses.empty()) addresses.push_back("localhost");
+
+      std::vector<std::unique_ptr<InterfaceBoard>> boards;
+      for (const std::string& address : addresses) {
+         boards.push_back(std::unique_ptr<InterfaceBoard>(new Arduino(address, std::unique_ptr<Link>(new TcpLink()))));
+      }
+      if (boards.size() > 1) {
+         char triggerLine[MM::MaxStrLength];
+         GetProperty("Trigger Line", triggerLine);
+         interface_ = new MultiBoard(std::move(boards), strcmp(triggerLine, g_TriggerShared) == 0);
+      } else {
+         interface_ = boards[0].release();
+      }
    } else 
 #endif
    return DEVICE_INVALID_BOARD_TYPE;
+
+   long commandsInFlight;
+   GetProperty("Max. Commands In Flight", commandsInFlight);
+   interface_->SetMaxPendingCommands(commandsInFlight);
+
+   char serialMode[MM::MaxStrLength];
+   GetProperty("Serial Mode", serialMode);
+   interface_->SetLowLatency(strcmp(serialMode, g_SerialLowLatency) == 0);
+
+#ifdef BUILD_JOURNAL
+   char journalFile[MM::MaxStrLength];
+   GetProperty("Journal File", journalFile);
+   if (journalFile[0] != '\0') {
+      journal_ = new JournalBoard(std::unique_ptr<InterfaceBoard>(interface_), journalFile);
+      interface_ = journal_;
+   }
+#endif
    
    interface_->Open();
    if (!interface_->DeviceIsOpen()) {
       LogMessage("The device could not be opened!");
+      for (std::string error = interface_->PopError(); !error.empty(); error = interface_->PopError()) {
+         LogMessage(error, false);
+      }
       ret = DEVICE_NOT_CONNECTED;
    }
    
@@ -163,13 +353,38 @@ int LaserDiodeDriver::Initialize()
       return ret;
    }
 
+   // The board reports its channels when it is opened; lasers beyond them get no properties.
+   numberOfLasers_ = std::min((int)interface_->GetNumberOfChannels(), MAX_LASERS);
+   ret = CreateIntegerProperty("Number Of Lasers", numberOfLasers_, true);
+
+   ret = LoadLaserSettings();
+   if (ret != DEVICE_OK) {
+      return ret;
+   }
+
+   char shutdown[MM::MaxStrLength];
+   GetProperty("Lasers On Shutdown", shutdown);
+   interface_->SetKeepOutputsOnClose(strcmp(shutdown, g_ShutdownKeep) == 0);
+
+   // The board is attached without resetting its outputs, so the lasers start as they are.
+   RestoreOutputState();
+
+   char calibrationFile[MM::MaxStrLength];
+   GetProperty("Calibration File", calibrationFile);
+   if (calibrationFile[0] != '\0') {
+      ret = LoadCalibrationFile(calibrationFile);
+      if (ret != DEVICE_OK) {
+         return ret;
+      }
+   }
+
    std::vector<std::string> digitalValues;
    digitalValues.push_back(OFF);
    digitalValues.push_back(ON);
 
-   for (int i = 0; i < NUMBER_OF_LASERS; ++i) {
-      CPropertyAction* pActLaserPower = new CPropertyAction (this, &LaserDiodeDriver::OnLaserPower);
-      CPropertyAction* pActLaserOnOff = new CPropertyAction (this, &LaserDiodeDriver::OnLaserOnOff);
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      CPropertyActionEx* pActLaserPower = new CPropertyActionEx (this, &LaserDiodeDriver::OnLaserPower, i);
+      CPropertyActionEx* pActLaserOnOff = new CPropertyActionEx (this, &LaserDiodeDriver::OnLaserOnOff, i);
 
       char p_name[64];
 
@@ -182,7 +397,152 @@ int LaserDiodeDriver::Initialize()
       sprintf(p_name, "Enable Laser %d", i+1);
       ret = CreateStringProperty(p_name, OFF, false, pActLaserOnOff);
       ret = SetAllowedValues(p_name, digitalValues);
+
+      // DAC output driving the laser, e.g. "0x60/A"
+      uint8_t dacAddress, dacOutput;
+      if (interface_->GetChannelOutput(i, dacAddress, dacOutput) == 0) {
+         char output[16];
+         sprintf(output, "0x%02X/%c", dacAddress, 'A' + dacOutput);
+         sprintf(p_name, "DAC Output Laser %d", i+1);
+         ret = CreateStringProperty(p_name, output, true);
+      }
+   }
+
+   // Compound state of all lasers, e.g. "50:On,0:Off,-,-,100:On,-". Entries are "power:enable";
+   // either part may be omitted and "-" leaves a laser unchanged. Applied with a single batched
+   // write so that config groups switch all lasers at once.
+   CPropertyAction* pActLaserState = new CPropertyAction (this, &LaserDiodeDriver::OnLaserState);
+   ret = CreateStringProperty("Laser State", "", false, pActLaserState);
+
+   // Latency is measured from setting a property until the board acknowledged the change (write)
+   // or until the command was written to the port (send).
+   for (int i = 0; i < NUMBER_OF_STATISTICS; ++i) {
+      CPropertyActionEx* pActStatistic = new CPropertyActionEx (this, &LaserDiodeDriver::OnStatistic, i);
+      if (i == STAT_COMMANDS_PER_SECOND || i == STAT_BYTES_SENT) {
+         ret = CreateFloatProperty(g_StatisticNames[i], 0.0, true, pActStatistic);
+      } else {
+         ret = CreateIntegerProperty(g_StatisticNames[i], 0, true, pActStatistic);
+      }
+   }
+
+   CPropertyAction* pActResetStatistics = new CPropertyAction (this, &LaserDiodeDriver::OnResetStatistics);
+   ret = CreateStringProperty("Stat. Reset", g_StatisticsIdle, false, pActResetStatistics);
+   AddAllowedValue("Stat. Reset", g_StatisticsIdle);
+   AddAllowedValue("Stat. Reset", g_StatisticsReset);
+   rateTime_ = std::chrono::steady_clock::now();
+
+   // Waveforms played back by the device with microsecond timing, see LoadWaveformFile() for
+   // the file format. "Waveform" loads one of the waveforms of the file to the device, "Waveform
+   // State" starts and stops it and reports whether it is still running.
+   CPropertyAction* pActWaveformFile = new CPropertyAction (this, &LaserDiodeDriver::OnWaveformFile);
+   ret = CreateStringProperty("Waveform File", "", false, pActWaveformFile);
+
+   CPropertyAction* pActWaveform = new CPropertyAction (this, &LaserDiodeDriver::OnWaveform);
+   ret = CreateStringProperty("Waveform", g_WaveformNone, false, pActWaveform);
+   AddAllowedValue("Waveform", g_WaveformNone);
+
+   // Number of periods to play, 0 repeats the waveform until it is stopped
+   ret = CreateIntegerProperty("Waveform Repetitions", 0, false);
+   ret = SetPropertyLimits("Waveform Repetitions", 0, 65535);
+
+   CPropertyAction* pActWaveformState = new CPropertyAction (this, &LaserDiodeDriver::OnWaveformState);
+   ret = CreateStringProperty("Waveform State", g_WaveformStopped, false, pActWaveformState);
+   AddAllowedValue("Waveform State", g_WaveformStopped);
+   AddAllowedValue("Waveform State", g_WaveformRunning);
+
+   // Blanked lasers only emit light while the camera's exposure output, connected to the
+   // board, is active. The board switches them by itself, so they follow the camera at any frame
+   // rate.
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      CPropertyActionEx* pActBlanking = new CPropertyActionEx (this, &LaserDiodeDriver::OnBlanking, i);
+      char p_name[64];
+      sprintf(p_name, "Blanking Laser %d", i+1);
+      ret = CreateStringProperty(p_name, OFF, false, pActBlanking);
+      ret = SetAllowedValues(p_name, digitalValues);
+   }
+
+   CPropertyAction* pActBlankingPolarity = new CPropertyAction (this, &LaserDiodeDriver::OnBlankingPolarity);
+   ret = CreateStringProperty("Blanking Polarity", g_BlankingActiveHigh, false, pActBlankingPolarity);
+   AddAllowedValue("Blanking Polarity", g_BlankingActiveHigh);
+   AddAllowedValue("Blanking Polarity", g_BlankingActiveLow);
+
+   // Power changes of lasers with a ramp time are faded by the board over that time instead of
+   // being written at once, and the devices are busy until the ramp has ended. Exponential ramps
+   // change the power by the same factor every millisecond. Sequences and waveforms are not
+   // ramped.
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      CPropertyActionEx* pActRampTime = new CPropertyActionEx (this, &LaserDiodeDriver::OnRampTime, i);
+      char p_name[64];
+      sprintf(p_name, "Ramp Time Laser %d (ms)", i+1);
+      ret = CreateIntegerProperty(p_name, 0, false, pActRampTime);
+      ret = SetPropertyLimits(p_name, 0, 60000);
+   }
+
+   CPropertyAction* pActRampCurve = new CPropertyAction (this, &LaserDiodeDriver::OnRampCurve);
+   ret = CreateStringProperty("Ramp Curve", g_RampLinear, false, pActRampCurve);
+   AddAllowedValue("Ramp Curve", g_RampLinear);
+   AddAllowedValue("Ramp Curve", g_RampExponential);
+
+   // Modulation outputs of the board for pulsed lasers. A change takes effect at the end of the
+   // running period; both properties are sequenceable, e.g. for lifetime or modulation sweeps.
+   // The values start at the board's defaults: the first output pulses at 1 MHz with 75 % duty
+   // cycle, the others are off.
+   modulators_.assign(interface_->GetNumberOfModulators(), ModulationOutput());
+   if (!modulators_.empty()) modulators_[0].dutyCycle = 75.0;
+   for (size_t i = 0; i < modulators_.size(); ++i) {
+      CPropertyActionEx* pActFrequency = new CPropertyActionEx (this, &LaserDiodeDriver::OnModulationFrequency, (long)i);
+      char p_name[64];
+      sprintf(p_name, "Modulation %d Frequency (Hz)", (int)i+1);
+      ret = CreateFloatProperty(p_name, modulators_[i].frequency, false, pActFrequency);
+      ret = SetPropertyLimits(p_name, std::ceil((double)MODULATION_CLOCK / MODULATION_MAX_TOP / (1 << MODULATION_MAX_PRESCALER)),
+                              std::floor((double)MODULATION_CLOCK / MODULATION_MIN_TOP));
+
+      CPropertyActionEx* pActDutyCycle = new CPropertyActionEx (this, &LaserDiodeDriver::OnModulationDutyCycle, (long)i);
+      sprintf(p_name, "Modulation %d Duty Cycle (%%)", (int)i+1);
+      ret = CreateFloatProperty(p_name, modulators_[i].dutyCycle, false, pActDutyCycle);
+      ret = SetPropertyLimits(p_name, 0.0, 100.0);
+   }
+
+   // Telemetry streamed by the board: the monitor inputs, e.g. photodiodes, sampled at the given
+   // rate and a snapshot of the outputs at the given interval. "Monitor N" shows the latest
+   // sample, "Readback Laser N" what the board actually outputs.
+   CPropertyActionEx* pActTelemetryRate = new CPropertyActionEx (this, &LaserDiodeDriver::OnTelemetry, 0);
+   ret = CreateIntegerProperty("Telemetry Rate (Hz)", 0, false, pActTelemetryRate);
+   ret = SetPropertyLimits("Telemetry Rate (Hz)", 0, TELEMETRY_MAX_RATE);
+
+   CPropertyActionEx* pActStateInterval = new CPropertyActionEx (this, &LaserDiodeDriver::OnTelemetry, 1);
+   ret = CreateIntegerProperty("State Interval (ms)", 0, false, pActStateInterval);
+   ret = SetPropertyLimits("State Interval (ms)", 0, 10000);
+
+   for (unsigned int i = 0; i < interface_->GetNumberOfMonitors(); ++i) {
+      CPropertyActionEx* pActMonitor = new CPropertyActionEx (this, &LaserDiodeDriver::OnMonitor, i);
+      char p_name[64];
+      sprintf(p_name, "Monitor %d (%%)", i+1);
+      ret = CreateFloatProperty(p_name, 0.0, true, pActMonitor);
+   }
+
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      CPropertyActionEx* pActReadback = new CPropertyActionEx (this, &LaserDiodeDriver::OnReadback, i);
+      char p_name[64];
+      sprintf(p_name, "Readback Laser %d", i+1);
+      ret = CreateStringProperty(p_name, g_ReadbackUnknown, true, pActReadback);
+   }
+
+#ifdef BUILD_JOURNAL
+   // Light dose of every laser recorded in the journal file, including earlier sessions, as the
+   // time it would have taken at full power
+   if (journal_ != nullptr) {
+      for (int i = 0; i < numberOfLasers_; ++i) {
+         CPropertyActionEx* pActDose = new CPropertyActionEx (this, &LaserDiodeDriver::OnDose, i);
+         char p_name[64];
+         sprintf(p_name, "Dose Laser %d (s at 100 %%)", i+1);
+         ret = CreateFloatProperty(p_name, 0.0, true, pActDose);
+      }
+
+      CPropertyActionEx* pActLost = new CPropertyActionEx (this, &LaserDiodeDriver::OnDose, -1);
+      ret = CreateIntegerProperty("Journal Lost Records", 0, true, pActLost);
    }
+#endif
 
    if (ret != DEVICE_OK) {
       return ret;
@@ -192,6 +552,65 @@ int LaserDiodeDriver::Initialize()
    return DEVICE_OK;
 }
 
+bool LaserDiodeDriver::Busy()
+{
+   if (!initialized_) {
+      return false;
+   }
+
+   bool busy = interface_->Busy() || Ramping();
+
+   // Report failures of commands that were acknowledged in the meantime.
+   for (std::string error = interface_->PopError(); !error.empty(); error = interface_->PopError()) {
+      LogMessage(error, false);
+   }
+
+   return busy;
+}
+
+// Offers one device per laser and the shutter as peripherals of the hub.
+int LaserDiodeDriver::DetectInstalledDevices()
+{
+   ClearInstalledDevices();
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      std::string name = g_LaserDiodeLaserName + std::to_string(i+1);
+      MM::Device* device = CreateDevice(name.c_str());
+      if (device) {
+         AddInstalledDevice(device);
+      }
+   }
+   MM::Device* shutter = CreateDevice(g_LaserDiodeShutterName);
+   if (shutter) {
+      AddInstalledDevice(shutter);
+   }
+   return DEVICE_OK;
+}
+
+// Registers an initialized laser device so it is notified of changes, nullptr unregisters it.
+void LaserDiodeDriver::AttachLaser(int idx, LaserDiodeLaser* laser)
+{
+   laserDevices_[idx] = laser;
+}
+
+int LaserDiodeDriver::GetNumberOfLasers() const
+{
+   return numberOfLasers_;
+}
+
+size_t LaserDiodeDriver::GetMonitorSamples(uint64_t& cursor, std::vector<MonitorSample>& samples)
+{
+   if (interface_ == nullptr) {
+      return 0;
+   }
+   return interface_->GetMonitorSamples(cursor, samples);
+}
+
+std::string LaserDiodeDriver::GetLaserLabel(int idx)
+{
+   std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+   return lasers_[idx].label;
+}
+
 int LaserDiodeDriver::Shutdown()
 {
    if (initialized_ == false)
@@ -219,146 +638,1232 @@ int LaserDiodeDriver::OnPort(MM::PropertyBase* pProp, MM::ActionType eAct) {
 	return DEVICE_OK;
 }
 
-int LaserDiodeDriver::OnLaserMinPower(MM::PropertyBase* pProp, MM::ActionType eAct) {   
-   if (eAct == MM::AfterSet) {
-      double value;
-      std::string pName = pProp->GetName();
+// Reads the labels and power limits of the lasers from the comma-separated lists of the
+// pre-initialization properties. A minimum above the maximum is lowered to the maximum.
+int LaserDiodeDriver::LoadLaserSettings() {
+   const char* const lists[3] = {"Laser Labels", "Min. Laser Powers (%)", "Max. Laser Powers (%)"};
+   std::vector<std::string> entries[3];
+   for (int l = 0; l < 3; ++l) {
+      char list[MM::MaxStrLength];
+      GetProperty(lists[l], list);
+      std::istringstream stream(list);
+      for (std::string entry; std::getline(stream, entry, ',');) {
+         entry.erase(0, entry.find_first_not_of(" "));
+         entry.erase(entry.find_last_not_of(" ") + 1);
+         entries[l].push_back(entry);
+      }
+      if ((int)entries[l].size() > numberOfLasers_) {
+         LogMessage(std::string(lists[l]) + " has more entries than the board has lasers", false);
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+   }
+
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      double limits[2] = {0.0, 100.0};
+      for (int l = 1; l < 3; ++l) {
+         if (i >= (int)entries[l].size() || entries[l][i].empty()) continue;
+         char* end;
+         limits[l - 1] = strtod(entries[l][i].c_str(), &end);
+         if (*end != '\0' || !(limits[l - 1] >= 0.0 && limits[l - 1] <= 100.0)) {
+            LogMessage(std::string(lists[l]) + ": invalid entry \"" + entries[l][i] + "\"", false);
+            return DEVICE_INVALID_PROPERTY_VALUE;
+         }
+      }
+
+      std::lock_guard<std::mutex> lock(lasers_[i].mutex);
+      lasers_[i].label = i < (int)entries[0].size() ? entries[0][i] : "";
+      lasers_[i].maxPower = limits[1];
+      lasers_[i].minPower = std::min(limits[0], limits[1]);
+      lasers_[i].sentCode = -1;
+   }
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnLaserOnOff(MM::PropertyBase* pProp, MM::ActionType eAct, long idx) {
+   if (eAct == MM::BeforeGet) {
+      std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+      pProp->Set(lasers_[idx].enabled ? ON : OFF);
+   } else if (eAct == MM::AfterSet) {
+      std::string value;
       pProp->Get(value);
 
-      int idx = -1;
+      return SetLaserOnOff(idx, value == ON);
+   } else if (eAct == MM::IsSequenceable) {
+      pProp->SetSequenceable(interface_->GetMaxSequenceLength());
+   } else if (eAct == MM::AfterLoadSequence) {
+      std::vector<std::string> sequence = pProp->GetSequence();
+      if (sequence.size() > interface_->GetMaxSequenceLength()) {
+         return DEVICE_SEQUENCE_TOO_LONG;
+      }
 
-      sscanf(pName.c_str(), "Min. Laser Power %d (%%)", &idx);
+      std::vector<bool> values;
+      for (size_t i = 0; i < sequence.size(); ++i) {
+         values.push_back(sequence[i] == ON);
+      }
 
-      double max_value = GetLaserMaxPower(idx-1);
+      if (interface_->LoadDigitalSequence(idx, values) != 0) {
+         LogMessage("Could not load digital sequence!", false);
+         return DEVICE_ERR;
+      }
+   } else if (eAct == MM::StartSequence || eAct == MM::StopSequence) {
+      // The sequence changes the output, so the cached state is no longer valid.
+      std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+      lasers_[idx].sentEnabled = -1;
 
-      if (value > max_value) {
-         value = max_value;
+      int ret;
+      if (eAct == MM::StartSequence) {
+         ret = interface_->StartDigitalSequence(idx);
+      } else {
+         ret = interface_->StopDigitalSequence(idx);
       }
-   }
 
+      if (ret != 0) {
+         return DEVICE_ERR;
+      }
+   }
    return DEVICE_OK;
 }
 
-int LaserDiodeDriver::OnLaserMaxPower(MM::PropertyBase* pProp, MM::ActionType eAct) {   
-   if (eAct == MM::AfterSet) {
+int LaserDiodeDriver::OnLaserPower(MM::PropertyBase* pProp, MM::ActionType eAct, long idx) {
+   if (eAct == MM::BeforeGet) {
+      std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+      pProp->Set(lasers_[idx].power);
+   } else if (eAct == MM::AfterSet) {
       double value;
-      std::string pName = pProp->GetName();
       pProp->Get(value);
 
-      int idx = -1;
+      int ret = SetLaserPower(idx, value);
+
+      if (ret != DEVICE_OK) {
+         // error occure
+         // TODO: Maybe this should be handled in some way?
+         return ret;
+      }
+   } else if (eAct == MM::IsSequenceable) {
+      pProp->SetSequenceable(interface_->GetMaxSequenceLength());
+   } else if (eAct == MM::AfterLoadSequence) {
+      std::vector<std::string> sequence = pProp->GetSequence();
+      if (sequence.size() > interface_->GetMaxSequenceLength()) {
+         return DEVICE_SEQUENCE_TOO_LONG;
+      }
 
-      sscanf(pName.c_str(), "Max. Laser Power %d (%%)", &idx);
+      std::vector<double> values;
+      for (size_t i = 0; i < sequence.size(); ++i) {
+         values.push_back(GetRelativeValue(idx, atof(sequence[i].c_str())));
+      }
 
-      double min_value = GetLaserMinPower(idx-1);
+      if (interface_->LoadAnalogSequence(idx, values) != 0) {
+         LogMessage("Could not load analog sequence!", false);
+         return DEVICE_ERR;
+      }
+   } else if (eAct == MM::StartSequence || eAct == MM::StopSequence) {
+      // The sequence changes the output, so the cached state is no longer valid. Starting it
+      // ends a running ramp.
+      std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+      lasers_[idx].sentCode = -1;
+      lasers_[idx].rampEnd = std::chrono::steady_clock::time_point();
 
-      if (value < min_value) {
-         value = min_value;
+      int ret;
+      if (eAct == MM::StartSequence) {
+         ret = interface_->StartAnalogSequence(idx);
+      } else {
+         ret = interface_->StopAnalogSequence(idx);
       }
 
-      pProp->Set(value);
+      if (ret != 0) {
+         return DEVICE_ERR;
+      }
    }
 
    return DEVICE_OK;
 }
 
-int LaserDiodeDriver::OnLaserOnOff(MM::PropertyBase* pProp, MM::ActionType eAct) {   
-   if (eAct == MM::AfterSet) {
+int LaserDiodeDriver::OnLaserState(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   if (eAct == MM::BeforeGet) {
+      std::ostringstream state;
+      for (int i = 0; i < numberOfLasers_; ++i) {
+         std::lock_guard<std::mutex> lock(lasers_[i].mutex);
+         if (i > 0) state << ",";
+         state << lasers_[i].power << ":" << (lasers_[i].enabled ? ON : OFF);
+      }
+      pProp->Set(state.str().c_str());
+   } else if (eAct == MM::AfterSet) {
       std::string value;
-      std::string pName = pProp->GetName();
       pProp->Get(value);
+      return SetLaserState(value);
+   }
+   return DEVICE_OK;
+}
 
-      int ret;
-      int idx = -1;
+double LaserDiodeDriver::GetLaserMaxPower(int idx) {
+   std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+   return lasers_[idx].maxPower;
+}
+
+double LaserDiodeDriver::GetLaserMinPower(int idx) {
+   std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+   return lasers_[idx].minPower;
+}
 
-      sscanf(pName.c_str(), "Enable Laser %d", &idx);
+// Relative output value of a power in %, called with the laser's lock held.
+static double RelativeValue(const LaserChannel& laser, double power) {
+   double min_value = laser.minPower;
+   double max_value = laser.maxPower;
 
-      if (value == ON) {
-         ret = SetLaserOnOff(idx-1, true);
-      } else {
-         ret = SetLaserOnOff(idx-1, false);
+   double relative_value = (min_value + power * (max_value - min_value) / 100.0) / 100.0;
+   if (relative_value > 1.0) {
+      relative_value = 1.0;
+   } else if (relative_value < 0.0) {
+      relative_value = 0.0;
+   }
+   return relative_value;
+}
+
+double LaserDiodeDriver::GetRelativeValue(int idx, double power) {
+   std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+   return RelativeValue(lasers_[idx], power);
+}
+
+// 16-bit representation of a relative value, used to detect writes that change nothing.
+static long RelativeToCode(double relative_value) {
+   return (long)(relative_value * 65535);
+}
+
+// Takes over the outputs of the board as the properties' values. Powers are converted back
+// through the limits of the lasers; the outputs themselves are not written.
+void LaserDiodeDriver::RestoreOutputState() {
+   OutputState state;
+   if (interface_->GetOutputState(state) != 0) {
+      return;
+   }
+
+   for (int i = 0; i < numberOfLasers_ && i < (int)state.relative_values.size(); ++i) {
+      std::lock_guard<std::mutex> lock(lasers_[i].mutex);
+      LaserChannel& laser = lasers_[i];
+      double relative_value = state.relative_values[i];
+      double power = 0.0;
+      if (laser.maxPower > laser.minPower) {
+         power = (relative_value * 100.0 - laser.minPower) * 100.0 / (laser.maxPower - laser.minPower);
+         power = std::min(std::max(power, 0.0), 100.0);
       }
+      laser.power = power;
+      laser.enabled = (state.enable_mask >> i) & 1;
+      laser.sentCode = RelativeToCode(relative_value);
+      laser.sentEnabled = laser.enabled;
+   }
 
-      if (ret != DEVICE_OK) {
-         // error occured; revert values and return
-         if (value == ON) {
-            pProp->Set(OFF);
+   std::lock_guard<std::mutex> lock(blankingMutex_);
+   blankingMask_ = state.blanking_mask & (uint32_t)((1ull << numberOfLasers_) - 1);
+   blankingActiveLow_ = state.blanking_active_low;
+}
+
+int LaserDiodeDriver::SetLaserOnOff(int idx, bool enabled) {
+   {
+      std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+      lasers_[idx].enabled = enabled;
+      if (lasers_[idx].sentEnabled != (int)enabled) {
+         int ret = interface_->WriteDigital(idx, enabled);
+         if (ret != DEVICE_OK) { // error
+            LogMessage("Could not set digital value!", false);
+            lasers_[idx].sentEnabled = -1;
+            return DEVICE_ERR;
+         }
+         lasers_[idx].sentEnabled = enabled;
+      }
+   }
+   NotifyLaserChanged(idx);
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::SetLaserPower(int idx, double power) {
+   {
+      std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+      lasers_[idx].power = power;
+      double relative_value = RelativeValue(lasers_[idx], power);
+      long code = RelativeToCode(relative_value);
+      if (lasers_[idx].sentCode != code) {
+         int ret;
+         if (lasers_[idx].rampTime > 0) {
+            ret = StartRamp(idx, relative_value);
          } else {
-            pProp->Set(ON);
+            ret = interface_->WriteAnalogRelative(idx, relative_value);
+            lasers_[idx].rampEnd = std::chrono::steady_clock::time_point(); // Ends a running ramp
          }
-         return ret;
+         if (ret == 1) { // error
+            // Debug
+            LogMessage("Could not set analog value!", false);
+            lasers_[idx].sentCode = -1;
+            return DEVICE_ERR;
+         }
+         lasers_[idx].sentCode = code;
       }
    }
+   NotifyLaserChanged(idx);
    return DEVICE_OK;
 }
 
-int LaserDiodeDriver::OnLaserPower(MM::PropertyBase* pProp, MM::ActionType eAct) {
-   if (eAct == MM::AfterSet) {
-      double value;
-      std::string pName = pProp->GetName();
-      pProp->Get(value);
+// Reports the state of a laser to Micro-Manager after it was changed through any device.
+void LaserDiodeDriver::NotifyLaserChanged(int idx) {
+   double power;
+   bool enabled;
+   {
+      std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+      power = lasers_[idx].power;
+      enabled = lasers_[idx].enabled;
+   }
 
-      int ret;
-      int idx = -1;
-      sscanf(pName.c_str(), "Laser Power %d", &idx);
+   char p_name[64];
+   sprintf(p_name, "Laser Power %d (%%)", idx+1);
+   OnPropertyChanged(p_name, CDeviceUtils::ConvertToString(power));
+   sprintf(p_name, "Enable Laser %d", idx+1);
+   OnPropertyChanged(p_name, enabled ? ON : OFF);
+
+   LaserDiodeLaser* laser = laserDevices_[idx];
+   if (laser != nullptr) {
+      laser->LaserChanged(power, enabled);
+   }
+}
 
-      ret = SetLaserPower(idx-1, value);
+int LaserDiodeDriver::SetLaserState(const std::string& state) {
+   uint32_t analog_mask = 0;
+   uint32_t digital_mask = 0;
+   uint32_t digital_values = 0;
+   std::vector<double> powers(MAX_LASERS, 0.0);
+
+   std::istringstream entries(state);
+   std::string entry;
+   for (int i = 0; std::getline(entries, entry, ','); ++i) {
+      entry.erase(0, entry.find_first_not_of(" "));
+      entry.erase(entry.find_last_not_of(" ") + 1);
+      if (entry.empty() || entry == "-") continue;
+      if (i >= numberOfLasers_) return DEVICE_INVALID_PROPERTY_VALUE;
+
+      std::string power = entry.substr(0, entry.find(':'));
+      std::string enabled = entry.find(':') == std::string::npos ? "" : entry.substr(entry.find(':') + 1);
+
+      if (!power.empty()) {
+         char* end;
+         powers[i] = strtod(power.c_str(), &end);
+         if (*end != '\0' || powers[i] < 0.0 || powers[i] > 100.0) return DEVICE_INVALID_PROPERTY_VALUE;
+         analog_mask |= 1u << i;
+      }
 
-      if (ret != DEVICE_OK) {
-         // error occure
-         // TODO: Maybe this should be handled in some way?
-         return ret;
+      if (enabled == ON) {
+         digital_mask |= 1u << i;
+         digital_values |= 1u << i;
+      } else if (enabled == OFF) {
+         digital_mask |= 1u << i;
+      } else if (!enabled.empty()) {
+         return DEVICE_INVALID_PROPERTY_VALUE;
       }
    }
 
-   return DEVICE_OK;
+   return ApplyLaserState(analog_mask, powers, digital_mask, digital_values);
 }
 
-double LaserDiodeDriver::GetLaserMaxPower(int idx) {
-   double value;
-   char p_name[64];
-   sprintf(p_name, "Max. Laser Power %d (%%)", idx+1);
-   GetProperty(p_name, value);
-   return value;
+// Switches the lasers in mask on or off at the same time.
+int LaserDiodeDriver::SetLasersOnOff(uint32_t mask, bool enabled) {
+   if (!initialized_) {
+      return DEVICE_NOT_CONNECTED;
+   }
+   return ApplyLaserState(0, std::vector<double>(MAX_LASERS, 0.0), mask, enabled ? mask : 0);
 }
 
-double LaserDiodeDriver::GetLaserMinPower(int idx) {
-   double value;
-   char p_name[64];
-   sprintf(p_name, "Min. Laser Power %d (%%)", idx+1);
-   GetProperty(p_name, value);
-   return value;
+// Waits until all writes have been executed by the device.
+int LaserDiodeDriver::Flush() {
+   if (!initialized_) {
+      return DEVICE_NOT_CONNECTED;
+   }
+   return interface_->Flush() == 0 ? DEVICE_OK : DEVICE_ERR;
 }
 
-int LaserDiodeDriver::SetLaserOnOff(int idx, bool enabled) {
-   if (!interface_->DeviceIsOpen()) {
-      LogMessage("No open device!");
+// Writes the powers of the lasers in analog_mask and the enable states of those in digital_mask
+// with one batched write each and updates their properties.
+int LaserDiodeDriver::ApplyLaserState(uint32_t analog_mask, const std::vector<double>& powers, uint32_t digital_mask, uint32_t digital_values) {
+   // Lock the affected lasers in ascending order so concurrent batches can not deadlock.
+   std::unique_lock<std::mutex> locks[MAX_LASERS];
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      if ((analog_mask | digital_mask) & (1u << i)) locks[i] = std::unique_lock<std::mutex>(lasers_[i].mutex);
+   }
+
+   std::vector<double> relative_values(MAX_LASERS, 0.0);
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      if (analog_mask & (1u << i)) relative_values[i] = RelativeValue(lasers_[i], powers[i]);
+   }
+
+   // Only write the channels whose outputs actually change.
+   uint32_t analog_write_mask = 0;
+   uint32_t digital_write_mask = 0;
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      if ((analog_mask & (1u << i)) && lasers_[i].sentCode != RelativeToCode(relative_values[i])) {
+         analog_write_mask |= 1u << i;
+      }
+      if ((digital_mask & (1u << i)) && lasers_[i].sentEnabled != (int)((digital_values >> i) & 1u)) {
+         digital_write_mask |= 1u << i;
+      }
+   }
+
+   // Lasers with a ramp time start their ramps one after the other, the others change together.
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      if (!(analog_write_mask & (1u << i)) || lasers_[i].rampTime == 0) continue;
+      if (StartRamp(i, relative_values[i]) != 0) {
+         LogMessage("Could not start ramp!", false);
+         return DEVICE_ERR;
+      }
+      analog_write_mask &= ~(1u << i);
+   }
+
+   if (analog_write_mask && interface_->WriteAnalogRelativeMulti(analog_write_mask, relative_values) != 0) {
+      LogMessage("Could not set analog values!", false);
       return DEVICE_ERR;
-   } else {
-      LogMessage("Device is open; attempting to write.");
    }
-   int ret = interface_->WriteDigital(idx, enabled);
-   if (ret != DEVICE_OK) { // error
-      return ret;
+   if (digital_write_mask && interface_->WriteDigitalMulti(digital_write_mask, digital_values) != 0) {
+      LogMessage("Could not set digital values!", false);
+      return DEVICE_ERR;
+   }
+
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      if (analog_mask & (1u << i)) {
+         lasers_[i].power = powers[i];
+         lasers_[i].sentCode = RelativeToCode(relative_values[i]);
+      }
+      if (analog_write_mask & (1u << i)) {
+         lasers_[i].rampEnd = std::chrono::steady_clock::time_point(); // Ends a running ramp
+      }
+      if (digital_mask & (1u << i)) {
+         lasers_[i].enabled = (digital_values >> i) & 1u;
+         lasers_[i].sentEnabled = lasers_[i].enabled;
+      }
+   }
+
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      if (locks[i].owns_lock()) {
+         locks[i].unlock();
+         NotifyLaserChanged(i);
+      }
    }
    return DEVICE_OK;
 }
 
-int LaserDiodeDriver::SetLaserPower(int idx, double power) {
-   double min_value = GetLaserMinPower(idx);
-   double max_value = GetLaserMaxPower(idx);
-
-   double relative_value = (min_value + power * (max_value - min_value) / 100.0) / 100.0;
-   if (relative_value > 1.0) {
-      relative_value = 1.0;
-   } else if (relative_value < 0.0) {
-      relative_value = 0.0;
+int LaserDiodeDriver::OnStatistic(MM::PropertyBase* pProp, MM::ActionType eAct, long stat) {
+   if (eAct != MM::BeforeGet) {
+      return DEVICE_OK;
    }
 
-   int ret = interface_->WriteAnalogRelative(idx, relative_value);
-   if (ret == 1) { // error
-      // Debug
-      LogMessage("Could not set analog value!", false);
-      return DEVICE_ERR;
+   BoardStatistics stats;
+   interface_->GetStatistics(stats);
+
+   switch (stat) {
+      case STAT_WRITE_LATENCY_P50: pProp->Set((long)stats.write_latency_p50_us); break;
+      case STAT_WRITE_LATENCY_P99: pProp->Set((long)stats.write_latency_p99_us); break;
+      case STAT_WRITE_LATENCY_MAX: pProp->Set((long)stats.write_latency_max_us); break;
+      case STAT_SEND_LATENCY_P50: pProp->Set((long)stats.send_latency_p50_us); break;
+      case STAT_SEND_LATENCY_P99: pProp->Set((long)stats.send_latency_p99_us); break;
+      case STAT_COMMANDS_PER_SECOND:
+      {
+         auto now = std::chrono::steady_clock::now();
+         double seconds = std::chrono::duration<double>(now - rateTime_).count();
+         uint64_t commands = stats.commands < rateCommands_ ? stats.commands : stats.commands - rateCommands_;
+         pProp->Set(seconds > 0.0 ? commands / seconds : 0.0);
+         rateCommands_ = stats.commands;
+         rateTime_ = now;
+      }
+         break;
+      case STAT_BYTES_SENT: pProp->Set((double)stats.bytes_sent); break;
+      case STAT_QUEUE_DEPTH: pProp->Set((long)stats.queue_depth); break;
+      case STAT_ERRORS: pProp->Set((long)stats.errors); break;
+      case STAT_RESYNCS: pProp->Set((long)stats.resyncs); break;
+      case STAT_BOARD_COMMANDS_PER_SECOND: pProp->Set((long)stats.board_commands_per_second); break;
+      case STAT_BOARD_BUFFER_PEAK: pProp->Set((long)stats.board_buffer_peak); break;
    }
+
    return DEVICE_OK;
 }
+
+int LaserDiodeDriver::OnResetStatistics(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   if (eAct == MM::AfterSet) {
+      std::string value;
+      pProp->Get(value);
+      if (value == g_StatisticsReset) {
+         interface_->ResetStatistics();
+         rateCommands_ = 0;
+         rateTime_ = std::chrono::steady_clock::now();
+      }
+      pProp->Set(g_StatisticsIdle);
+   }
+
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnBlanking(MM::PropertyBase* pProp, MM::ActionType eAct, long idx) {
+   std::lock_guard<std::mutex> lock(blankingMutex_);
+   if (eAct == MM::BeforeGet) {
+      pProp->Set((blankingMask_ & (1u << idx)) ? ON : OFF);
+   } else if (eAct == MM::AfterSet) {
+      std::string value;
+      pProp->Get(value);
+      uint32_t mask = value == ON ? blankingMask_ | (1u << idx) : blankingMask_ & ~(1u << idx);
+      if (mask != blankingMask_ && interface_->SetBlanking(mask, blankingActiveLow_) != 0) {
+         LogMessage("Could not set blanking!", false);
+         return DEVICE_ERR;
+      }
+      blankingMask_ = mask;
+   }
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnRampTime(MM::PropertyBase* pProp, MM::ActionType eAct, long idx) {
+   std::lock_guard<std::mutex> lock(lasers_[idx].mutex);
+   if (eAct == MM::BeforeGet) {
+      pProp->Set(lasers_[idx].rampTime);
+   } else if (eAct == MM::AfterSet) {
+      long value;
+      pProp->Get(value);
+      lasers_[idx].rampTime = std::max(value, 0L);
+   }
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnRampCurve(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   if (eAct == MM::BeforeGet) {
+      pProp->Set(rampExponential_ ? g_RampExponential : g_RampLinear);
+   } else if (eAct == MM::AfterSet) {
+      std::string value;
+      pProp->Get(value);
+      rampExponential_ = value == g_RampExponential;
+   }
+   return DEVICE_OK;
+}
+
+// Ramps a laser from its current output to relative_value over its ramp time. Must be called
+// while holding the laser's lock.
+int LaserDiodeDriver::StartRamp(int idx, double relative_value) {
+   LaserChannel& laser = lasers_[idx];
+   if (interface_->Ramp(idx, relative_value, (uint32_t)laser.rampTime * 1000, rampExponential_) != 0) {
+      return 1;
+   }
+   laser.rampEnd = std::chrono::steady_clock::now() + std::chrono::milliseconds(laser.rampTime);
+   return 0;
+}
+
+// Whether the ramp of any laser is still running
+bool LaserDiodeDriver::Ramping() {
+   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      std::lock_guard<std::mutex> lock(lasers_[i].mutex);
+      if (lasers_[i].rampEnd > now) return true;
+   }
+   return false;
+}
+
+int LaserDiodeDriver::OnModulationFrequency(MM::PropertyBase* pProp, MM::ActionType eAct, long idx) {
+   return OnModulation(pProp, eAct, idx, false);
+}
+
+int LaserDiodeDriver::OnModulationDutyCycle(MM::PropertyBase* pProp, MM::ActionType eAct, long idx) {
+   return OnModulation(pProp, eAct, idx, true);
+}
+
+// Both properties of a modulation output. The board's sequence runs while the sequence of either
+// property does.
+int LaserDiodeDriver::OnModulation(MM::PropertyBase* pProp, MM::ActionType eAct, int idx, bool dutyCycle) {
+   std::lock_guard<std::mutex> lock(modulationMutex_);
+   ModulationOutput& modulator = modulators_[idx];
+   double& value = dutyCycle ? modulator.dutyCycle : modulator.frequency;
+   std::vector<double>& sequence = dutyCycle ? modulator.dutyCycleSequence : modulator.frequencySequence;
+   if (eAct == MM::BeforeGet) {
+      pProp->Set(value);
+   } else if (eAct == MM::AfterSet) {
+      double previous = value;
+      pProp->Get(value);
+      if (interface_->SetModulation(idx, modulator.frequency, modulator.dutyCycle / 100.0) != 0) {
+         value = previous;
+         LogMessage("Could not set modulation!", false);
+         return DEVICE_ERR;
+      }
+   } else if (eAct == MM::IsSequenceable) {
+      pProp->SetSequenceable(interface_->GetMaxSequenceLength() / 2);
+   } else if (eAct == MM::AfterLoadSequence) {
+      std::vector<std::string> values = pProp->GetSequence();
+      sequence.clear();
+      for (size_t i = 0; i < values.size(); ++i) {
+         sequence.push_back(atof(values[i].c_str()));
+      }
+      return LoadModulationSequence(idx);
+   } else if (eAct == MM::StartSequence) {
+      if (modulator.runningSequences == 0 && interface_->StartModulationSequence(idx) != 0) {
+         return DEVICE_ERR;
+      }
+      modulator.runningSequences++;
+   } else if (eAct == MM::StopSequence) {
+      // The next sequence is loaded without this property's values unless they are loaded again.
+      sequence.clear();
+      if (modulator.runningSequences > 0 && --modulator.runningSequences == 0
+          && interface_->StopModulationSequence(idx) != 0) {
+         return DEVICE_ERR;
+      }
+   }
+   return DEVICE_OK;
+}
+
+// Loads the sequences of both properties of a modulation output into the board as one; a property
+// without a sequence keeps its value. Like the properties' own sequences, the combined one repeats
+// after the least common multiple of their lengths. Must be called while holding
+// modulationMutex_.
+int LaserDiodeDriver::LoadModulationSequence(int idx) {
+   const ModulationOutput& modulator = modulators_[idx];
+   size_t frequencies = std::max<size_t>(modulator.frequencySequence.size(), 1);
+   size_t dutyCycles = std::max<size_t>(modulator.dutyCycleSequence.size(), 1);
+   size_t a = frequencies, b = dutyCycles;
+   while (b != 0) {
+      size_t rest = a % b;
+      a = b;
+      b = rest;
+   }
+   size_t length = frequencies / a * dutyCycles;
+   if (length > interface_->GetMaxSequenceLength() / 2) {
+      return DEVICE_SEQUENCE_TOO_LONG;
+   }
+
+   std::vector<double> frequencyValues, dutyCycleValues;
+   for (size_t i = 0; i < length; ++i) {
+      frequencyValues.push_back(modulator.frequencySequence.empty() ? modulator.frequency
+                                                                     : modulator.frequencySequence[i % frequencies]);
+      dutyCycleValues.push_back((modulator.dutyCycleSequence.empty() ? modulator.dutyCycle
+                                                                     : modulator.dutyCycleSequence[i % dutyCycles]) / 100.0);
+   }
+   if (interface_->LoadModulationSequence(idx, frequencyValues, dutyCycleValues) != 0) {
+      LogMessage("Could not load modulation sequence!", false);
+      return DEVICE_ERR;
+   }
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnBlankingPolarity(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   std::lock_guard<std::mutex> lock(blankingMutex_);
+   if (eAct == MM::BeforeGet) {
+      pProp->Set(blankingActiveLow_ ? g_BlankingActiveLow : g_BlankingActiveHigh);
+   } else if (eAct == MM::AfterSet) {
+      std::string value;
+      pProp->Get(value);
+      bool activeLow = value == g_BlankingActiveLow;
+      if (activeLow != blankingActiveLow_ && interface_->SetBlanking(blankingMask_, activeLow) != 0) {
+         LogMessage("Could not set blanking!", false);
+         return DEVICE_ERR;
+      }
+      blankingActiveLow_ = activeLow;
+   }
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnTelemetry(MM::PropertyBase* pProp, MM::ActionType eAct, long setting) {
+   long& value = setting == 0 ? telemetryRate_ : stateInterval_;
+   if (eAct == MM::BeforeGet) {
+      pProp->Set(value);
+   } else if (eAct == MM::AfterSet) {
+      long previous = value;
+      pProp->Get(value);
+      if (interface_->SetTelemetry(telemetryRate_, stateInterval_) != 0) {
+         value = previous;
+         LogMessage("Could not set telemetry!", false);
+         return DEVICE_ERR;
+      }
+   }
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnMonitor(MM::PropertyBase* pProp, MM::ActionType eAct, long idx) {
+   if (eAct != MM::BeforeGet) {
+      return DEVICE_OK;
+   }
+
+   uint64_t count = interface_->GetMonitorSampleCount();
+   if (count == 0) {
+      pProp->Set(0.0);
+      return DEVICE_OK;
+   }
+   uint64_t cursor = count - 1;
+   std::vector<MonitorSample> samples;
+   interface_->GetMonitorSamples(cursor, samples);
+   if (!samples.empty() && (unsigned int)idx < samples.back().count) {
+      pProp->Set(samples.back().values[idx] * 100.0);
+   }
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnReadback(MM::PropertyBase* pProp, MM::ActionType eAct, long idx) {
+   if (eAct != MM::BeforeGet) {
+      return DEVICE_OK;
+   }
+
+   BoardState state;
+   if (interface_->GetBoardState(state) != 0 || (size_t)idx >= state.relative_outputs.size()) {
+      pProp->Set(g_ReadbackUnknown);
+      return DEVICE_OK;
+   }
+   // Enable state and analog output, e.g. "On, 37.5 %"; "blanked" if the exposure input holds
+   // an enabled laser off
+   char value[64];
+   bool enabled = (state.enable_mask >> idx) & 1;
+   bool high = (state.level_mask >> idx) & 1;
+   sprintf(value, "%s%s, %.1f %%", enabled ? ON : OFF, enabled && !high ? " (blanked)" : "",
+      state.relative_outputs[idx] * 100.0);
+   pProp->Set(value);
+   return DEVICE_OK;
+}
+
+// idx -1 reports the records the journal dropped because it could not keep up.
+int LaserDiodeDriver::OnDose(MM::PropertyBase* pProp, MM::ActionType eAct, long idx) {
+#ifdef BUILD_JOURNAL
+   if (eAct == MM::BeforeGet && journal_ != nullptr) {
+      if (idx < 0) {
+         pProp->Set((long)journal_->GetLostRecords());
+      } else {
+         pProp->Set(journal_->GetDose(idx));
+      }
+   }
+#else
+   (void)pProp;
+   (void)eAct;
+   (void)idx;
+#endif
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnWaveformFile(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   if (eAct == MM::AfterSet) {
+      std::string path;
+      pProp->Get(path);
+      if (path.empty()) {
+         return DEVICE_OK;
+      }
+      return LoadWaveformFile(path);
+   }
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnWaveform(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   if (eAct == MM::BeforeGet) {
+      pProp->Set(waveformName_.empty() ? g_WaveformNone : waveformName_.c_str());
+   } else if (eAct == MM::AfterSet) {
+      std::string name;
+      pProp->Get(name);
+      if (name == g_WaveformNone) {
+         int ret = StopWaveform();
+         waveformName_.clear();
+         return ret;
+      }
+      return UploadWaveform(name);
+   }
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::OnWaveformState(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   if (eAct == MM::BeforeGet) {
+      if (waveformRunning_) {
+         bool running;
+         uint32_t periods;
+         if (interface_->GetWaveformStatus(running, periods) == 0 && !running) {
+            // Finished on its own after the requested number of periods
+            waveformRunning_ = false;
+            RestoreLaserOutputs(waveformEnableMask_, waveformPowerMask_);
+         }
+      }
+      pProp->Set(waveformRunning_ ? g_WaveformRunning : g_WaveformStopped);
+   } else if (eAct == MM::AfterSet) {
+      std::string value;
+      pProp->Get(value);
+      if (value == g_WaveformStopped) {
+         return StopWaveform();
+      }
+
+      if (waveformName_.empty()) {
+         pProp->Set(g_WaveformStopped);
+         return ERR_WAVEFORM;
+      }
+
+      long repetitions;
+      GetProperty("Waveform Repetitions", repetitions);
+      const WaveformDefinition& waveform = waveforms_[waveformName_];
+      if (interface_->StartWaveform(waveformEnableMask_, waveform.period, repetitions, false) != 0) {
+         pProp->Set(g_WaveformStopped);
+         return ERR_WAVEFORM;
+      }
+
+      // The waveform changes the outputs, so the cached state is no longer valid.
+      waveformRunning_ = true;
+      for (int i = 0; i < numberOfLasers_; ++i) {
+         std::lock_guard<std::mutex> lock(lasers_[i].mutex);
+         if (waveformEnableMask_ & (1u << i)) lasers_[i].sentEnabled = -1;
+         if (waveformPowerMask_ & (1u << i)) lasers_[i].sentCode = -1;
+      }
+   }
+   return DEVICE_OK;
+}
+
+// Reads the power calibration of the lasers and loads it to the device, which then maps the
+// requested powers of the calibrated lasers to their analog outputs with a lookup table. Each
+// laser's curve starts with its number in brackets, followed by one line per measured point:
+//
+//    [1]        # laser number
+//    0    0     # analog output in %, measured power in any unit, e.g. mW
+//    12   0.1
+//    20   4.5
+//    100  52
+//
+// Outputs must increase and powers must not decrease. The highest power is 100 %, so "Laser
+// Power" and the power limits of a calibrated laser are in % of its measured power. Everything
+// after # is ignored.
+int LaserDiodeDriver::LoadCalibrationFile(const std::string& path) {
+   std::ifstream file(path.c_str());
+   if (!file) {
+      LogMessage("Could not open calibration file " + path + ".", false);
+      return ERR_CALIBRATION;
+   }
+
+   std::map<int, std::vector<std::pair<double, double>>> curves;
+   std::vector<std::pair<double, double>>* current = nullptr;
+   std::string line;
+   for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+      line = line.substr(0, line.find('#'));
+      line.erase(0, line.find_first_not_of(" \t\r"));
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+      if (line.empty()) continue;
+
+      bool ok = true;
+      if (line[0] == '[') {
+         int laser;
+         char rest;
+         ok = line[line.size() - 1] == ']' && sscanf(line.c_str(), "[%d]%c", &laser, &rest) == 1
+            && laser >= 1 && laser <= numberOfLasers_;
+         if (ok) current = &curves[laser - 1];
+      } else {
+         double output, power;
+         std::istringstream tokens(line);
+         std::string rest;
+         ok = current != nullptr && (tokens >> output >> power) && !(tokens >> rest)
+            && output >= 0.0 && output <= 100.0 && power >= 0.0
+            && (current->empty() || (output > current->back().first && power >= current->back().second));
+         if (ok) current->push_back(std::make_pair(output, power));
+      }
+
+      if (!ok) {
+         LogMessage("Invalid line " + std::to_string(lineNumber) + " in calibration file " + path + ": " + line, false);
+         return ERR_CALIBRATION;
+      }
+   }
+
+   unsigned int size = interface_->GetCalibrationSize();
+   for (const auto& entry : curves) {
+      const std::vector<std::pair<double, double>>& curve = entry.second;
+      if (curve.size() < 2 || curve.back().second <= 0.0) {
+         LogMessage("The calibration of laser " + std::to_string(entry.first + 1) + " needs at least two points and a power above 0.", false);
+         return ERR_CALIBRATION;
+      }
+
+      // Invert the curve: entry i holds the output for i / (size - 1) of the highest power.
+      std::vector<double> table(size);
+      size_t segment = 0;
+      for (unsigned int i = 0; i < size; ++i) {
+         double power = curve.back().second * i / (size - 1);
+         while (segment + 2 < curve.size() && curve[segment + 1].second < power) ++segment;
+         const std::pair<double, double>& lower = curve[segment];
+         const std::pair<double, double>& upper = curve[segment + 1];
+         double output = lower.first;
+         if (power > lower.second && upper.second > lower.second) {
+            output += (std::min(power, upper.second) - lower.second) * (upper.first - lower.first) / (upper.second - lower.second);
+         }
+         table[i] = output / 100.0;
+      }
+
+      if (interface_->LoadCalibration(entry.first, table) != 0) {
+         LogMessage("Could not load the calibration of laser " + std::to_string(entry.first + 1) + ".", false);
+         return ERR_CALIBRATION;
+      }
+   }
+   return DEVICE_OK;
+}
+
+// Reads the waveforms of a file. Each waveform starts with its name in brackets, followed by its
+// period and one line per event, sorted by time:
+//
+//    [strobe]             # name
+//    period 1000          # period in us
+//    0    1-0---  1=80    # time in us, enable state per laser (1 on, 0 off, - unchanged) and
+//    100  0-----          # optionally laser=power pairs with the power in %
+//
+// Everything after # is ignored.
+int LaserDiodeDriver::LoadWaveformFile(const std::string& path) {
+   std::ifstream file(path.c_str());
+   if (!file) {
+      LogMessage("Could not open waveform file " + path + ".", false);
+      return ERR_WAVEFORM_FILE;
+   }
+
+   std::map<std::string, WaveformDefinition> waveforms;
+   WaveformDefinition* current = nullptr;
+   std::string line;
+   for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+      line = line.substr(0, line.find('#'));
+      line.erase(0, line.find_first_not_of(" \t\r"));
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+      if (line.empty()) continue;
+
+      bool ok = true;
+      std::istringstream tokens(line);
+      std::string first;
+      tokens >> first;
+
+      if (line[0] == '[') {
+         ok = line.size() > 2 && line[line.size() - 1] == ']';
+         if (ok) current = &waveforms[line.substr(1, line.size() - 2)];
+      } else if (current == nullptr) {
+         ok = false;
+      } else if (first == "period") {
+         ok = (tokens >> current->period) && current->period > 0;
+      } else {
+         WaveformDefinition::Event event;
+         char* end;
+         event.time = strtoul(first.c_str(), &end, 10);
+         ok = *end == '\0' && (current->events.empty() || event.time >= current->events.back().time);
+
+         std::string states;
+         ok = ok && (tokens >> states) && states.size() <= (size_t)numberOfLasers_;
+         for (size_t i = 0; ok && i < states.size(); ++i) {
+            if (states[i] == '1') event.on |= 1u << i;
+            else if (states[i] == '0') event.off |= 1u << i;
+            else ok = states[i] == '-';
+         }
+
+         std::string power;
+         while (ok && tokens >> power) {
+            int laser;
+            double percent;
+            char rest;
+            ok = sscanf(power.c_str(), "%d=%lf%c", &laser, &percent, &rest) == 2
+               && laser >= 1 && laser <= numberOfLasers_ && percent >= 0.0 && percent <= 100.0;
+            event.powers.push_back(std::make_pair(laser - 1, percent));
+         }
+
+         if (ok) current->events.push_back(event);
+      }
+
+      if (!ok) {
+         LogMessage("Invalid line " + std::to_string(lineNumber) + " in waveform file " + path + ": " + line, false);
+         return ERR_WAVEFORM_FILE;
+      }
+   }
+
+   for (const auto& entry : waveforms) {
+      const WaveformDefinition& waveform = entry.second;
+      if (waveform.events.empty() || waveform.period <= waveform.events.back().time) {
+         LogMessage("Waveform " + entry.first + " has no events or a period not longer than its last event.", false);
+         return ERR_WAVEFORM_FILE;
+      }
+   }
+
+   waveforms_ = waveforms;
+   ClearAllowedValues("Waveform");
+   AddAllowedValue("Waveform", g_WaveformNone);
+   for (const auto& entry : waveforms_) {
+      AddAllowedValue("Waveform", entry.first.c_str());
+   }
+   return DEVICE_OK;
+}
+
+// Loads a waveform of the waveform file to the device. Each power change becomes an event of
+// its own.
+int LaserDiodeDriver::UploadWaveform(const std::string& name) {
+   auto it = waveforms_.find(name);
+   if (it == waveforms_.end()) {
+      return DEVICE_INVALID_PROPERTY_VALUE;
+   }
+
+   int ret = StopWaveform();
+   if (ret != DEVICE_OK) {
+      return ret;
+   }
+
+   std::vector<WaveformEvent> events;
+   uint32_t enableMask = 0;
+   uint32_t powerMask = 0;
+   for (const auto& definition : it->second.events) {
+      WaveformEvent event;
+      event.time_us = definition.time;
+      event.on_mask = definition.on;
+      event.off_mask = definition.off;
+      enableMask |= definition.on | definition.off;
+      if (definition.powers.empty()) {
+         events.push_back(event);
+      }
+      for (const auto& power : definition.powers) {
+         event.power_channel = power.first;
+         event.relative_power = GetRelativeValue(power.first, power.second);
+         powerMask |= 1u << power.first;
+         events.push_back(event);
+         event.on_mask = 0;
+         event.off_mask = 0;
+      }
+   }
+
+   if (events.size() > interface_->GetMaxWaveformEvents() || interface_->LoadWaveform(events) != 0) {
+      waveformName_.clear();
+      return ERR_WAVEFORM;
+   }
+
+   waveformName_ = name;
+   waveformEnableMask_ = enableMask;
+   waveformPowerMask_ = powerMask;
+   return DEVICE_OK;
+}
+
+int LaserDiodeDriver::StopWaveform() {
+   if (!waveformRunning_) {
+      return DEVICE_OK;
+   }
+
+   waveformRunning_ = false;
+   int ret = interface_->StopWaveform();
+   RestoreLaserOutputs(waveformEnableMask_, waveformPowerMask_);
+   return ret == 0 ? DEVICE_OK : DEVICE_ERR;
+}
+
+// Writes the states of the "Enable Laser" and "Laser Power" properties to outputs that were
+// changed by a waveform.
+void LaserDiodeDriver::RestoreLaserOutputs(uint32_t enableMask, uint32_t powerMask) {
+   for (int i = 0; i < numberOfLasers_; ++i) {
+      bool enabled;
+      double power;
+      {
+         std::lock_guard<std::mutex> lock(lasers_[i].mutex);
+         if (enableMask & (1u << i)) lasers_[i].sentEnabled = -1;
+         if (powerMask & (1u << i)) lasers_[i].sentCode = -1;
+         enabled = lasers_[i].enabled;
+         power = lasers_[i].power;
+      }
+      if (enableMask & (1u << i)) SetLaserOnOff(i, enabled);
+      if (powerMask & (1u << i)) SetLaserPower(i, power);
+   }
+}
+
+LaserDiodeShutter::LaserDiodeShutter()
+{
+   InitializeDefaultErrorMessages();
+   CreateHubIDProperty();
+}
+
+LaserDiodeShutter::~LaserDiodeShutter()
+{
+   Shutdown();
+}
+
+void LaserDiodeShutter::GetName(char* name) const
+{
+   CDeviceUtils::CopyLimitedString(name, g_LaserDiodeShutterName);
+}
+
+int LaserDiodeShutter::Initialize()
+{
+   if (initialized_) {
+      return DEVICE_OK;
+   }
+
+   driver_ = dynamic_cast<LaserDiodeDriver*>(GetParentHub());
+   if (driver_ == nullptr) {
+      return DEVICE_COMM_HUB_MISSING;
+   }
+
+   std::vector<std::string> digitalValues;
+   digitalValues.push_back(OFF);
+   digitalValues.push_back(ON);
+
+   int ret = DEVICE_OK;
+   int numberOfLasers = driver_->GetNumberOfLasers();
+   laserMask_ &= (uint32_t)((1ull << numberOfLasers) - 1);
+   for (int i = 0; i < numberOfLasers; ++i) {
+      CPropertyActionEx* pActLaser = new CPropertyActionEx (this, &LaserDiodeShutter::OnLaser, i);
+      char p_name[64];
+      sprintf(p_name, "Switch Laser %d", i+1);
+      ret = CreateStringProperty(p_name, (laserMask_ & (1u << i)) ? ON : OFF, false, pActLaser);
+      ret = SetAllowedValues(p_name, digitalValues);
+   }
+
+   if (ret != DEVICE_OK) {
+      return ret;
+   }
+
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int LaserDiodeShutter::Shutdown()
+{
+   initialized_ = false;
+   driver_ = nullptr;
+   return DEVICE_OK;
+}
+
+bool LaserDiodeShutter::Busy()
+{
+   return driver_ != nullptr && driver_->Busy();
+}
+
+// All selected lasers are switched by a single command and change at the same time.
+int LaserDiodeShutter::SetOpen(bool open)
+{
+   if (!initialized_) {
+      return DEVICE_NOT_CONNECTED;
+   }
+
+   int ret = driver_->SetLasersOnOff(laserMask_, open);
+   if (ret != DEVICE_OK) {
+      return ret;
+   }
+   open_ = open;
+   return DEVICE_OK;
+}
+
+int LaserDiodeShutter::GetOpen(bool& open)
+{
+   open = open_;
+   return DEVICE_OK;
+}
+
+// Opens the shutter for deltaT ms, timed by the host.
+int LaserDiodeShutter::Fire(double deltaT)
+{
+   int ret = SetOpen(true);
+   if (ret == DEVICE_OK) {
+      ret = driver_->Flush();
+   }
+   if (ret == DEVICE_OK) {
+      CDeviceUtils::SleepMs((long)deltaT);
+   }
+
+   int closeRet = SetOpen(false);
+   return ret != DEVICE_OK ? ret : closeRet;
+}
+
+int LaserDiodeShutter::OnLaser(MM::PropertyBase* pProp, MM::ActionType eAct, long idx) {
+   if (eAct == MM::BeforeGet) {
+      pProp->Set((laserMask_ & (1u << idx)) ? ON : OFF);
+   } else if (eAct == MM::AfterSet) {
+      std::string value;
+      pProp->Get(value);
+      bool selected = value == ON;
+      if (selected == (bool)(laserMask_ & (1u << idx))) {
+         return DEVICE_OK;
+      }
+
+      // While the shutter is open, lasers added to it are switched on and removed ones off.
+      if (open_) {
+         int ret = driver_->SetLasersOnOff(1u << idx, selected);
+         if (ret != DEVICE_OK) {
+            pProp->Set((laserMask_ & (1u << idx)) ? ON : OFF);
+            return ret;
+         }
+      }
+      laserMask_ = selected ? laserMask_ | (1u << idx) : laserMask_ & ~(1u << idx);
+   }
+   return DEVICE_OK;
+}
+
+LaserDiodeLaser::LaserDiodeLaser(int idx) : idx_(idx)
+{
+   InitializeDefaultErrorMessages();
+   SetErrorText(ERR_NO_LASER, g_Msg_ERR_NO_LASER);
+   CreateHubIDProperty();
+}
+
+LaserDiodeLaser::~LaserDiodeLaser()
+{
+   Shutdown();
+}
+
+void LaserDiodeLaser::GetName(char* name) const
+{
+   std::string deviceName = g_LaserDiodeLaserName + std::to_string(idx_+1);
+   CDeviceUtils::CopyLimitedString(name, deviceName.c_str());
+}
+
+int LaserDiodeLaser::Initialize()
+{
+   if (initialized_) {
+      return DEVICE_OK;
+   }
+
+   hub_ = dynamic_cast<LaserDiodeDriver*>(GetParentHub());
+   if (hub_ == nullptr) {
+      return DEVICE_COMM_HUB_MISSING;
+   }
+   if (idx_ >= hub_->GetNumberOfLasers()) {
+      hub_ = nullptr;
+      return ERR_NO_LASER;
+   }
+
+   std::vector<std::string> digitalValues;
+   digitalValues.push_back(OFF);
+   digitalValues.push_back(ON);
+
+   int ret = CreateStringProperty("Label", hub_->GetLaserLabel(idx_).c_str(), true);
+
+   CPropertyAction* pActPower = new CPropertyAction (this, &LaserDiodeLaser::OnPower);
+   ret = CreateFloatProperty("Power (%)", 0.0, false, pActPower);
+   ret = SetPropertyLimits("Power (%)", 0, 100);
+
+   CPropertyAction* pActEnable = new CPropertyAction (this, &LaserDiodeLaser::OnEnable);
+   ret = CreateStringProperty("Enable", OFF, false, pActEnable);
+   ret = SetAllowedValues("Enable", digitalValues);
+
+   CPropertyAction* pActBlanking = new CPropertyAction (this, &LaserDiodeLaser::OnBlanking);
+   ret = CreateStringProperty("Blanking", OFF, false, pActBlanking);
+   ret = SetAllowedValues("Blanking", digitalValues);
+
+   CPropertyAction* pActRampTime = new CPropertyAction (this, &LaserDiodeLaser::OnRampTime);
+   ret = CreateIntegerProperty("Ramp Time (ms)", 0, false, pActRampTime);
+   ret = SetPropertyLimits("Ramp Time (ms)", 0, 60000);
+
+   if (ret != DEVICE_OK) {
+      return ret;
+   }
+
+   hub_->AttachLaser(idx_, this);
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int LaserDiodeLaser::Shutdown()
+{
+   if (initialized_) {
+      hub_->AttachLaser(idx_, nullptr);
+      initialized_ = false;
+   }
+   return DEVICE_OK;
+}
+
+bool LaserDiodeLaser::Busy()
+{
+   return hub_ != nullptr && hub_->Busy();
+}
+
+// The properties are handled by the hub, which keeps the state of all lasers.
+int LaserDiodeLaser::OnPower(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   return hub_->OnLaserPower(pProp, eAct, idx_);
+}
+
+int LaserDiodeLaser::OnEnable(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   return hub_->OnLaserOnOff(pProp, eAct, idx_);
+}
+
+int LaserDiodeLaser::OnBlanking(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   return hub_->OnBlanking(pProp, eAct, idx_);
+}
+
+int LaserDiodeLaser::OnRampTime(MM::PropertyBase* pProp, MM::ActionType eAct) {
+   return hub_->OnRampTime(pProp, eAct, idx_);
+}
+
+void LaserDiodeLaser::LaserChanged(double power, bool enabled) {
+   OnPropertyChanged("Power (%)", CDeviceUtils::ConvertToString(power));
+   OnPropertyChanged("Enable", enabled ? ON : OFF);
+}
@@ -30,12 +30,90 @@
 #include "DeviceBase.h"
 #include "ModuleInterface.h"
 
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 #define ERR_UNKNOWN_MODE         102
-#define NUMBER_OF_LASERS         6
+#define ERR_WAVEFORM_FILE        103
+#define ERR_WAVEFORM             104
+#define ERR_NO_LASER             105
+#define ERR_CALIBRATION          106
+#define MAX_LASERS               32 // channels the board reports are used up to this number
+#define DEFAULT_COMMANDS_IN_FLIGHT 16
 
-class LaserDiodeDriver : public CGenericBase<LaserDiodeDriver>  
+// State of a single laser. The last values written to the board are cached so that writes which
+// would not change the outputs can be skipped. Each laser has its own lock, so different lasers
+// can be driven from different threads at the same time.
+struct LaserChannel
+{
+   std::mutex mutex;       // guards the fields below
+   std::string label;
+   double minPower = 0.0;  // %
+   double maxPower = 100.0;// %
+   double power = 0.0;     // requested power in %
+   bool enabled = false;   // requested enable state
+   long sentCode = -1;     // 16-bit analog value last written, -1 if unknown
+   int sentEnabled = -1;   // enable state last written, -1 if unknown
+   long rampTime = 0;      // ms over which power changes are ramped, 0 writes them at once
+   std::chrono::steady_clock::time_point rampEnd; // end of the last ramp
+};
+
+// Setting of a modulation output of the board and the sequences loaded for its frequency and duty
+// cycle properties. The board plays both as a single modulation sequence.
+struct ModulationOutput
+{
+   double frequency = 1000000.0;         // Hz
+   double dutyCycle = 0.0;               // %
+   std::vector<double> frequencySequence;
+   std::vector<double> dutyCycleSequence;
+   int runningSequences = 0;             // properties whose sequence was started
+};
+
+// Waveform read from a waveform file. Powers are in % like the "Laser Power" properties.
+struct WaveformDefinition
+{
+   struct Event
+   {
+      uint32_t time = 0;  // us from the start of the period
+      uint32_t on = 0;    // lasers switched on
+      uint32_t off = 0;   // lasers switched off
+      std::vector<std::pair<int, double>> powers; // laser index and power
+   };
+
+   uint32_t period = 0; // us
+   std::vector<Event> events;
+};
+
+// Read-only properties reporting the statistics of the interface board
+enum Statistic
+{
+   STAT_WRITE_LATENCY_P50,
+   STAT_WRITE_LATENCY_P99,
+   STAT_WRITE_LATENCY_MAX,
+   STAT_SEND_LATENCY_P50,
+   STAT_SEND_LATENCY_P99,
+   STAT_COMMANDS_PER_SECOND,
+   STAT_BYTES_SENT,
+   STAT_QUEUE_DEPTH,
+   STAT_ERRORS,
+   STAT_RESYNCS,
+   STAT_BOARD_COMMANDS_PER_SECOND,
+   STAT_BOARD_BUFFER_PEAK,
+   NUMBER_OF_STATISTICS
+};
+
+class LaserDiodeLaser;
+class JournalBoard;
+
+// Hub owning the connection to the interface board. The board's interface queues and orders the
+// commands of all lasers, so the per-laser devices and the hub's own properties can be used
+// concurrently.
+class LaserDiodeDriver : public HubBase<LaserDiodeDriver>
 {
 public:
    LaserDiodeDriver();
@@ -50,25 +128,153 @@ public:
    // LaserDiodeDriver API
    int SetLaserPower(int idx, double power);
    int SetLaserOnOff(int idx, bool enabled);
+   int SetLaserState(const std::string& state);
+   int SetLasersOnOff(uint32_t mask, bool enabled);
+   int Flush();
 
-   int OnNumberOfLasers(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnBoardType(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnPort(MM::PropertyBase* pProp, MM::ActionType eAct);
-   int OnLaserOnOff(MM::PropertyBase* pProp, MM::ActionType eAct);
-   int OnLaserPower(MM::PropertyBase* pProp, MM::ActionType eAct);
-   int OnLaserLabel(MM::PropertyBase* pProp, MM::ActionType eAct);
-   int OnLaserMinPower(MM::PropertyBase* pProp, MM::ActionType eAct);
-   int OnLaserMaxPower(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnLaserOnOff(MM::PropertyBase* pProp, MM::ActionType eAct, long idx);
+   int OnLaserPower(MM::PropertyBase* pProp, MM::ActionType eAct, long idx);
+   int OnLaserState(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStatistic(MM::PropertyBase* pProp, MM::ActionType eAct, long stat);
+   int OnResetStatistics(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnWaveformFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnWaveform(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnWaveformState(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBlanking(MM::PropertyBase* pProp, MM::ActionType eAct, long idx);
+   int OnBlankingPolarity(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTelemetry(MM::PropertyBase* pProp, MM::ActionType eAct, long setting);
+   int OnMonitor(MM::PropertyBase* pProp, MM::ActionType eAct, long idx);
+   int OnReadback(MM::PropertyBase* pProp, MM::ActionType eAct, long idx);
+   int OnDose(MM::PropertyBase* pProp, MM::ActionType eAct, long idx);
+   int OnRampTime(MM::PropertyBase* pProp, MM::ActionType eAct, long idx);
+   int OnRampCurve(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnModulationFrequency(MM::PropertyBase* pProp, MM::ActionType eAct, long idx);
+   int OnModulationDutyCycle(MM::PropertyBase* pProp, MM::ActionType eAct, long idx);
 
    double GetLaserMaxPower(int idx);
    double GetLaserMinPower(int idx);
+   double GetRelativeValue(int idx, double power);
+
+   bool Busy();
 
-   bool Busy() { return false; }
+   // Hub API
+   int DetectInstalledDevices();
+   void AttachLaser(int idx, LaserDiodeLaser* laser);
+   std::string GetLaserLabel(int idx);
+   int GetNumberOfLasers() const;
+
+   // Monitor samples received since cursor, see InterfaceBoard::GetMonitorSamples()
+   size_t GetMonitorSamples(uint64_t& cursor, std::vector<MonitorSample>& samples);
 
 private:
+   void NotifyLaserChanged(int idx);
+   int ApplyLaserState(uint32_t analog_mask, const std::vector<double>& powers, uint32_t digital_mask, uint32_t digital_values);
+   void RestoreOutputState();
+   int LoadLaserSettings();
+   int LoadCalibrationFile(const std::string& path);
+   int LoadWaveformFile(const std::string& path);
+   int UploadWaveform(const std::string& name);
+   int StopWaveform();
+   void RestoreLaserOutputs(uint32_t enableMask, uint32_t powerMask);
+   int StartRamp(int idx, double relative_value);
+   bool Ramping();
+   int OnModulation(MM::PropertyBase* pProp, MM::ActionType eAct, int idx, bool dutyCycle);
+   int LoadModulationSequence(int idx);
+
    bool initialized_ = false;
    InterfaceBoard *interface_ = nullptr;
+   JournalBoard *journal_ = nullptr; // interface_ if commands are recorded in a journal
    std::string boardType_;
+   int numberOfLasers_ = 0; // channels reported by the board
+   LaserChannel lasers_[MAX_LASERS];
+   std::atomic<LaserDiodeLaser*> laserDevices_[MAX_LASERS]; // initialized laser devices
+
+   // Commands/s is the rate since the previous read of the property.
+   uint64_t rateCommands_ = 0;
+   std::chrono::steady_clock::time_point rateTime_;
+
+   // Waveforms of the waveform file and the one loaded to the board, with the lasers whose enable
+   // state and power it controls
+   std::map<std::string, WaveformDefinition> waveforms_;
+   std::string waveformName_;
+   uint32_t waveformEnableMask_ = 0;
+   uint32_t waveformPowerMask_ = 0;
+   bool waveformRunning_ = false;
+
+   // Lasers gated by the board's exposure input and the polarity of that input
+   std::mutex blankingMutex_;
+   uint32_t blankingMask_ = 0;
+   bool blankingActiveLow_ = false;
+
+   // Curve of the power ramps, see "Ramp Curve"
+   std::atomic<bool> rampExponential_{false};
+
+   // Modulation outputs reported by the board
+   std::mutex modulationMutex_;
+   std::vector<ModulationOutput> modulators_;
+
+   // Telemetry requested from the board
+   long telemetryRate_ = 0;
+   long stateInterval_ = 0;
+};
+
+// A single laser of a LaserDiodeDriver hub
+class LaserDiodeLaser : public CGenericBase<LaserDiodeLaser>
+{
+public:
+   LaserDiodeLaser(int idx);
+   ~LaserDiodeLaser();
+
+   // MMDevice API
+   int Initialize();
+   int Shutdown();
+
+   void GetName(char* name) const;
+   bool Busy();
+
+   int OnPower(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnEnable(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBlanking(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRampTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+   // Called by the hub when the laser was changed through another device
+   void LaserChanged(double power, bool enabled);
+
+private:
+   int idx_;
+   bool initialized_ = false;
+   LaserDiodeDriver* hub_ = nullptr;
+};
+
+// Shutter that switches a selectable set of lasers of a LaserDiodeDriver on and off with a single
+// command, so Micro-Manager's autoshutter can drive the lasers.
+class LaserDiodeShutter : public CShutterBase<LaserDiodeShutter>
+{
+public:
+   LaserDiodeShutter();
+   ~LaserDiodeShutter();
+
+   // MMDevice API
+   int Initialize();
+   int Shutdown();
+
+   void GetName(char* name) const;
+   bool Busy();
+
+   // Shutter API
+   int SetOpen(bool open = true);
+   int GetOpen(bool& open);
+   int Fire(double deltaT);
+
+   int OnLaser(MM::PropertyBase* pProp, MM::ActionType eAct, long idx);
+
+private:
+   bool initialized_ = false;
+   LaserDiodeDriver* driver_ = nullptr;
+   uint32_t laserMask_ = (uint32_t)((1ull << MAX_LASERS) - 1); // lasers switched by the shutter
+   bool open_ = false;
 };
 
 #endif //LASERDIODEDRIVER_H_
@@ -0,0 +1,81 @@
+/* Link.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LINK_H_
+#define LINK_H_
+
+#include <cstdint>
+#include <string>
+
+#include "serial/serial.h"
+
+// Byte stream to the board that carries the framed protocol. Like serial::Serial, whose interface
+// it follows, all methods throw on failure. read() and waitReadable() wait at most the timeout
+// given to setTimeout().
+class Link {
+    public:
+        virtual ~Link() {}
+        virtual void setPort(const std::string &port) = 0;
+        virtual void setTimeout(uint32_t timeout_ms) = 0;
+        virtual void setLowLatency(bool low_latency) = 0;
+        virtual void open() = 0;
+        virtual void close() = 0;
+        virtual bool isOpen() const = 0;
+        virtual void flushInput() = 0;
+        virtual size_t available() = 0;
+        virtual size_t read(uint8_t *buffer, size_t size) = 0;
+        virtual void writeGather(const serial::WriteBuffer *buffers, size_t count) = 0;
+        virtual bool waitReadable() = 0;
+};
+
+// USB serial port of the board
+class SerialLink : public Link {
+    public:
+        explicit SerialLink(uint32_t baudrate) {
+            dev_.setBaudrate(baudrate);
+        }
+        void setPort(const std::string &port) { dev_.setPort(port); }
+        void setTimeout(uint32_t timeout_ms) {
+            auto timeout = serial::Timeout::simpleTimeout(timeout_ms);
+            dev_.setTimeout(timeout);
+        }
+        void setLowLatency(bool low_latency) { dev_.setLowLatency(low_latency); }
+        void open() { dev_.open(); }
+        void close() { dev_.close(); }
+        bool isOpen() const { return dev_.isOpen(); }
+        void flushInput() { dev_.flushInput(); }
+        size_t available() { return dev_.available(); }
+        size_t read(uint8_t *buffer, size_t size) { return dev_.read(buffer, size); }
+        // serial::Serial returns a short count when the write timeout runs out. The rest of the
+        // frames would never be sent, so that is a failure like any other.
+        void writeGather(const serial::WriteBuffer *buffers, size_t count) {
+            size_t total = 0;
+            for (size_t i = 0; i < count; ++i) total += buffers[i].size;
+            if (dev_.writeGather(buffers, count) != total) throw serial::SerialException("Timed out while writing.");
+        }
+        bool waitReadable() { return dev_.waitReadable(); }
+    private:
+        serial::Serial dev_;
+};
+
+#endif // LINK_H_
@@ -0,0 +1,507 @@
+/* MultiBoard.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "MultiBoard.h"
+
+#include <algorithm>
+#include <thread>
+
+MultiBoard::MultiBoard(std::vector<std::unique_ptr<InterfaceBoard>> boards, bool shared_trigger)
+    : boards_(std::move(boards)), shared_trigger_(shared_trigger) {
+    if (boards_.size() > MULTI_MAX_CHANNELS) boards_.resize(MULTI_MAX_CHANNELS);
+    all_boards_ = (uint32_t)((1ull << boards_.size()) - 1);
+}
+
+// Opens all boards at the same time. Channels beyond MULTI_MAX_CHANNELS are left unused.
+int MultiBoard::Open() {
+    if (boards_.empty()) {
+        AddError("No boards were given.");
+        return 1;
+    }
+    if (ForEachBoard(all_boards_, [this](size_t b) { return boards_[b]->Open(); }) != 0) return 1;
+
+    number_of_channels_ = 0;
+    first_channels_.clear();
+    channel_counts_.clear();
+    for (const auto &board : boards_) {
+        unsigned int count = std::min(board->GetNumberOfChannels(), MULTI_MAX_CHANNELS - number_of_channels_);
+        if (count < board->GetNumberOfChannels()) {
+            AddError("Only the first " + std::to_string(MULTI_MAX_CHANNELS) + " channels of all boards are used.");
+        }
+        first_channels_.push_back(number_of_channels_);
+        channel_counts_.push_back(count);
+        number_of_channels_ += count;
+    }
+    return 0;
+}
+
+// Board and channel on that board of a channel of the combined channel space
+int MultiBoard::Locate(unsigned int channel, size_t &board, unsigned int &local_channel) const {
+    for (size_t b = 0; b < first_channels_.size(); ++b) {
+        if (channel >= first_channels_[b] && channel < first_channels_[b] + channel_counts_[b]) {
+            board = b;
+            local_channel = channel - first_channels_[b];
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Board and output on that board of a modulation output of the combined outputs
+int MultiBoard::LocateModulator(unsigned int output, size_t &board, unsigned int &local_output) const {
+    for (size_t b = 0; b < boards_.size(); ++b) {
+        unsigned int count = boards_[b]->GetNumberOfModulators();
+        if (output < count) {
+            board = b;
+            local_output = output;
+            return 0;
+        }
+        output -= count;
+    }
+    return 1;
+}
+
+// Part of channel_mask that selects channels of the given board, shifted to the board's channels
+uint32_t MultiBoard::BoardMask(size_t board, uint32_t channel_mask) const {
+    unsigned int count = channel_counts_[board];
+    if (count == 0) return 0;
+    uint32_t board_channels = count == 32 ? 0xFFFFFFFF : (1u << count) - 1;
+    return (uint32_t)((uint64_t)channel_mask >> first_channels_[board]) & board_channels;
+}
+
+// Runs command for every board in board_mask, each board in its own thread, and returns 1 if it
+// failed for any of them.
+int MultiBoard::ForEachBoard(uint32_t board_mask, const std::function<int(size_t)> &command) {
+    std::vector<size_t> selected;
+    for (size_t b = 0; b < boards_.size(); ++b) {
+        if (board_mask & (1u << b)) selected.push_back(b);
+    }
+    if (selected.empty()) return 0;
+
+    std::vector<int> results(selected.size(), 0);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < selected.size(); ++i) {
+        threads.emplace_back([&, i] { results[i] = command(selected[i]); });
+    }
+    results[0] = command(selected[0]);
+    for (auto &thread : threads) thread.join();
+
+    int ret = 0;
+    for (int result : results) ret |= result;
+    return ret;
+}
+
+void MultiBoard::AddError(const std::string &error) {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    errors_.push_back(error);
+    if (errors_.size() > MAX_QUEUED_ERRORS) errors_.pop_front();
+}
+
+std::string MultiBoard::PopError() {
+    {
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (!errors_.empty()) {
+            std::string error = errors_.front();
+            errors_.pop_front();
+            return error;
+        }
+    }
+    for (size_t b = 0; b < boards_.size(); ++b) {
+        std::string error = boards_[b]->PopError();
+        if (!error.empty()) return "Board " + std::to_string(b + 1) + ": " + error;
+    }
+    return "";
+}
+
+int MultiBoard::WriteAnalogRelative(unsigned int channel, double relative_value) {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->WriteAnalogRelative(local_channel, relative_value);
+}
+
+int MultiBoard::WriteDigital(unsigned int channel, bool value) {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->WriteDigital(local_channel, value);
+}
+
+bool MultiBoard::DeviceIsOpen() const {
+    if (boards_.empty()) return false;
+    for (const auto &board : boards_) {
+        if (!board->DeviceIsOpen()) return false;
+    }
+    return true;
+}
+
+unsigned int MultiBoard::GetNumberOfChannels() const {
+    return number_of_channels_;
+}
+
+int MultiBoard::GetChannelOutput(unsigned int channel, uint8_t &dac_address, uint8_t &dac_output) const {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->GetChannelOutput(local_channel, dac_address, dac_output);
+}
+
+// Writes only queue the values on the boards, whose writer threads then send them concurrently,
+// so the boards can be handed their parts one after the other.
+int MultiBoard::WriteAnalogRelativeMulti(uint32_t channel_mask, const std::vector<double> &relative_values) {
+    if ((uint64_t)channel_mask >> number_of_channels_) return 1;
+
+    int ret = 0;
+    std::vector<double> board_values;
+    for (size_t b = 0; b < boards_.size(); ++b) {
+        uint32_t board_mask = BoardMask(b, channel_mask);
+        if (board_mask == 0) continue;
+        size_t first = first_channels_[b];
+        if (relative_values.size() <= first) return 1;
+        size_t last = std::min<size_t>(relative_values.size(), first + channel_counts_[b]);
+        board_values.assign(relative_values.begin() + first, relative_values.begin() + last);
+        ret |= boards_[b]->WriteAnalogRelativeMulti(board_mask, board_values);
+    }
+    return ret;
+}
+
+int MultiBoard::WriteDigitalMulti(uint32_t channel_mask, uint32_t values) {
+    if ((uint64_t)channel_mask >> number_of_channels_) return 1;
+
+    int ret = 0;
+    for (size_t b = 0; b < boards_.size(); ++b) {
+        uint32_t board_mask = BoardMask(b, channel_mask);
+        if (board_mask == 0) continue;
+        ret |= boards_[b]->WriteDigitalMulti(board_mask, BoardMask(b, values));
+    }
+    return ret;
+}
+
+unsigned int MultiBoard::GetMaxSequenceLength() const {
+    unsigned int length = boards_.empty() ? 0 : boards_[0]->GetMaxSequenceLength();
+    for (const auto &board : boards_) length = std::min(length, board->GetMaxSequenceLength());
+    return length;
+}
+
+int MultiBoard::LoadAnalogSequence(unsigned int channel, const std::vector<double> &relative_values) {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->LoadAnalogSequence(local_channel, relative_values);
+}
+
+int MultiBoard::LoadDigitalSequence(unsigned int channel, const std::vector<bool> &values) {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->LoadDigitalSequence(local_channel, values);
+}
+
+int MultiBoard::StartAnalogSequence(unsigned int channel) {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->StartAnalogSequence(local_channel);
+}
+
+int MultiBoard::StopAnalogSequence(unsigned int channel) {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->StopAnalogSequence(local_channel);
+}
+
+int MultiBoard::StartDigitalSequence(unsigned int channel) {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->StartDigitalSequence(local_channel);
+}
+
+int MultiBoard::StopDigitalSequence(unsigned int channel) {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->StopDigitalSequence(local_channel);
+}
+
+unsigned int MultiBoard::GetMaxWaveformEvents() const {
+    unsigned int events = boards_.empty() ? 0 : boards_[0]->GetMaxWaveformEvents();
+    for (const auto &board : boards_) events = std::min(events, board->GetMaxWaveformEvents());
+    return events;
+}
+
+// Every board gets the events that switch or set one of its channels. Boards without any events
+// have their waveform cleared and are left out when the waveform is started.
+int MultiBoard::LoadWaveform(const std::vector<WaveformEvent> &events) {
+    std::vector<std::vector<WaveformEvent>> board_events(boards_.size());
+    for (const auto &event : events) {
+        if (((uint64_t)(event.on_mask | event.off_mask) >> number_of_channels_) != 0) return 1;
+
+        size_t power_board = boards_.size();
+        unsigned int power_channel = 0;
+        if (event.power_channel >= 0 && Locate(event.power_channel, power_board, power_channel) != 0) return 1;
+
+        for (size_t b = 0; b < boards_.size(); ++b) {
+            WaveformEvent board_event;
+            board_event.time_us = event.time_us;
+            board_event.on_mask = BoardMask(b, event.on_mask);
+            board_event.off_mask = BoardMask(b, event.off_mask);
+            if (b == power_board) {
+                board_event.power_channel = power_channel;
+                board_event.relative_power = event.relative_power;
+            }
+            if (board_event.on_mask != 0 || board_event.off_mask != 0 || board_event.power_channel >= 0) {
+                board_events[b].push_back(board_event);
+            }
+        }
+    }
+
+    waveform_boards_ = 0;
+    for (size_t b = 0; b < boards_.size(); ++b) {
+        if (!board_events[b].empty()) waveform_boards_ |= 1u << b;
+    }
+    return ForEachBoard(all_boards_, [&](size_t b) { return boards_[b]->LoadWaveform(board_events[b]); });
+}
+
+// With a shared trigger line, the boards are armed and start at the next trigger edge together.
+int MultiBoard::StartWaveform(uint32_t channel_mask, uint32_t period_us, unsigned int repetitions, bool on_trigger) {
+    if ((uint64_t)channel_mask >> number_of_channels_) return 1;
+    if (waveform_boards_ == 0) return 1;
+
+    bool armed = on_trigger || shared_trigger_;
+    return ForEachBoard(waveform_boards_, [&](size_t b) {
+        return boards_[b]->StartWaveform(BoardMask(b, channel_mask), period_us, repetitions, armed);
+    });
+}
+
+int MultiBoard::StopWaveform() {
+    return ForEachBoard(all_boards_, [this](size_t b) { return boards_[b]->StopWaveform(); });
+}
+
+// The waveform runs as long as it runs on any board; the completed periods are those of the
+// board that is furthest behind.
+int MultiBoard::GetWaveformStatus(bool &running, uint32_t &periods) {
+    std::vector<bool> board_running(boards_.size(), false);
+    std::vector<uint32_t> board_periods(boards_.size(), 0);
+    int ret = ForEachBoard(waveform_boards_, [&](size_t b) {
+        bool r = false;
+        uint32_t p = 0;
+        int result = boards_[b]->GetWaveformStatus(r, p);
+        board_running[b] = r;
+        board_periods[b] = p;
+        return result;
+    });
+    if (ret != 0) return 1;
+
+    running = false;
+    periods = 0;
+    bool first = true;
+    for (size_t b = 0; b < boards_.size(); ++b) {
+        if (!(waveform_boards_ & (1u << b))) continue;
+        running = running || board_running[b];
+        periods = first ? board_periods[b] : std::min(periods, board_periods[b]);
+        first = false;
+    }
+    return 0;
+}
+
+int MultiBoard::SetBlanking(uint32_t channel_mask, bool active_low) {
+    if ((uint64_t)channel_mask >> number_of_channels_) return 1;
+    return ForEachBoard(all_boards_, [&](size_t b) {
+        return boards_[b]->SetBlanking(BoardMask(b, channel_mask), active_low);
+    });
+}
+
+int MultiBoard::Ramp(unsigned int channel, double relative_value, uint32_t duration_us, bool exponential) {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->Ramp(local_channel, relative_value, duration_us, exponential);
+}
+
+unsigned int MultiBoard::GetNumberOfModulators() const {
+    unsigned int count = 0;
+    for (const auto &board : boards_) {
+        count += board->GetNumberOfModulators();
+    }
+    return count;
+}
+
+int MultiBoard::SetModulation(unsigned int output, double frequency_hz, double duty_cycle) {
+    size_t board;
+    unsigned int local_output;
+    if (LocateModulator(output, board, local_output) != 0) return 1;
+    return boards_[board]->SetModulation(local_output, frequency_hz, duty_cycle);
+}
+
+int MultiBoard::LoadModulationSequence(unsigned int output, const std::vector<double> &frequencies_hz,
+                                       const std::vector<double> &duty_cycles) {
+    size_t board;
+    unsigned int local_output;
+    if (LocateModulator(output, board, local_output) != 0) return 1;
+    return boards_[board]->LoadModulationSequence(local_output, frequencies_hz, duty_cycles);
+}
+
+int MultiBoard::StartModulationSequence(unsigned int output) {
+    size_t board;
+    unsigned int local_output;
+    if (LocateModulator(output, board, local_output) != 0) return 1;
+    return boards_[board]->StartModulationSequence(local_output);
+}
+
+int MultiBoard::StopModulationSequence(unsigned int output) {
+    size_t board;
+    unsigned int local_output;
+    if (LocateModulator(output, board, local_output) != 0) return 1;
+    return boards_[board]->StopModulationSequence(local_output);
+}
+
+// All boards run the same program and have tables of the same size.
+unsigned int MultiBoard::GetCalibrationSize() const {
+    return boards_.empty() ? 0 : boards_[0]->GetCalibrationSize();
+}
+
+int MultiBoard::LoadCalibration(unsigned int channel, const std::vector<double> &relative_outputs) {
+    size_t board;
+    unsigned int local_channel;
+    if (Locate(channel, board, local_channel) != 0) return 1;
+    return boards_[board]->LoadCalibration(local_channel, relative_outputs);
+}
+
+unsigned int MultiBoard::GetNumberOfMonitors() const {
+    return boards_.empty() ? 0 : boards_[0]->GetNumberOfMonitors();
+}
+
+// Samples are taken by the first board only; state snapshots come from all boards.
+int MultiBoard::SetTelemetry(unsigned int sample_rate, unsigned int state_interval_ms) {
+    return ForEachBoard(all_boards_, [&](size_t b) {
+        return boards_[b]->SetTelemetry(b == 0 ? sample_rate : 0, state_interval_ms);
+    });
+}
+
+uint64_t MultiBoard::GetMonitorSampleCount() const {
+    return boards_.empty() ? 0 : boards_[0]->GetMonitorSampleCount();
+}
+
+size_t MultiBoard::GetMonitorSamples(uint64_t &cursor, std::vector<MonitorSample> &samples) {
+    return boards_.empty() ? 0 : boards_[0]->GetMonitorSamples(cursor, samples);
+}
+
+// Latest snapshots of all boards, combined into one channel space. The time and PWM settings are
+// those of the first board.
+int MultiBoard::GetBoardState(BoardState &state) {
+    BoardState combined;
+    for (size_t b = 0; b < boards_.size(); ++b) {
+        BoardState board_state;
+        if (boards_[b]->GetBoardState(board_state) != 0) return 1;
+        if (b == 0) {
+            combined.board_time_us = board_state.board_time_us;
+            combined.pwm_duty = board_state.pwm_duty;
+            combined.pwm_top = board_state.pwm_top;
+        }
+        uint32_t board_channels = BoardMask(b, 0xFFFFFFFF);
+        combined.enable_mask |= (board_state.enable_mask & board_channels) << first_channels_[b];
+        combined.level_mask |= (board_state.level_mask & board_channels) << first_channels_[b];
+        board_state.relative_outputs.resize(channel_counts_[b], 0.0);
+        combined.relative_outputs.insert(combined.relative_outputs.end(), board_state.relative_outputs.begin(),
+                                         board_state.relative_outputs.end());
+    }
+    state = combined;
+    return 0;
+}
+
+int MultiBoard::GetOutputState(OutputState &state) {
+    OutputState combined;
+    for (size_t b = 0; b < boards_.size(); ++b) {
+        OutputState board_state;
+        if (boards_[b]->GetOutputState(board_state) != 0) return 1;
+        if (b == 0) combined.blanking_active_low = board_state.blanking_active_low;
+        uint32_t board_channels = BoardMask(b, 0xFFFFFFFF);
+        combined.enable_mask |= (board_state.enable_mask & board_channels) << first_channels_[b];
+        combined.blanking_mask |= (board_state.blanking_mask & board_channels) << first_channels_[b];
+        board_state.relative_values.resize(channel_counts_[b], 0.0);
+        combined.relative_values.insert(combined.relative_values.end(), board_state.relative_values.begin(),
+                                        board_state.relative_values.end());
+    }
+    state = combined;
+    return 0;
+}
+
+void MultiBoard::SetKeepOutputsOnClose(bool keep) {
+    for (const auto &board : boards_) board->SetKeepOutputsOnClose(keep);
+}
+
+bool MultiBoard::Busy() {
+    for (const auto &board : boards_) {
+        if (board->Busy()) return true;
+    }
+    return false;
+}
+
+// The boards send in parallel, so by the time the first one is flushed the others are mostly
+// done as well.
+int MultiBoard::Flush() {
+    int ret = 0;
+    for (const auto &board : boards_) ret |= board->Flush();
+    return ret;
+}
+
+int MultiBoard::SetMaxPendingCommands(unsigned int count) {
+    int ret = 0;
+    for (const auto &board : boards_) ret |= board->SetMaxPendingCommands(count);
+    return ret;
+}
+
+int MultiBoard::SetLowLatency(bool low_latency) {
+    int ret = 0;
+    for (const auto &board : boards_) ret |= board->SetLowLatency(low_latency);
+    return ret;
+}
+
+// Counters are summed up. Latencies are those of the slowest board, the processing rate that of
+// the slowest board and the buffer peak the highest of all boards.
+void MultiBoard::GetStatistics(BoardStatistics &stats) {
+    stats = BoardStatistics();
+    for (size_t b = 0; b < boards_.size(); ++b) {
+        BoardStatistics board_stats;
+        boards_[b]->GetStatistics(board_stats);
+        stats.write_latency_p50_us = std::max(stats.write_latency_p50_us, board_stats.write_latency_p50_us);
+        stats.write_latency_p99_us = std::max(stats.write_latency_p99_us, board_stats.write_latency_p99_us);
+        stats.write_latency_max_us = std::max(stats.write_latency_max_us, board_stats.write_latency_max_us);
+        stats.send_latency_p50_us = std::max(stats.send_latency_p50_us, board_stats.send_latency_p50_us);
+        stats.send_latency_p99_us = std::max(stats.send_latency_p99_us, board_stats.send_latency_p99_us);
+        stats.commands += board_stats.commands;
+        stats.bytes_sent += board_stats.bytes_sent;
+        stats.queue_depth += board_stats.queue_depth;
+        stats.errors += board_stats.errors;
+        stats.resyncs += board_stats.resyncs;
+        stats.board_commands_per_second = b == 0 ? board_stats.board_commands_per_second
+                                                 : std::min(stats.board_commands_per_second, board_stats.board_commands_per_second);
+        stats.board_buffer_peak = std::max(stats.board_buffer_peak, board_stats.board_buffer_peak);
+    }
+}
+
+void MultiBoard::ResetStatistics() {
+    for (const auto &board : boards_) board->ResetStatistics();
+}
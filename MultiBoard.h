@@ -0,0 +1,121 @@
+/* MultiBoard.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MULTIBOARD_H_
+#define MULTIBOARD_H_
+
+#include "InterfaceBoard.h"
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Number of channels of all boards together that can be addressed by the 32-bit channel masks
+#define MULTI_MAX_CHANNELS 32
+
+// Several interface boards, e.g. LaserEngines on separate USB ports, combined into a single
+// channel space: the channels of the first board come first, followed by those of the second and
+// so on. Every board keeps its own I/O threads, so a batched write that spans several boards is
+// sent to all of them at the same time and takes as long as the slowest board, not the sum of
+// all. Commands that wait for the boards, like loading and starting waveforms, are issued to the
+// boards concurrently as well.
+//
+// With shared_trigger, the trigger inputs of all boards are wired to the same line. Triggered
+// sequences then advance in step, and waveforms are armed on every board and start together at
+// the next trigger edge instead of right away.
+//
+// Modulation outputs follow each other like the channels. Monitor inputs and samples are those of
+// the first board.
+class MultiBoard : public InterfaceBoard {
+    public:
+        MultiBoard(std::vector<std::unique_ptr<InterfaceBoard>> boards, bool shared_trigger);
+        int Open();
+        int WriteAnalogRelative(unsigned int channel, double relative_value);
+        int WriteDigital(unsigned int channel, bool value);
+        bool DeviceIsOpen() const;
+        unsigned int GetNumberOfChannels() const;
+        int GetChannelOutput(unsigned int channel, uint8_t &dac_address, uint8_t &dac_output) const;
+        int WriteAnalogRelativeMulti(uint32_t channel_mask, const std::vector<double> &relative_values);
+        int WriteDigitalMulti(uint32_t channel_mask, uint32_t values);
+        unsigned int GetMaxSequenceLength() const;
+        int LoadAnalogSequence(unsigned int channel, const std::vector<double> &relative_values);
+        int LoadDigitalSequence(unsigned int channel, const std::vector<bool> &values);
+        int StartAnalogSequence(unsigned int channel);
+        int StopAnalogSequence(unsigned int channel);
+        int StartDigitalSequence(unsigned int channel);
+        int StopDigitalSequence(unsigned int channel);
+        unsigned int GetMaxWaveformEvents() const;
+        int LoadWaveform(const std::vector<WaveformEvent> &events);
+        int StartWaveform(uint32_t channel_mask, uint32_t period_us, unsigned int repetitions, bool on_trigger);
+        int StopWaveform();
+        int GetWaveformStatus(bool &running, uint32_t &periods);
+        int SetBlanking(uint32_t channel_mask, bool active_low);
+        int Ramp(unsigned int channel, double relative_value, uint32_t duration_us, bool exponential);
+        unsigned int GetNumberOfModulators() const;
+        int SetModulation(unsigned int output, double frequency_hz, double duty_cycle);
+        int LoadModulationSequence(unsigned int output, const std::vector<double> &frequencies_hz,
+                                   const std::vector<double> &duty_cycles);
+        int StartModulationSequence(unsigned int output);
+        int StopModulationSequence(unsigned int output);
+        unsigned int GetCalibrationSize() const;
+        int LoadCalibration(unsigned int channel, const std::vector<double> &relative_outputs);
+        unsigned int GetNumberOfMonitors() const;
+        int SetTelemetry(unsigned int sample_rate, unsigned int state_interval_ms);
+        uint64_t GetMonitorSampleCount() const;
+        size_t GetMonitorSamples(uint64_t &cursor, std::vector<MonitorSample> &samples);
+        int GetBoardState(BoardState &state);
+        int GetOutputState(OutputState &state);
+        void SetKeepOutputsOnClose(bool keep);
+        bool Busy();
+        int Flush();
+        int SetMaxPendingCommands(unsigned int count);
+        int SetLowLatency(bool low_latency);
+        std::string PopError();
+        void GetStatistics(BoardStatistics &stats);
+        void ResetStatistics();
+    private:
+        int Locate(unsigned int channel, size_t &board, unsigned int &local_channel) const;
+        int LocateModulator(unsigned int output, size_t &board, unsigned int &local_output) const;
+        uint32_t BoardMask(size_t board, uint32_t channel_mask) const;
+        int ForEachBoard(uint32_t board_mask, const std::function<int(size_t)> &command);
+        void AddError(const std::string &error);
+
+        std::vector<std::unique_ptr<InterfaceBoard>> boards_;
+        bool shared_trigger_;
+
+        // Set up when the boards are opened
+        std::vector<unsigned int> first_channels_; // First channel of every board
+        std::vector<unsigned int> channel_counts_; // Channels of every board that are used
+        unsigned int number_of_channels_ = 0;
+        uint32_t all_boards_ = 0;                  // Bit n set for board n
+
+        uint32_t waveform_boards_ = 0; // Boards that got events of the loaded waveform
+
+        std::mutex error_mutex_;
+        std::deque<std::string> errors_;
+};
+
+#endif // MULTIBOARD_H_
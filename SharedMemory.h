@@ -0,0 +1,262 @@
+/* SharedMemory.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Layout of the POSIX shared memory object through which the broker in tools/broker shares one
+// interface board with several local processes (Linux only). The broker creates the object, fills
+// in the board's info and the output state and publishes magic last. Clients then
+//
+// - push analog and digital writes to the command ring, a bounded lock-free queue with one
+//   sequence number per slot that any number of clients can write and the broker reads, and
+// - read the current outputs from the state table, which the broker updates under a sequence
+//   lock, and
+// - claim one of the client slots for all other calls: they write a request into the slot, set
+//   its state to SHARED_CLIENT_REQUEST and wait until the broker set it to SHARED_CLIENT_REPLY.
+//
+// After posting work, clients increment doorbell and wake the broker if it waits on it. Writes
+// and requests of a client are executed in the order they were made. All processes must use the
+// same build of this header.
+
+#ifndef SHARED_MEMORY_H_
+#define SHARED_MEMORY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Name of the shared memory object if none is given
+#define SHARED_MEMORY_DEFAULT_NAME "/ldd_broker"
+
+#define SHARED_MEMORY_MAGIC 0x4C444242 // "LDBB"
+#define SHARED_MEMORY_VERSION 2
+
+// Channels that can be addressed by the 32-bit channel masks
+#define SHARED_MAX_CHANNELS 32
+
+// Slots of the command ring, a power of two
+#define SHARED_RING_SIZE 256
+
+#define SHARED_MAX_CLIENTS 8
+
+// Largest request or reply in bytes, enough for a waveform of 1024 events
+#define SHARED_REQUEST_SIZE 32768
+
+// Time the broker busy-waits for more work before sleeping in us
+#define SHARED_SPIN_US 50
+
+// Time a client busy-waits for a reply before sleeping in us, longer than a round trip to the
+// board so that calls that wait for an acknowledgement do not pay for a wakeup
+#define SHARED_REPLY_SPIN_US 500
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "The shared memory needs lock-free atomics, which work across processes.");
+
+// Types of the writes in the command ring
+#define SHARED_WRITE_ANALOG 1
+#define SHARED_WRITE_DIGITAL 2
+
+// States of a client slot
+#define SHARED_CLIENT_FREE 0
+#define SHARED_CLIENT_IDLE 1
+#define SHARED_CLIENT_REQUEST 2
+#define SHARED_CLIENT_REPLY 3
+
+// Requests handled through the client slots. The payloads are the arguments of the
+// InterfaceBoard method of the same name in the order they are declared, copied as they are.
+#define SHARED_REQUEST_FLUSH 1
+#define SHARED_REQUEST_POP_ERROR 2
+#define SHARED_REQUEST_LOAD_ANALOG_SEQUENCE 3
+#define SHARED_REQUEST_LOAD_DIGITAL_SEQUENCE 4
+#define SHARED_REQUEST_START_ANALOG_SEQUENCE 5
+#define SHARED_REQUEST_STOP_ANALOG_SEQUENCE 6
+#define SHARED_REQUEST_START_DIGITAL_SEQUENCE 7
+#define SHARED_REQUEST_STOP_DIGITAL_SEQUENCE 8
+#define SHARED_REQUEST_LOAD_WAVEFORM 9
+#define SHARED_REQUEST_START_WAVEFORM 10
+#define SHARED_REQUEST_STOP_WAVEFORM 11
+#define SHARED_REQUEST_WAVEFORM_STATUS 12
+#define SHARED_REQUEST_SET_BLANKING 13
+#define SHARED_REQUEST_LOAD_CALIBRATION 14
+#define SHARED_REQUEST_SET_TELEMETRY 15
+#define SHARED_REQUEST_MONITOR_SAMPLES 16
+#define SHARED_REQUEST_BOARD_STATE 17
+#define SHARED_REQUEST_STATISTICS 18
+#define SHARED_REQUEST_RESET_STATISTICS 19
+#define SHARED_REQUEST_RAMP 20
+#define SHARED_REQUEST_SET_MODULATION 21
+#define SHARED_REQUEST_LOAD_MODULATION_SEQUENCE 22
+#define SHARED_REQUEST_START_MODULATION_SEQUENCE 23
+#define SHARED_REQUEST_STOP_MODULATION_SEQUENCE 24
+
+// A write in the command ring. sequence equals the slot's position while the slot is free and
+// position + 1 once a client filled it.
+struct SharedWrite {
+    std::atomic<uint64_t> sequence;
+    uint32_t type;
+    uint32_t channel_mask;
+    uint32_t digital_values;
+    double relative_values[SHARED_MAX_CHANNELS];
+};
+
+// The board as reported when the broker opened it
+struct SharedInfo {
+    uint32_t number_of_channels;
+    uint8_t dac_addresses[SHARED_MAX_CHANNELS];
+    uint8_t dac_outputs[SHARED_MAX_CHANNELS];
+    uint32_t max_sequence_length;
+    uint32_t max_waveform_events;
+    uint32_t calibration_size;
+    uint32_t number_of_monitors;
+    uint32_t number_of_modulators;
+};
+
+// Outputs as last set through the broker. sequence is odd while the broker updates the table;
+// readers retry if it was odd or changed while they read. Values are stored as the bits of a
+// double.
+struct SharedState {
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> enable_mask;
+    std::atomic<uint32_t> blanking_mask;
+    std::atomic<uint32_t> blanking_active_low;
+    std::atomic<uint64_t> relative_values[SHARED_MAX_CHANNELS];
+    std::atomic<uint64_t> monitor_sample_count;
+    std::atomic<uint32_t> busy;
+};
+
+struct SharedClient {
+    std::atomic<uint32_t> state; // SHARED_CLIENT_*, also waited on for the reply
+    std::atomic<int32_t> pid;    // Process that claimed the slot
+    uint64_t ring_position;      // The request waits until the ring was read up to here
+    uint32_t request;            // SHARED_REQUEST_*
+    int32_t result;              // Return value of the call
+    uint32_t size;               // Bytes in data, of the request and then of the reply
+    uint8_t data[SHARED_REQUEST_SIZE];
+};
+
+struct SharedMemory {
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+    int32_t broker_pid;
+    SharedInfo info;
+
+    alignas(64) std::atomic<uint32_t> doorbell;
+    std::atomic<uint32_t> broker_waiting;
+
+    alignas(64) SharedState state;
+
+    alignas(64) std::atomic<uint64_t> ring_head; // Next position a client writes to
+    alignas(64) std::atomic<uint64_t> ring_tail; // Next position the broker reads
+    SharedWrite ring[SHARED_RING_SIZE];
+
+    SharedClient clients[SHARED_MAX_CLIENTS];
+};
+
+inline uint64_t shared_double_bits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline double shared_bits_double(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Appends a value or count values with their count to the data of a client slot. Fails if the
+// data would not fit.
+template <typename T>
+bool shared_put(SharedClient &client, const T &value) {
+    static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be shared.");
+    if (client.size + sizeof(T) > SHARED_REQUEST_SIZE) return false;
+    memcpy(client.data + client.size, &value, sizeof(T));
+    client.size += sizeof(T);
+    return true;
+}
+
+template <typename T>
+bool shared_put_array(SharedClient &client, const T *values, uint32_t count) {
+    static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be shared.");
+    if (!shared_put(client, count) || client.size + (uint64_t)count * sizeof(T) > SHARED_REQUEST_SIZE) return false;
+    if (count > 0) memcpy(client.data + client.size, values, count * sizeof(T));
+    client.size += count * sizeof(T);
+    return true;
+}
+
+// Size of the data of a client slot as far as it lies within the slot. The other process may
+// write any size.
+inline uint32_t shared_size(const SharedClient &client) {
+    uint32_t size = client.size;
+    return size < SHARED_REQUEST_SIZE ? size : SHARED_REQUEST_SIZE;
+}
+
+// Reads what was put in the same order, starting at position 0. Fails at the end of the data and
+// for arrays of more than max_count values.
+template <typename T>
+bool shared_get(const SharedClient &client, uint32_t &position, T &value) {
+    static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be shared.");
+    if ((uint64_t)position + sizeof(T) > shared_size(client)) return false;
+    memcpy(&value, client.data + position, sizeof(T));
+    position += sizeof(T);
+    return true;
+}
+
+template <typename T, typename Vector>
+bool shared_get_array(const SharedClient &client, uint32_t &position, Vector &values, uint32_t max_count = UINT32_MAX) {
+    uint32_t count;
+    if (!shared_get(client, position, count) || count > max_count
+        || position + (uint64_t)count * sizeof(T) > shared_size(client)) {
+        return false;
+    }
+    values.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        T value;
+        shared_get(client, position, value);
+        values[i] = value;
+    }
+    return true;
+}
+
+// Waits until *word no longer holds expected, a wakeup or at most timeout_us. Not private to the
+// process, since the word lies in shared memory.
+inline void shared_wait(std::atomic<uint32_t> *word, uint32_t expected, unsigned int timeout_us) {
+    struct timespec timeout = {(time_t)(timeout_us / 1000000), (long)(timeout_us % 1000000) * 1000};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+inline void shared_wake(std::atomic<uint32_t> *word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, 0x7FFFFFFF, nullptr, nullptr, 0);
+}
+
+// Tells the broker that there is new work.
+inline void shared_ring_doorbell(SharedMemory *shm) {
+    shm->doorbell.fetch_add(1);
+    if (shm->broker_waiting.load()) shared_wake(&shm->doorbell);
+}
+
+#endif // SHARED_MEMORY_H_
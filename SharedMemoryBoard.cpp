@@ -0,0 +1,508 @@
+/* SharedMemoryBoard.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "SharedMemoryBoard.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+
+SharedMemoryBoard::SharedMemoryBoard(std::string name)
+    : name_(name), is_open_(false), info_(), written_position_(0) {}
+
+SharedMemoryBoard::~SharedMemoryBoard() {
+    if (client_ != nullptr) {
+        client_->pid = 0;
+        client_->state.store(SHARED_CLIENT_FREE, std::memory_order_release);
+    }
+    if (shm_ != nullptr) munmap(shm_, sizeof(SharedMemory));
+}
+
+int SharedMemoryBoard::Open() {
+    int fd = shm_open(name_.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        AddError("No broker was found at " + name_ + ": " + strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    void *memory = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SharedMemory)) {
+        memory = mmap(nullptr, sizeof(SharedMemory), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) {
+        AddError("The shared memory at " + name_ + " could not be mapped.");
+        return 1;
+    }
+    shm_ = static_cast<SharedMemory *>(memory);
+
+    if (shm_->magic.load(std::memory_order_acquire) != SHARED_MEMORY_MAGIC || !BrokerAlive()) {
+        AddError("The broker at " + name_ + " is not running.");
+        return 1;
+    }
+    if (shm_->version != SHARED_MEMORY_VERSION) {
+        AddError("The broker uses shared memory version " + std::to_string(shm_->version) + " but version "
+                 + std::to_string(SHARED_MEMORY_VERSION) + " is required.");
+        return 1;
+    }
+    info_ = shm_->info;
+
+    for (auto &client : shm_->clients) {
+        uint32_t expected = SHARED_CLIENT_FREE;
+        if (client.state.compare_exchange_strong(expected, SHARED_CLIENT_IDLE)) {
+            client.pid = getpid();
+            client_ = &client;
+            break;
+        }
+    }
+    if (client_ == nullptr) {
+        AddError("All " + std::to_string(SHARED_MAX_CLIENTS) + " client slots of the broker are in use.");
+        return 1;
+    }
+
+    is_open_ = true;
+    return 0;
+}
+
+bool SharedMemoryBoard::BrokerAlive() const {
+    return shm_->magic.load(std::memory_order_acquire) == SHARED_MEMORY_MAGIC
+           && (kill(shm_->broker_pid, 0) == 0 || errno == EPERM);
+}
+
+void SharedMemoryBoard::AddError(const std::string &error) {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    errors_.push_back(error);
+    if (errors_.size() > MAX_QUEUED_ERRORS) errors_.pop_front();
+}
+
+// Claims a slot of the command ring, fills it and publishes it. Waits while the ring is full.
+int SharedMemoryBoard::PushWrite(uint32_t type, uint32_t channel_mask, uint32_t digital_values,
+                                 const double *relative_values) {
+    if (!is_open_ || ((uint64_t)channel_mask >> info_.number_of_channels)) return 1;
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t position = shm_->ring_head.load(std::memory_order_relaxed);
+    SharedWrite *slot;
+    for (;;) {
+        slot = &shm_->ring[position % SHARED_RING_SIZE];
+        uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+        if (sequence == position) {
+            if (shm_->ring_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+        } else if (sequence < position) {
+            // The slot still holds a write from the previous round, so the broker is behind.
+            if (std::chrono::steady_clock::now() - start > std::chrono::milliseconds(SHARED_RING_TIMEOUT)
+                || !BrokerAlive()) {
+                AddError("The broker did not take any writes.");
+                return 1;
+            }
+            shared_ring_doorbell(shm_);
+            std::this_thread::yield();
+            position = shm_->ring_head.load(std::memory_order_relaxed);
+        } else {
+            position = shm_->ring_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->type = type;
+    slot->channel_mask = channel_mask;
+    slot->digital_values = digital_values;
+    if (relative_values != nullptr) {
+        for (unsigned int ch = 0; ch < info_.number_of_channels; ++ch) {
+            if (channel_mask & (1u << ch)) slot->relative_values[ch] = relative_values[ch];
+        }
+    }
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    uint64_t written = written_position_.load(std::memory_order_relaxed);
+    while (written < position + 1 && !written_position_.compare_exchange_weak(written, position + 1)) {}
+
+    shared_ring_doorbell(shm_);
+    return 0;
+}
+
+int SharedMemoryBoard::WriteAnalogRelative(unsigned int channel, double relative_value) {
+    if (channel >= info_.number_of_channels) return 1;
+    double values[SHARED_MAX_CHANNELS];
+    values[channel] = relative_value;
+    return PushWrite(SHARED_WRITE_ANALOG, 1u << channel, 0, values);
+}
+
+int SharedMemoryBoard::WriteDigital(unsigned int channel, bool value) {
+    if (channel >= info_.number_of_channels) return 1;
+    return PushWrite(SHARED_WRITE_DIGITAL, 1u << channel, value ? 1u << channel : 0, nullptr);
+}
+
+int SharedMemoryBoard::WriteAnalogRelativeMulti(uint32_t channel_mask, const std::vector<double> &relative_values) {
+    for (unsigned int ch = 0; (channel_mask >> ch) != 0; ++ch) {
+        if ((channel_mask & (1u << ch)) && ch >= relative_values.size()) return 1;
+    }
+    return PushWrite(SHARED_WRITE_ANALOG, channel_mask, 0, relative_values.data());
+}
+
+int SharedMemoryBoard::WriteDigitalMulti(uint32_t channel_mask, uint32_t values) {
+    return PushWrite(SHARED_WRITE_DIGITAL, channel_mask, values, nullptr);
+}
+
+bool SharedMemoryBoard::DeviceIsOpen() const {
+    return is_open_;
+}
+
+unsigned int SharedMemoryBoard::GetNumberOfChannels() const {
+    return info_.number_of_channels;
+}
+
+int SharedMemoryBoard::GetChannelOutput(unsigned int channel, uint8_t &dac_address, uint8_t &dac_output) const {
+    if (channel >= info_.number_of_channels) return 1;
+    dac_address = info_.dac_addresses[channel];
+    dac_output = info_.dac_outputs[channel];
+    return 0;
+}
+
+unsigned int SharedMemoryBoard::GetMaxSequenceLength() const {
+    return info_.max_sequence_length;
+}
+
+unsigned int SharedMemoryBoard::GetMaxWaveformEvents() const {
+    return info_.max_waveform_events;
+}
+
+unsigned int SharedMemoryBoard::GetCalibrationSize() const {
+    return info_.calibration_size;
+}
+
+unsigned int SharedMemoryBoard::GetNumberOfMonitors() const {
+    return info_.number_of_monitors;
+}
+
+unsigned int SharedMemoryBoard::GetNumberOfModulators() const {
+    return info_.number_of_modulators;
+}
+
+uint64_t SharedMemoryBoard::GetMonitorSampleCount() const {
+    return shm_ == nullptr ? 0 : shm_->state.monitor_sample_count.load(std::memory_order_acquire);
+}
+
+// Reads the state table without blocking the broker.
+int SharedMemoryBoard::GetOutputState(OutputState &state) {
+    if (!is_open_) return 1;
+    const SharedState &shared = shm_->state;
+    state.relative_values.resize(info_.number_of_channels);
+    for (;;) {
+        uint32_t sequence = shared.sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        state.enable_mask = shared.enable_mask.load(std::memory_order_relaxed);
+        state.blanking_mask = shared.blanking_mask.load(std::memory_order_relaxed);
+        state.blanking_active_low = shared.blanking_active_low.load(std::memory_order_relaxed) != 0;
+        for (unsigned int ch = 0; ch < info_.number_of_channels; ++ch) {
+            state.relative_values[ch] = shared_bits_double(shared.relative_values[ch].load(std::memory_order_relaxed));
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shared.sequence.load(std::memory_order_relaxed) == sequence) return 0;
+    }
+}
+
+void SharedMemoryBoard::SetKeepOutputsOnClose(bool keep) {
+    (void)keep;
+}
+
+int SharedMemoryBoard::SetMaxPendingCommands(unsigned int count) {
+    (void)count;
+    return 0;
+}
+
+int SharedMemoryBoard::SetLowLatency(bool low_latency) {
+    (void)low_latency;
+    return 0;
+}
+
+// Writes of this process that the broker has not taken yet, or commands the board has not
+// acknowledged yet
+bool SharedMemoryBoard::Busy() {
+    if (!is_open_) return false;
+    return shm_->ring_tail.load(std::memory_order_acquire) < written_position_.load()
+           || shm_->state.busy.load(std::memory_order_acquire) != 0;
+}
+
+// Starts a request in the client slot. Must be called while holding request_mutex_.
+bool SharedMemoryBoard::BeginRequest(uint32_t request) {
+    if (!is_open_) return false;
+    client_->request = request;
+    client_->size = 0;
+    return true;
+}
+
+// Hands the request to the broker and waits for the reply. Must be called while holding
+// request_mutex_.
+int SharedMemoryBoard::Call() {
+    client_->ring_position = written_position_.load();
+    client_->state.store(SHARED_CLIENT_REQUEST, std::memory_order_release);
+    shared_ring_doorbell(shm_);
+
+    auto start = std::chrono::steady_clock::now();
+    while (client_->state.load(std::memory_order_acquire) != SHARED_CLIENT_REPLY) {
+        if (std::chrono::steady_clock::now() - start < std::chrono::microseconds(SHARED_REPLY_SPIN_US)) {
+            std::this_thread::yield();
+            continue;
+        }
+        shared_wait(&client_->state, SHARED_CLIENT_REQUEST, 100000);
+        if (client_->state.load(std::memory_order_acquire) != SHARED_CLIENT_REPLY && !BrokerAlive()) {
+            AddError("The broker at " + name_ + " stopped.");
+            is_open_ = false;
+            return 1;
+        }
+    }
+    client_->state.store(SHARED_CLIENT_IDLE, std::memory_order_relaxed);
+    return client_->result;
+}
+
+int SharedMemoryBoard::RequestTooLarge() {
+    AddError("The request is too large for the shared memory.");
+    return 1;
+}
+
+int SharedMemoryBoard::ChannelRequest(uint32_t request, unsigned int channel) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(request)) return 1;
+    shared_put(*client_, (uint32_t)channel);
+    return Call();
+}
+
+int SharedMemoryBoard::Flush() {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_FLUSH)) return 1;
+    return Call();
+}
+
+// Own errors first, then those of the board
+std::string SharedMemoryBoard::PopError() {
+    {
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (!errors_.empty()) {
+            std::string error = errors_.front();
+            errors_.pop_front();
+            return error;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_POP_ERROR) || Call() != 0) return "";
+    return std::string(reinterpret_cast<const char *>(client_->data), shared_size(*client_));
+}
+
+int SharedMemoryBoard::LoadAnalogSequence(unsigned int channel, const std::vector<double> &relative_values) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_LOAD_ANALOG_SEQUENCE)) return 1;
+    if (!shared_put(*client_, (uint32_t)channel)
+        || !shared_put_array(*client_, relative_values.data(), (uint32_t)relative_values.size())) {
+        return RequestTooLarge();
+    }
+    return Call();
+}
+
+int SharedMemoryBoard::LoadDigitalSequence(unsigned int channel, const std::vector<bool> &values) {
+    std::vector<uint8_t> bytes(values.begin(), values.end());
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_LOAD_DIGITAL_SEQUENCE)) return 1;
+    if (!shared_put(*client_, (uint32_t)channel) || !shared_put_array(*client_, bytes.data(), (uint32_t)bytes.size())) {
+        return RequestTooLarge();
+    }
+    return Call();
+}
+
+int SharedMemoryBoard::StartAnalogSequence(unsigned int channel) {
+    return ChannelRequest(SHARED_REQUEST_START_ANALOG_SEQUENCE, channel);
+}
+
+int SharedMemoryBoard::StopAnalogSequence(unsigned int channel) {
+    return ChannelRequest(SHARED_REQUEST_STOP_ANALOG_SEQUENCE, channel);
+}
+
+int SharedMemoryBoard::StartDigitalSequence(unsigned int channel) {
+    return ChannelRequest(SHARED_REQUEST_START_DIGITAL_SEQUENCE, channel);
+}
+
+int SharedMemoryBoard::StopDigitalSequence(unsigned int channel) {
+    return ChannelRequest(SHARED_REQUEST_STOP_DIGITAL_SEQUENCE, channel);
+}
+
+int SharedMemoryBoard::LoadWaveform(const std::vector<WaveformEvent> &events) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_LOAD_WAVEFORM)) return 1;
+    if (!shared_put_array(*client_, events.data(), (uint32_t)events.size())) return RequestTooLarge();
+    return Call();
+}
+
+int SharedMemoryBoard::StartWaveform(uint32_t channel_mask, uint32_t period_us, unsigned int repetitions,
+                                     bool on_trigger) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_START_WAVEFORM)) return 1;
+    shared_put(*client_, channel_mask);
+    shared_put(*client_, period_us);
+    shared_put(*client_, (uint32_t)repetitions);
+    shared_put(*client_, (uint8_t)on_trigger);
+    return Call();
+}
+
+int SharedMemoryBoard::StopWaveform() {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_STOP_WAVEFORM)) return 1;
+    return Call();
+}
+
+int SharedMemoryBoard::GetWaveformStatus(bool &running, uint32_t &periods) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_WAVEFORM_STATUS) || Call() != 0) return 1;
+    uint32_t position = 0;
+    uint8_t is_running;
+    if (!shared_get(*client_, position, is_running) || !shared_get(*client_, position, periods)) return 1;
+    running = is_running != 0;
+    return 0;
+}
+
+int SharedMemoryBoard::SetBlanking(uint32_t channel_mask, bool active_low) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_SET_BLANKING)) return 1;
+    shared_put(*client_, channel_mask);
+    shared_put(*client_, (uint8_t)active_low);
+    return Call();
+}
+
+int SharedMemoryBoard::Ramp(unsigned int channel, double relative_value, uint32_t duration_us, bool exponential) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_RAMP)) return 1;
+    shared_put(*client_, (uint32_t)channel);
+    shared_put(*client_, relative_value);
+    shared_put(*client_, duration_us);
+    shared_put(*client_, (uint8_t)exponential);
+    return Call();
+}
+
+int SharedMemoryBoard::SetModulation(unsigned int output, double frequency_hz, double duty_cycle) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_SET_MODULATION)) return 1;
+    shared_put(*client_, (uint32_t)output);
+    shared_put(*client_, frequency_hz);
+    shared_put(*client_, duty_cycle);
+    return Call();
+}
+
+int SharedMemoryBoard::LoadModulationSequence(unsigned int output, const std::vector<double> &frequencies_hz,
+                                              const std::vector<double> &duty_cycles) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_LOAD_MODULATION_SEQUENCE)) return 1;
+    if (!shared_put(*client_, (uint32_t)output)
+        || !shared_put_array(*client_, frequencies_hz.data(), (uint32_t)frequencies_hz.size())
+        || !shared_put_array(*client_, duty_cycles.data(), (uint32_t)duty_cycles.size())) {
+        return RequestTooLarge();
+    }
+    return Call();
+}
+
+int SharedMemoryBoard::StartModulationSequence(unsigned int output) {
+    return ChannelRequest(SHARED_REQUEST_START_MODULATION_SEQUENCE, output);
+}
+
+int SharedMemoryBoard::StopModulationSequence(unsigned int output) {
+    return ChannelRequest(SHARED_REQUEST_STOP_MODULATION_SEQUENCE, output);
+}
+
+int SharedMemoryBoard::LoadCalibration(unsigned int channel, const std::vector<double> &relative_outputs) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_LOAD_CALIBRATION)) return 1;
+    if (!shared_put(*client_, (uint32_t)channel)
+        || !shared_put_array(*client_, relative_outputs.data(), (uint32_t)relative_outputs.size())) {
+        return RequestTooLarge();
+    }
+    return Call();
+}
+
+int SharedMemoryBoard::SetTelemetry(unsigned int sample_rate, unsigned int state_interval_ms) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_SET_TELEMETRY)) return 1;
+    shared_put(*client_, (uint32_t)sample_rate);
+    shared_put(*client_, (uint32_t)state_interval_ms);
+    return Call();
+}
+
+// A reply holds as many samples as fit into the client slot, so larger backlogs take several
+// requests.
+size_t SharedMemoryBoard::GetMonitorSamples(uint64_t &cursor, std::vector<MonitorSample> &samples) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    uint64_t lost = 0;
+    for (;;) {
+        if (!BeginRequest(SHARED_REQUEST_MONITOR_SAMPLES)) return lost;
+        shared_put(*client_, cursor);
+        if (Call() != 0) return lost;
+
+        uint32_t position = 0;
+        uint64_t reply_lost, reply_cursor;
+        uint8_t more;
+        std::vector<MonitorSample> reply_samples;
+        if (!shared_get(*client_, position, reply_lost) || !shared_get(*client_, position, reply_cursor)
+            || !shared_get(*client_, position, more)
+            || !shared_get_array<MonitorSample>(*client_, position, reply_samples)) {
+            return lost;
+        }
+        lost += reply_lost;
+        cursor = reply_cursor;
+        samples.insert(samples.end(), reply_samples.begin(), reply_samples.end());
+        if (!more) return lost;
+    }
+}
+
+int SharedMemoryBoard::GetBoardState(BoardState &state) {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_BOARD_STATE) || Call() != 0) return 1;
+    uint32_t position = 0;
+    uint32_t pwm_duty, pwm_top;
+    if (!shared_get(*client_, position, state.board_time_us) || !shared_get(*client_, position, state.enable_mask)
+        || !shared_get(*client_, position, state.level_mask) || !shared_get(*client_, position, pwm_duty)
+        || !shared_get(*client_, position, pwm_top)
+        || !shared_get_array<double>(*client_, position, state.relative_outputs)) {
+        return 1;
+    }
+    state.pwm_duty = pwm_duty;
+    state.pwm_top = pwm_top;
+    return 0;
+}
+
+void SharedMemoryBoard::GetStatistics(BoardStatistics &stats) {
+    stats = BoardStatistics();
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (!BeginRequest(SHARED_REQUEST_STATISTICS) || Call() != 0) return;
+    uint32_t position = 0;
+    shared_get(*client_, position, stats);
+}
+
+void SharedMemoryBoard::ResetStatistics() {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (BeginRequest(SHARED_REQUEST_RESET_STATISTICS)) Call();
+}
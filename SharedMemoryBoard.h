@@ -0,0 +1,117 @@
+/* SharedMemoryBoard.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SHARED_MEMORY_BOARD_H_
+#define SHARED_MEMORY_BOARD_H_
+
+#include "InterfaceBoard.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "SharedMemory.h"
+
+// Time a full command ring may take to drain before a write fails in ms
+#define SHARED_RING_TIMEOUT 1000
+
+// Interface board shared by the broker in tools/broker, see SharedMemory.h. Writes are pushed to
+// the broker without waiting for it, and the outputs are read from the state table; all other
+// calls wait for the broker to execute them on the board. The connection settings and whether
+// the outputs are kept on close are those the broker was started with, so SetMaxPendingCommands(),
+// SetLowLatency() and SetKeepOutputsOnClose() have no effect. Errors of the board are reported to
+// the client that asks for them first.
+class SharedMemoryBoard : public InterfaceBoard {
+    public:
+        SharedMemoryBoard(std::string name);
+        ~SharedMemoryBoard();
+        int Open();
+        int WriteAnalogRelative(unsigned int channel, double relative_value);
+        int WriteDigital(unsigned int channel, bool value);
+        bool DeviceIsOpen() const;
+        unsigned int GetNumberOfChannels() const;
+        int GetChannelOutput(unsigned int channel, uint8_t &dac_address, uint8_t &dac_output) const;
+        int WriteAnalogRelativeMulti(uint32_t channel_mask, const std::vector<double> &relative_values);
+        int WriteDigitalMulti(uint32_t channel_mask, uint32_t values);
+        unsigned int GetMaxSequenceLength() const;
+        int LoadAnalogSequence(unsigned int channel, const std::vector<double> &relative_values);
+        int LoadDigitalSequence(unsigned int channel, const std::vector<bool> &values);
+        int StartAnalogSequence(unsigned int channel);
+        int StopAnalogSequence(unsigned int channel);
+        int StartDigitalSequence(unsigned int channel);
+        int StopDigitalSequence(unsigned int channel);
+        unsigned int GetMaxWaveformEvents() const;
+        int LoadWaveform(const std::vector<WaveformEvent> &events);
+        int StartWaveform(uint32_t channel_mask, uint32_t period_us, unsigned int repetitions, bool on_trigger);
+        int StopWaveform();
+        int GetWaveformStatus(bool &running, uint32_t &periods);
+        int SetBlanking(uint32_t channel_mask, bool active_low);
+        int Ramp(unsigned int channel, double relative_value, uint32_t duration_us, bool exponential);
+        unsigned int GetNumberOfModulators() const;
+        int SetModulation(unsigned int output, double frequency_hz, double duty_cycle);
+        int LoadModulationSequence(unsigned int output, const std::vector<double> &frequencies_hz,
+                                   const std::vector<double> &duty_cycles);
+        int StartModulationSequence(unsigned int output);
+        int StopModulationSequence(unsigned int output);
+        unsigned int GetCalibrationSize() const;
+        int LoadCalibration(unsigned int channel, const std::vector<double> &relative_outputs);
+        unsigned int GetNumberOfMonitors() const;
+        int SetTelemetry(unsigned int sample_rate, unsigned int state_interval_ms);
+        uint64_t GetMonitorSampleCount() const;
+        size_t GetMonitorSamples(uint64_t &cursor, std::vector<MonitorSample> &samples);
+        int GetBoardState(BoardState &state);
+        int GetOutputState(OutputState &state);
+        void SetKeepOutputsOnClose(bool keep);
+        bool Busy();
+        int Flush();
+        int SetMaxPendingCommands(unsigned int count);
+        int SetLowLatency(bool low_latency);
+        std::string PopError();
+        void GetStatistics(BoardStatistics &stats);
+        void ResetStatistics();
+    private:
+        int PushWrite(uint32_t type, uint32_t channel_mask, uint32_t digital_values, const double *relative_values);
+        bool BeginRequest(uint32_t request);
+        int Call();
+        int RequestTooLarge();
+        int ChannelRequest(uint32_t request, unsigned int channel);
+        bool BrokerAlive() const;
+        void AddError(const std::string &error);
+
+        std::string name_; // Name of the shared memory object
+        SharedMemory *shm_ = nullptr;
+        SharedClient *client_ = nullptr; // Slot claimed for requests
+        std::atomic<bool> is_open_;
+        SharedInfo info_;
+
+        // Ring position after the newest write of this process; requests wait for it
+        std::atomic<uint64_t> written_position_;
+
+        std::mutex request_mutex_; // Held while the client slot is in use
+
+        std::mutex error_mutex_;
+        std::deque<std::string> errors_;
+};
+
+#endif // SHARED_MEMORY_BOARD_H_
@@ -0,0 +1,120 @@
+/* Statistics.h
+ *
+ * Copyright (C) 2020, 2021 John Wigg
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef STATISTICS_H_
+#define STATISTICS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Histogram of durations in microseconds. Recording is lock-free and may happen concurrently
+// with reading. Durations below 8 us are counted exactly; above that every power of two is split
+// into 8 buckets, so reported percentiles are within 12.5 % of the recorded values.
+class LatencyHistogram {
+    public:
+        LatencyHistogram() { Reset(); }
+
+        void Record(uint64_t us) {
+            counts_[Bucket(us)].fetch_add(1, std::memory_order_relaxed);
+            count_.fetch_add(1, std::memory_order_relaxed);
+            uint64_t max = max_.load(std::memory_order_relaxed);
+            while (us > max && !max_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {}
+        }
+
+        // Returns the upper bound of the bucket holding the given quantile (0 to 1), or 0 if
+        // nothing was recorded.
+        uint64_t Percentile(double quantile) const {
+            uint64_t count = count_.load(std::memory_order_relaxed);
+            if (count == 0) return 0;
+            uint64_t rank = (uint64_t)(quantile * (count - 1)) + 1;
+            uint64_t seen = 0;
+            for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+                seen += counts_[bucket].load(std::memory_order_relaxed);
+                if (seen >= rank) {
+                    uint64_t upper = UpperBound(bucket);
+                    uint64_t max = Max();
+                    return upper < max ? upper : max;
+                }
+            }
+            return Max();
+        }
+
+        uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+        uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+
+        void Reset() {
+            for (auto &count : counts_) count.store(0, std::memory_order_relaxed);
+            count_.store(0, std::memory_order_relaxed);
+            max_.store(0, std::memory_order_relaxed);
+        }
+
+    private:
+        static const size_t SUB_BUCKETS = 8;
+        static const size_t BUCKETS = SUB_BUCKETS * 40; // Up to about 2^40 us
+
+        static size_t Bucket(uint64_t us) {
+            if (us < SUB_BUCKETS) return (size_t)us;
+            size_t shift = 0;
+            while (us >= 2 * SUB_BUCKETS) {
+                us >>= 1;
+                ++shift;
+            }
+            size_t bucket = SUB_BUCKETS * (shift + 1) + (size_t)(us - SUB_BUCKETS);
+            return bucket < BUCKETS ? bucket : BUCKETS - 1;
+        }
+
+        static uint64_t UpperBound(size_t bucket) {
+            if (bucket < SUB_BUCKETS) return bucket;
+            size_t shift = bucket / SUB_BUCKETS - 1;
+            uint64_t lower = (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+            return lower + ((uint64_t)1 << shift) - 1;
+        }
+
+        std::atomic<uint64_t> counts_[BUCKETS];
+        std::atomic<uint64_t> count_;
+        std::atomic<uint64_t> max_;
+};
+
+// Counters of an interface board since the last reset. Latencies are measured from the write
+// call to the time the command was written to the device (send) and to its acknowledgement,
+// i.e. until the outputs have changed (write).
+struct BoardStatistics {
+    uint64_t write_latency_p50_us = 0;
+    uint64_t write_latency_p99_us = 0;
+    uint64_t write_latency_max_us = 0;
+    uint64_t send_latency_p50_us = 0;
+    uint64_t send_latency_p99_us = 0;
+    uint64_t commands = 0;    // Acknowledged commands
+    uint64_t bytes_sent = 0;
+    uint64_t queue_depth = 0; // Queued channels and unacknowledged commands
+    uint64_t errors = 0;
+    uint64_t resyncs = 0;     // Corrupted frames and lost acknowledgements the protocol recovered from
+
+    // Reported by the board, if supported: commands it can execute per second of processing
+    // time and the highest fill level of its receive buffer in bytes
+    uint64_t board_commands_per_second = 0;
+    uint64_t board_buffer_peak = 0;
+};
+
+#endif // STATISTICS_H_
@@ -0,0 +1,208 @@
+/* TcpLink.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "TcpLink.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void ThrowError(const std::string &what, int error) {
+    throw serial::SerialException((what + ": " + strerror(error)).c_str());
+}
+
+TcpLink::TcpLink() {}
+
+TcpLink::~TcpLink() {
+    close();
+}
+
+void TcpLink::setPort(const std::string &port) {
+    host_ = port;
+    service_ = TCP_DEFAULT_PORT;
+    size_t colon = port.rfind(':');
+    size_t bracket = port.rfind(']');
+    bool bracketed = !port.empty() && port[0] == '[' && bracket != std::string::npos;
+    if (colon != std::string::npos && (bracketed ? colon > bracket : port.find(':') == colon)) {
+        host_ = port.substr(0, colon);
+        service_ = port.substr(colon + 1);
+    }
+    if (bracketed) host_ = host_.substr(1, host_.rfind(']') - 1);
+}
+
+void TcpLink::setTimeout(uint32_t timeout_ms) {
+    timeout_ms_ = timeout_ms;
+}
+
+// TCP has no waits to skip, so both modes behave the same.
+void TcpLink::setLowLatency(bool low_latency) {
+    (void)low_latency;
+}
+
+// Tries all addresses of the host, each for at most TCP_CONNECT_TIMEOUT.
+void TcpLink::open() {
+    close();
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    int ret = getaddrinfo(host_.c_str(), service_.c_str(), &hints, &addresses);
+    if (ret != 0) throw serial::SerialException((host_ + ": " + gai_strerror(ret)).c_str());
+
+    int error = ECONNREFUSED;
+    for (addrinfo *address = addresses; address != nullptr && fd_ == -1; address = address->ai_next) {
+        int fd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            error = errno;
+            continue;
+        }
+        if (connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            error = errno;
+            if (error == EINPROGRESS) {
+                pollfd pfd = {fd, POLLOUT, 0};
+                socklen_t length = sizeof(error);
+                if (poll(&pfd, 1, TCP_CONNECT_TIMEOUT) != 1) error = ETIMEDOUT;
+                else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0) error = errno;
+            }
+            if (error != 0) {
+                ::close(fd);
+                continue;
+            }
+        }
+        fd_ = fd;
+    }
+    freeaddrinfo(addresses);
+    if (fd_ == -1) ThrowError(host_ + ":" + service_, error);
+
+    int on = 1;
+    int idle_s = 1, interval_s = 1, probes = TCP_DEAD_TIMEOUT / 1000;
+    unsigned int user_timeout = TCP_DEAD_TIMEOUT;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd_, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd_, IPPROTO_TCP, TCP_KEEPIDLE, &idle_s, sizeof(idle_s));
+    setsockopt(fd_, IPPROTO_TCP, TCP_KEEPINTVL, &interval_s, sizeof(interval_s));
+    setsockopt(fd_, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    setsockopt(fd_, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+}
+
+void TcpLink::close() {
+    if (fd_ != -1) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool TcpLink::isOpen() const {
+    return fd_ != -1;
+}
+
+void TcpLink::flushInput() {
+    if (fd_ == -1) return;
+    uint8_t buffer[256];
+    while (recv(fd_, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+}
+
+size_t TcpLink::available() {
+    if (fd_ == -1) return 0;
+    int count = 0;
+    if (ioctl(fd_, FIONREAD, &count) == -1) ThrowError("ioctl", errno);
+    return (size_t)count;
+}
+
+// Returns what has arrived once data is there, like a serial port that times out between bytes.
+size_t TcpLink::read(uint8_t *buffer, size_t size) {
+    if (fd_ == -1) throw serial::PortNotOpenedException("TcpLink::read");
+    if (!waitReadable()) return 0;
+    ssize_t count = recv(fd_, buffer, size, MSG_DONTWAIT);
+    if (count == 0) throw serial::SerialException("The server closed the connection.");
+    if (count < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        ThrowError("recv", errno);
+    }
+    return (size_t)count;
+}
+
+// Sends all buffers with a single call unless the socket buffer is full.
+void TcpLink::writeGather(const serial::WriteBuffer *buffers, size_t count) {
+    if (fd_ == -1) throw serial::PortNotOpenedException("TcpLink::writeGather");
+    iovec iov[16];
+    if (count > sizeof(iov) / sizeof(iov[0])) throw serial::SerialException("Too many buffers.");
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        iov[i].iov_base = const_cast<uint8_t *>(buffers[i].data);
+        iov[i].iov_len = buffers[i].size;
+        total += buffers[i].size;
+    }
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    while (total > 0) {
+        ssize_t sent = sendmsg(fd_, &message, MSG_NOSIGNAL); // A closed connection must not raise SIGPIPE
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) ThrowError("send", errno);
+            pollfd pfd = {fd_, POLLOUT, 0};
+            if (poll(&pfd, 1, TCP_DEAD_TIMEOUT) != 1) ThrowError("send", ETIMEDOUT);
+            continue;
+        }
+        total -= sent;
+        while (sent > 0 && message.msg_iovlen > 0) {
+            size_t part = std::min((size_t)sent, message.msg_iov->iov_len);
+            message.msg_iov->iov_base = static_cast<uint8_t *>(message.msg_iov->iov_base) + part;
+            message.msg_iov->iov_len -= part;
+            sent -= part;
+            if (message.msg_iov->iov_len == 0) {
+                ++message.msg_iov;
+                --message.msg_iovlen;
+            }
+        }
+    }
+}
+
+// A connection closed by the server stays readable without ever returning data, so it is
+// reported as an error once everything it sent was read.
+bool TcpLink::waitReadable() {
+    if (fd_ == -1) throw serial::PortNotOpenedException("TcpLink::waitReadable");
+    pollfd pfd = {fd_, POLLIN | POLLRDHUP, 0};
+    int ret = poll(&pfd, 1, (int)timeout_ms_);
+    if (ret < 0) {
+        if (errno == EINTR) return false;
+        ThrowError("poll", errno);
+    }
+    if (ret == 0) return false;
+    if ((pfd.revents & (POLLERR | POLLHUP | POLLRDHUP)) && available() == 0) {
+        throw serial::SerialException("The server closed the connection.");
+    }
+    return true;
+}
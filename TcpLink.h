@@ -0,0 +1,65 @@
+/* TcpLink.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TCP_LINK_H_
+#define TCP_LINK_H_
+
+#include "Link.h"
+
+// Port of the server in tools/server if the address does not name one
+#define TCP_DEFAULT_PORT "7265"
+
+// Time a connection attempt may take in ms
+#define TCP_CONNECT_TIMEOUT 1000
+
+// Time after which a connection whose peer stopped answering is dropped in ms. Keepalive probes
+// detect it while idle, unacknowledged data while sending.
+#define TCP_DEAD_TIMEOUT 3000
+
+// Connection to the server in tools/server, which passes the bytes on to the board's serial port
+// (Linux only). The address is "host" or "host:port"; IPv6 addresses with a port are written as
+// "[address]:port". Nagle's algorithm is off, so every frame is sent right away and commands are
+// pipelined like on the serial port.
+class TcpLink : public Link {
+    public:
+        TcpLink();
+        ~TcpLink();
+        void setPort(const std::string &port);
+        void setTimeout(uint32_t timeout_ms);
+        void setLowLatency(bool low_latency);
+        void open();
+        void close();
+        bool isOpen() const;
+        void flushInput();
+        size_t available();
+        size_t read(uint8_t *buffer, size_t size);
+        void writeGather(const serial::WriteBuffer *buffers, size_t count);
+        bool waitReadable();
+    private:
+        std::string host_;
+        std::string service_;
+        int fd_ = -1;
+        uint32_t timeout_ms_ = 0;
+};
+
+#endif // TCP_LINK_H_
@@ -0,0 +1,160 @@
+/* Framing.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Framing of the serial protocol, shared by the Arduino program and the device adapter.
+//
+// A frame is the COBS encoding of the message followed by its CRC-16/CCITT-FALSE (low byte
+// first), terminated by a single zero byte. COBS removes all zero bytes from the encoded data,
+// so the delimiter can never appear inside a frame and the receiver resynchronizes at the next
+// zero byte after corrupted or truncated data.
+
+#ifndef FRAMING_H_
+#define FRAMING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_DELIMITER 0x00
+
+// Largest message (code, sequence number and payload) that fits into a frame
+#define FRAME_MAX_MESSAGE 250
+
+// Size of a frame carrying a message of the given length, including CRC, COBS overhead and
+// delimiter
+#define FRAME_ENCODED_SIZE(length) ((length) + 2 + ((length) + 2) / 254 + 1 + 1)
+
+// Largest frame
+#define FRAME_MAX_ENCODED FRAME_ENCODED_SIZE(FRAME_MAX_MESSAGE)
+
+inline uint16_t frame_crc16(const uint8_t *data, size_t length) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; ++i) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+// Encodes a message into out, which must hold FRAME_ENCODED_SIZE(length) bytes. Returns the
+// number of bytes written including the delimiter.
+inline size_t frame_encode(const uint8_t *message, size_t length, uint8_t *out) {
+    uint16_t crc = frame_crc16(message, length);
+    size_t total = length + 2;
+
+    size_t code_pos = 0; // Position of the current COBS code byte
+    size_t out_pos = 1;
+    uint8_t code = 1;
+
+    for (size_t i = 0; i < total; ++i) {
+        uint8_t byte;
+        if (i < length) byte = message[i];
+        else if (i == length) byte = (uint8_t)crc;
+        else byte = (uint8_t)(crc >> 8);
+
+        if (byte == 0) {
+            out[code_pos] = code;
+            code_pos = out_pos++;
+            code = 1;
+        } else {
+            out[out_pos++] = byte;
+            if (++code == 0xFF) {
+                out[code_pos] = code;
+                code_pos = out_pos++;
+                code = 1;
+            }
+        }
+    }
+    out[code_pos] = code;
+    out[out_pos++] = FRAME_DELIMITER;
+    return out_pos;
+}
+
+// Incremental decoder for frames that arrive byte by byte. Each received byte is passed to
+// frame_decoder_push(), which decodes it right away so no frame buffer is needed.
+struct FrameDecoder {
+    uint8_t message[FRAME_MAX_MESSAGE + 2]; // Decoded message followed by its CRC
+    size_t length;                          // Number of decoded bytes
+    uint8_t remaining;                      // Data bytes left in the current COBS block
+    bool zero_pending;                      // The current block is followed by a zero
+    bool started;                           // Bytes were received since the last delimiter
+    bool error;                             // Discard everything up to the next delimiter
+};
+
+// Results of frame_decoder_push() besides the length of a complete message
+#define FRAME_INCOMPLETE (-2)
+#define FRAME_INVALID (-1)
+
+inline void frame_decoder_reset(FrameDecoder *decoder) {
+    decoder->length = 0;
+    decoder->remaining = 0;
+    decoder->zero_pending = false;
+    decoder->started = false;
+    decoder->error = false;
+}
+
+// Feeds one received byte to the decoder. Returns the length of the message in
+// decoder->message when the byte completed a valid frame, FRAME_INVALID when it completed a
+// malformed or corrupted frame and FRAME_INCOMPLETE otherwise. Delimiters without a frame in
+// between are ignored.
+inline int frame_decoder_push(FrameDecoder *decoder, uint8_t byte) {
+    if (byte == FRAME_DELIMITER) {
+        int result = FRAME_INCOMPLETE;
+        if (decoder->started) {
+            result = FRAME_INVALID;
+            if (!decoder->error && decoder->remaining == 0 && decoder->length >= 2) {
+                size_t message_length = decoder->length - 2;
+                uint16_t crc = decoder->message[message_length] | (decoder->message[message_length + 1] << 8);
+                if (crc == frame_crc16(decoder->message, message_length)) result = (int)message_length;
+            }
+        }
+        frame_decoder_reset(decoder);
+        return result;
+    }
+
+    decoder->started = true;
+    if (decoder->error) return FRAME_INCOMPLETE;
+
+    if (decoder->remaining == 0) { // COBS code byte
+        if (decoder->zero_pending) {
+            if (decoder->length >= sizeof(decoder->message)) {
+                decoder->error = true;
+                return FRAME_INCOMPLETE;
+            }
+            decoder->message[decoder->length++] = 0;
+        }
+        decoder->zero_pending = byte != 0xFF;
+        decoder->remaining = byte - 1;
+    } else {
+        if (decoder->length >= sizeof(decoder->message)) {
+            decoder->error = true;
+            return FRAME_INCOMPLETE;
+        }
+        decoder->message[decoder->length++] = byte;
+        decoder->remaining--;
+    }
+    return FRAME_INCOMPLETE;
+}
+
+#endif // FRAMING_H_
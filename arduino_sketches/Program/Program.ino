@@ -24,167 +24,1222 @@
 #include <Arduino.h>
 #include <Adafruit_MCP4728.h>
 #include <SPI.h>
+#include <Wire.h>
 
-#define BAUD 115200
+#include "Framing.h"
+#include "Protocol.h"
 
-// Codes for communication via Serial
-#define CODE_OPEN 0x00
-#define CODE_CLOSE 0x01
-#define CODE_WRITE_ANALOG 0x02
-#define CODE_WRITE_DIGITAL 0x03
-#define CODE_SET_PWM 0x04
-#define CODE_END_SEQUENCE 0x0A
+// MCP4728s are searched at all eight addresses at startup and assigned to the channels in the
+// order of their addresses.
+#define ADDR_MCP_FIRST 0x60
+#define MAX_DACS 8
+#define CHANNELS_PER_DAC 3 // Needs to be changed according to #channels per DAC
 
-// Adresses of MCPs
-#define ADDR_MCP_1 0x60
-#define ADDR_MCP_2 0x61
+// I2C clock. 400 kHz (Fast mode) is the fastest clock the nRF52840 supports.
+#define I2C_CLOCK 400000
 
-// MCP4728 is 12-bit
-#define MAX_VALUE 4095
+// Optional pin wired to the LDAC inputs of the MCP4728s. It is held high while a multi-write is
+// transferred and pulsed low afterwards so that all outputs change at once. Boards without the
+// connection are not affected.
+#define LDAC_PIN 2
 
-// Buffer size for receiving data
-#define BUFFER_SIZE 64
 
-// D0 and D1 are used for Serial comms, D2 is used to adress the second MCP4728 board, D3 is used
-// as a pulse generator output for the fast laser switching. Block D4-D9 refers to Enable Laser 1 - 6.
-// D11 Mosi, D12 Miso, D13 clock, chip select: 405nm = d10, 488nm = a6, 640nm = a7.
-#define DIGITAL_PIN_OFFSET 4
+// Size of the receive ring buffer, a power of two. Received bytes are moved from the USB buffer
+// in large chunks before and after every command, so the host can keep sending while slow I2C
+// transfers are in progress. When the ring is full, bytes stay in the USB buffer and USB flow
+// control holds off the host; nothing is ever dropped.
+#define RX_RING_SIZE 4096
 
-Adafruit_MCP4728 mcp1; // MCP4728 at address 0x60
-Adafruit_MCP4728 mcp2; // MCP4728 at address 0x61
+// D2 is the LDAC output (LDAC_PIN), D3, D0 and D1 are modulation outputs for the fast laser
+// switching. Block D4-D9 refers to Enable Laser 1 - 6, further channels continue at D10-D13, A2,
+// A3, A6 and A7. A4 and A5 are the I2C bus. Boards that control lasers over SPI use D11-D13 as
+// MOSI, MISO and SCK and D10, A6 and A7 as chip selects, so they must not have more than six
+// channels; only the enable outputs of channels that have a DAC output are configured.
+#define MAX_CHANNELS 14
+const uint8_t enable_pins[MAX_CHANNELS] = {4, 5, 6, 7, 8, 9, 10, 11, 12, 13, A2, A3, A6, A7};
+static_assert(MAX_CHANNELS <= PROTOCOL_MAX_CHANNELS, "Channels are selected by 16-bit masks");
 
-constexpr char end_marker = CODE_END_SEQUENCE;
+// Camera TTL input that advances running sequences on every rising edge.
+#define TRIGGER_PIN A0
 
-// Pulse-width modulation for MHz pulsing laser diodes
-#define PWM_PIN (12UL)
-#define PWM_PORT (1UL)
-uint16_t pwm_seq[1] = {0};
+// Camera TTL input that is active while the camera exposes. Blanked channels only emit light
+// while it is active.
+#define EXPOSURE_PIN A1
 
+// Maximum number of entries of a single analog or digital sequence
+#define MAX_SEQUENCE_LENGTH 256
+
+// Maximum number of events of the waveform and size of an event in a CODE_WAVEFORM_LOAD payload
+#define WAVEFORM_MAX_EVENTS 1024
+
+// Entries of a calibration table. Entry i holds the DAC code of the 16-bit relative value i * 64,
+// so a relative value is calibrated by looking up entry (value + 32) >> CALIBRATION_SHIFT.
+#define CALIBRATION_SIZE 1025
+#define CALIBRATION_SHIFT 6
+
+// Telemetry is sent without being requested: samples of the monitor photodiode inputs and
+// snapshots of the output state. The analog inputs that are not needed as enable outputs are
+// monitor inputs, the last ones first. They are only configured once the host turns sampling on,
+// since A6 and A7 are chip selects on boards that control lasers over SPI.
+#define MAX_MONITORS 4
+const uint8_t monitor_pins[MAX_MONITORS] = {A7, A6, A3, A2};
+#define TELEMETRY_BATCH_US 10000 // Longest time a sample waits for its frame
+
+// Largest payload appended to an acknowledgement
+#define REPLY_PAYLOAD_SIZE 48
+
+// MCP4728s found at startup, in the order of their addresses
+Adafruit_MCP4728 dacs[MAX_DACS];
+uint8_t dac_addresses[MAX_DACS];
+uint8_t number_of_dacs = 0;
+
+// Channels that have both a DAC output and an enable output
+uint8_t number_of_channels = 0;
+
+// Last value written to each DAC output. Fast writes always update all four outputs of a DAC.
+uint16_t dac_codes[MAX_DACS][4];
+
+// Last 16-bit relative value written to each channel before calibration, reported by
+// CODE_GET_STATE so that a host attaching later can take over the outputs as they are
+uint16_t analog_values[MAX_CHANNELS];
+
+// Set by CODE_OPEN and cleared when the outputs are reset, so a host can tell whether the board
+// restarted since it last attached
+bool host_state = false;
+
+// Calibration tables uploaded by the host, mapping relative values to DAC codes. A table is only
+// used once all of its entries were loaded; channels without one are mapped linearly.
+uint16_t calibration_tables[MAX_CHANNELS][CALIBRATION_SIZE];
+uint16_t calibration_lengths[MAX_CHANNELS];
+
+uint8_t number_of_monitors = 0;
+
+// Samples are collected by loop() and sent in batches, each sample with its time in us.
+uint32_t telemetry_interval_us = 0; // 0 if sampling is off
+uint32_t telemetry_next_us = 0;
+uint32_t state_interval_ms = 0;     // 0 if snapshots are off
+uint32_t state_next_ms = 0;
+uint8_t telemetry_samples[FRAME_MAX_MESSAGE]; // CODE_TELEMETRY_SAMPLES message being filled
+size_t telemetry_length = 0;
+uint8_t telemetry_count = 0;
+uint32_t telemetry_first_us = 0;
+
+// Modulation outputs for MHz pulsing laser diodes, each driven by its own PWM. The PWMs load the
+// period together with the compare values (WaveForm decoder), so both change at the end of a
+// period. A change is written to the sequence slot that is not playing and started there; the
+// PWM finishes its period with the other slot, which is never touched while it may be read. A
+// new prescaler restarts the output. The last output shares D13 with the enable output of channel
+// 10 and is only available with fewer channels. D0 and D1 are the UART and D13 the LED and SCK,
+// so outputs 2 to 4 only take over their pins once the host uses them and release them on reset.
+#define MAX_MODULATORS 4
+NRF_PWM_Type *const modulation_pwms[MAX_MODULATORS] = {NRF_PWM0, NRF_PWM1, NRF_PWM2, NRF_PWM3};
+const uint8_t modulation_pins[MAX_MODULATORS] = {3, 0, 1, 13};
+
+struct Modulator {
+    uint16_t slots[2][4]; // Compare values of OUT[0] to OUT[2] and the period
+    uint8_t slot;         // Slot started last
+    uint8_t prescaler;
+    uint16_t top;
+    uint16_t high;
+    bool attached;        // Pin connected to the PWM
+};
+
+Modulator modulators[MAX_MODULATORS];
+uint8_t number_of_modulators = 0;
+
+// Hardware-triggered sequences, one analog and one digital sequence per channel and one per
+// modulation output.
+struct Sequence {
+    uint16_t values[MAX_SEQUENCE_LENGTH];
+    uint16_t length;
+    volatile uint16_t pos;
+    volatile bool running;
+};
+
+Sequence analog_sequences[MAX_CHANNELS];
+Sequence digital_sequences[MAX_CHANNELS];
+Sequence modulation_sequences[MAX_MODULATORS];
+
+// Number of trigger edges seen by the ISR and number of edges already applied to the analog
+// sequences in loop(). The DACs are on I2C which must not be used from interrupt context.
+volatile uint32_t trigger_count = 0;
+uint32_t analog_trigger_count = 0;
+
+uint8_t rx_ring[RX_RING_SIZE];
+size_t rx_head = 0; // Next byte to write
+size_t rx_tail = 0; // Next byte to read
+size_t rx_peak = 0; // Highest fill level of the ring
+FrameDecoder decoder;
+
+// Number of executed commands, time spent executing them and frames that could not be decoded
+uint32_t stat_commands = 0;
+uint32_t stat_processing_us = 0;
+uint32_t stat_frame_errors = 0;
+
+// Data appended to the acknowledgement of the command being executed
+uint8_t reply_payload[REPLY_PAYLOAD_SIZE];
+size_t reply_length = 0;
+
+// Waveform played back by TIMER4 independently of the host. Each event switches the enable
+// outputs in on and off at its time (in us from the start of the period) and may set the power
+// of one channel. The enable outputs change in the timer interrupt with microsecond accuracy;
+// power changes need I2C and are applied by loop() as soon as possible.
+struct WaveformEvent {
+    uint32_t time;
+    uint16_t on;
+    uint16_t off;
+    uint8_t power_channel; // WAVEFORM_NO_CHANNEL if the power is not changed
+    uint16_t power;
+};
+
+#define WAVEFORM_TIMER NRF_TIMER4
+#define WAVEFORM_IRQ TIMER4_IRQn
+
+WaveformEvent waveform[WAVEFORM_MAX_EVENTS];
+uint16_t waveform_length = 0;
+uint32_t waveform_period = 0;      // us
+uint16_t waveform_repetitions = 0; // 0 repeats until stopped
+uint16_t waveform_channels = 0;    // Enable outputs turned off when the waveform ends
+volatile bool waveform_running = false;
+volatile bool waveform_armed = false; // Waits for the next trigger edge to start
+volatile uint32_t waveform_passes = 0;
+uint16_t waveform_pos = 0;   // Next event, waveform_length for the end of the period
+uint32_t waveform_base = 0;  // Timer value at the start of the current period
+
+// GPIO port and pin mask of each enable output. Writing the OUTSET and OUTCLR registers of the
+// ports switches several outputs at the same instant. On the Nano 33 BLE the enable outputs are
+// spread over P0 and P1, so a change takes at most one write per port and direction.
+NRF_GPIO_Type *const gpio_ports[2] = {NRF_P0, NRF_P1};
+uint8_t enable_ports[MAX_CHANNELS];
+uint32_t enable_bits[MAX_CHANNELS];
+
+// State of the enable outputs as set by commands, sequences and the waveform. The pins of
+// blanked channels follow it only while the exposure input is active.
+volatile bool output_states[MAX_CHANNELS];
+volatile uint16_t blanking_channels = 0;
+volatile bool blanking_active_low = false;
+volatile bool exposure_active = false;
+
+// Power changes of waveform events not yet written to the DACs
+volatile uint16_t waveform_power[MAX_CHANNELS];
+volatile uint16_t waveform_power_mask = 0;
+
+// Ramps of the analog outputs. While ramps run, TIMER3 sets ramp_due every RAMP_UPDATE_US and
+// loop() writes the interpolated values of all ramping channels with one latched multi-write. A
+// fast write of an MCP4728 takes about 0.25 ms at 400 kHz; updates that loop() could not keep up
+// with are skipped rather than queued. Writes, sequences and waveform power changes of a channel
+// end its ramp where it is.
+#define RAMP_TIMER NRF_TIMER3
+#define RAMP_IRQ TIMER3_IRQn
+#define RAMP_UPDATE_US 1000
+
+struct Ramp {
+    uint16_t from;
+    uint16_t to;
+    uint32_t start;    // micros() when the ramp started
+    uint32_t duration; // us
+    uint8_t curve;     // RAMP_LINEAR or RAMP_EXPONENTIAL
+};
+
+Ramp ramps[MAX_CHANNELS];
+uint16_t ramp_channels = 0; // Channels whose ramp is running
+volatile bool ramp_due = false;
+
+uint8_t parseBuffer(char code, char *payload, size_t length);
+void send_message(const uint8_t *message, size_t length);
+void send_ack(uint8_t seq, uint8_t status);
+void reply_u8(uint8_t value);
+void reply_u16(uint16_t value);
+void reply_u32(uint32_t value);
+void receive();
+void apply_triggers();
+void apply_waveform_power();
+void waveform_start();
+void waveform_stop();
+void waveform_isr();
+void apply_ramps();
+void ramp_start(int ch, uint16_t value, uint32_t duration, uint8_t curve);
+uint16_t ramp_value(const Ramp *ramp, uint32_t elapsed);
+void ramp_isr();
+void write_analog(int ch, uint16_t value);
+void write_digital(int ch, bool value);
+void write_digital_multi(uint16_t mask, uint16_t values);
+void write_enable_pins(uint16_t mask, uint16_t values);
+void write_analog_multi(uint16_t mask, const uint16_t *values);
+uint16_t to_dac_code(int ch, uint16_t value);
+uint16_t payload_u16(const char *data);
+Sequence *get_sequence(uint8_t ch, uint8_t type);
+void on_trigger();
+void on_exposure();
+void set_modulation(int m, uint16_t period, uint16_t high);
+void attach_modulation(int m);
+void detach_modulation(int m);
+void reset_modulation();
+bool modulation_valid(uint16_t period, uint16_t high);
+void send_telemetry();
+void sample_monitors();
+void flush_samples();
+void send_state();
 
 void setup() {
     Serial.begin(BAUD);
 
-    // Set pinMode to OUTPUT and set to LOW.
-    for (int ch = 0; ch < 8; ++ch) {
-        pinMode(DIGITAL_PIN_OFFSET+ch, OUTPUT);
-        digitalWrite(DIGITAL_PIN_OFFSET+ch, LOW);
+    pinMode(LDAC_PIN, OUTPUT);
+    digitalWrite(LDAC_PIN, LOW);
+
+    for (uint8_t address = ADDR_MCP_FIRST; address < ADDR_MCP_FIRST + MAX_DACS; ++address) {
+        if (dacs[number_of_dacs].begin(address)) dac_addresses[number_of_dacs++] = address;
+    }
+    number_of_channels = number_of_dacs * CHANNELS_PER_DAC;
+    if (number_of_channels > MAX_CHANNELS) number_of_channels = MAX_CHANNELS;
+    number_of_monitors = MAX_CHANNELS - number_of_channels;
+    if (number_of_monitors > MAX_MONITORS) number_of_monitors = MAX_MONITORS;
+    number_of_modulators = number_of_channels > 9 ? MAX_MODULATORS - 1 : MAX_MODULATORS;
+    Wire.setClock(I2C_CLOCK);
+
+    // Set pinMode of the enable outputs to OUTPUT and set to LOW.
+    for (int ch = 0; ch < number_of_channels; ++ch) {
+        pinMode(enable_pins[ch], OUTPUT);
+        digitalWrite(enable_pins[ch], LOW);
+        uint32_t pin = digitalPinToPinName(enable_pins[ch]);
+        enable_ports[ch] = pin >> 5;
+        enable_bits[ch] = 1UL << (pin & 31);
+    }
+    analogReadResolution(ADC_RESOLUTION);
+
+    // Select the internal reference right away; fast writes keep the reference of the last write.
+    for (int dac = 0; dac < number_of_dacs; ++dac) {
+        for (int ch = 0; ch < 4; ++ch) {
+            dacs[dac].setChannelValue((MCP4728_channel_t)ch, (uint16_t)0, MCP4728_VREF_INTERNAL, MCP4728_GAIN_1X);
+        }
     }
-    
-    mcp1.begin(0x60);
-    mcp2.begin(0x61);
 
-    for (int ch = 0; ch < 4; ++ch) {
-      mcp1.setChannelValue((MCP4728_channel_t)ch, (uint16_t)0);
-      mcp2.setChannelValue((MCP4728_channel_t)ch, (uint16_t)0);
+    // Each PWM drives OUT[0] from the first slot entry once its pin is attached.
+    for (int m = 0; m < number_of_modulators; ++m) {
+        NRF_PWM_Type *pwm = modulation_pwms[m];
+        pwm->MODE = PWM_MODE_UPDOWN_Up << PWM_MODE_UPDOWN_Pos;
+        pwm->PRESCALER = PWM_PRESCALER_PRESCALER_DIV_1 << PWM_PRESCALER_PRESCALER_Pos;
+        pwm->LOOP = PWM_LOOP_CNT_Disabled << PWM_LOOP_CNT_Pos;
+        pwm->DECODER = (PWM_DECODER_LOAD_WaveForm << PWM_DECODER_LOAD_Pos) | (PWM_DECODER_MODE_RefreshCount << PWM_DECODER_MODE_Pos);
+        for (int slot = 0; slot < 2; ++slot) {
+            pwm->SEQ[slot].PTR = (uint32_t)(uintptr_t)modulators[m].slots[slot] << PWM_SEQ_PTR_PTR_Pos;
+            pwm->SEQ[slot].CNT = 4 << PWM_SEQ_CNT_CNT_Pos;
+            pwm->SEQ[slot].REFRESH = 0;
+            pwm->SEQ[slot].ENDDELAY = 0;
+        }
     }
+    attach_modulation(0);
+    reset_modulation();
+
+    pinMode(TRIGGER_PIN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(TRIGGER_PIN), on_trigger, RISING);
 
-    // hard-code the pulse-generator settings in for MHz pulsing lasers to 1MHz & 75% duty cycle
-    set_pwm(4, 16);
+    pinMode(EXPOSURE_PIN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(EXPOSURE_PIN), on_exposure, CHANGE);
+
+    frame_decoder_reset(&decoder);
+
+    // 32-bit timer counting microseconds for the waveform
+    WAVEFORM_TIMER->MODE = TIMER_MODE_MODE_Timer << TIMER_MODE_MODE_Pos;
+    WAVEFORM_TIMER->BITMODE = TIMER_BITMODE_BITMODE_32Bit << TIMER_BITMODE_BITMODE_Pos;
+    WAVEFORM_TIMER->PRESCALER = 4 << TIMER_PRESCALER_PRESCALER_Pos; // 16 MHz / 2^4
+    WAVEFORM_TIMER->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+    NVIC_SetVector(WAVEFORM_IRQ, (uint32_t)(uintptr_t)&waveform_isr);
+    NVIC_EnableIRQ(WAVEFORM_IRQ);
+
+    // Same for the ramp updates; it only runs while ramps do.
+    RAMP_TIMER->MODE = TIMER_MODE_MODE_Timer << TIMER_MODE_MODE_Pos;
+    RAMP_TIMER->BITMODE = TIMER_BITMODE_BITMODE_32Bit << TIMER_BITMODE_BITMODE_Pos;
+    RAMP_TIMER->PRESCALER = 4 << TIMER_PRESCALER_PRESCALER_Pos;
+    RAMP_TIMER->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+    NVIC_SetVector(RAMP_IRQ, (uint32_t)(uintptr_t)&ramp_isr);
+    NVIC_EnableIRQ(RAMP_IRQ);
 }
 
 void loop () {
-    char rc;
-    static char buffer[BUFFER_SIZE];
-    static size_t pos;
-
-    while (Serial.available() ) {
-        rc = Serial.read();
-        
-        if (rc == end_marker) {
-            parseBuffer(buffer, pos+1);
-            pos = 0;
-        } else if (pos < 62) {
-            buffer[pos++] = rc;
+    apply_triggers();
+    apply_waveform_power();
+    apply_ramps();
+    send_telemetry();
+
+    receive();
+    while (rx_tail != rx_head) {
+        uint8_t rc = rx_ring[rx_tail];
+        rx_tail = (rx_tail + 1) % RX_RING_SIZE;
+
+        int length = frame_decoder_push(&decoder, rc);
+        if (length == FRAME_INCOMPLETE) continue;
+
+        if (length >= 2) { // code and sequence number
+            uint8_t *message = decoder.message;
+            uint32_t start = micros();
+            uint8_t status = parseBuffer(message[0], (char *)message + 2, length - 2);
+            stat_processing_us += micros() - start;
+            stat_commands++;
+            send_ack(message[1], status);
         } else {
-            pos = 0;
-            break;
+            uint8_t reply[] = {CODE_FRAME_ERROR};
+            send_message(reply, sizeof(reply));
+            stat_frame_errors++;
         }
+        apply_triggers();
+        apply_waveform_power();
+        apply_ramps();
+        send_telemetry();
+        receive();
     }
 }
 
-void parseBuffer(char *buffer, size_t length) {
-    if (length == 0) return; // Buffer is empty, can't parse
-    char code = buffer[0];
+// Apply pending trigger edges to the analog sequences.
+void apply_triggers() {
+    uint32_t count = trigger_count;
+    if (count == analog_trigger_count) return;
+    for (int ch = 0; ch < number_of_channels; ++ch) {
+        Sequence *seq = &analog_sequences[ch];
+        if (!seq->running) continue;
+        seq->pos = (seq->pos + (count - analog_trigger_count)) % seq->length;
+        write_analog(ch, seq->values[seq->pos]);
+    }
+    analog_trigger_count = count;
+}
+
+// Move everything the USB buffer holds into the ring buffer.
+void receive() {
+    for (;;) {
+        size_t used = (rx_head - rx_tail) % RX_RING_SIZE;
+        if (used > rx_peak) rx_peak = used;
+        size_t free = RX_RING_SIZE - 1 - used;
+        if (free == 0) return;
+
+        int available = Serial.available();
+        if (available <= 0) return;
+
+        // Read up to the end of the ring, the rest follows in the next iteration.
+        size_t count = RX_RING_SIZE - rx_head;
+        if (count > free) count = free;
+        if (count > (size_t)available) count = available;
+        count = Serial.readBytes((char *)rx_ring + rx_head, count);
+        if (count == 0) return;
+        rx_head = (rx_head + count) % RX_RING_SIZE;
+    }
+}
+
+// Execute a command and return its status. payload holds the bytes between the sequence
+// number and the end marker.
+uint8_t parseBuffer(char code, char *payload, size_t length) {
     switch (code)  {
         case CODE_OPEN: // Open the device
         {
+            // The outputs are left as they are. Telemetry is only sent once the new host asks
+            // for it.
+            flush_samples();
+            telemetry_interval_us = 0;
+            state_interval_ms = 0;
+            host_state = true;
         }
             break;
         case CODE_CLOSE:
         {
-            // Turn lasers off.
-            for (int ch = 0; ch < 8; ++ch) {
-                digitalWrite(DIGITAL_PIN_OFFSET+ch, LOW);
+            // Payload (optional): flags. Stop sequences, waveforms and telemetry and turn lasers
+            // off unless CLOSE_KEEP_OUTPUTS is set.
+            for (int ch = 0; ch < MAX_CHANNELS; ++ch) {
+                analog_sequences[ch].running = false;
+                digital_sequences[ch].running = false;
+            }
+            for (int m = 0; m < MAX_MODULATORS; ++m) {
+                modulation_sequences[m].running = false;
             }
+            flush_samples();
+            telemetry_interval_us = 0;
+            state_interval_ms = 0;
+            if (length >= 1 && (payload[0] & CLOSE_KEEP_OUTPUTS)) {
+                noInterrupts();
+                WAVEFORM_TIMER->TASKS_STOP = 1;
+                waveform_running = false;
+                waveform_armed = false;
+                interrupts();
+                break;
+            }
+
+            waveform_stop();
+            reset_modulation();
+            ramp_channels = 0;
+            blanking_channels = 0;
+            for (int ch = 0; ch < MAX_CHANNELS; ++ch) {
+                calibration_lengths[ch] = 0;
+                analog_values[ch] = 0;
+            }
+            host_state = false;
 
-            for (int ch = 0; ch < 4; ++ch) {
-                mcp1.setChannelValue((MCP4728_channel_t)ch, (uint16_t)0);
-                mcp2.setChannelValue((MCP4728_channel_t)ch, (uint16_t)0);
+            for (int ch = 0; ch < number_of_channels; ++ch) {
+                digitalWrite(enable_pins[ch], LOW);
+                output_states[ch] = false;
+            }
+
+            for (int dac = 0; dac < number_of_dacs; ++dac) {
+                for (int ch = 0; ch < 4; ++ch) {
+                    dacs[dac].setChannelValue((MCP4728_channel_t)ch, (uint16_t)0, MCP4728_VREF_INTERNAL, MCP4728_GAIN_1X);
+                    dac_codes[dac][ch] = 0;
+                }
+                dacs[dac].saveToEEPROM();
             }
-                
-            mcp1.saveToEEPROM();
-            mcp2.saveToEEPROM();
         }
             break;
         case CODE_WRITE_ANALOG: // Write to MCPs analog channel
         {
-            char ch = buffer[1];
-            if (ch >= 6) return; // We only have 6 channels
-            Adafruit_MCP4728 *dev;
-            if (ch > 2) dev = &mcp2; // Needs to be changed according to #channels per DAC
-            else dev = &mcp1;
-            
-            ch %= 3; // Needs to be changed according to #channels per DAC
-
-            uint8_t lower_bytes = buffer[2];
-            uint8_t upper_bytes = buffer[3];
-            uint16_t value = (upper_bytes << 8) | lower_bytes;
-            float rel_val = (float)value / 65535;
-            dev->setChannelValue((MCP4728_channel_t)ch, (uint16_t)(rel_val * MAX_VALUE), MCP4728_VREF_INTERNAL,
-MCP4728_GAIN_1X);
+            if (length < 3) return STATUS_INVALID_LENGTH;
+            uint8_t ch = payload[0];
+            if (ch >= number_of_channels) return STATUS_INVALID_CHANNEL;
+            uint8_t lower_bytes = payload[1];
+            uint8_t upper_bytes = payload[2];
+            ramp_channels &= ~(1 << ch);
+            write_analog(ch, (upper_bytes << 8) | lower_bytes);
         }
             break;
         case CODE_WRITE_DIGITAL: // Write to Arduino's digital channel
         {
-            char ch = buffer[1]; // channel
-            if (ch >= 6) return; // We only use 6 channels.
-            char val = buffer[2]; // value
-            if (val) digitalWrite(ch + DIGITAL_PIN_OFFSET, HIGH);
-            else digitalWrite(ch + DIGITAL_PIN_OFFSET, LOW);
-        }
-            break;
-        case CODE_SET_PWM: // Write to PWM channel
-         {
-             uint8_t duty = buffer[1];
-             uint8_t top  = buffer[2];
-             //uint16_t value = (upper_bytes << 8) | lower_bytes;
-             set_pwm(duty, top);
-         }
-             break;
-    }
-}
-
-
-void set_pwm(uint16_t duty, uint16_t top) // CLK = 16MHz
-{
-    pwm_seq[0] = (0 << 15) | duty; // Inverse polarity (bit 15), 1500us duty cycle
-//      Configure PWM_PIN as output, and set it to 0
-//  NRF_GPIO->DIRSET = (1 << PWM_PIN);
-//  NRF_GPIO->OUTCLR = (1 << PWM_PIN);
-  NRF_PWM0->PSEL.OUT[0] = (PWM_PIN << PWM_PSEL_OUT_PIN_Pos) | (PWM_PORT << PWM_PSEL_OUT_PORT_Pos) | (PWM_PSEL_OUT_CONNECT_Connected << PWM_PSEL_OUT_CONNECT_Pos);
-  NRF_PWM0->ENABLE = (PWM_ENABLE_ENABLE_Enabled << PWM_ENABLE_ENABLE_Pos);
-  NRF_PWM0->MODE = (PWM_MODE_UPDOWN_Up << PWM_MODE_UPDOWN_Pos);
-  NRF_PWM0->PRESCALER = (PWM_PRESCALER_PRESCALER_DIV_1 << PWM_PRESCALER_PRESCALER_Pos);
-  NRF_PWM0->COUNTERTOP = (top << PWM_COUNTERTOP_COUNTERTOP_Pos); //1 msec
-  NRF_PWM0->LOOP = (PWM_LOOP_CNT_Disabled << PWM_LOOP_CNT_Pos);
-  NRF_PWM0->DECODER = (PWM_DECODER_LOAD_Common << PWM_DECODER_LOAD_Pos) | (PWM_DECODER_MODE_RefreshCount << PWM_DECODER_MODE_Pos);
-  NRF_PWM0->SEQ[0].PTR = ((uint32_t)(pwm_seq) << PWM_SEQ_PTR_PTR_Pos);
-  NRF_PWM0->SEQ[0].CNT = ((sizeof(pwm_seq) / sizeof(uint16_t)) << PWM_SEQ_CNT_CNT_Pos);
-  NRF_PWM0->SEQ[0].REFRESH = 0;
-  NRF_PWM0->SEQ[0].ENDDELAY = 0;
-  NRF_PWM0->TASKS_SEQSTART[0] = 1;
-}
-
-// Explanation
-// top: Frequency based on a 16MHz repetition rate. Counter counts up with a 16MHz clock.
-// duty: Off duty time
+            if (length < 2) return STATUS_INVALID_LENGTH;
+            uint8_t ch = payload[0]; // channel
+            if (ch >= number_of_channels) return STATUS_INVALID_CHANNEL;
+            char val = payload[1]; // value
+            write_digital(ch, val);
+        }
+            break;
+        case CODE_WRITE_ANALOG_MULTI: // Write several analog channels and latch them together
+        {
+            // Payload: channel mask (16 bit) followed by two bytes per channel in the mask
+            if (length < 2) return STATUS_INVALID_LENGTH;
+            uint16_t mask = payload_u16(payload);
+            if (mask >> number_of_channels) return STATUS_INVALID_CHANNEL;
+            uint16_t values[MAX_CHANNELS];
+            size_t pos = 2;
+            for (int ch = 0; ch < number_of_channels; ++ch) {
+                if (!(mask & (1 << ch))) continue;
+                if (pos + 2 > length) return STATUS_INVALID_LENGTH;
+                uint8_t lower_bytes = payload[pos];
+                uint8_t upper_bytes = payload[pos + 1];
+                values[ch] = (upper_bytes << 8) | lower_bytes;
+                pos += 2;
+            }
+            if (pos != length) return STATUS_INVALID_LENGTH;
+            ramp_channels &= ~mask;
+            write_analog_multi(mask, values);
+        }
+            break;
+        case CODE_WRITE_DIGITAL_MULTI: // Write several digital channels
+        {
+            // Payload: channel mask, values (16 bit each)
+            if (length < 4) return STATUS_INVALID_LENGTH;
+            uint16_t mask = payload_u16(payload);
+            uint16_t values = payload_u16(payload + 2);
+            if (mask >> number_of_channels) return STATUS_INVALID_CHANNEL;
+            write_digital_multi(mask, values);
+        }
+            break;
+        case CODE_CLEAR_SEQUENCE: // Stop and empty a sequence
+        {
+            if (length < 2) return STATUS_INVALID_LENGTH;
+            Sequence *seq = get_sequence(payload[0], payload[1]);
+            if (!seq) return STATUS_INVALID_CHANNEL;
+            seq->running = false;
+            seq->length = 0;
+        }
+            break;
+        case CODE_LOAD_SEQUENCE: // Append values to a sequence
+        {
+            // Payload: channel, type, followed by two bytes per value
+            if (length < 2 || length % 2 != 0) return STATUS_INVALID_LENGTH;
+            Sequence *seq = get_sequence(payload[0], payload[1]);
+            if (!seq) return STATUS_INVALID_CHANNEL;
+            if (seq->running) return STATUS_SEQUENCE_RUNNING;
+            size_t count = (length - 2) / 2;
+            if (seq->length + count > MAX_SEQUENCE_LENGTH) return STATUS_SEQUENCE_FULL;
+            for (size_t i = 0; i < count; ++i) {
+                uint8_t lower_bytes = payload[2 + 2*i];
+                uint8_t upper_bytes = payload[3 + 2*i];
+                seq->values[seq->length++] = (upper_bytes << 8) | lower_bytes;
+            }
+        }
+            break;
+        case CODE_START_SEQUENCE: // Output the first value and advance on every trigger edge
+        {
+            if (length < 2) return STATUS_INVALID_LENGTH;
+            uint8_t ch = payload[0];
+            uint8_t type = payload[1];
+            Sequence *seq = get_sequence(ch, type);
+            if (!seq) return STATUS_INVALID_CHANNEL;
+            if (seq->length == 0) return STATUS_INVALID_LENGTH;
+            if (type == SEQUENCE_MODULATION) {
+                // Entries are pairs, and the trigger interrupt cannot change the prescaler.
+                if (seq->length % 2 != 0) return STATUS_INVALID_LENGTH;
+                for (int i = 0; i < seq->length; i += 2) {
+                    if (!modulation_valid(seq->values[i], seq->values[i + 1])) return STATUS_INVALID_VALUE;
+                    if ((seq->values[i] ^ seq->values[0]) >> MODULATION_PRESCALER_SHIFT) return STATUS_INVALID_VALUE;
+                }
+                attach_modulation(ch);
+                set_modulation(ch, seq->values[0], seq->values[1]);
+                seq->pos = 0;
+                seq->running = true;
+                break;
+            }
+            noInterrupts();
+            seq->pos = 0;
+            seq->running = true;
+            if (type == SEQUENCE_ANALOG) analog_trigger_count = trigger_count;
+            interrupts();
+            if (type == SEQUENCE_ANALOG) {
+                ramp_channels &= ~(1 << ch);
+                write_analog(ch, seq->values[0]);
+            } else {
+                write_digital(ch, seq->values[0]);
+            }
+        }
+            break;
+        case CODE_STOP_SEQUENCE:
+        {
+            if (length < 2) return STATUS_INVALID_LENGTH;
+            Sequence *seq = get_sequence(payload[0], payload[1]);
+            if (!seq) return STATUS_INVALID_CHANNEL;
+            seq->running = false;
+        }
+            break;
+        case CODE_GET_STATS: // Report the number of executed commands, the time spent executing
+                             // them in us, undecodable frames and the receive buffer peak
+        {
+            reply_u32(stat_commands);
+            reply_u32(stat_processing_us);
+            reply_u32(stat_frame_errors);
+            reply_u16((uint16_t)rx_peak);
+        }
+            break;
+        case CODE_WAVEFORM_CLEAR: // Stop and empty the waveform
+        {
+            waveform_stop();
+            waveform_length = 0;
+        }
+            break;
+        case CODE_WAVEFORM_LOAD: // Append events to the waveform
+        {
+            // Payload: per event the time in us (32 bit), on mask and off mask (16 bit each), power
+            // channel and power (16 bit). Times must not decrease.
+            if (length % WAVEFORM_EVENT_SIZE != 0) return STATUS_INVALID_LENGTH;
+            if (waveform_running) return STATUS_SEQUENCE_RUNNING;
+            size_t count = length / WAVEFORM_EVENT_SIZE;
+            if (waveform_length + count > WAVEFORM_MAX_EVENTS) return STATUS_SEQUENCE_FULL;
+            for (size_t i = 0; i < count; ++i) {
+                const uint8_t *data = (const uint8_t *)payload + i * WAVEFORM_EVENT_SIZE;
+                WaveformEvent event;
+                event.time = data[0] | (data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+                event.on = data[4] | (data[5] << 8);
+                event.off = data[6] | (data[7] << 8);
+                event.power_channel = data[8];
+                event.power = data[9] | (data[10] << 8);
+                if ((event.on | event.off) >> number_of_channels) return STATUS_INVALID_CHANNEL;
+                if (event.power_channel != WAVEFORM_NO_CHANNEL && event.power_channel >= number_of_channels) return STATUS_INVALID_CHANNEL;
+                if (waveform_length > 0 && event.time < waveform[waveform_length - 1].time) return STATUS_INVALID_VALUE;
+                waveform[waveform_length++] = event;
+            }
+        }
+            break;
+        case CODE_WAVEFORM_START: // Play the waveform
+        {
+            // Payload: enable outputs turned off at the end (16 bit), number of periods (16 bit, 0
+            // repeats until stopped), period in us (32 bit) and optional flags
+            if (length < 8) return STATUS_INVALID_LENGTH;
+            if (waveform_length == 0) return STATUS_INVALID_LENGTH;
+            uint16_t channels = payload_u16(payload);
+            uint16_t repetitions = payload_u16(payload + 2);
+            uint32_t period = payload_u16(payload + 4) | ((uint32_t)payload_u16(payload + 6) << 16);
+            if (channels >> number_of_channels) return STATUS_INVALID_CHANNEL;
+            if (period == 0 || period <= waveform[waveform_length - 1].time) return STATUS_INVALID_VALUE;
+            waveform_stop();
+            waveform_channels = channels;
+            waveform_repetitions = repetitions;
+            waveform_period = period;
+            if (length >= 9 && (payload[8] & WAVEFORM_START_ON_TRIGGER)) {
+                waveform_passes = 0;
+                waveform_armed = true;
+            } else {
+                waveform_start();
+            }
+        }
+            break;
+        case CODE_WAVEFORM_STOP: // Stop the waveform and turn off its enable outputs
+        {
+            waveform_stop();
+        }
+            break;
+        case CODE_WAVEFORM_STATUS: // Report whether the waveform is running and the completed periods
+        {
+            reply_u8(waveform_running || waveform_armed); // Armed counts as running
+            reply_u32(waveform_passes);
+        }
+            break;
+        case CODE_SET_BLANKING: // Gate enable outputs with the exposure input
+        {
+            // Payload: blanked channels (16 bit), polarity of the exposure input (0 active high, 1
+            // active low)
+            if (length < 3) return STATUS_INVALID_LENGTH;
+            uint16_t channels = payload_u16(payload);
+            if (channels >> number_of_channels) return STATUS_INVALID_CHANNEL;
+            noInterrupts();
+            blanking_channels = channels;
+            blanking_active_low = payload[2] != 0;
+            interrupts();
+            on_exposure();
+            uint16_t values = 0;
+            for (int ch = 0; ch < number_of_channels; ++ch) {
+                if (output_states[ch]) values |= 1 << ch;
+            }
+            write_digital_multi((1 << number_of_channels) - 1, values);
+        }
+            break;
+        case CODE_GET_INFO: // Report the protocol version, the channels and the buffer sizes
+        {
+            // Reply: protocol version, number of channels, maximum sequence length, maximum number
+            // of waveform events, receive buffer size and calibration table size (16 bit each),
+            // number of monitor inputs, number of modulation outputs, then the DAC address and
+            // output of every channel
+            reply_u8(PROTOCOL_VERSION);
+            reply_u8(number_of_channels);
+            reply_u16(MAX_SEQUENCE_LENGTH);
+            reply_u16(WAVEFORM_MAX_EVENTS);
+            reply_u16(RX_RING_SIZE);
+            reply_u16(CALIBRATION_SIZE);
+            reply_u8(number_of_monitors);
+            reply_u8(number_of_modulators);
+            for (int ch = 0; ch < number_of_channels; ++ch) {
+                reply_u8(dac_addresses[ch / CHANNELS_PER_DAC]);
+                reply_u8(ch % CHANNELS_PER_DAC);
+            }
+        }
+            break;
+        case CODE_CLEAR_CALIBRATION: // Empty the calibration table of a channel and map it linearly
+        {
+            if (length < 1) return STATUS_INVALID_LENGTH;
+            uint8_t ch = payload[0];
+            if (ch >= number_of_channels) return STATUS_INVALID_CHANNEL;
+            calibration_lengths[ch] = 0;
+        }
+            break;
+        case CODE_LOAD_CALIBRATION: // Append entries to the calibration table of a channel
+        {
+            // Payload: channel, followed by a DAC code (16 bit) per entry. The table is used as
+            // soon as it is full.
+            if (length < 1 || length % 2 != 1) return STATUS_INVALID_LENGTH;
+            uint8_t ch = payload[0];
+            if (ch >= number_of_channels) return STATUS_INVALID_CHANNEL;
+            size_t count = (length - 1) / 2;
+            if (calibration_lengths[ch] + count > CALIBRATION_SIZE) return STATUS_SEQUENCE_FULL;
+            for (size_t i = 0; i < count; ++i) {
+                uint16_t code = payload_u16(payload + 1 + 2*i);
+                if (code > DAC_MAX_CODE) return STATUS_INVALID_VALUE;
+                calibration_tables[ch][calibration_lengths[ch]++] = code;
+            }
+        }
+            break;
+        case CODE_SET_TELEMETRY: // Start or stop sending telemetry
+        {
+            // Payload: monitor samples per second and interval of the state snapshots in ms (16
+            // bit each), 0 turns either off
+            if (length < 4) return STATUS_INVALID_LENGTH;
+            uint16_t rate = payload_u16(payload);
+            uint16_t interval = payload_u16(payload + 2);
+            if (rate > TELEMETRY_MAX_RATE) return STATUS_INVALID_VALUE;
+            if (rate != 0 && number_of_monitors == 0) return STATUS_INVALID_CHANNEL;
+            flush_samples();
+            for (int m = 0; rate != 0 && m < number_of_monitors; ++m) {
+                pinMode(monitor_pins[m], INPUT);
+            }
+            telemetry_interval_us = rate ? 1000000UL / rate : 0;
+            telemetry_next_us = micros();
+            state_interval_ms = interval;
+            state_next_ms = millis();
+        }
+            break;
+        case CODE_IDENTIFY: // Tell the host that this program is running
+        {
+            // Reply: FIRMWARE_ID, protocol version and 1 if a host attached since the board
+            // started and left the outputs set, 0 otherwise
+            for (size_t i = 0; i < FIRMWARE_ID_LENGTH; ++i) {
+                reply_u8(FIRMWARE_ID[i]);
+            }
+            reply_u8(PROTOCOL_VERSION);
+            reply_u8(host_state);
+        }
+            break;
+        case CODE_GET_STATE: // Report the outputs as set by the host
+        {
+            // Reply: enabled channels, blanked channels (16 bit each), polarity of the exposure
+            // input, then the relative value of every channel (16 bit)
+            uint16_t enabled = 0;
+            for (int ch = 0; ch < number_of_channels; ++ch) {
+                if (output_states[ch]) enabled |= 1 << ch;
+            }
+            reply_u16(enabled);
+            reply_u16(blanking_channels);
+            reply_u8(blanking_active_low);
+            for (int ch = 0; ch < number_of_channels; ++ch) {
+                reply_u16(analog_values[ch]);
+            }
+        }
+            break;
+        case CODE_RAMP: // Move an analog output to a value over time
+        {
+            // Payload: channel, 16-bit relative value to end at, duration in us (32 bit), curve.
+            // The ramp starts at the current value; without a duration the value is written
+            // right away.
+            if (length < 8) return STATUS_INVALID_LENGTH;
+            uint8_t ch = payload[0];
+            if (ch >= number_of_channels) return STATUS_INVALID_CHANNEL;
+            uint16_t value = payload_u16(payload + 1);
+            uint32_t duration = payload_u16(payload + 3) | ((uint32_t)payload_u16(payload + 5) << 16);
+            uint8_t curve = payload[7];
+            if (curve != RAMP_LINEAR && curve != RAMP_EXPONENTIAL) return STATUS_INVALID_VALUE;
+            if (analog_sequences[ch].running) return STATUS_SEQUENCE_RUNNING;
+            ramp_channels &= ~(1 << ch);
+            if (duration == 0) write_analog(ch, value);
+            else ramp_start(ch, value, duration, curve);
+        }
+            break;
+        case CODE_SET_MODULATION: // Set the period and high time of a modulation output
+        {
+            // Payload: modulation output, period with prescaler and high time (16 bit each). The
+            // change takes effect at the end of the current period.
+            if (length < 5) return STATUS_INVALID_LENGTH;
+            uint8_t m = payload[0];
+            if (m >= number_of_modulators) return STATUS_INVALID_CHANNEL;
+            uint16_t period = payload_u16(payload + 1);
+            uint16_t high = payload_u16(payload + 3);
+            if (!modulation_valid(period, high)) return STATUS_INVALID_VALUE;
+            if (modulation_sequences[m].running) return STATUS_SEQUENCE_RUNNING;
+            attach_modulation(m);
+            set_modulation(m, period, high);
+        }
+            break;
+        default:
+            return STATUS_UNKNOWN_CODE;
+    }
+    return STATUS_OK;
+}
+
+void send_message(const uint8_t *message, size_t length) {
+    uint8_t frame[FRAME_MAX_ENCODED];
+    Serial.write(frame, frame_encode(message, length, frame));
+}
+
+// Send the acknowledgement of a command together with the data the command appended.
+void send_ack(uint8_t seq, uint8_t status) {
+    uint8_t reply[3 + REPLY_PAYLOAD_SIZE] = {CODE_ACK, seq, status};
+    memcpy(reply + 3, reply_payload, reply_length);
+    send_message(reply, 3 + reply_length);
+    reply_length = 0;
+}
+
+void reply_u8(uint8_t value) {
+    if (reply_length < REPLY_PAYLOAD_SIZE) reply_payload[reply_length++] = value;
+}
+
+// Multi-byte values are sent little-endian.
+void reply_u16(uint16_t value) {
+    reply_u8((uint8_t)value);
+    reply_u8((uint8_t)(value >> 8));
+}
+
+void reply_u32(uint32_t value) {
+    reply_u16((uint16_t)value);
+    reply_u16((uint16_t)(value >> 16));
+}
+
+// Little-endian 16-bit value at the start of a payload
+uint16_t payload_u16(const char *data) {
+    return (uint8_t)data[0] | ((uint8_t)data[1] << 8);
+}
+
+// Convert the 16-bit relative value of a channel to a DAC code.
+uint16_t to_dac_code(int ch, uint16_t value) {
+    if (calibration_lengths[ch] == CALIBRATION_SIZE) {
+        return calibration_tables[ch][(value + (1 << (CALIBRATION_SHIFT - 1))) >> CALIBRATION_SHIFT];
+    }
+    return (uint16_t)((uint32_t)value * DAC_MAX_CODE / 65535);
+}
+
+// Write a 16-bit relative value to the DAC output of a channel.
+void write_analog(int ch, uint16_t value) {
+    analog_values[ch] = value;
+    uint16_t code = to_dac_code(ch, value);
+    int dac = ch / CHANNELS_PER_DAC;
+    ch %= CHANNELS_PER_DAC;
+
+    dac_codes[dac][ch] = code;
+    dacs[dac].setChannelValue((MCP4728_channel_t)ch, code, MCP4728_VREF_INTERNAL, MCP4728_GAIN_1X);
+}
+
+// Write the 16-bit relative values of all channels in mask with one fast write per DAC and
+// latch all outputs together.
+void write_analog_multi(uint16_t mask, const uint16_t *values) {
+    bool changed[MAX_DACS] = {false};
+    for (int ch = 0; ch < number_of_channels; ++ch) {
+        if (!(mask & (1 << ch))) continue;
+        int dac = ch / CHANNELS_PER_DAC;
+        analog_values[ch] = values[ch];
+        dac_codes[dac][ch % CHANNELS_PER_DAC] = to_dac_code(ch, values[ch]);
+        changed[dac] = true;
+    }
+
+    digitalWrite(LDAC_PIN, HIGH);
+    for (int dac = 0; dac < number_of_dacs; ++dac) {
+        if (!changed[dac]) continue;
+        uint16_t *codes = dac_codes[dac];
+        dacs[dac].fastWrite(codes[0], codes[1], codes[2], codes[3]);
+    }
+    digitalWrite(LDAC_PIN, LOW);
+}
+
+void write_digital(int ch, bool value) {
+    write_digital_multi(1 << ch, value ? 1 << ch : 0);
+}
+
+// Set the enable outputs in mask to the states in values; all of them change at the same time.
+// Blanked channels are only switched on while the exposure input is active. Safe to call from
+// interrupts.
+void write_digital_multi(uint16_t mask, uint16_t values) {
+    for (int ch = 0; ch < number_of_channels; ++ch) {
+        if (mask & (1 << ch)) output_states[ch] = values & (1 << ch);
+    }
+
+    // If on_exposure() interrupts this, write the pins again with the new exposure state.
+    bool exposure;
+    do {
+        exposure = exposure_active;
+        write_enable_pins(mask, exposure ? values : values & ~blanking_channels);
+    } while ((mask & blanking_channels) && exposure != exposure_active);
+}
+
+// Write the enable outputs in mask with one register write per port and direction.
+void write_enable_pins(uint16_t mask, uint16_t values) {
+    uint32_t set[2] = {0, 0};
+    uint32_t clear[2] = {0, 0};
+    for (int ch = 0; ch < number_of_channels; ++ch) {
+        if (!(mask & (1 << ch))) continue;
+        if (values & (1 << ch)) set[enable_ports[ch]] |= enable_bits[ch];
+        else clear[enable_ports[ch]] |= enable_bits[ch];
+    }
+    for (int port = 0; port < 2; ++port) {
+        if (set[port]) gpio_ports[port]->OUTSET = set[port];
+        if (clear[port]) gpio_ports[port]->OUTCLR = clear[port];
+    }
+}
+
+Sequence *get_sequence(uint8_t ch, uint8_t type) {
+    if (type == SEQUENCE_MODULATION) return ch < number_of_modulators ? &modulation_sequences[(int)ch] : nullptr;
+    if (ch >= number_of_channels) return nullptr;
+    if (type == SEQUENCE_ANALOG) return &analog_sequences[(int)ch];
+    if (type == SEQUENCE_DIGITAL) return &digital_sequences[(int)ch];
+    return nullptr;
+}
+
+// Start an armed waveform, advance the digital and modulation sequences right away and leave the
+// analog sequences to loop().
+void on_trigger() {
+    if (waveform_armed) {
+        waveform_armed = false;
+        waveform_start();
+    }
+
+    uint16_t mask = 0;
+    uint16_t values = 0;
+    for (int ch = 0; ch < number_of_channels; ++ch) {
+        Sequence *seq = &digital_sequences[ch];
+        if (!seq->running) continue;
+        seq->pos = (seq->pos + 1) % seq->length;
+        mask |= 1 << ch;
+        if (seq->values[seq->pos]) values |= 1 << ch;
+    }
+    if (mask) write_digital_multi(mask, values);
+
+    for (int m = 0; m < number_of_modulators; ++m) {
+        Sequence *seq = &modulation_sequences[m];
+        if (!seq->running) continue;
+        seq->pos = (seq->pos + 2) % seq->length;
+        set_modulation(m, seq->values[seq->pos], seq->values[seq->pos + 1]);
+    }
+    trigger_count++;
+}
+
+// Switch the blanked channels that are on with the exposure input.
+void on_exposure() {
+    bool active = (digitalRead(EXPOSURE_PIN) == HIGH) != blanking_active_low;
+    exposure_active = active;
+    uint16_t channels = blanking_channels;
+    uint16_t values = 0;
+    if (active) {
+        for (int ch = 0; ch < number_of_channels; ++ch) {
+            if (output_states[ch]) values |= 1 << ch;
+        }
+    }
+    if (channels) write_enable_pins(channels, values);
+}
+
+// Write power changes of waveform events to the DACs.
+void apply_waveform_power() {
+    if (!waveform_power_mask) return;
+    noInterrupts();
+    uint16_t mask = waveform_power_mask;
+    uint16_t values[MAX_CHANNELS];
+    for (int ch = 0; ch < number_of_channels; ++ch) values[ch] = waveform_power[ch];
+    waveform_power_mask = 0;
+    interrupts();
+    ramp_channels &= ~mask;
+    write_analog_multi(mask, values);
+}
+
+// Write the current values of the running ramps if an update is due. Ramps that reached their
+// duration write their target and end.
+void apply_ramps() {
+    if (!ramp_due) return;
+    ramp_due = false;
+
+    uint32_t now = micros();
+    uint16_t mask = 0;
+    uint16_t values[MAX_CHANNELS];
+    for (int ch = 0; ch < number_of_channels; ++ch) {
+        if (!(ramp_channels & (1 << ch))) continue;
+        const Ramp *ramp = &ramps[ch];
+        uint32_t elapsed = now - ramp->start;
+        if (elapsed >= ramp->duration) {
+            values[ch] = ramp->to;
+            ramp_channels &= ~(1 << ch);
+        } else {
+            values[ch] = ramp_value(ramp, elapsed);
+        }
+        if (values[ch] != analog_values[ch]) mask |= 1 << ch;
+    }
+    if (!ramp_channels) RAMP_TIMER->TASKS_STOP = 1;
+    if (mask) write_analog_multi(mask, values);
+}
+
+// Start a ramp of a channel from its current value and the timer if it is not running yet.
+void ramp_start(int ch, uint16_t value, uint32_t duration, uint8_t curve) {
+    Ramp *ramp = &ramps[ch];
+    ramp->from = analog_values[ch];
+    ramp->to = value;
+    ramp->start = micros();
+    ramp->duration = duration;
+    ramp->curve = curve;
+    if (!ramp_channels) {
+        RAMP_TIMER->TASKS_STOP = 1;
+        RAMP_TIMER->TASKS_CLEAR = 1;
+        RAMP_TIMER->CC[0] = RAMP_UPDATE_US;
+        RAMP_TIMER->EVENTS_COMPARE[0] = 0;
+        RAMP_TIMER->TASKS_START = 1;
+    }
+    ramp_channels |= 1 << ch;
+}
+
+// Value of a ramp elapsed us after its start, which must be before its end.
+uint16_t ramp_value(const Ramp *ramp, uint32_t elapsed) {
+    if (ramp->curve == RAMP_EXPONENTIAL) {
+        float from = ramp->from > RAMP_EXPONENTIAL_FLOOR ? ramp->from : RAMP_EXPONENTIAL_FLOOR;
+        float to = ramp->to > RAMP_EXPONENTIAL_FLOOR ? ramp->to : RAMP_EXPONENTIAL_FLOOR;
+        return (uint16_t)(from * powf(to / from, (float)elapsed / ramp->duration) + 0.5f);
+    }
+    int32_t step = (int32_t)ramp->to - ramp->from;
+    return (uint16_t)(ramp->from + (int32_t)((int64_t)step * elapsed / ramp->duration));
+}
+
+// Ask loop() for a ramp update and schedule the next one. The compare value is taken from the
+// counter, so a late interrupt does not make the timer skip a full wrap-around.
+void ramp_isr() {
+    RAMP_TIMER->EVENTS_COMPARE[0] = 0;
+    RAMP_TIMER->TASKS_CAPTURE[1] = 1;
+    RAMP_TIMER->CC[0] = RAMP_TIMER->CC[1] + RAMP_UPDATE_US;
+    ramp_due = true;
+}
+
+void waveform_start() {
+    waveform_passes = 0;
+    waveform_pos = 0;
+    waveform_base = 0;
+    waveform_running = true;
+    WAVEFORM_TIMER->TASKS_CLEAR = 1;
+    WAVEFORM_TIMER->CC[0] = waveform[0].time;
+    WAVEFORM_TIMER->EVENTS_COMPARE[0] = 0;
+    WAVEFORM_TIMER->TASKS_START = 1;
+    NVIC_SetPendingIRQ(WAVEFORM_IRQ); // Events at time 0 are never matched by the counter
+}
+
+void waveform_stop() {
+    noInterrupts();
+    waveform_armed = false;
+    WAVEFORM_TIMER->TASKS_STOP = 1;
+    if (waveform_running) {
+        waveform_running = false;
+        write_digital_multi(waveform_channels, 0);
+    }
+    interrupts();
+}
+
+// Apply all events that are due and schedule the next one. Spurious calls return right away.
+void waveform_isr() {
+    WAVEFORM_TIMER->EVENTS_COMPARE[0] = 0;
+    if (!waveform_running) return;
+
+    for (;;) {
+        WAVEFORM_TIMER->TASKS_CAPTURE[1] = 1;
+        if ((int32_t)(WAVEFORM_TIMER->CC[0] - WAVEFORM_TIMER->CC[1]) > 0) return;
+
+        if (waveform_pos == waveform_length) { // End of the period
+            waveform_passes++;
+            if (waveform_repetitions != 0 && waveform_passes >= waveform_repetitions) {
+                WAVEFORM_TIMER->TASKS_STOP = 1;
+                waveform_running = false;
+                write_digital_multi(waveform_channels, 0);
+                return;
+            }
+            waveform_pos = 0;
+            waveform_base += waveform_period;
+        } else {
+            const WaveformEvent *event = &waveform[waveform_pos++];
+            if (event->on | event->off) write_digital_multi(event->on | event->off, event->on);
+            if (event->power_channel != WAVEFORM_NO_CHANNEL) {
+                waveform_power[event->power_channel] = event->power;
+                waveform_power_mask |= 1 << event->power_channel;
+            }
+        }
+
+        WAVEFORM_TIMER->CC[0] = waveform_base
+            + (waveform_pos == waveform_length ? waveform_period : waveform[waveform_pos].time);
+    }
+}
+
+// Send the telemetry that is due.
+void send_telemetry() {
+    sample_monitors();
+    if (telemetry_count != 0 && micros() - telemetry_first_us >= TELEMETRY_BATCH_US) flush_samples();
+
+    if (state_interval_ms != 0 && (int32_t)(millis() - state_next_ms) >= 0) {
+        state_next_ms += state_interval_ms;
+        if ((int32_t)(millis() - state_next_ms) >= 0) state_next_ms = millis() + state_interval_ms;
+        send_state();
+    }
+}
+
+// Read the monitor inputs if a sample is due. Samples missed while loop() was busy are skipped.
+void sample_monitors() {
+    uint32_t now = micros();
+    if (telemetry_interval_us == 0 || (int32_t)(now - telemetry_next_us) < 0) return;
+    telemetry_next_us += telemetry_interval_us;
+    if ((int32_t)(now - telemetry_next_us) >= 0) telemetry_next_us = now + telemetry_interval_us;
+
+    // Message: code, number of monitors, number of samples, then per sample its time (32 bit)
+    // and the reading of every monitor (16 bit)
+    size_t sample_size = 4 + 2 * number_of_monitors;
+    if (telemetry_count == 0) {
+        telemetry_length = 3;
+        telemetry_first_us = now;
+    }
+    put_u32(telemetry_samples + telemetry_length, now);
+    for (int m = 0; m < number_of_monitors; ++m) {
+        put_u16(telemetry_samples + telemetry_length + 4 + 2 * m, analogRead(monitor_pins[m]));
+    }
+    telemetry_length += sample_size;
+    telemetry_count++;
+    if (telemetry_length + sample_size > FRAME_MAX_MESSAGE) flush_samples();
+}
+
+void flush_samples() {
+    if (telemetry_count == 0) return;
+    telemetry_samples[0] = CODE_TELEMETRY_SAMPLES;
+    telemetry_samples[1] = number_of_monitors;
+    telemetry_samples[2] = telemetry_count;
+    send_message(telemetry_samples, telemetry_length);
+    telemetry_count = 0;
+}
+
+// Send a snapshot of the outputs: code, time in us (32 bit), number of channels, enable states
+// as set by commands, sequences and the waveform, actual enable pin levels, high time and period of
+// the first modulation output (16 bit each), then the DAC code of every channel (16 bit).
+void send_state() {
+    uint8_t message[16 + 2 * MAX_CHANNELS] = {CODE_TELEMETRY_STATE};
+    uint16_t states = 0;
+    uint16_t levels = 0;
+    for (int ch = 0; ch < number_of_channels; ++ch) {
+        if (output_states[ch]) states |= 1 << ch;
+        if (gpio_ports[enable_ports[ch]]->OUT & enable_bits[ch]) levels |= 1 << ch;
+    }
+    put_u32(message + 1, micros());
+    message[5] = number_of_channels;
+    put_u16(message + 6, states);
+    put_u16(message + 8, levels);
+    put_u16(message + 10, modulators[0].high);
+    put_u16(message + 12, modulators[0].top);
+    for (int ch = 0; ch < number_of_channels; ++ch) {
+        put_u16(message + 14 + 2 * ch, dac_codes[ch / CHANNELS_PER_DAC][ch % CHANNELS_PER_DAC]);
+    }
+    send_message(message, 14 + 2 * number_of_channels);
+}
+
+// Check a period word and high time as sent by the host.
+bool modulation_valid(uint16_t period, uint16_t high) {
+    uint16_t top = period & MODULATION_MAX_TOP;
+    return (period >> MODULATION_PRESCALER_SHIFT) <= MODULATION_MAX_PRESCALER && top >= MODULATION_MIN_TOP
+        && high <= top;
+}
+
+// Set the period and high time of a modulation output from the next period on. Safe to call from
+// interrupts as long as the prescaler does not change.
+void set_modulation(int m, uint16_t period, uint16_t high) {
+    Modulator *mod = &modulators[m];
+    NRF_PWM_Type *pwm = modulation_pwms[m];
+    uint8_t prescaler = period >> MODULATION_PRESCALER_SHIFT;
+    uint8_t slot = mod->slot ^ 1;
+    mod->top = period & MODULATION_MAX_TOP;
+    mod->high = high;
+    mod->slots[slot][0] = 0x8000 | high; // Falling edge (bit 15): high until the compare value
+    mod->slots[slot][1] = 0;
+    mod->slots[slot][2] = 0;
+    mod->slots[slot][3] = mod->top;
+    mod->slot = slot;
+    if (prescaler != mod->prescaler) {
+        // The prescaler only takes effect on a stopped PWM; disabling it stops it right away.
+        pwm->ENABLE = PWM_ENABLE_ENABLE_Disabled << PWM_ENABLE_ENABLE_Pos;
+        pwm->PRESCALER = prescaler << PWM_PRESCALER_PRESCALER_Pos;
+        if (mod->attached) pwm->ENABLE = PWM_ENABLE_ENABLE_Enabled << PWM_ENABLE_ENABLE_Pos;
+        mod->prescaler = prescaler;
+    }
+    if (mod->attached) pwm->TASKS_SEQSTART[slot] = 1;
+}
+
+// Connect the pin of a modulation output to its PWM. The pin is low until the next
+// set_modulation() starts a period.
+void attach_modulation(int m) {
+    Modulator *mod = &modulators[m];
+    NRF_PWM_Type *pwm = modulation_pwms[m];
+    if (mod->attached) return;
+    pinMode(modulation_pins[m], OUTPUT);
+    digitalWrite(modulation_pins[m], LOW);
+    pwm->PSEL.OUT[0] = ((uint32_t)digitalPinToPinName(modulation_pins[m]) << PWM_PSEL_OUT_PIN_Pos)
+        | (PWM_PSEL_OUT_CONNECT_Connected << PWM_PSEL_OUT_CONNECT_Pos);
+    pwm->ENABLE = PWM_ENABLE_ENABLE_Enabled << PWM_ENABLE_ENABLE_Pos;
+    mod->attached = true;
+}
+
+// Stop a modulation output and return its pin to a high-impedance input.
+void detach_modulation(int m) {
+    Modulator *mod = &modulators[m];
+    NRF_PWM_Type *pwm = modulation_pwms[m];
+    if (!mod->attached) return;
+    pwm->ENABLE = PWM_ENABLE_ENABLE_Disabled << PWM_ENABLE_ENABLE_Pos;
+    pwm->PSEL.OUT[0] = PWM_PSEL_OUT_CONNECT_Disconnected << PWM_PSEL_OUT_CONNECT_Pos;
+    pinMode(modulation_pins[m], INPUT);
+    mod->attached = false;
+}
+
+// Pulse the first modulation output at 1 MHz with 75 % duty cycle and release the others.
+void reset_modulation() {
+    for (int m = 0; m < number_of_modulators; ++m) {
+        set_modulation(m, 16, m == 0 ? 12 : 0);
+        if (m != 0) detach_modulation(m);
+    }
+}
@@ -0,0 +1,352 @@
+/* Protocol.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Messages of the serial protocol, shared by the Arduino program and the device adapter.
+//
+// Every command message is [code, sequence number, payload...] and sent as a frame (see
+// Framing.h). The Arduino answers each command with [CODE_ACK, sequence number, status] once it
+// has been executed, and frames it could not decode with [CODE_FRAME_ERROR]. Commands that return
+// data append it to their acknowledgement. Telemetry messages are sent by the Arduino on its own
+// and carry no sequence number. Multi-byte values are sent low byte first.
+//
+// The message_*() functions encode commands into a Message on the stack. They are constexpr, so
+// the layouts below are checked at compile time.
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Framing.h"
+
+#define BAUD 115200
+
+// Version of the protocol, reported by CODE_IDENTIFY and CODE_GET_INFO
+#define PROTOCOL_VERSION 8
+
+// Command codes, see the encoders below for their payloads
+#define CODE_OPEN 0x00
+#define CODE_CLOSE 0x01
+#define CODE_WRITE_ANALOG 0x02
+#define CODE_WRITE_DIGITAL 0x03
+#define CODE_SET_MODULATION 0x04
+#define CODE_CLEAR_SEQUENCE 0x05
+#define CODE_LOAD_SEQUENCE 0x06
+#define CODE_START_SEQUENCE 0x07
+#define CODE_STOP_SEQUENCE 0x08
+#define CODE_WRITE_ANALOG_MULTI 0x0B
+#define CODE_WRITE_DIGITAL_MULTI 0x0C
+#define CODE_GET_STATS 0x0D
+#define CODE_WAVEFORM_CLEAR 0x12
+#define CODE_WAVEFORM_LOAD 0x13
+#define CODE_WAVEFORM_START 0x14
+#define CODE_WAVEFORM_STOP 0x15
+#define CODE_WAVEFORM_STATUS 0x16
+#define CODE_SET_BLANKING 0x17
+#define CODE_GET_INFO 0x18
+#define CODE_CLEAR_CALIBRATION 0x19
+#define CODE_LOAD_CALIBRATION 0x1A
+#define CODE_SET_TELEMETRY 0x1B
+#define CODE_IDENTIFY 0x1E
+#define CODE_GET_STATE 0x1F
+#define CODE_RAMP 0x20
+
+// Codes of the messages sent by the Arduino
+#define CODE_ACK 0x10
+#define CODE_FRAME_ERROR 0x11
+#define CODE_TELEMETRY_SAMPLES 0x1C
+#define CODE_TELEMETRY_STATE 0x1D
+
+// Status of an acknowledgement
+#define STATUS_OK 0x00
+#define STATUS_UNKNOWN_CODE 0x01
+#define STATUS_INVALID_CHANNEL 0x02
+#define STATUS_INVALID_LENGTH 0x03
+#define STATUS_SEQUENCE_FULL 0x04
+#define STATUS_SEQUENCE_RUNNING 0x05
+#define STATUS_INVALID_VALUE 0x06
+
+// Sequence types used by the sequence codes
+#define SEQUENCE_ANALOG 0x00
+#define SEQUENCE_DIGITAL 0x01
+#define SEQUENCE_MODULATION 0x02 // Channel is the modulation output, two values per entry
+
+// Flags of CODE_CLOSE. Without CLOSE_KEEP_OUTPUTS all lasers are turned off.
+#define CLOSE_KEEP_OUTPUTS 0x01
+
+// Flags of CODE_WAVEFORM_START. With WAVEFORM_START_ON_TRIGGER the waveform is armed and starts
+// at the next rising edge of the trigger input, so boards sharing a trigger line start together.
+#define WAVEFORM_START_ON_TRIGGER 0x01
+
+// Curves of CODE_RAMP. A linear ramp changes the output by the same amount at every update, an
+// exponential one by the same factor, so it progresses evenly on a logarithmic scale. Exponential
+// ramps treat values below RAMP_EXPONENTIAL_FLOOR as that value, so that they can start or end at
+// 0; the last update always writes the exact target.
+#define RAMP_LINEAR 0x00
+#define RAMP_EXPONENTIAL 0x01
+#define RAMP_EXPONENTIAL_FLOOR 64 // 16-bit relative value, 1/1024 of full scale
+
+// Modulation outputs are driven by the PWMs of the nRF52840, counting a MODULATION_CLOCK divided
+// by 2^prescaler. CODE_SET_MODULATION and every entry of a modulation sequence hold two 16-bit
+// words: the period in counts with the prescaler in the bits from MODULATION_PRESCALER_SHIFT up,
+// and the counts the output is high at the start of each period, up to the full period. All
+// entries of a sequence must use the same prescaler.
+#define MODULATION_CLOCK 16000000
+#define MODULATION_PRESCALER_SHIFT 13
+#define MODULATION_MAX_PRESCALER 7
+#define MODULATION_MIN_TOP 3
+#define MODULATION_MAX_TOP ((1 << MODULATION_PRESCALER_SHIFT) - 1)
+
+// Reply of CODE_IDENTIFY that identifies the Arduino program, followed by the protocol version
+#define FIRMWARE_ID "LDD"
+#define FIRMWARE_ID_LENGTH 3
+
+// Channels are selected by 16-bit masks
+#define PROTOCOL_MAX_CHANNELS 16
+
+// No power change in a waveform event
+#define WAVEFORM_NO_CHANNEL 0xFF
+
+// Largest DAC code and monitor reading. The MCP4728 is 12-bit and the monitor inputs are read
+// with ADC_RESOLUTION bits.
+#define DAC_MAX_CODE 4095
+#define ADC_RESOLUTION 12
+#define MONITOR_FULL_SCALE ((1 << ADC_RESOLUTION) - 1)
+
+// Fastest monitor sampling in samples per second
+#define TELEMETRY_MAX_RATE 5000
+
+// Code and sequence number in front of every command payload
+#define MESSAGE_HEADER_SIZE 2
+
+// Payload sizes of the commands with a variable number of entries
+#define WAVEFORM_EVENT_SIZE 11
+#define SEQUENCE_VALUES_PER_FRAME ((FRAME_MAX_MESSAGE - MESSAGE_HEADER_SIZE - 2) / 2)
+#define CALIBRATION_VALUES_PER_FRAME ((FRAME_MAX_MESSAGE - MESSAGE_HEADER_SIZE - 1) / 2)
+#define WAVEFORM_EVENTS_PER_FRAME ((FRAME_MAX_MESSAGE - MESSAGE_HEADER_SIZE) / WAVEFORM_EVENT_SIZE)
+
+// Offsets in the reply of CODE_GET_INFO and CODE_GET_STATE, where the per-channel entries start
+#define INFO_CHANNELS_OFFSET 12
+#define STATE_CHANNELS_OFFSET 5
+
+constexpr void put_u16(uint8_t *data, uint16_t value) {
+    data[0] = (uint8_t)value;
+    data[1] = (uint8_t)(value >> 8);
+}
+
+constexpr void put_u32(uint8_t *data, uint32_t value) {
+    put_u16(data, (uint16_t)value);
+    put_u16(data + 2, (uint16_t)(value >> 16));
+}
+
+constexpr uint16_t get_u16(const uint8_t *data) {
+    return (uint16_t)(data[0] | (data[1] << 8));
+}
+
+constexpr uint32_t get_u32(const uint8_t *data) {
+    return get_u16(data) | ((uint32_t)get_u16(data + 2) << 16);
+}
+
+// Command message. The sequence number is filled in when the message is sent. Bytes beyond
+// FRAME_MAX_MESSAGE are dropped, so callers keep to the *_PER_FRAME limits.
+struct Message {
+    uint8_t data[FRAME_MAX_MESSAGE];
+    size_t length;
+};
+
+constexpr void message_put_u8(Message &message, uint8_t value) {
+    if (message.length < FRAME_MAX_MESSAGE) message.data[message.length++] = value;
+}
+
+constexpr void message_put_u16(Message &message, uint16_t value) {
+    message_put_u8(message, (uint8_t)value);
+    message_put_u8(message, (uint8_t)(value >> 8));
+}
+
+constexpr void message_put_u32(Message &message, uint32_t value) {
+    message_put_u16(message, (uint16_t)value);
+    message_put_u16(message, (uint16_t)(value >> 16));
+}
+
+// Commands without payload: CODE_OPEN, CODE_GET_STATS, CODE_WAVEFORM_CLEAR, CODE_WAVEFORM_STOP,
+// CODE_WAVEFORM_STATUS, CODE_GET_INFO, CODE_IDENTIFY and CODE_GET_STATE
+constexpr Message message_begin(uint8_t code) {
+    Message message = {};
+    message_put_u8(message, code);
+    message_put_u8(message, 0);
+    return message;
+}
+
+// Payload: flags
+constexpr Message message_close(uint8_t flags) {
+    Message message = message_begin(CODE_CLOSE);
+    message_put_u8(message, flags);
+    return message;
+}
+
+// Payload: channel, 16-bit relative value
+constexpr Message message_write_analog(uint8_t channel, uint16_t value) {
+    Message message = message_begin(CODE_WRITE_ANALOG);
+    message_put_u8(message, channel);
+    message_put_u16(message, value);
+    return message;
+}
+
+// Payload: channel, value (0 or 1)
+constexpr Message message_write_digital(uint8_t channel, bool value) {
+    Message message = message_begin(CODE_WRITE_DIGITAL);
+    message_put_u8(message, channel);
+    message_put_u8(message, value ? 1 : 0);
+    return message;
+}
+
+// Payload: channel mask, followed by the relative value of every channel in the mask in the order
+// of the channels. values holds one entry per channel.
+constexpr Message message_write_analog_multi(uint16_t mask, const uint16_t *values) {
+    Message message = message_begin(CODE_WRITE_ANALOG_MULTI);
+    message_put_u16(message, mask);
+    for (int ch = 0; ch < PROTOCOL_MAX_CHANNELS; ++ch) {
+        if (mask & (1u << ch)) message_put_u16(message, values[ch]);
+    }
+    return message;
+}
+
+// Payload: channel mask, values (bit n for channel n)
+constexpr Message message_write_digital_multi(uint16_t mask, uint16_t values) {
+    Message message = message_begin(CODE_WRITE_DIGITAL_MULTI);
+    message_put_u16(message, mask);
+    message_put_u16(message, values & mask);
+    return message;
+}
+
+// Payload: modulation output, period with prescaler and high time (16 bit each)
+constexpr Message message_set_modulation(uint8_t output, uint16_t period, uint16_t high) {
+    Message message = message_begin(CODE_SET_MODULATION);
+    message_put_u8(message, output);
+    message_put_u16(message, period);
+    message_put_u16(message, high);
+    return message;
+}
+
+// CODE_CLEAR_SEQUENCE, CODE_START_SEQUENCE and CODE_STOP_SEQUENCE. Payload: channel, type.
+// CODE_LOAD_SEQUENCE appends up to SEQUENCE_VALUES_PER_FRAME 16-bit values to this.
+constexpr Message message_sequence(uint8_t code, uint8_t channel, uint8_t type) {
+    Message message = message_begin(code);
+    message_put_u8(message, channel);
+    message_put_u8(message, type);
+    return message;
+}
+
+// Event of a CODE_WAVEFORM_LOAD message, up to WAVEFORM_EVENTS_PER_FRAME per message. Layout:
+// time in us (32 bit), channels switched on and off (16 bit each), channel whose power is set or
+// WAVEFORM_NO_CHANNEL, power (16 bit). Times must not decrease.
+constexpr void message_put_waveform_event(Message &message, uint32_t time, uint16_t on, uint16_t off,
+                                          uint8_t power_channel, uint16_t power) {
+    message_put_u32(message, time);
+    message_put_u16(message, on);
+    message_put_u16(message, off);
+    message_put_u8(message, power_channel);
+    message_put_u16(message, power);
+}
+
+// Payload: enable outputs turned off at the end (16 bit), number of periods (16 bit, 0 repeats
+// until stopped), period in us (32 bit) and flags
+constexpr Message message_waveform_start(uint16_t mask, uint16_t repetitions, uint32_t period_us, uint8_t flags) {
+    Message message = message_begin(CODE_WAVEFORM_START);
+    message_put_u16(message, mask);
+    message_put_u16(message, repetitions);
+    message_put_u32(message, period_us);
+    message_put_u8(message, flags);
+    return message;
+}
+
+// Payload: channel, 16-bit relative value to end at, duration in us (32 bit), curve
+constexpr Message message_ramp(uint8_t channel, uint16_t value, uint32_t duration_us, uint8_t curve) {
+    Message message = message_begin(CODE_RAMP);
+    message_put_u8(message, channel);
+    message_put_u16(message, value);
+    message_put_u32(message, duration_us);
+    message_put_u8(message, curve);
+    return message;
+}
+
+// Payload: blanked channels (16 bit), polarity of the exposure input (0 active high, 1 active low)
+constexpr Message message_set_blanking(uint16_t mask, bool active_low) {
+    Message message = message_begin(CODE_SET_BLANKING);
+    message_put_u16(message, mask);
+    message_put_u8(message, active_low ? 1 : 0);
+    return message;
+}
+
+// CODE_CLEAR_CALIBRATION. Payload: channel. CODE_LOAD_CALIBRATION appends up to
+// CALIBRATION_VALUES_PER_FRAME 16-bit DAC codes to this.
+constexpr Message message_calibration(uint8_t code, uint8_t channel) {
+    Message message = message_begin(code);
+    message_put_u8(message, channel);
+    return message;
+}
+
+// Payload: monitor samples per second and interval of the state snapshots in ms (16 bit each),
+// 0 turns either off
+constexpr Message message_set_telemetry(uint16_t rate, uint16_t interval_ms) {
+    Message message = message_begin(CODE_SET_TELEMETRY);
+    message_put_u16(message, rate);
+    message_put_u16(message, interval_ms);
+    return message;
+}
+
+// Replies:
+// CODE_GET_STATS: executed commands, time spent executing them in us, undecodable frames (32 bit
+//   each), receive buffer peak (16 bit)
+// CODE_WAVEFORM_STATUS: 1 if running, completed periods (32 bit)
+// CODE_GET_INFO: protocol version, number of channels, maximum sequence length, maximum number of
+//   waveform events, receive buffer size and calibration table size (16 bit each), number of
+//   monitor inputs, number of modulation outputs, then the DAC address and output of every channel
+// CODE_IDENTIFY: FIRMWARE_ID, protocol version, 1 if the outputs were set by a host since the
+//   board started
+// CODE_GET_STATE: enabled and blanked channels (16 bit each), polarity of the exposure input, then
+//   the relative value of every channel (16 bit)
+//
+// Telemetry:
+// CODE_TELEMETRY_SAMPLES: number of monitors, number of samples, then per sample its time in us
+//   (32 bit) and the reading of every monitor (16 bit)
+// CODE_TELEMETRY_STATE: time in us (32 bit), number of channels, enabled channels and enable
+//   outputs that are high (16 bit each), high time and period of the first modulation output in
+//   counts (16 bit each), then the DAC code of every channel (16 bit)
+
+static_assert(SEQUENCE_VALUES_PER_FRAME > 0 && CALIBRATION_VALUES_PER_FRAME > 0 && WAVEFORM_EVENTS_PER_FRAME > 0,
+              "Frames must hold at least one entry of every command");
+static_assert(MESSAGE_HEADER_SIZE + 2 + 2 * PROTOCOL_MAX_CHANNELS <= FRAME_MAX_MESSAGE,
+              "CODE_WRITE_ANALOG_MULTI must fit into a frame for all channels");
+static_assert(FRAME_ENCODED_SIZE(FRAME_MAX_MESSAGE) == FRAME_MAX_ENCODED, "Inconsistent frame size");
+static_assert(message_write_analog(2, 0x1234).length == MESSAGE_HEADER_SIZE + 3
+              && message_write_analog(2, 0x1234).data[3] == 0x34 && message_write_analog(2, 0x1234).data[4] == 0x12,
+              "CODE_WRITE_ANALOG layout");
+static_assert(message_waveform_start(0, 0, 0, 0).length == MESSAGE_HEADER_SIZE + 9, "CODE_WAVEFORM_START layout");
+static_assert(message_set_blanking(0, false).length == MESSAGE_HEADER_SIZE + 3, "CODE_SET_BLANKING layout");
+static_assert(message_ramp(0, 0, 0, 0).length == MESSAGE_HEADER_SIZE + 8, "CODE_RAMP layout");
+static_assert(message_set_modulation(0, 0, 0).length == MESSAGE_HEADER_SIZE + 5, "CODE_SET_MODULATION layout");
+static_assert(MODULATION_MAX_PRESCALER < (1 << (16 - MODULATION_PRESCALER_SHIFT)), "Prescaler must fit into the period word");
+
+#endif // PROTOCOL_H_
@@ -0,0 +1,158 @@
+/* Bench.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Measures latency and throughput of the Arduino interface board, either against a real board
+// or against the emulator in tools/emulator. Exits with a non-zero status if the board reports
+// an error, so it can be used as an end-to-end test.
+
+#include "Arduino.h"
+#include "TcpLink.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed_us(Clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+void print_latencies(const char *name, std::vector<double> &latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    size_t n = latencies.size();
+    printf("%-28s p50 %8.1f us  p99 %8.1f us  max %8.1f us  (n=%zu)\n", name,
+           latencies[n / 2], latencies[std::min(n - 1, n * 99 / 100)], latencies[n - 1], n);
+}
+
+int report_errors(Arduino &board) {
+    int count = 0;
+    for (std::string error = board.PopError(); !error.empty(); error = board.PopError()) {
+        fprintf(stderr, "error: %s\n", error.c_str());
+        ++count;
+    }
+    return count;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    bool low_latency = false, tcp = false;
+    while (argc > 1 && argv[argc - 1][0] == '-') {
+        std::string option = argv[argc - 1];
+        if (option == "--low-latency") low_latency = true;
+        else if (option == "--tcp") tcp = true;
+        else argc = 0;
+        --argc;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s PORT [ITERATIONS] [--low-latency] [--tcp]\n"
+                        "  --tcp  PORT is the address of tools/server instead of a serial port\n", argv[0]);
+        return 1;
+    }
+    int iterations = argc > 2 ? atoi(argv[2]) : 200;
+    if (iterations < 1) iterations = 1;
+
+    std::unique_ptr<Link> link(tcp ? static_cast<Link *>(new TcpLink()) : new SerialLink(BAUD));
+    Arduino board(argv[1], std::move(link));
+    if (low_latency && board.SetLowLatency(true) != 0) {
+        fprintf(stderr, "Could not enable the low latency mode\n");
+        return 1;
+    }
+    auto start = Clock::now();
+    if (board.Open() != 0) {
+        fprintf(stderr, "Could not open %s\n", argv[1]);
+        return 1;
+    }
+    printf("%-28s %8.1f us\n", "open", elapsed_us(start));
+    const int channels = board.GetNumberOfChannels();
+    if (channels == 0) return 1;
+
+    // Round trip of a single write, from the call until its acknowledgement
+    std::vector<double> latencies;
+    for (int i = 0; i < iterations; ++i) {
+        start = Clock::now();
+        if (board.WriteAnalogRelative(i % channels, (i % 100) / 100.0) != 0 || board.Flush() != 0) return 1;
+        latencies.push_back(elapsed_us(start));
+    }
+    print_latencies("analog write", latencies);
+
+    latencies.clear();
+    for (int i = 0; i < iterations; ++i) {
+        start = Clock::now();
+        if (board.WriteDigital(i % channels, i % 2 != 0) != 0 || board.Flush() != 0) return 1;
+        latencies.push_back(elapsed_us(start));
+    }
+    print_latencies("digital write", latencies);
+
+    latencies.clear();
+    std::vector<double> values(channels);
+    for (int i = 0; i < iterations; ++i) {
+        for (int ch = 0; ch < channels; ++ch) values[ch] = ((i + ch) % 100) / 100.0;
+        start = Clock::now();
+        if (board.WriteAnalogRelativeMulti((1u << channels) - 1, values) != 0 || board.Flush() != 0) return 1;
+        latencies.push_back(elapsed_us(start));
+    }
+    print_latencies(("analog write, " + std::to_string(channels) + " channels").c_str(), latencies);
+
+    // Sustained writes; values the board can not keep up with are coalesced on the host.
+    start = Clock::now();
+    for (int i = 0; i < iterations * 100; ++i) {
+        if (board.WriteAnalogRelative(i % channels, (i % 1000) / 1000.0) != 0) return 1;
+    }
+    double enqueue_us = elapsed_us(start);
+    if (board.Flush() != 0) return 1;
+    printf("%-28s %8.0f writes/s enqueued, all applied after %.1f ms\n", "analog write burst",
+           iterations * 100 / enqueue_us * 1e6, elapsed_us(start) / 1000);
+
+    std::vector<double> sequence(board.GetMaxSequenceLength());
+    for (size_t i = 0; i < sequence.size(); ++i) sequence[i] = (double)i / sequence.size();
+    start = Clock::now();
+    if (board.LoadAnalogSequence(0, sequence) != 0) return 1;
+    printf("%-28s %8.1f us for %zu values\n", "sequence load", elapsed_us(start), sequence.size());
+
+    // The board's own figures are queried in the background and arrive with a later call.
+    BoardStatistics stats;
+    board.GetStatistics(stats);
+    for (int i = 0; i < 100 && stats.board_commands_per_second == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        board.GetStatistics(stats);
+    }
+    printf("%-28s p50 %8llu us  p99 %8llu us  max %8llu us\n", "board write latency",
+           (unsigned long long)stats.write_latency_p50_us, (unsigned long long)stats.write_latency_p99_us,
+           (unsigned long long)stats.write_latency_max_us);
+    printf("%-28s %llu commands, %llu bytes, %llu resyncs\n", "board totals",
+           (unsigned long long)stats.commands, (unsigned long long)stats.bytes_sent,
+           (unsigned long long)stats.resyncs);
+    printf("%-28s %llu commands/s, receive buffer peak %llu bytes\n", "board processing",
+           (unsigned long long)stats.board_commands_per_second, (unsigned long long)stats.board_buffer_peak);
+
+    return report_errors(board) == 0 ? 0 : 1;
+}
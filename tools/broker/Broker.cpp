@@ -0,0 +1,731 @@
+/* Broker.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Opens the Arduino interface board once and shares it with other processes on the same machine
+// through POSIX shared memory, see SharedMemory.h for the layout. Clients, like the device adapter
+// with the "Shared Memory" device type, can come and go while the broker keeps the port open.
+
+#include "Arduino.h"
+#include "MultiBoard.h"
+#include "SharedMemory.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <grp.h>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Interval between checks for clients that exited without releasing their slot in ms
+const unsigned int CLIENT_CHECK_INTERVAL = 1000;
+
+// Longest sleep while idle in us, shorter while the board has unacknowledged commands so the
+// busy flag follows the board closely
+const unsigned int IDLE_WAIT_US = 10000;
+const unsigned int BUSY_WAIT_US = 200;
+
+// Time after which a ring slot that a client claimed but never filled is skipped in ms. Filling a
+// slot takes a few instructions, so the client has died or been stopped in between. Shorter than
+// SHARED_RING_TIMEOUT, after which clients waiting for a full ring give up.
+const unsigned int RING_SLOT_TIMEOUT = 100;
+
+volatile sig_atomic_t running = 1;
+
+// Whether a relative output or duty cycle sent by a client can be passed to the board
+bool valid_fraction(double value) {
+    return std::isfinite(value) && value >= 0.0 && value <= 1.0;
+}
+
+void on_signal(int) {
+    running = 0;
+}
+
+void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s PORT[,PORT...] [--name NAME] [--shared-trigger] [--keep-outputs] [--low-latency]\n"
+            "          [--max-in-flight N] [--group GROUP] [--mode MODE]\n"
+            "  PORT             serial port of the Arduino, Auto to search for it; several ports\n"
+            "                   separated by commas combine the boards\n"
+            "  --name           name of the shared memory object, default " SHARED_MEMORY_DEFAULT_NAME "\n"
+            "  --shared-trigger the trigger inputs of all boards are wired to the same line\n"
+            "  --keep-outputs   leave the lasers as they are when the broker exits\n"
+            "  --low-latency    use the low-latency serial mode\n"
+            "  --max-in-flight  commands sent ahead of their acknowledgements\n"
+            "  --group          group that owns the shared memory, for clients that run as other users\n"
+            "  --mode           octal permissions of the shared memory, default 600, or 660 with --group;\n"
+            "                   other users can not be given access\n",
+            name);
+}
+
+// A process that exited but was not waited for by its parent counts as gone.
+bool process_alive(int32_t pid) {
+    if (pid <= 0 || (kill(pid, 0) != 0 && errno != EPERM)) return false;
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file == nullptr) return true;
+    char state = 0;
+    int fields = fscanf(file, "%*d (%*[^)]) %c", &state);
+    fclose(file);
+    return fields != 1 || state != 'Z';
+}
+
+// Whether a broker that is still running owns the shared memory object name
+bool broker_running(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return errno == EACCES; // Owned by a broker of another user, it can not be replaced
+    bool alive = false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SharedMemory)) {
+        void *memory = mmap(nullptr, sizeof(SharedMemory), PROT_READ, MAP_SHARED, fd, 0);
+        if (memory != MAP_FAILED) {
+            const SharedMemory *shm = static_cast<const SharedMemory *>(memory);
+            alive = shm->magic.load() == SHARED_MEMORY_MAGIC && process_alive(shm->broker_pid);
+            munmap(memory, sizeof(SharedMemory));
+        }
+    }
+    close(fd);
+    return alive;
+}
+
+class Broker {
+    public:
+        Broker(InterfaceBoard &board, SharedMemory *shm) : board_(board), shm_(shm) {}
+        void Start();
+        void Run();
+        void Stop();
+    private:
+        bool DrainRing();
+        bool HandleRequests();
+        void Execute(SharedClient &client);
+        int Reject(const std::string &error);
+        void QueueError(const std::string &error);
+        void Publish();
+        void CheckClients();
+
+        InterfaceBoard &board_;
+        SharedMemory *shm_;
+        unsigned int number_of_channels_ = 0;
+        OutputState outputs_;         // Outputs as set through the broker
+        std::vector<double> values_;  // Values of the write being executed
+        std::deque<std::string> errors_; // At most MAX_QUEUED_ERRORS, the oldest are dropped
+        uint64_t stalled_position_ = UINT64_MAX; // Ring position claimed but not filled, if any
+        Clock::time_point stalled_since_;
+};
+
+// Fills in the board's info and outputs and publishes the shared memory to clients.
+void Broker::Start() {
+    number_of_channels_ = std::min(board_.GetNumberOfChannels(), (unsigned int)SHARED_MAX_CHANNELS);
+    board_.GetOutputState(outputs_);
+    outputs_.relative_values.resize(number_of_channels_, 0.0);
+    values_.resize(number_of_channels_, 0.0);
+
+    SharedInfo &info = shm_->info;
+    info.number_of_channels = number_of_channels_;
+    for (unsigned int ch = 0; ch < number_of_channels_; ++ch) {
+        board_.GetChannelOutput(ch, info.dac_addresses[ch], info.dac_outputs[ch]);
+    }
+    info.max_sequence_length = board_.GetMaxSequenceLength();
+    info.max_waveform_events = board_.GetMaxWaveformEvents();
+    info.calibration_size = board_.GetCalibrationSize();
+    info.number_of_monitors = board_.GetNumberOfMonitors();
+    info.number_of_modulators = board_.GetNumberOfModulators();
+
+    for (uint64_t i = 0; i < SHARED_RING_SIZE; ++i) shm_->ring[i].sequence.store(i, std::memory_order_relaxed);
+    shm_->version = SHARED_MEMORY_VERSION;
+    shm_->broker_pid = getpid();
+    Publish();
+    shm_->magic.store(SHARED_MEMORY_MAGIC, std::memory_order_release);
+}
+
+// Executes writes and requests as they come in. Spins for a while after the last piece of work
+// and then sleeps until a client rings the doorbell.
+void Broker::Run() {
+    Clock::time_point last_work = Clock::now();
+    Clock::time_point last_check = last_work;
+    while (running) {
+        bool worked = DrainRing();
+        worked = HandleRequests() || worked;
+        if (worked) {
+            Publish();
+            last_work = Clock::now();
+            continue;
+        }
+
+        Clock::time_point now = Clock::now();
+        if (now - last_check > std::chrono::milliseconds(CLIENT_CHECK_INTERVAL)) {
+            CheckClients();
+            last_check = now;
+        }
+        if (now - last_work < std::chrono::microseconds(SHARED_SPIN_US)) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        // Clients ring the doorbell after posting work, so work posted after it was read makes
+        // the wait return right away.
+        shm_->broker_waiting.store(1);
+        uint32_t doorbell = shm_->doorbell.load();
+        uint64_t tail = shm_->ring_tail.load();
+        bool pending = shm_->ring[tail % SHARED_RING_SIZE].sequence.load() == tail + 1;
+        for (const auto &client : shm_->clients) pending = pending || client.state.load() == SHARED_CLIENT_REQUEST;
+        if (!pending) shared_wait(&shm_->doorbell, doorbell, board_.Busy() ? BUSY_WAIT_US : IDLE_WAIT_US);
+        shm_->broker_waiting.store(0);
+        Publish();
+    }
+}
+
+// Tells clients that the broker is gone. Waiting clients notice it right away.
+void Broker::Stop() {
+    shm_->magic.store(0, std::memory_order_release);
+    for (auto &client : shm_->clients) shared_wake(&client.state);
+}
+
+// Executes the writes in the command ring in the order they were pushed. A slot that stays
+// claimed for RING_SLOT_TIMEOUT is skipped, so a client that died while writing does not block
+// the ring.
+bool Broker::DrainRing() {
+    bool worked = false;
+    for (;;) {
+        uint64_t position = shm_->ring_tail.load(std::memory_order_relaxed);
+        SharedWrite &slot = shm_->ring[position % SHARED_RING_SIZE];
+        uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence < position) {
+            // Filled after it was skipped a lap earlier; free it again for the waiting clients.
+            slot.sequence.compare_exchange_strong(sequence, position, std::memory_order_release);
+            break;
+        }
+        if (sequence != position + 1) {
+            if (shm_->ring_head.load(std::memory_order_relaxed) <= position) break;
+            Clock::time_point now = Clock::now();
+            if (stalled_position_ != position) {
+                stalled_position_ = position;
+                stalled_since_ = now;
+            }
+            if (now - stalled_since_ < std::chrono::milliseconds(RING_SLOT_TIMEOUT)) break;
+            QueueError("A client stopped while pushing a write; the write was dropped.");
+        } else if (slot.type == SHARED_WRITE_ANALOG) {
+            uint32_t mask = slot.channel_mask;
+            bool valid = (uint64_t)mask >> number_of_channels_ == 0;
+            for (unsigned int ch = 0; valid && ch < number_of_channels_; ++ch) {
+                if (!(mask & (1u << ch))) continue;
+                values_[ch] = slot.relative_values[ch];
+                valid = valid_fraction(values_[ch]);
+            }
+            if (!valid) {
+                QueueError("A write of a client was dropped, it selected a missing channel or a value outside 0 to 1.");
+            } else {
+                for (unsigned int ch = 0; ch < number_of_channels_; ++ch) {
+                    if (mask & (1u << ch)) outputs_.relative_values[ch] = values_[ch];
+                }
+                if (board_.WriteAnalogRelativeMulti(mask, values_) != 0) QueueError("A write of a client could not be queued.");
+            }
+        } else if (slot.type == SHARED_WRITE_DIGITAL) {
+            uint32_t mask = slot.channel_mask;
+            uint32_t digital_values = slot.digital_values;
+            if ((uint64_t)mask >> number_of_channels_) {
+                QueueError("A write of a client was dropped, it selected a missing channel.");
+            } else {
+                outputs_.enable_mask = (outputs_.enable_mask & ~mask) | (digital_values & mask);
+                if (board_.WriteDigitalMulti(mask, digital_values) != 0) QueueError("A write of a client could not be queued.");
+            }
+        } else {
+            QueueError("A write of a client was dropped, its type is unknown.");
+        }
+
+        slot.sequence.store(position + SHARED_RING_SIZE, std::memory_order_release);
+        shm_->ring_tail.store(position + 1, std::memory_order_release);
+        worked = true;
+    }
+    return worked;
+}
+
+void Broker::QueueError(const std::string &error) {
+    errors_.push_back(error);
+    if (errors_.size() > MAX_QUEUED_ERRORS) errors_.pop_front();
+}
+
+// Fails a request whose arguments are not passed to the board. The client reads the reason with
+// PopError().
+int Broker::Reject(const std::string &error) {
+    QueueError(error);
+    return 1;
+}
+
+// Executes the requests whose writes were all taken from the ring.
+bool Broker::HandleRequests() {
+    bool worked = false;
+    uint64_t tail = shm_->ring_tail.load(std::memory_order_relaxed);
+    for (auto &client : shm_->clients) {
+        if (client.state.load(std::memory_order_acquire) != SHARED_CLIENT_REQUEST || client.ring_position > tail) continue;
+        Execute(client);
+        client.state.store(SHARED_CLIENT_REPLY, std::memory_order_release);
+        shared_wake(&client.state);
+        worked = true;
+    }
+    return worked;
+}
+
+// Calls the board with the arguments of the request and replaces them with the reply.
+//
+// Clients are not trusted: arrays are only read within the slot and up to what the board takes,
+// and channels and values are checked before they reach the board.
+void Broker::Execute(SharedClient &client) {
+    const SharedInfo &info = shm_->info;
+    uint32_t position = 0;
+    uint32_t channel = 0;
+    int result = 1;
+    switch (client.request) {
+        case SHARED_REQUEST_FLUSH:
+            client.size = 0;
+            result = board_.Flush();
+            break;
+        case SHARED_REQUEST_POP_ERROR:
+        {
+            std::string error;
+            if (!errors_.empty()) {
+                error = errors_.front();
+                errors_.pop_front();
+            } else {
+                error = board_.PopError();
+            }
+            client.size = (uint32_t)std::min(error.size(), (size_t)SHARED_REQUEST_SIZE);
+            memcpy(client.data, error.data(), client.size);
+            result = 0;
+        }
+            break;
+        case SHARED_REQUEST_LOAD_ANALOG_SEQUENCE:
+        case SHARED_REQUEST_LOAD_CALIBRATION:
+        {
+            std::vector<double> values;
+            uint32_t max_count = client.request == SHARED_REQUEST_LOAD_CALIBRATION ? info.calibration_size
+                                                                                 : info.max_sequence_length;
+            if (!shared_get(client, position, channel) || !shared_get_array<double>(client, position, values, max_count)) {
+                result = Reject("A request of a client was malformed or too long.");
+            } else if (channel >= number_of_channels_) {
+                result = Reject("A request of a client selected a missing channel.");
+            } else if (!std::all_of(values.begin(), values.end(), valid_fraction)) {
+                result = Reject("A request of a client held a value outside 0 to 1.");
+            } else {
+                result = client.request == SHARED_REQUEST_LOAD_CALIBRATION ? board_.LoadCalibration(channel, values)
+                                                                           : board_.LoadAnalogSequence(channel, values);
+            }
+            client.size = 0;
+        }
+            break;
+        case SHARED_REQUEST_LOAD_DIGITAL_SEQUENCE:
+        {
+            std::vector<bool> values;
+            if (!shared_get(client, position, channel)
+                || !shared_get_array<uint8_t>(client, position, values, info.max_sequence_length)) {
+                result = Reject("A request of a client was malformed or too long.");
+            } else if (channel >= number_of_channels_) {
+                result = Reject("A request of a client selected a missing channel.");
+            } else {
+                result = board_.LoadDigitalSequence(channel, values);
+            }
+            client.size = 0;
+        }
+            break;
+        case SHARED_REQUEST_START_ANALOG_SEQUENCE:
+        case SHARED_REQUEST_STOP_ANALOG_SEQUENCE:
+        case SHARED_REQUEST_START_DIGITAL_SEQUENCE:
+        case SHARED_REQUEST_STOP_DIGITAL_SEQUENCE:
+            if (shared_get(client, position, channel)) {
+                if (client.request == SHARED_REQUEST_START_ANALOG_SEQUENCE) result = board_.StartAnalogSequence(channel);
+                if (client.request == SHARED_REQUEST_STOP_ANALOG_SEQUENCE) result = board_.StopAnalogSequence(channel);
+                if (client.request == SHARED_REQUEST_START_DIGITAL_SEQUENCE) result = board_.StartDigitalSequence(channel);
+                if (client.request == SHARED_REQUEST_STOP_DIGITAL_SEQUENCE) result = board_.StopDigitalSequence(channel);
+            }
+            client.size = 0;
+            break;
+        case SHARED_REQUEST_LOAD_WAVEFORM:
+        {
+            std::vector<WaveformEvent> events;
+            if (!shared_get_array<WaveformEvent>(client, position, events, info.max_waveform_events)) {
+                result = Reject("A request of a client was malformed or too long.");
+            } else if (!std::all_of(events.begin(), events.end(), [this](const WaveformEvent &event) {
+                           return ((uint64_t)event.on_mask >> number_of_channels_) == 0
+                               && ((uint64_t)event.off_mask >> number_of_channels_) == 0
+                               && (event.power_channel < 0 || ((unsigned int)event.power_channel < number_of_channels_
+                                                               && valid_fraction(event.relative_power)));
+                       })) {
+                result = Reject("A waveform of a client selected a missing channel or held a power outside 0 to 1.");
+            } else {
+                result = board_.LoadWaveform(events);
+            }
+            client.size = 0;
+        }
+            break;
+        case SHARED_REQUEST_START_WAVEFORM:
+        {
+            uint32_t channel_mask, period_us, repetitions;
+            uint8_t on_trigger;
+            if (!shared_get(client, position, channel_mask) || !shared_get(client, position, period_us)
+                || !shared_get(client, position, repetitions) || !shared_get(client, position, on_trigger)) {
+                result = Reject("A request of a client was malformed.");
+            } else if ((uint64_t)channel_mask >> number_of_channels_) {
+                result = Reject("A request of a client selected a missing channel.");
+            } else {
+                result = board_.StartWaveform(channel_mask, period_us, repetitions, on_trigger != 0);
+            }
+            client.size = 0;
+        }
+            break;
+        case SHARED_REQUEST_STOP_WAVEFORM:
+            client.size = 0;
+            result = board_.StopWaveform();
+            break;
+        case SHARED_REQUEST_WAVEFORM_STATUS:
+        {
+            bool running_waveform = false;
+            uint32_t periods = 0;
+            result = board_.GetWaveformStatus(running_waveform, periods);
+            client.size = 0;
+            shared_put(client, (uint8_t)running_waveform);
+            shared_put(client, periods);
+        }
+            break;
+        case SHARED_REQUEST_SET_BLANKING:
+        {
+            uint32_t channel_mask;
+            uint8_t active_low;
+            if (!shared_get(client, position, channel_mask) || !shared_get(client, position, active_low)) {
+                result = Reject("A request of a client was malformed.");
+            } else if ((uint64_t)channel_mask >> number_of_channels_) {
+                result = Reject("A request of a client selected a missing channel.");
+            } else {
+                result = board_.SetBlanking(channel_mask, active_low != 0);
+                if (result == 0) {
+                    outputs_.blanking_mask = channel_mask;
+                    outputs_.blanking_active_low = active_low != 0;
+                }
+            }
+            client.size = 0;
+        }
+            break;
+        case SHARED_REQUEST_RAMP:
+        {
+            double relative_value;
+            uint32_t duration_us;
+            uint8_t exponential;
+            if (!shared_get(client, position, channel) || !shared_get(client, position, relative_value)
+                || !shared_get(client, position, duration_us) || !shared_get(client, position, exponential)) {
+                result = Reject("A request of a client was malformed.");
+            } else if (channel >= number_of_channels_ || !valid_fraction(relative_value)) {
+                result = Reject("A ramp of a client selected a missing channel or a value outside 0 to 1.");
+            } else {
+                result = board_.Ramp(channel, relative_value, duration_us, exponential != 0);
+                if (result == 0) outputs_.relative_values[channel] = relative_value;
+            }
+            client.size = 0;
+        }
+            break;
+        case SHARED_REQUEST_SET_MODULATION:
+        {
+            double frequency_hz, duty_cycle;
+            if (!shared_get(client, position, channel) || !shared_get(client, position, frequency_hz)
+                || !shared_get(client, position, duty_cycle)) {
+                result = Reject("A request of a client was malformed.");
+            } else if (!std::isfinite(frequency_hz) || !valid_fraction(duty_cycle)) {
+                result = Reject("A modulation of a client had an invalid frequency or a duty cycle outside 0 to 1.");
+            } else {
+                result = board_.SetModulation(channel, frequency_hz, duty_cycle);
+            }
+            client.size = 0;
+        }
+            break;
+        case SHARED_REQUEST_LOAD_MODULATION_SEQUENCE:
+        {
+            std::vector<double> frequencies_hz, duty_cycles;
+            uint32_t max_count = info.max_sequence_length / 2;
+            if (!shared_get(client, position, channel)
+                || !shared_get_array<double>(client, position, frequencies_hz, max_count)
+                || !shared_get_array<double>(client, position, duty_cycles, max_count)) {
+                result = Reject("A request of a client was malformed or too long.");
+            } else if (!std::all_of(frequencies_hz.begin(), frequencies_hz.end(), [](double f) { return std::isfinite(f); })
+                       || !std::all_of(duty_cycles.begin(), duty_cycles.end(), valid_fraction)) {
+                result = Reject("A modulation of a client had an invalid frequency or a duty cycle outside 0 to 1.");
+            } else {
+                result = board_.LoadModulationSequence(channel, frequencies_hz, duty_cycles);
+            }
+            client.size = 0;
+        }
+            break;
+        case SHARED_REQUEST_START_MODULATION_SEQUENCE:
+        case SHARED_REQUEST_STOP_MODULATION_SEQUENCE:
+            if (shared_get(client, position, channel)) {
+                result = client.request == SHARED_REQUEST_START_MODULATION_SEQUENCE ? board_.StartModulationSequence(channel)
+                                                                                    : board_.StopModulationSequence(channel);
+            }
+            client.size = 0;
+            break;
+        case SHARED_REQUEST_SET_TELEMETRY:
+        {
+            uint32_t sample_rate, state_interval_ms;
+            if (shared_get(client, position, sample_rate) && shared_get(client, position, state_interval_ms)) {
+                result = board_.SetTelemetry(sample_rate, state_interval_ms);
+            }
+            client.size = 0;
+        }
+            break;
+        case SHARED_REQUEST_MONITOR_SAMPLES:
+        {
+            // Samples that do not fit into the reply are left for the next request.
+            const size_t max_samples = (SHARED_REQUEST_SIZE - 2 * sizeof(uint64_t) - 1 - sizeof(uint32_t))
+                                       / sizeof(MonitorSample);
+            uint64_t cursor;
+            if (!shared_get(client, position, cursor)) {
+                client.size = 0;
+                break;
+            }
+            uint64_t start = cursor;
+            std::vector<MonitorSample> samples;
+            uint64_t lost = board_.GetMonitorSamples(cursor, samples);
+            bool more = samples.size() > max_samples;
+            if (more) {
+                samples.resize(max_samples);
+                cursor = start + lost + max_samples;
+            }
+            client.size = 0;
+            shared_put(client, lost);
+            shared_put(client, cursor);
+            shared_put(client, (uint8_t)more);
+            shared_put_array(client, samples.data(), (uint32_t)samples.size());
+            result = 0;
+        }
+            break;
+        case SHARED_REQUEST_BOARD_STATE:
+        {
+            BoardState state;
+            result = board_.GetBoardState(state);
+            client.size = 0;
+            shared_put(client, state.board_time_us);
+            shared_put(client, state.enable_mask);
+            shared_put(client, state.level_mask);
+            shared_put(client, (uint32_t)state.pwm_duty);
+            shared_put(client, (uint32_t)state.pwm_top);
+            shared_put_array(client, state.relative_outputs.data(), (uint32_t)state.relative_outputs.size());
+        }
+            break;
+        case SHARED_REQUEST_STATISTICS:
+        {
+            BoardStatistics stats;
+            board_.GetStatistics(stats);
+            client.size = 0;
+            shared_put(client, stats);
+            result = 0;
+        }
+            break;
+        case SHARED_REQUEST_RESET_STATISTICS:
+            board_.ResetStatistics();
+            client.size = 0;
+            result = 0;
+            break;
+        default:
+            result = Reject("A request of a client is unknown.");
+            client.size = 0;
+            break;
+    }
+    client.result = result;
+}
+
+// Updates the state table under its sequence lock.
+void Broker::Publish() {
+    SharedState &state = shm_->state;
+    uint32_t sequence = state.sequence.load(std::memory_order_relaxed);
+    state.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    state.enable_mask.store(outputs_.enable_mask, std::memory_order_relaxed);
+    state.blanking_mask.store(outputs_.blanking_mask, std::memory_order_relaxed);
+    state.blanking_active_low.store(outputs_.blanking_active_low, std::memory_order_relaxed);
+    for (unsigned int ch = 0; ch < number_of_channels_; ++ch) {
+        state.relative_values[ch].store(shared_double_bits(outputs_.relative_values[ch]), std::memory_order_relaxed);
+    }
+    state.sequence.store(sequence + 2, std::memory_order_release);
+
+    state.monitor_sample_count.store(board_.GetMonitorSampleCount(), std::memory_order_release);
+    state.busy.store(board_.Busy(), std::memory_order_release);
+}
+
+// Frees the slots of clients that exited without releasing them.
+void Broker::CheckClients() {
+    for (size_t i = 0; i < SHARED_MAX_CLIENTS; ++i) {
+        SharedClient &client = shm_->clients[i];
+        int32_t pid = client.pid.load();
+        if (client.state.load() == SHARED_CLIENT_FREE || pid == 0 || process_alive(pid)) continue;
+        client.pid = 0;
+        client.state.store(SHARED_CLIENT_FREE, std::memory_order_release);
+        printf("Freed the slot of client %zu, process %d exited.\n", i + 1, (int)pid);
+        fflush(stdout);
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string ports = argv[1];
+    std::string name = SHARED_MEMORY_DEFAULT_NAME;
+    bool shared_trigger = false;
+    bool keep_outputs = false;
+    bool low_latency = false;
+    unsigned int max_in_flight = DEFAULT_MAX_PENDING_COMMANDS;
+    std::string group;
+    std::string mode_arg;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--name" && i + 1 < argc) {
+            name = argv[++i];
+        } else if (arg == "--shared-trigger") {
+            shared_trigger = true;
+        } else if (arg == "--keep-outputs") {
+            keep_outputs = true;
+        } else if (arg == "--low-latency") {
+            low_latency = true;
+        } else if (arg == "--max-in-flight" && i + 1 < argc) {
+            max_in_flight = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--group" && i + 1 < argc) {
+            group = argv[++i];
+        } else if (arg == "--mode" && i + 1 < argc) {
+            mode_arg = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (name.empty() || name[0] != '/') name = "/" + name;
+
+    // Anyone who can write to the shared memory can switch the lasers on, so it is never opened
+    // up to all users.
+    mode_t mode = group.empty() ? 0600 : 0660;
+    if (!mode_arg.empty()) {
+        char *end = nullptr;
+        unsigned long value = strtoul(mode_arg.c_str(), &end, 8);
+        if (*end != '\0' || (value & ~0770UL)) {
+            fprintf(stderr, "Invalid mode %s, only the owner and the group can be given access.\n", mode_arg.c_str());
+            return 1;
+        }
+        mode = (mode_t)value;
+    }
+    gid_t gid = (gid_t)-1;
+    if (!group.empty()) {
+        const struct group *entry = getgrnam(group.c_str());
+        char *end = nullptr;
+        if (entry != nullptr) gid = entry->gr_gid;
+        else gid = (gid_t)strtoul(group.c_str(), &end, 10);
+        if (entry == nullptr && (end == group.c_str() || *end != '\0')) {
+            fprintf(stderr, "Unknown group %s.\n", group.c_str());
+            return 1;
+        }
+    }
+
+    if (broker_running(name.c_str())) {
+        fprintf(stderr, "Another broker is running at %s.\n", name.c_str());
+        return 1;
+    }
+
+    std::vector<std::string> port_list;
+    std::istringstream port_stream(ports);
+    for (std::string port; std::getline(port_stream, port, ',');) {
+        if (!port.empty()) port_list.push_back(port);
+    }
+    std::unique_ptr<InterfaceBoard> board;
+    if (port_list.size() > 1) {
+        std::vector<std::unique_ptr<InterfaceBoard>> boards;
+        for (const std::string &port : port_list) boards.push_back(std::unique_ptr<InterfaceBoard>(new Arduino(port)));
+        board.reset(new MultiBoard(std::move(boards), shared_trigger));
+    } else {
+        board.reset(new Arduino(port_list.empty() ? std::string(AUTO_PORT) : port_list[0]));
+    }
+    board->SetMaxPendingCommands(max_in_flight);
+    board->SetLowLatency(low_latency);
+    if (board->Open() != 0) {
+        fprintf(stderr, "The board could not be opened.\n");
+        for (std::string error = board->PopError(); !error.empty(); error = board->PopError()) {
+            fprintf(stderr, "error: %s\n", error.c_str());
+        }
+        return 1;
+    }
+    board->SetKeepOutputsOnClose(keep_outputs);
+
+    // An object left behind by a broker that did not exit cleanly is replaced.
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "The shared memory %s could not be created: %s\n", name.c_str(), strerror(errno));
+        return 1;
+    }
+    // Created for the owner only; group and mode are applied afterwards, regardless of the umask.
+    if ((gid != (gid_t)-1 && fchown(fd, (uid_t)-1, gid) != 0) || fchmod(fd, mode) != 0) {
+        fprintf(stderr, "The permissions of the shared memory %s could not be set: %s\n", name.c_str(), strerror(errno));
+        close(fd);
+        shm_unlink(name.c_str());
+        return 1;
+    }
+    void *memory = MAP_FAILED;
+    if (ftruncate(fd, sizeof(SharedMemory)) == 0) {
+        memory = mmap(nullptr, sizeof(SharedMemory), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "The shared memory %s could not be mapped: %s\n", name.c_str(), strerror(errno));
+        shm_unlink(name.c_str());
+        return 1;
+    }
+    SharedMemory *shm = new (memory) SharedMemory();
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    Broker broker(*board, shm);
+    broker.Start();
+    printf("Sharing %u channels of %s at %s\n", shm->info.number_of_channels, ports.c_str(), name.c_str());
+    fflush(stdout);
+    broker.Run();
+    broker.Stop();
+
+    munmap(memory, sizeof(SharedMemory));
+    shm_unlink(name.c_str());
+    return 0;
+}
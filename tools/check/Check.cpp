@@ -0,0 +1,520 @@
+/* Check.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Checks the features of the Arduino program end to end against the emulator in tools/emulator.
+// Drives the board directly, through tools/server, tools/broker, several boards at once or while
+// recording a journal, and compares the DAC codes, pins and PWM settings the emulators recorded
+// with the expected ones. Exits with a non-zero status if a check fails, so CI can run it.
+//
+// The emulators must be started with --record, with pulses on the trigger input A0 for the
+// sequence check and on the exposure input A1 for the blanking check, e.g.
+//
+//    ldd_emulator --link /tmp/ldd --record ldd.csv --pulse 14:500 --pulse 15:100:2000
+
+#include "Arduino.h"
+#include "JournalBoard.h"
+#include "MultiBoard.h"
+#include "SharedMemoryBoard.h"
+#include "TcpLink.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Time the recorded outputs may take to reach the expected state in ms
+const unsigned int SETTLE_TIMEOUT = 2000;
+
+// Enable outputs of the channels, as enable_pins in Program.ino with A2 = 16
+const int ENABLE_PINS[] = {4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 16, 17, 20, 21};
+const unsigned int MAX_CHECKED_CHANNELS = sizeof(ENABLE_PINS) / sizeof(ENABLE_PINS[0]);
+
+// All checks in the order they run. The deterministic ones come first; they are the ones a
+// journal can be compared on.
+const char *const ALL_CHECKS = "writes,shutter,calibration,modulation,ramp,sequence,waveform,blanking";
+
+void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s TARGET CSV[,CSV...] [--tcp] [--shared-memory] [--journal FILE] [--checks NAME,...]\n"
+            "       %s --compare CSV CSV\n"
+            "  TARGET           serial port of the emulator; several ports separated by commas combine\n"
+            "                   the boards\n"
+            "  CSV              file the emulator behind TARGET records to, one per board in order\n"
+            "  --tcp            TARGET is the address of tools/server\n"
+            "  --shared-memory  TARGET is the name of the broker in tools/broker\n"
+            "  --journal        record a journal of the checks to FILE\n"
+            "  --checks         checks to run, default %s\n"
+            "  --compare        whether the second recording, e.g. of the replay of a journal, changed\n"
+            "                   every DAC output, enable output and PWM like the first and ended with the\n"
+            "                   same values; coalesced writes may skip values\n",
+            name, name, ALL_CHECKS);
+}
+
+// Values an emulator recorded, by "source/channel", e.g. "dac0x60/A", "pin/4" or "pwm0/top".
+// Repeated values are dropped, so a series lists the changes.
+class Recording {
+    public:
+        explicit Recording(std::string path) : path_(path) {}
+
+        bool Load() {
+            FILE *file = fopen(path_.c_str(), "r");
+            if (file == nullptr) return false;
+            series_.clear();
+            char line[128];
+            while (fgets(line, sizeof(line), file)) {
+                unsigned long long time;
+                char source[32], channel[16];
+                long value;
+                if (sscanf(line, "%llu,%31[^,],%15[^,],%ld", &time, source, channel, &value) != 4) continue;
+                std::vector<long> &values = series_[std::string(source) + "/" + channel];
+                if (values.empty() || values.back() != value) values.push_back(value);
+            }
+            fclose(file);
+            return true;
+        }
+
+        const std::vector<long> &Get(const std::string &key) const {
+            static const std::vector<long> empty;
+            auto found = series_.find(key);
+            return found == series_.end() ? empty : found->second;
+        }
+
+        const std::map<std::string, std::vector<long>> &All() const {
+            return series_;
+        }
+
+    private:
+        std::string path_;
+        std::map<std::string, std::vector<long>> series_;
+};
+
+// Where the emulators record a channel
+struct ChannelOutput {
+    size_t recording;
+    std::string dac;  // "dac0x60/A"
+    std::string pin;  // "pin/4"
+};
+
+class Checker {
+    public:
+        Checker(InterfaceBoard &board, std::vector<Recording> &recordings, std::vector<ChannelOutput> outputs)
+            : board_(board), recordings_(recordings), outputs_(outputs) {}
+
+        bool Run(const std::string &name);
+
+    private:
+        bool Writes();
+        bool Shutter();
+        bool Calibration();
+        bool Modulation();
+        bool Ramp();
+        bool Sequence();
+        bool Waveform();
+        bool Blanking();
+
+        // Loads the recordings until condition holds or SETTLE_TIMEOUT passed.
+        bool WaitFor(const std::function<bool()> &condition);
+        // Number of changes recorded so far for the DAC or enable output of a channel, to look at
+        // the ones that follow
+        size_t Mark(const std::string &key, unsigned int channel);
+        const std::vector<long> &Series(const std::string &key, unsigned int channel);
+        bool Fail(const char *what);
+
+        InterfaceBoard &board_;
+        std::vector<Recording> &recordings_;
+        std::vector<ChannelOutput> outputs_;
+};
+
+long dac_code(double relative_value) {
+    return (long)((uint32_t)(relative_value * 65535) * DAC_MAX_CODE / 65535);
+}
+
+bool near(long code, long expected, long tolerance) {
+    return std::labs(code - expected) <= tolerance;
+}
+
+// Whether values contains expected in this order, with any values in between
+bool contains_in_order(const std::vector<long> &values, size_t from, const std::vector<long> &expected) {
+    size_t next = 0;
+    for (size_t i = from; i < values.size() && next < expected.size(); ++i) {
+        if (values[i] == expected[next]) ++next;
+    }
+    return next == expected.size();
+}
+
+bool Checker::Run(const std::string &name) {
+    static const std::map<std::string, bool (Checker::*)()> checks = {
+        {"writes", &Checker::Writes},         {"shutter", &Checker::Shutter},
+        {"calibration", &Checker::Calibration}, {"modulation", &Checker::Modulation},
+        {"ramp", &Checker::Ramp},             {"sequence", &Checker::Sequence},
+        {"waveform", &Checker::Waveform},     {"blanking", &Checker::Blanking},
+    };
+    auto check = checks.find(name);
+    if (check == checks.end()) {
+        fprintf(stderr, "Unknown check %s\n", name.c_str());
+        return false;
+    }
+    auto start = Clock::now();
+    bool ok = (this->*check->second)() && board_.Flush() == 0;
+    for (std::string error = board_.PopError(); !error.empty(); error = board_.PopError()) {
+        fprintf(stderr, "%s: error: %s\n", name.c_str(), error.c_str());
+        ok = false;
+    }
+    printf("%-28s %s (%.0f ms)\n", name.c_str(), ok ? "ok" : "FAILED",
+           std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+    fflush(stdout);
+    return ok;
+}
+
+bool Checker::WaitFor(const std::function<bool()> &condition) {
+    auto deadline = Clock::now() + std::chrono::milliseconds(SETTLE_TIMEOUT);
+    for (;;) {
+        for (Recording &recording : recordings_) recording.Load();
+        if (condition()) return true;
+        if (Clock::now() > deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+const std::vector<long> &Checker::Series(const std::string &key, unsigned int channel) {
+    const ChannelOutput &output = outputs_[channel];
+    return recordings_[output.recording].Get(key == "dac" ? output.dac : output.pin);
+}
+
+size_t Checker::Mark(const std::string &key, unsigned int channel) {
+    recordings_[outputs_[channel].recording].Load();
+    return Series(key, channel).size();
+}
+
+bool Checker::Fail(const char *what) {
+    fprintf(stderr, "  %s\n", what);
+    return false;
+}
+
+// Batched analog and digital writes reach every DAC and enable output.
+bool Checker::Writes() {
+    unsigned int channels = outputs_.size();
+    uint32_t mask = (uint32_t)((1ull << channels) - 1);
+    std::vector<double> values(channels);
+    for (unsigned int ch = 0; ch < channels; ++ch) values[ch] = (ch + 1) / (channels + 1.0);
+    if (board_.WriteAnalogRelativeMulti(mask, values) != 0 || board_.WriteDigitalMulti(mask, 0x55555555 & mask) != 0
+        || board_.Flush() != 0) {
+        return Fail("the writes were not acknowledged");
+    }
+    bool ok = WaitFor([&] {
+        for (unsigned int ch = 0; ch < channels; ++ch) {
+            const std::vector<long> &codes = Series("dac", ch);
+            const std::vector<long> &pins = Series("pin", ch);
+            if (codes.empty() || !near(codes.back(), dac_code(values[ch]), 1)) return false;
+            if ((pins.empty() ? 0 : pins.back()) != (ch % 2 == 0 ? 1 : 0)) return false;
+        }
+        return true;
+    });
+    if (!ok) return Fail("the DAC codes or enable outputs do not match the writes");
+
+    for (unsigned int ch = 0; ch < channels; ++ch) {
+        if (board_.WriteAnalogRelative(ch, 0.0) != 0 || board_.WriteDigital(ch, false) != 0) return Fail("a write failed");
+    }
+    return board_.Flush() == 0;
+}
+
+// The shutter switches the enable outputs of all lasers with one batched write.
+bool Checker::Shutter() {
+    unsigned int channels = outputs_.size();
+    uint32_t mask = (uint32_t)((1ull << channels) - 1);
+    for (int open = 1; open >= 0; --open) {
+        if (board_.WriteDigitalMulti(mask, open ? mask : 0) != 0 || board_.Flush() != 0) {
+            return Fail("the shutter write was not acknowledged");
+        }
+        bool ok = WaitFor([&] {
+            for (unsigned int ch = 0; ch < channels; ++ch) {
+                const std::vector<long> &pins = Series("pin", ch);
+                if ((pins.empty() ? 0 : pins.back()) != open) return false;
+            }
+            return true;
+        });
+        if (!ok) return Fail(open ? "the shutter did not switch all lasers on" : "the shutter did not switch all lasers off");
+    }
+    return true;
+}
+
+// A calibration table maps the relative value of a channel to its DAC code.
+bool Checker::Calibration() {
+    unsigned int size = board_.GetCalibrationSize();
+    if (size < 2) return Fail("the board has no calibration tables");
+    unsigned int ch = outputs_.size() - 1;
+    std::vector<double> table(size);
+    for (unsigned int i = 0; i < size; ++i) table[i] = std::pow((double)i / (size - 1), 2.0);
+    if (board_.LoadCalibration(ch, table) != 0 || board_.WriteAnalogRelative(ch, 0.5) != 0 || board_.Flush() != 0) {
+        return Fail("the calibration was not acknowledged");
+    }
+    if (!WaitFor([&] { return !Series("dac", ch).empty() && near(Series("dac", ch).back(), dac_code(0.25), 4); })) {
+        return Fail("the calibrated DAC code does not follow the table");
+    }
+    if (board_.LoadCalibration(ch, std::vector<double>()) != 0 || board_.WriteAnalogRelative(ch, 0.5) != 0
+        || board_.Flush() != 0) {
+        return Fail("the calibration could not be cleared");
+    }
+    if (!WaitFor([&] { return !Series("dac", ch).empty() && near(Series("dac", ch).back(), dac_code(0.5), 1); })) {
+        return Fail("the cleared calibration is still applied");
+    }
+    return board_.WriteAnalogRelative(ch, 0.0) == 0;
+}
+
+// Frequency and duty cycle of the modulation outputs
+bool Checker::Modulation() {
+    unsigned int modulators = std::min(board_.GetNumberOfModulators(), 2u);
+    if (modulators == 0) return Fail("the board has no modulation outputs");
+    for (unsigned int m = 0; m < modulators; ++m) {
+        // 100 kHz at 16 MHz without prescaler: 160 cycles, a quarter of them high
+        if (board_.SetModulation(m, 100000.0, 0.25 * (m + 1)) != 0 || board_.Flush() != 0) {
+            return Fail("the modulation was not acknowledged");
+        }
+        std::string pwm = "pwm" + std::to_string(m);
+        bool ok = WaitFor([&] {
+            const std::vector<long> &top = recordings_[0].Get(pwm + "/top");
+            const std::vector<long> &duty = recordings_[0].Get(pwm + "/duty");
+            return !top.empty() && top.back() == 160 && !duty.empty() && duty.back() == 40 * (long)(m + 1);
+        });
+        if (!ok) return Fail("the PWM does not run at the requested frequency and duty cycle");
+    }
+    // The defaults: 1 MHz with 75 % on the first output, the others off
+    for (unsigned int m = 0; m < modulators; ++m) {
+        if (board_.SetModulation(m, 1000000.0, m == 0 ? 0.75 : 0.0) != 0) return Fail("the modulation could not be reset");
+    }
+    return board_.Flush() == 0;
+}
+
+// A ramp passes through intermediate codes to the target.
+bool Checker::Ramp() {
+    unsigned int ch = 0;
+    size_t mark = Mark("dac", ch);
+    if (board_.Ramp(ch, 1.0, 50000, false) != 0 || board_.Flush() != 0) return Fail("the ramp was not acknowledged");
+    bool ok = WaitFor([&] {
+        const std::vector<long> &codes = Series("dac", ch);
+        return !codes.empty() && codes.back() == DAC_MAX_CODE;
+    });
+    if (!ok) return Fail("the ramp did not reach its target");
+    const std::vector<long> &codes = Series("dac", ch);
+    if (codes.size() - mark < 10) return Fail("the ramp jumped to its target");
+    if (!std::is_sorted(codes.begin() + mark, codes.end())) return Fail("the ramp did not rise steadily");
+    return board_.WriteAnalogRelative(ch, 0.0) == 0 && board_.Flush() == 0;
+}
+
+// An analog sequence advances on the trigger pulses of the emulator.
+bool Checker::Sequence() {
+    unsigned int ch = outputs_.size() > 1 ? 1 : 0;
+    std::vector<double> values = {0.2, 0.4, 0.6, 0.8};
+    std::vector<long> codes;
+    for (double value : values) codes.push_back(dac_code(value));
+    size_t mark = Mark("dac", ch);
+    if (board_.LoadAnalogSequence(ch, values) != 0 || board_.StartAnalogSequence(ch) != 0 || board_.Flush() != 0) {
+        return Fail("the sequence was not acknowledged");
+    }
+    bool ok = WaitFor([&] { return contains_in_order(Series("dac", ch), mark, codes); });
+    if (board_.StopAnalogSequence(ch) != 0 || board_.WriteAnalogRelative(ch, 0.0) != 0 || board_.Flush() != 0) {
+        return Fail("the sequence could not be stopped");
+    }
+    return ok || Fail("the sequence did not advance through its values on trigger pulses");
+}
+
+// A waveform switches a laser on and off with its power for the given number of periods.
+bool Checker::Waveform() {
+    unsigned int ch = outputs_.size() > 2 ? 2 : 0;
+    std::vector<WaveformEvent> events(2);
+    events[0].time_us = 0;
+    events[0].on_mask = 1u << ch;
+    events[0].power_channel = ch;
+    events[0].relative_power = 0.5;
+    events[1].time_us = 2000;
+    events[1].off_mask = 1u << ch;
+    size_t mark = Mark("pin", ch);
+    if (board_.LoadWaveform(events) != 0 || board_.StartWaveform(1u << ch, 5000, 3, false) != 0 || board_.Flush() != 0) {
+        return Fail("the waveform was not acknowledged");
+    }
+    auto deadline = Clock::now() + std::chrono::milliseconds(SETTLE_TIMEOUT);
+    bool running = true;
+    uint32_t periods = 0;
+    while (running && Clock::now() < deadline) {
+        if (board_.GetWaveformStatus(running, periods) != 0) return Fail("the waveform status could not be read");
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    if (running) return Fail("the waveform did not end");
+    if (periods != 3) return Fail("the waveform did not play three periods");
+    bool ok = WaitFor([&] { return contains_in_order(Series("pin", ch), mark, {1, 0, 1, 0, 1, 0}); });
+    if (!ok) return Fail("the enable output did not follow the waveform");
+    const std::vector<long> &codes = Series("dac", ch);
+    if (std::find_if(codes.begin(), codes.end(), [](long code) { return near(code, dac_code(0.5), 1); }) == codes.end()) {
+        return Fail("the waveform did not set the power");
+    }
+    return board_.WriteAnalogRelative(ch, 0.0) == 0 && board_.Flush() == 0;
+}
+
+// A blanked laser follows the exposure pulses of the emulator.
+bool Checker::Blanking() {
+    unsigned int ch = outputs_.size() - 1;
+    size_t mark = Mark("pin", ch);
+    if (board_.SetBlanking(1u << ch, false) != 0 || board_.WriteDigital(ch, true) != 0 || board_.Flush() != 0) {
+        return Fail("the blanking was not acknowledged");
+    }
+    bool ok = WaitFor([&] { return contains_in_order(Series("pin", ch), mark, {1, 0, 1, 0, 1}); });
+    if (board_.SetBlanking(0, false) != 0 || board_.WriteDigital(ch, false) != 0 || board_.Flush() != 0) {
+        return Fail("the blanking could not be turned off");
+    }
+    return ok || Fail("the enable output did not follow the exposure input");
+}
+
+// Compares the changes of the outputs two emulators recorded. The second may skip values of the
+// first, since writes the board has not taken yet are coalesced, but must end with the same ones.
+int compare(const std::string &first_path, const std::string &second_path) {
+    Recording first(first_path), second(second_path);
+    if (!first.Load() || !second.Load()) {
+        fprintf(stderr, "The recordings could not be read.\n");
+        return 1;
+    }
+    std::vector<std::string> keys;
+    for (const auto &series : first.All()) keys.push_back(series.first);
+    for (const auto &series : second.All()) keys.push_back(series.first);
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    int differences = 0;
+    for (const std::string &key : keys) {
+        // Trigger and exposure inputs and LDAC depend on timing, not on the commands.
+        if (key == "pin/2" || key == "pin/14" || key == "pin/15") continue;
+        const std::vector<long> &expected = first.Get(key), &values = second.Get(key);
+        bool same_end = expected.empty() ? values.empty() : !values.empty() && values.back() == expected.back();
+        if (!same_end || !contains_in_order(expected, 0, values)) {
+            fprintf(stderr, "%s: the %zu changes do not follow the %zu recorded ones\n", key.c_str(), values.size(),
+                    expected.size());
+            ++differences;
+        }
+    }
+    printf("%-28s %zu outputs, %s\n", "compare", keys.size(), differences == 0 ? "ok" : "FAILED");
+    return differences == 0 ? 0 : 1;
+}
+
+std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::istringstream stream(list);
+    for (std::string item; std::getline(stream, item, ',');) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc == 4 && std::string(argv[1]) == "--compare") return compare(argv[2], argv[3]);
+    if (argc < 3 || argv[1][0] == '-' || argv[2][0] == '-') {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string target = argv[1];
+    std::vector<std::string> csv_paths = split(argv[2]);
+    std::string journal, checks = ALL_CHECKS;
+    bool tcp = false, shared_memory = false;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--tcp") {
+            tcp = true;
+        } else if (arg == "--shared-memory") {
+            shared_memory = true;
+        } else if (arg == "--journal" && i + 1 < argc) {
+            journal = argv[++i];
+        } else if (arg == "--checks" && i + 1 < argc) {
+            checks = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // The Arduinos are kept to find the recording of each channel after MultiBoard took them.
+    std::unique_ptr<InterfaceBoard> board;
+    std::vector<InterfaceBoard *> arduinos;
+    if (shared_memory) {
+        board.reset(new SharedMemoryBoard(target[0] == '/' ? target : "/" + target));
+        arduinos.push_back(board.get());
+    } else {
+        std::vector<std::unique_ptr<InterfaceBoard>> boards;
+        for (const std::string &port : split(target)) {
+            if (tcp) boards.push_back(std::unique_ptr<InterfaceBoard>(new Arduino(port, std::unique_ptr<Link>(new TcpLink()))));
+            else boards.push_back(std::unique_ptr<InterfaceBoard>(new Arduino(port)));
+            arduinos.push_back(boards.back().get());
+        }
+        if (boards.size() == 1) board = std::move(boards[0]);
+        else board.reset(new MultiBoard(std::move(boards), false));
+    }
+    if (arduinos.empty() || csv_paths.size() != arduinos.size()) {
+        fprintf(stderr, "Give one recording for every board.\n");
+        return 1;
+    }
+    if (!journal.empty()) board.reset(new JournalBoard(std::move(board), journal));
+    if (board->Open() != 0 || !board->DeviceIsOpen()) {
+        fprintf(stderr, "Could not open %s\n", target.c_str());
+        for (std::string error = board->PopError(); !error.empty(); error = board->PopError()) {
+            fprintf(stderr, "error: %s\n", error.c_str());
+        }
+        return 1;
+    }
+
+    std::vector<Recording> recordings;
+    for (const std::string &path : csv_paths) recordings.emplace_back(path);
+    std::vector<ChannelOutput> outputs;
+    for (size_t b = 0; b < arduinos.size(); ++b) {
+        for (unsigned int ch = 0; ch < arduinos[b]->GetNumberOfChannels() && ch < MAX_CHECKED_CHANNELS; ++ch) {
+            uint8_t address, output;
+            if (arduinos[b]->GetChannelOutput(ch, address, output) != 0) continue;
+            char dac[32];
+            snprintf(dac, sizeof(dac), "dac%#04x/%c", address, 'A' + output);
+            outputs.push_back({b, dac, "pin/" + std::to_string(ENABLE_PINS[ch])});
+        }
+    }
+    if (outputs.empty() || outputs.size() != board->GetNumberOfChannels()) {
+        fprintf(stderr, "The board has %u channels, %zu of them can be checked\n", board->GetNumberOfChannels(),
+                outputs.size());
+        return 1;
+    }
+
+    Checker checker(*board, recordings, outputs);
+    int failed = 0;
+    for (const std::string &check : split(checks)) {
+        if (!checker.Run(check)) ++failed;
+    }
+    if (failed > 0) fprintf(stderr, "%d checks failed\n", failed);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,785 @@
+/* Emulator.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Runs Program.ino on the host. The Arduino core, the MCP4728 library and the nRF52840 PWM are
+// replaced by the stand-ins in stubs/ and the USB-CDC port of the board by a pseudo-terminal
+// that the device adapter opens like the real board.
+//
+// Timing follows the hardware: bytes cross the USB link only at full-speed frame boundaries with
+// a limited number of bytes per frame, and each DAC access takes as long as its I2C transfer.
+// Every change of a DAC output, pin or PWM setting can be recorded to a CSV file with the time
+// in microseconds since start.
+
+#include <Arduino.h>
+#include <Adafruit_MCP4728.h>
+#include <Wire.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+void setup();
+void loop();
+
+namespace {
+
+// Defaults of a full-speed USB link: 1 ms frames with up to 19 bulk packets of 64 bytes each.
+unsigned long usb_frame_us = 1000;
+size_t usb_bytes_per_frame = 19 * 64;
+unsigned long i2c_hz = 100000;
+bool i2c_hz_fixed = false; // Set on the command line, Wire.setClock() is ignored
+
+const auto start_time = std::chrono::steady_clock::now();
+
+uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+}
+
+// Waits until the given time. Sleeps for most of the time and spins for the rest so that short
+// I2C transfers are timed accurately.
+void wait_until_us(uint64_t deadline) {
+    uint64_t now = now_us();
+    if (deadline > now + 200) std::this_thread::sleep_for(std::chrono::microseconds(deadline - now - 100));
+    while (now_us() < deadline) {}
+}
+
+// Interrupts are modelled by running the handlers on the thread generating the input pulses.
+// noInterrupts() holds this mutex so handlers can not run in between.
+std::recursive_mutex interrupt_mutex;
+int wake_fd = -1; // Wakes the main loop after an interrupt
+
+// Recording
+
+FILE *record_file = nullptr;
+std::mutex record_mutex;
+
+void record(uint64_t time, const char *source, const char *channel, long value) {
+    if (!record_file) return;
+    std::lock_guard<std::mutex> lock(record_mutex);
+    fprintf(record_file, "%llu,%s,%s,%ld\n", (unsigned long long)time, source, channel, value);
+}
+
+// Pins
+
+struct Pin {
+    int mode = INPUT;
+    int value = LOW;
+    void (*handler)() = nullptr;
+    int trigger = 0;
+    int analog = 0; // Reading of analogRead() at 12 bit
+};
+
+Pin pins[NUMBER_OF_PINS];
+std::mutex pin_mutex;
+int analog_resolution = 10;
+
+// GPIO pins (32 * port + pin) of D0-D13 and A0-A7 on the Nano 33 BLE
+const uint32_t pin_names[NUMBER_OF_PINS] = {
+    35, 42, 43, 44, 47, 45, 46, 23, 21, 27, 34, 33, 40, 13,
+    4, 5, 30, 29, 31, 2, 28, 3,
+};
+
+NRF_GPIO_Type gpio_instances[2];
+
+void set_pin(int pin, int value);
+
+// MCP4728
+
+const int MAX_DACS = 8;
+const int LDAC = 2; // LDAC_PIN of Program.ino
+
+struct DacState {
+    uint8_t address;
+    uint16_t input[4];  // Input registers
+    uint16_t output[4]; // Output registers
+    bool pending;       // Input registers were written while LDAC was high
+};
+
+DacState dac_states[MAX_DACS];
+int number_of_dacs = 0;
+
+// Addresses that answer on the I2C bus
+std::vector<uint8_t> dac_bus = {0x60, 0x61};
+
+// Duration of an I2C transfer of the given number of bytes including the address byte, with
+// start and stop condition and one acknowledge bit per byte.
+uint64_t i2c_transfer_us(size_t bytes) {
+    return ((bytes * 9 + 2) * 1000000ULL + i2c_hz - 1) / i2c_hz;
+}
+
+void update_dac_output(DacState &dac, int ch, uint64_t time) {
+    if (dac.output[ch] == dac.input[ch]) return;
+    dac.output[ch] = dac.input[ch];
+    char source[16], channel[4];
+    snprintf(source, sizeof(source), "dac%#04x", dac.address);
+    snprintf(channel, sizeof(channel), "%c", 'A' + ch);
+    record(time, source, channel, dac.output[ch]);
+}
+
+// Latches the input registers of all DACs on a falling edge of LDAC.
+void latch_dacs(uint64_t time) {
+    for (int i = 0; i < number_of_dacs; ++i) {
+        if (!dac_states[i].pending) continue;
+        for (int ch = 0; ch < 4; ++ch) update_dac_output(dac_states[i], ch, time);
+        dac_states[i].pending = false;
+    }
+}
+
+void set_pin(int pin, int value) {
+    uint64_t time = now_us();
+    void (*handler)() = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(pin_mutex);
+        Pin &p = pins[pin];
+        if (p.value == value) return;
+        p.value = value;
+        NRF_GPIO_Type &port = gpio_instances[pin_names[pin] >> 5];
+        if (value) port.OUT |= 1UL << (pin_names[pin] & 31);
+        else port.OUT &= ~(1UL << (pin_names[pin] & 31));
+        if (p.handler) {
+            if (p.trigger == CHANGE || (p.trigger == RISING && value) || (p.trigger == FALLING && !value)) {
+                handler = p.handler;
+            }
+        }
+    }
+
+    char channel[8];
+    snprintf(channel, sizeof(channel), "%d", pin);
+    record(time, "pin", channel, value);
+    if (pin == LDAC && !value) latch_dacs(time);
+
+    if (handler) {
+        handler();
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {}
+    }
+}
+
+// Sets (reg 1) or clears (reg 0) the pins of a port whose bits are set in value.
+void on_gpio_write(void *peripheral, int reg, uint32_t value) {
+    int port = (int)((NRF_GPIO_Type *)peripheral - gpio_instances);
+    for (int pin = 0; pin < NUMBER_OF_PINS; ++pin) {
+        if ((int)(pin_names[pin] >> 5) == port && (value & (1UL << (pin_names[pin] & 31)))) {
+            set_pin(pin, reg ? HIGH : LOW);
+        }
+    }
+}
+
+// PWM
+
+NRF_PWM_Type pwm_instances[4];
+
+void on_pwm_task(void *peripheral, int task) {
+    NRF_PWM_Type *pwm = (NRF_PWM_Type *)peripheral;
+    char source[8];
+    snprintf(source, sizeof(source), "pwm%d", (int)(pwm - pwm_instances));
+    uint64_t time = now_us();
+
+    if (task < 0) { // TASKS_STOP
+        record(time, source, "top", 0);
+        return;
+    }
+    // The emulator is linked without position independence so that the sequence pointer
+    // Program.ino stores in the 32-bit register is a valid address.
+    // With the WaveForm decoder the fourth value of an entry is the period. The recorded duty is
+    // the time OUT[0] is high, whose polarity bit 15 tells whether it starts high or low.
+    const uint16_t *seq = (const uint16_t *)(uintptr_t)pwm->SEQ[task].PTR;
+    bool waveform = (pwm->DECODER & 3) == PWM_DECODER_LOAD_WaveForm;
+    if (!seq || pwm->SEQ[task].CNT < (waveform ? 4u : 1u)) return;
+    uint32_t top = waveform ? seq[3] & 0x7FFF : pwm->COUNTERTOP;
+    uint32_t compare = std::min<uint32_t>(seq[0] & 0x7FFF, top);
+    record(time, source, "prescaler", pwm->PRESCALER);
+    record(time, source, "top", top);
+    record(time, source, "duty", (seq[0] & 0x8000) ? compare : top - compare);
+}
+
+// TIMER
+
+const int NUMBER_OF_TIMERS = 3;
+const int TIMER_TASK_START = 0;
+const int TIMER_TASK_STOP = 1;
+const int TIMER_TASK_CLEAR = 2;
+const int TIMER_TASK_CAPTURE = 10; // + index of the CC register
+
+NRF_TIMER_Type timer_instances[NUMBER_OF_TIMERS];
+const IRQn_Type timer_irqs[NUMBER_OF_TIMERS] = {TIMER2_IRQn, TIMER3_IRQn, TIMER4_IRQn};
+
+// Counter state of a timer. The counter is derived from the host clock while the timer runs.
+struct TimerState {
+    bool running = false;
+    uint64_t started_us = 0; // Host time at which the counter had the value offset
+    uint32_t offset = 0;
+    uint32_t last = 0;       // Counter value at the last check for compare events
+};
+
+TimerState timer_states[NUMBER_OF_TIMERS];
+std::mutex timer_mutex;
+
+struct Irq {
+    void (*handler)() = nullptr;
+    std::atomic<bool> enabled{false};
+    std::atomic<bool> pending{false};
+};
+
+Irq irqs[64];
+
+uint32_t timer_counter(const NRF_TIMER_Type &timer, const TimerState &state, uint64_t time) {
+    if (!state.running) return state.offset;
+    uint64_t ticks = ((time - state.started_us) * 16) >> timer.PRESCALER;
+    return state.offset + (uint32_t)ticks;
+}
+
+void on_timer_task(void *peripheral, int task) {
+    NRF_TIMER_Type *timer = (NRF_TIMER_Type *)peripheral;
+    std::lock_guard<std::mutex> lock(timer_mutex);
+    TimerState &state = timer_states[timer - timer_instances];
+    uint64_t time = now_us();
+    uint32_t counter = timer_counter(*timer, state, time);
+
+    if (task == TIMER_TASK_START) {
+        if (!state.running) state.started_us = time;
+        state.running = true;
+    } else if (task == TIMER_TASK_STOP) {
+        state.offset = counter;
+        state.running = false;
+    } else if (task == TIMER_TASK_CLEAR) {
+        state.offset = 0;
+        state.started_us = time;
+        state.last = 0;
+    } else if (task >= TIMER_TASK_CAPTURE) {
+        timer->CC[task - TIMER_TASK_CAPTURE] = counter;
+    }
+}
+
+// Raises compare events of the running timers and runs pending interrupt handlers.
+void run_timers() {
+    for (;;) {
+        bool any_running = false;
+        for (int i = 0; i < NUMBER_OF_TIMERS; ++i) {
+            NRF_TIMER_Type &timer = timer_instances[i];
+            bool raise = false;
+            {
+                std::lock_guard<std::mutex> lock(timer_mutex);
+                TimerState &state = timer_states[i];
+                if (!state.running) continue;
+                any_running = true;
+                uint32_t counter = timer_counter(timer, state, now_us());
+                for (int cc = 0; cc < 6; ++cc) {
+                    uint32_t distance = timer.CC[cc] - state.last;
+                    if (distance == 0 || distance > counter - state.last) continue;
+                    timer.EVENTS_COMPARE[cc] = 1;
+                    if (timer.INTENSET & (TIMER_INTENSET_COMPARE0_Msk << cc)) raise = true;
+                }
+                state.last = counter;
+            }
+            if (raise) irqs[timer_irqs[i]].pending = true;
+        }
+
+        for (auto &irq : irqs) {
+            if (!irq.pending || !irq.enabled || !irq.handler) continue;
+            std::lock_guard<std::recursive_mutex> lock(interrupt_mutex);
+            irq.pending = false;
+            irq.handler();
+            uint64_t one = 1;
+            if (write(wake_fd, &one, sizeof(one)) < 0) {}
+        }
+
+        std::this_thread::sleep_for(std::chrono::microseconds(any_running ? 10 : 200));
+    }
+}
+
+// USB-CDC link
+
+int master_fd = -1;
+
+struct TimedByte {
+    uint64_t time;
+    uint8_t value;
+};
+
+std::deque<TimedByte> usb_in;  // Sent by the host, not yet delivered to the board
+std::deque<uint8_t> rx_buffer; // Delivered to the board
+std::deque<TimedByte> usb_out; // Written by the board, not yet sent to the host
+uint64_t last_frame = 0;
+
+// Moves bytes across the link for every frame boundary that passed since the last call.
+void service_usb() {
+    uint64_t time = now_us();
+
+    uint8_t buffer[4096];
+    ssize_t n;
+    while ((n = read(master_fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < n; ++i) usb_in.push_back({time, buffer[i]});
+    }
+
+    uint64_t frame = time / usb_frame_us;
+    if (frame == last_frame) return;
+    uint64_t frame_start = frame * usb_frame_us;
+    size_t budget = usb_bytes_per_frame * (size_t)(frame - last_frame);
+    last_frame = frame;
+
+    size_t count = 0;
+    while (count < budget && !usb_in.empty() && usb_in.front().time < frame_start) {
+        rx_buffer.push_back(usb_in.front().value);
+        usb_in.pop_front();
+        ++count;
+    }
+
+    count = 0;
+    std::vector<uint8_t> out;
+    while (count < budget && count < usb_out.size() && usb_out[count].time < frame_start) {
+        out.push_back(usb_out[count].value);
+        ++count;
+    }
+    size_t written = 0;
+    while (written < out.size()) {
+        n = write(master_fd, out.data() + written, out.size() - written);
+        if (n <= 0) break; // The host does not read; keep the rest for the next frame.
+        written += n;
+    }
+    usb_out.erase(usb_out.begin(), usb_out.begin() + written);
+}
+
+// Sleeps until the next frame boundary, data from the host or an interrupt, but no longer than
+// LOOP_INTERVAL_US: the real board runs loop() continuously, and the program polls the clock for
+// work such as telemetry.
+const uint64_t LOOP_INTERVAL_US = 100;
+
+void wait_for_work() {
+    if (!rx_buffer.empty()) return;
+    uint64_t time = now_us();
+    uint64_t timeout_us = LOOP_INTERVAL_US;
+    if (!usb_in.empty() || !usb_out.empty()) timeout_us = std::min(timeout_us, usb_frame_us - time % usb_frame_us);
+    struct timespec timeout = {0, (long)(timeout_us * 1000)};
+    struct pollfd fds[2] = {{master_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+    if (ppoll(fds, 2, &timeout, nullptr) > 0 && (fds[1].revents & POLLIN)) {
+        uint64_t value;
+        if (read(wake_fd, &value, sizeof(value)) < 0) {}
+    }
+}
+
+// Input pulses
+
+struct PulseTrain {
+    int pin;
+    double hz;
+    unsigned long width_us;
+};
+
+void run_pulses(PulseTrain train) {
+    uint64_t period = (uint64_t)(1000000.0 / train.hz);
+    uint64_t next = now_us() + period;
+    for (;;) {
+        wait_until_us(next);
+        {
+            std::lock_guard<std::recursive_mutex> lock(interrupt_mutex);
+            set_pin(train.pin, HIGH);
+        }
+        wait_until_us(next + train.width_us);
+        {
+            std::lock_guard<std::recursive_mutex> lock(interrupt_mutex);
+            set_pin(train.pin, LOW);
+        }
+        next += period;
+    }
+}
+
+int open_pty(const char *link) {
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd < 0 || grantpt(master_fd) != 0 || unlockpt(master_fd) != 0) return 1;
+    const char *path = ptsname(master_fd);
+    if (!path) return 1;
+
+    // Raw mode, so the line discipline passes every byte unchanged
+    struct termios tio;
+    tcgetattr(master_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master_fd, TCSANOW, &tio);
+    fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK);
+
+    // Keep the slave side open so the master does not report a hangup while no host is connected.
+    if (open(path, O_RDWR | O_NOCTTY) < 0) return 1;
+
+    if (link) {
+        unlink(link);
+        if (symlink(path, link) != 0) {
+            perror("symlink");
+            return 1;
+        }
+        printf("%s -> %s\n", link, path);
+    } else {
+        printf("%s\n", path);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --link PATH          create a symbolic link to the pseudo-terminal\n"
+        "  --record FILE        record DAC, pin and PWM changes as CSV\n"
+        "  --usb-frame-us US    USB frame interval (default %lu)\n"
+        "  --usb-frame-bytes N  bytes per USB frame and direction (default %zu)\n"
+        "  --i2c-hz HZ          I2C clock, overrides Wire.setClock() (default %lu)\n"
+        "  --dacs ADDR,...      addresses of the MCP4728s on the bus (default 0x60,0x61)\n"
+        "  --pulse PIN:HZ[:US]  drive an input pin with pulses of the given width (default 10 us)\n"
+        "  --analog PIN:VALUE   12-bit reading of an analog input (default 0)\n",
+        name, usb_frame_us, usb_bytes_per_frame, i2c_hz);
+}
+
+} // namespace
+
+// Arduino core
+
+EmulatedSerial Serial;
+TwoWire Wire;
+
+NRF_GPIO_Type *NRF_P0 = &gpio_instances[0];
+NRF_GPIO_Type *NRF_P1 = &gpio_instances[1];
+
+NRF_PWM_Type *NRF_PWM0 = &pwm_instances[0];
+NRF_PWM_Type *NRF_PWM1 = &pwm_instances[1];
+NRF_PWM_Type *NRF_PWM2 = &pwm_instances[2];
+NRF_PWM_Type *NRF_PWM3 = &pwm_instances[3];
+
+NRF_TIMER_Type *NRF_TIMER2 = &timer_instances[0];
+NRF_TIMER_Type *NRF_TIMER3 = &timer_instances[1];
+NRF_TIMER_Type *NRF_TIMER4 = &timer_instances[2];
+
+// The emulator is linked without position independence, so handler addresses fit the 32-bit
+// vector table entries.
+void NVIC_SetVector(IRQn_Type irq, uint32_t vector) {
+    irqs[irq].handler = (void (*)())(uintptr_t)vector;
+}
+
+void NVIC_EnableIRQ(IRQn_Type irq) {
+    irqs[irq].enabled = true;
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq) {
+    irqs[irq].enabled = false;
+}
+
+void NVIC_SetPendingIRQ(IRQn_Type irq) {
+    irqs[irq].pending = true;
+}
+
+void EmulatedSerial::begin(unsigned long) {}
+
+int EmulatedSerial::available() {
+    service_usb();
+    return (int)rx_buffer.size();
+}
+
+int EmulatedSerial::read() {
+    if (rx_buffer.empty()) service_usb();
+    if (rx_buffer.empty()) return -1;
+    uint8_t value = rx_buffer.front();
+    rx_buffer.pop_front();
+    return value;
+}
+
+size_t EmulatedSerial::readBytes(char *buffer, size_t length) {
+    size_t count = 0;
+    while (count < length) {
+        int value = read();
+        if (value < 0) break;
+        buffer[count++] = (char)value;
+    }
+    return count;
+}
+
+size_t EmulatedSerial::write(uint8_t byte) {
+    return write(&byte, 1);
+}
+
+size_t EmulatedSerial::write(const uint8_t *buffer, size_t size) {
+    uint64_t time = now_us();
+    for (size_t i = 0; i < size; ++i) usb_out.push_back({time, buffer[i]});
+    service_usb();
+    return size;
+}
+
+int EmulatedSerial::availableForWrite() {
+    return (int)usb_bytes_per_frame;
+}
+
+void EmulatedSerial::flush() {
+    while (!usb_out.empty()) {
+        wait_until_us((now_us() / usb_frame_us + 1) * usb_frame_us);
+        service_usb();
+    }
+}
+
+void pinMode(int pin, int mode) {
+    if (pin < 0 || pin >= NUMBER_OF_PINS) return;
+    std::lock_guard<std::mutex> lock(pin_mutex);
+    pins[pin].mode = mode;
+}
+
+void digitalWrite(int pin, int value) {
+    if (pin < 0 || pin >= NUMBER_OF_PINS) return;
+    set_pin(pin, value ? HIGH : LOW);
+}
+
+uint32_t digitalPinToPinName(int pin) {
+    if (pin < 0 || pin >= NUMBER_OF_PINS) return 0xFFFFFFFF;
+    return pin_names[pin];
+}
+
+int digitalRead(int pin) {
+    if (pin < 0 || pin >= NUMBER_OF_PINS) return LOW;
+    std::lock_guard<std::mutex> lock(pin_mutex);
+    return pins[pin].value;
+}
+
+int analogRead(int pin) {
+    if (pin < 0 || pin >= NUMBER_OF_PINS) return 0;
+    std::lock_guard<std::mutex> lock(pin_mutex);
+    return pins[pin].analog >> (12 - analog_resolution);
+}
+
+void analogReadResolution(int bits) {
+    if (bits >= 1 && bits <= 12) analog_resolution = bits;
+}
+
+void attachInterrupt(int interrupt, void (*handler)(), int mode) {
+    if (interrupt < 0 || interrupt >= NUMBER_OF_PINS) return;
+    std::lock_guard<std::mutex> lock(pin_mutex);
+    pins[interrupt].handler = handler;
+    pins[interrupt].trigger = mode;
+}
+
+void detachInterrupt(int interrupt) {
+    attachInterrupt(interrupt, nullptr, 0);
+}
+
+void noInterrupts() {
+    interrupt_mutex.lock();
+}
+
+void interrupts() {
+    interrupt_mutex.unlock();
+}
+
+unsigned long micros() {
+    return (unsigned long)now_us();
+}
+
+unsigned long millis() {
+    return (unsigned long)(now_us() / 1000);
+}
+
+void delay(unsigned long ms) {
+    wait_until_us(now_us() + ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    wait_until_us(now_us() + us);
+}
+
+// Wire
+
+void TwoWire::begin() {}
+
+void TwoWire::setClock(uint32_t hz) {
+    if (!i2c_hz_fixed && hz > 0) i2c_hz = hz;
+}
+
+// MCP4728
+
+bool Adafruit_MCP4728::begin(uint8_t i2c_address, TwoWire *) {
+    wait_until_us(now_us() + i2c_transfer_us(1));
+    if (std::find(dac_bus.begin(), dac_bus.end(), i2c_address) == dac_bus.end()) return false;
+    if (number_of_dacs >= MAX_DACS) return false;
+    address_ = i2c_address;
+    DacState &dac = dac_states[number_of_dacs++];
+    memset(&dac, 0, sizeof(dac));
+    dac.address = i2c_address;
+    return true;
+}
+
+static DacState *find_dac(uint8_t address) {
+    for (int i = 0; i < number_of_dacs; ++i) {
+        if (dac_states[i].address == address) return &dac_states[i];
+    }
+    return nullptr;
+}
+
+// Multi-write command: the output is updated when the transfer ends unless udac is set.
+bool Adafruit_MCP4728::setChannelValue(MCP4728_channel_t channel, uint16_t new_value,
+                                       MCP4728_vref_t, MCP4728_gain_t, MCP4728_pd_mode_t,
+                                       bool udac) {
+    wait_until_us(now_us() + i2c_transfer_us(4));
+    DacState *dac = find_dac(address_);
+    if (!dac) return false;
+    dac->input[channel] = new_value & 0x0FFF;
+    if (udac) dac->pending = true;
+    else update_dac_output(*dac, channel, now_us());
+    return true;
+}
+
+// Fast write command: the outputs are updated when the transfer ends while LDAC is low and on
+// the next falling edge of LDAC otherwise.
+bool Adafruit_MCP4728::fastWrite(uint16_t channel_a_value, uint16_t channel_b_value,
+                                 uint16_t channel_c_value, uint16_t channel_d_value) {
+    wait_until_us(now_us() + i2c_transfer_us(9));
+    DacState *dac = find_dac(address_);
+    if (!dac) return false;
+    uint16_t values[4] = {channel_a_value, channel_b_value, channel_c_value, channel_d_value};
+    for (int ch = 0; ch < 4; ++ch) dac->input[ch] = values[ch] & 0x0FFF;
+    if (digitalRead(LDAC) == HIGH) {
+        dac->pending = true;
+    } else {
+        uint64_t time = now_us();
+        for (int ch = 0; ch < 4; ++ch) update_dac_output(*dac, ch, time);
+    }
+    return true;
+}
+
+// Sequential write to the EEPROM, followed by the EEPROM write cycle of up to 50 ms.
+bool Adafruit_MCP4728::saveToEEPROM() {
+    wait_until_us(now_us() + i2c_transfer_us(10) + 50000);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const char *link = nullptr;
+    const char *record_path = nullptr;
+    std::vector<PulseTrain> trains;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *value = argv[++i];
+        if (arg == "--link") {
+            link = value;
+        } else if (arg == "--record") {
+            record_path = value;
+        } else if (arg == "--usb-frame-us") {
+            usb_frame_us = strtoul(value, nullptr, 10);
+        } else if (arg == "--usb-frame-bytes") {
+            usb_bytes_per_frame = strtoul(value, nullptr, 10);
+        } else if (arg == "--i2c-hz") {
+            i2c_hz = strtoul(value, nullptr, 10);
+            i2c_hz_fixed = true;
+        } else if (arg == "--dacs") {
+            dac_bus.clear();
+            for (const char *p = value; *p;) {
+                char *end;
+                unsigned long address = strtoul(p, &end, 0);
+                if (end == p || address > 0x7F || (*end && *end != ',')) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                dac_bus.push_back((uint8_t)address);
+                p = *end ? end + 1 : end;
+            }
+        } else if (arg == "--analog") {
+            int pin, reading;
+            if (sscanf(value, "%d:%d", &pin, &reading) != 2 || pin < 0 || pin >= NUMBER_OF_PINS
+                || reading < 0 || reading > 4095) {
+                usage(argv[0]);
+                return 1;
+            }
+            pins[pin].analog = reading;
+        } else if (arg == "--pulse") {
+            PulseTrain train = {0, 0, 10};
+            if (sscanf(value, "%d:%lf:%lu", &train.pin, &train.hz, &train.width_us) < 2
+                || train.pin < 0 || train.pin >= NUMBER_OF_PINS || train.hz <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            trains.push_back(train);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (usb_frame_us == 0 || usb_bytes_per_frame == 0 || i2c_hz == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (record_path) {
+        record_file = fopen(record_path, "w");
+        if (!record_file) {
+            perror(record_path);
+            return 1;
+        }
+        setvbuf(record_file, nullptr, _IOLBF, 0);
+        fprintf(record_file, "time_us,source,channel,value\n");
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (wake_fd < 0 || open_pty(link) != 0) {
+        perror("pty");
+        return 1;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        gpio_instances[i].OUTSET.bind(&gpio_instances[i], 1, on_gpio_write);
+        gpio_instances[i].OUTCLR.bind(&gpio_instances[i], 0, on_gpio_write);
+    }
+    for (int i = 0; i < 4; ++i) {
+        pwm_instances[i].TASKS_STOP.bind(&pwm_instances[i], -1, on_pwm_task);
+        pwm_instances[i].TASKS_SEQSTART[0].bind(&pwm_instances[i], 0, on_pwm_task);
+        pwm_instances[i].TASKS_SEQSTART[1].bind(&pwm_instances[i], 1, on_pwm_task);
+    }
+    for (int i = 0; i < NUMBER_OF_TIMERS; ++i) {
+        NRF_TIMER_Type &timer = timer_instances[i];
+        timer.TASKS_START.bind(&timer, TIMER_TASK_START, on_timer_task);
+        timer.TASKS_STOP.bind(&timer, TIMER_TASK_STOP, on_timer_task);
+        timer.TASKS_CLEAR.bind(&timer, TIMER_TASK_CLEAR, on_timer_task);
+        for (int cc = 0; cc < 6; ++cc) timer.TASKS_CAPTURE[cc].bind(&timer, TIMER_TASK_CAPTURE + cc, on_timer_task);
+    }
+
+    setup();
+    for (const auto &train : trains) std::thread(run_pulses, train).detach();
+    std::thread(run_timers).detach();
+
+    for (;;) {
+        loop();
+        service_usb();
+        wait_for_work();
+    }
+}
@@ -0,0 +1,2 @@
+// Builds the Arduino program for the emulator.
+#include "Program.ino"
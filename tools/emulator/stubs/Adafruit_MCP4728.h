@@ -0,0 +1,73 @@
+/* Adafruit_MCP4728.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Stand-in for the Adafruit MCP4728 library. Every call takes as long as the I2C transfer it
+// replaces and records the resulting outputs.
+
+#ifndef EMULATOR_ADAFRUIT_MCP4728_H_
+#define EMULATOR_ADAFRUIT_MCP4728_H_
+
+#include <stdint.h>
+
+typedef enum {
+    MCP4728_CHANNEL_A,
+    MCP4728_CHANNEL_B,
+    MCP4728_CHANNEL_C,
+    MCP4728_CHANNEL_D,
+} MCP4728_channel_t;
+
+typedef enum {
+    MCP4728_VREF_VDD,
+    MCP4728_VREF_INTERNAL,
+} MCP4728_vref_t;
+
+typedef enum {
+    MCP4728_GAIN_1X,
+    MCP4728_GAIN_2X,
+} MCP4728_gain_t;
+
+typedef enum {
+    MCP4728_PD_MODE_NORMAL,
+    MCP4728_PD_MODE_GND_1K,
+    MCP4728_PD_MODE_GND_100K,
+    MCP4728_PD_MODE_GND_500K,
+} MCP4728_pd_mode_t;
+
+class TwoWire;
+
+class Adafruit_MCP4728 {
+    public:
+        bool begin(uint8_t i2c_address = 0x60, TwoWire *wire = nullptr);
+        bool setChannelValue(MCP4728_channel_t channel, uint16_t new_value,
+                             MCP4728_vref_t new_vref = MCP4728_VREF_VDD,
+                             MCP4728_gain_t new_gain = MCP4728_GAIN_1X,
+                             MCP4728_pd_mode_t new_pd_mode = MCP4728_PD_MODE_NORMAL,
+                             bool udac = false);
+        bool fastWrite(uint16_t channel_a_value, uint16_t channel_b_value,
+                       uint16_t channel_c_value, uint16_t channel_d_value);
+        bool saveToEEPROM();
+    private:
+        uint8_t address_ = 0;
+};
+
+#endif // EMULATOR_ADAFRUIT_MCP4728_H_
@@ -0,0 +1,89 @@
+/* Arduino.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Stand-in for the Arduino core of the Nano 33 BLE, covering what Program.ino uses. Only
+// included when the program is built for the emulator.
+
+#ifndef EMULATOR_ARDUINO_H_
+#define EMULATOR_ARDUINO_H_
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "nrf.h"
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+// Pin numbers of the Nano 33 BLE
+enum { A0 = 14, A1, A2, A3, A4, A5, A6, A7 };
+
+#define NUMBER_OF_PINS 22
+
+// USB-CDC serial port. Bytes written by the host become available at the next USB frame and
+// bytes written here are sent to the host at the next USB frame.
+class EmulatedSerial {
+    public:
+        void begin(unsigned long baud);
+        int available();
+        int read();
+        size_t readBytes(char *buffer, size_t length);
+        size_t write(uint8_t byte);
+        size_t write(const uint8_t *buffer, size_t size);
+        int availableForWrite();
+        void flush();
+        operator bool() { return true; }
+};
+
+extern EmulatedSerial Serial;
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+int analogRead(int pin);
+void analogReadResolution(int bits);
+
+// GPIO pin of an Arduino pin, 32 * port + pin
+uint32_t digitalPinToPinName(int pin);
+
+inline int digitalPinToInterrupt(int pin) { return pin; }
+void attachInterrupt(int interrupt, void (*handler)(), int mode);
+void detachInterrupt(int interrupt);
+void noInterrupts();
+void interrupts();
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+#endif // EMULATOR_ARDUINO_H_
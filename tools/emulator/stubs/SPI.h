@@ -0,0 +1 @@
+// SPI is included by Program.ino but not used.
@@ -0,0 +1,174 @@
+/* nrf.h
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Register blocks of the nRF52840 peripherals used by Program.ino. Registers are plain memory;
+// writing a task register notifies the emulator so it can update or record the peripheral.
+
+#ifndef EMULATOR_NRF_H_
+#define EMULATOR_NRF_H_
+
+#include <stdint.h>
+
+// Task register; writing 1 triggers the task.
+class TaskRegister {
+    public:
+        typedef void (*Handler)(void *peripheral, int task);
+        void bind(void *peripheral, int task, Handler handler) { peripheral_ = peripheral; task_ = task; handler_ = handler; }
+        TaskRegister &operator=(uint32_t value) {
+            if (value && handler_) handler_(peripheral_, task_);
+            return *this;
+        }
+    private:
+        void *peripheral_ = nullptr;
+        int task_ = 0;
+        Handler handler_ = nullptr;
+};
+
+// Register that passes every written value to the emulator.
+class WriteRegister {
+    public:
+        typedef void (*Handler)(void *peripheral, int reg, uint32_t value);
+        void bind(void *peripheral, int reg, Handler handler) { peripheral_ = peripheral; reg_ = reg; handler_ = handler; }
+        WriteRegister &operator=(uint32_t value) {
+            if (handler_) handler_(peripheral_, reg_, value);
+            return *this;
+        }
+    private:
+        void *peripheral_ = nullptr;
+        int reg_ = 0;
+        Handler handler_ = nullptr;
+};
+
+// GPIO port
+typedef struct {
+    volatile uint32_t OUT; // Updated by the emulator
+    WriteRegister OUTSET;
+    WriteRegister OUTCLR;
+} NRF_GPIO_Type;
+
+extern NRF_GPIO_Type *NRF_P0;
+extern NRF_GPIO_Type *NRF_P1;
+
+// PWM
+typedef struct {
+    TaskRegister TASKS_STOP;
+    TaskRegister TASKS_SEQSTART[2];
+    TaskRegister TASKS_NEXTSTEP;
+    volatile uint32_t EVENTS_STOPPED;
+    volatile uint32_t EVENTS_SEQSTARTED[2];
+    volatile uint32_t EVENTS_SEQEND[2];
+    volatile uint32_t EVENTS_PWMPERIODEND;
+    volatile uint32_t EVENTS_LOOPSDONE;
+    volatile uint32_t SHORTS;
+    volatile uint32_t INTEN;
+    volatile uint32_t ENABLE;
+    volatile uint32_t MODE;
+    volatile uint32_t COUNTERTOP;
+    volatile uint32_t PRESCALER;
+    volatile uint32_t DECODER;
+    volatile uint32_t LOOP;
+    struct {
+        volatile uint32_t PTR;
+        volatile uint32_t CNT;
+        volatile uint32_t REFRESH;
+        volatile uint32_t ENDDELAY;
+    } SEQ[2];
+    struct {
+        volatile uint32_t OUT[4];
+    } PSEL;
+} NRF_PWM_Type;
+
+extern NRF_PWM_Type *NRF_PWM0;
+extern NRF_PWM_Type *NRF_PWM1;
+extern NRF_PWM_Type *NRF_PWM2;
+extern NRF_PWM_Type *NRF_PWM3;
+
+#define PWM_PSEL_OUT_PIN_Pos (0UL)
+#define PWM_PSEL_OUT_PORT_Pos (5UL)
+#define PWM_PSEL_OUT_CONNECT_Pos (31UL)
+#define PWM_PSEL_OUT_CONNECT_Connected (0UL)
+#define PWM_PSEL_OUT_CONNECT_Disconnected (1UL)
+#define PWM_ENABLE_ENABLE_Pos (0UL)
+#define PWM_ENABLE_ENABLE_Disabled (0UL)
+#define PWM_ENABLE_ENABLE_Enabled (1UL)
+#define PWM_MODE_UPDOWN_Pos (0UL)
+#define PWM_MODE_UPDOWN_Up (0UL)
+#define PWM_MODE_UPDOWN_UpAndDown (1UL)
+#define PWM_PRESCALER_PRESCALER_Pos (0UL)
+#define PWM_PRESCALER_PRESCALER_DIV_1 (0UL)
+#define PWM_COUNTERTOP_COUNTERTOP_Pos (0UL)
+#define PWM_LOOP_CNT_Pos (0UL)
+#define PWM_LOOP_CNT_Disabled (0UL)
+#define PWM_DECODER_LOAD_Pos (0UL)
+#define PWM_DECODER_LOAD_Common (0UL)
+#define PWM_DECODER_LOAD_Grouped (1UL)
+#define PWM_DECODER_LOAD_Individual (2UL)
+#define PWM_DECODER_LOAD_WaveForm (3UL)
+#define PWM_DECODER_MODE_Pos (8UL)
+#define PWM_DECODER_MODE_RefreshCount (0UL)
+#define PWM_DECODER_MODE_NextStep (1UL)
+#define PWM_SEQ_PTR_PTR_Pos (0UL)
+#define PWM_SEQ_CNT_CNT_Pos (0UL)
+
+// TIMER
+typedef struct {
+    TaskRegister TASKS_START;
+    TaskRegister TASKS_STOP;
+    TaskRegister TASKS_COUNT;
+    TaskRegister TASKS_CLEAR;
+    TaskRegister TASKS_SHUTDOWN;
+    TaskRegister TASKS_CAPTURE[6];
+    volatile uint32_t EVENTS_COMPARE[6];
+    volatile uint32_t SHORTS;
+    volatile uint32_t INTENSET; // Holds the enabled interrupts; INTENCLR is not modelled
+    volatile uint32_t MODE;
+    volatile uint32_t BITMODE;
+    volatile uint32_t PRESCALER;
+    volatile uint32_t CC[6];
+} NRF_TIMER_Type;
+
+extern NRF_TIMER_Type *NRF_TIMER2;
+extern NRF_TIMER_Type *NRF_TIMER3;
+extern NRF_TIMER_Type *NRF_TIMER4;
+
+#define TIMER_MODE_MODE_Pos (0UL)
+#define TIMER_MODE_MODE_Timer (0UL)
+#define TIMER_BITMODE_BITMODE_Pos (0UL)
+#define TIMER_BITMODE_BITMODE_32Bit (3UL)
+#define TIMER_PRESCALER_PRESCALER_Pos (0UL)
+#define TIMER_INTENSET_COMPARE0_Pos (16UL)
+#define TIMER_INTENSET_COMPARE0_Msk (1UL << TIMER_INTENSET_COMPARE0_Pos)
+
+// Interrupt controller. Handlers run on an emulator thread while interrupts are enabled.
+typedef enum {
+    TIMER2_IRQn = 10,
+    TIMER3_IRQn = 26,
+    TIMER4_IRQn = 27,
+} IRQn_Type;
+
+void NVIC_SetVector(IRQn_Type irq, uint32_t vector);
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+void NVIC_SetPendingIRQ(IRQn_Type irq);
+
+#endif // EMULATOR_NRF_H_
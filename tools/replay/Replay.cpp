@@ -0,0 +1,422 @@
+/* Replay.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Summarizes a journal written by JournalBoard, or plays it back against an interface board at
+// the original speed or as fast as possible, so that recorded acquisitions can be used as
+// benchmarks. Exits with a non-zero status if the board reports an error.
+
+#include "Arduino.h"
+#include "Journal.h"
+#include "MultiBoard.h"
+#include "SharedMemoryBoard.h"
+#include "Statistics.h"
+#include "TcpLink.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s JOURNAL [TARGET] [--session N] [--max-speed] [--tcp] [--shared-memory]\n"
+            "          [--shared-trigger] [--low-latency] [--max-in-flight N]\n"
+            "  JOURNAL          journal file; without TARGET, its sessions and doses are listed\n"
+            "  TARGET           serial port of the Arduino to play the journal back on, Auto to search\n"
+            "                   for it; several ports separated by commas combine the boards\n"
+            "  --session        play back only the given session, counting from 1\n"
+            "  --max-speed      send every command right after the previous one instead of at its\n"
+            "                   recorded time\n"
+            "  --tcp            TARGET is the address of tools/server\n"
+            "  --shared-memory  TARGET is the name of the broker in tools/broker\n"
+            "  --shared-trigger the trigger inputs of all boards are wired to the same line\n"
+            "  --low-latency    use the low-latency serial mode\n"
+            "  --max-in-flight  commands sent ahead of their acknowledgements\n",
+            name);
+}
+
+float bits_float(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+std::string format_time(uint64_t unix_time_ns) {
+    time_t seconds = (time_t)(unix_time_ns / 1000000000);
+    char text[32];
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+    return text;
+}
+
+int report_errors(InterfaceBoard &board) {
+    int count = 0;
+    for (std::string error = board.PopError(); !error.empty(); error = board.PopError()) {
+        fprintf(stderr, "error: %s\n", error.c_str());
+        ++count;
+    }
+    return count;
+}
+
+// Lists the sessions of the journal and the dose of every channel.
+int summarize(const std::string &path) {
+    JournalReader reader;
+    std::string error;
+    if (reader.Open(path, error) != 0) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    JournalDose dose;
+    JournalRecord record;
+    std::vector<uint8_t> payload;
+    unsigned int sessions = 0, channels = 0;
+    uint64_t records = 0, lost = 0, end_ns = 0;
+    auto print_session = [&]() {
+        if (sessions == 0) return;
+        printf("  %.3f s, %llu records, %llu lost\n", end_ns * 1e-9, (unsigned long long)records,
+               (unsigned long long)lost);
+    };
+    while (reader.Next(record, payload)) {
+        if (record.type == JOURNAL_SESSION && payload.size() >= sizeof(JournalSession)) {
+            print_session();
+            JournalSession session;
+            memcpy(&session, payload.data(), sizeof(session));
+            ++sessions;
+            channels = std::max(channels, session.channels);
+            records = lost = end_ns = 0;
+            printf("session %u: %s, %u channels\n", sessions, format_time(session.unix_time_ns).c_str(),
+                   session.channels);
+        } else if (record.type == JOURNAL_LOST) {
+            lost += record.value;
+        }
+        ++records;
+        end_ns = std::max(end_ns, record.time_ns);
+        dose.Add(record, payload);
+    }
+    print_session();
+
+    printf("dose in s at full power\n");
+    for (unsigned int i = 0; i < channels && i < JOURNAL_MAX_CHANNELS; ++i) {
+        printf("  channel %2u %12.3f\n", i + 1, dose.Get(i, end_ns));
+    }
+    return 0;
+}
+
+// Batched writes collected until their last record
+struct Batch {
+    uint32_t analog_mask = 0;
+    uint32_t digital_mask = 0;
+    uint32_t digital_values = 0;
+    std::vector<double> relative_values = std::vector<double>(JOURNAL_MAX_CHANNELS);
+    unsigned int count = 0;
+};
+
+int apply(InterfaceBoard &board, Batch &batch) {
+    int ret = 0;
+    if (batch.count == 1 && batch.analog_mask != 0) {
+        unsigned int channel = __builtin_ctz(batch.analog_mask);
+        ret = board.WriteAnalogRelative(channel, batch.relative_values[channel]);
+    } else if (batch.count == 1 && batch.digital_mask != 0) {
+        unsigned int channel = __builtin_ctz(batch.digital_mask);
+        ret = board.WriteDigital(channel, (batch.digital_values >> channel) & 1);
+    } else {
+        if (batch.analog_mask != 0) ret |= board.WriteAnalogRelativeMulti(batch.analog_mask, batch.relative_values);
+        if (batch.digital_mask != 0) ret |= board.WriteDigitalMulti(batch.digital_mask, batch.digital_values);
+    }
+    batch = Batch();
+    return ret;
+}
+
+template <typename T>
+std::vector<T> payload_values(const std::vector<uint8_t> &payload) {
+    std::vector<T> values(payload.size() / sizeof(T));
+    if (!values.empty()) memcpy(values.data(), payload.data(), values.size() * sizeof(T));
+    return values;
+}
+
+// Gives a record to the board and counts the commands that were given.
+int replay(InterfaceBoard &board, const JournalRecord &record, const std::vector<uint8_t> &payload, Batch &batch,
+           unsigned int &commands) {
+    int ret = 0;
+    if ((record.type == JOURNAL_ANALOG || record.type == JOURNAL_DIGITAL) && record.channel >= JOURNAL_MAX_CHANNELS) {
+        return 1;
+    }
+    switch (record.type) {
+        case JOURNAL_ANALOG:
+            batch.analog_mask |= 1u << record.channel;
+            batch.relative_values[record.channel] = bits_float(record.value);
+            ++batch.count;
+            if (!(record.flags & JOURNAL_FLAG_BATCHED)) {
+                ret = apply(board, batch);
+                ++commands;
+            }
+            break;
+        case JOURNAL_DIGITAL:
+            batch.digital_mask |= 1u << record.channel;
+            if (record.value != 0) batch.digital_values |= 1u << record.channel;
+            ++batch.count;
+            if (!(record.flags & JOURNAL_FLAG_BATCHED)) {
+                ret = apply(board, batch);
+                ++commands;
+            }
+            break;
+        case JOURNAL_LOAD_ANALOG_SEQUENCE: {
+            std::vector<float> values = payload_values<float>(payload);
+            ret = board.LoadAnalogSequence(record.channel, std::vector<double>(values.begin(), values.end()));
+            ++commands;
+            break;
+        }
+        case JOURNAL_LOAD_DIGITAL_SEQUENCE:
+            ret = board.LoadDigitalSequence(record.channel, std::vector<bool>(payload.begin(), payload.end()));
+            ++commands;
+            break;
+        case JOURNAL_START_ANALOG_SEQUENCE:
+            ret = board.StartAnalogSequence(record.channel);
+            ++commands;
+            break;
+        case JOURNAL_STOP_ANALOG_SEQUENCE:
+            ret = board.StopAnalogSequence(record.channel);
+            ++commands;
+            break;
+        case JOURNAL_START_DIGITAL_SEQUENCE:
+            ret = board.StartDigitalSequence(record.channel);
+            ++commands;
+            break;
+        case JOURNAL_STOP_DIGITAL_SEQUENCE:
+            ret = board.StopDigitalSequence(record.channel);
+            ++commands;
+            break;
+        case JOURNAL_LOAD_WAVEFORM: {
+            std::vector<WaveformEvent> events;
+            for (const JournalWaveformEvent &recorded : payload_values<JournalWaveformEvent>(payload)) {
+                WaveformEvent event;
+                event.time_us = recorded.time_us;
+                event.on_mask = recorded.on_mask;
+                event.off_mask = recorded.off_mask;
+                event.power_channel = recorded.power_channel;
+                event.relative_power = recorded.relative_power;
+                events.push_back(event);
+            }
+            ret = board.LoadWaveform(events);
+            ++commands;
+            break;
+        }
+        case JOURNAL_START_WAVEFORM: {
+            std::vector<JournalWaveformStart> start = payload_values<JournalWaveformStart>(payload);
+            if (start.empty()) break;
+            ret = board.StartWaveform(start[0].channel_mask, start[0].period_us, start[0].repetitions,
+                                      start[0].on_trigger != 0);
+            ++commands;
+            break;
+        }
+        case JOURNAL_STOP_WAVEFORM:
+            ret = board.StopWaveform();
+            ++commands;
+            break;
+        case JOURNAL_BLANKING:
+            ret = board.SetBlanking(record.value, record.channel != 0);
+            ++commands;
+            break;
+        case JOURNAL_LOAD_CALIBRATION: {
+            std::vector<float> values = payload_values<float>(payload);
+            ret = board.LoadCalibration(record.channel, std::vector<double>(values.begin(), values.end()));
+            ++commands;
+            break;
+        }
+        case JOURNAL_RAMP: {
+            std::vector<JournalRamp> ramp = payload_values<JournalRamp>(payload);
+            if (ramp.empty()) break;
+            ret = board.Ramp(record.channel, ramp[0].relative_value, ramp[0].duration_us, ramp[0].exponential != 0);
+            ++commands;
+            break;
+        }
+        case JOURNAL_MODULATION: {
+            std::vector<JournalModulation> modulation = payload_values<JournalModulation>(payload);
+            if (modulation.empty()) break;
+            ret = board.SetModulation(record.channel, modulation[0].frequency_hz, modulation[0].duty_cycle);
+            ++commands;
+            break;
+        }
+        case JOURNAL_LOAD_MODULATION_SEQUENCE: {
+            std::vector<double> frequencies_hz, duty_cycles;
+            for (const JournalModulation &entry : payload_values<JournalModulation>(payload)) {
+                frequencies_hz.push_back(entry.frequency_hz);
+                duty_cycles.push_back(entry.duty_cycle);
+            }
+            ret = board.LoadModulationSequence(record.channel, frequencies_hz, duty_cycles);
+            ++commands;
+            break;
+        }
+        case JOURNAL_START_MODULATION_SEQUENCE:
+            ret = board.StartModulationSequence(record.channel);
+            ++commands;
+            break;
+        case JOURNAL_STOP_MODULATION_SEQUENCE:
+            ret = board.StopModulationSequence(record.channel);
+            ++commands;
+            break;
+        case JOURNAL_CLOSE:
+            ret = board.Flush();
+            break;
+        default:
+            break;
+    }
+    return ret;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string path = argv[1];
+    std::string target;
+    unsigned int only_session = 0;
+    bool max_speed = false, tcp = false, shared_memory = false, shared_trigger = false, low_latency = false;
+    unsigned int max_in_flight = DEFAULT_MAX_PENDING_COMMANDS;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--session" && i + 1 < argc) {
+            only_session = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--max-speed") {
+            max_speed = true;
+        } else if (arg == "--tcp") {
+            tcp = true;
+        } else if (arg == "--shared-memory") {
+            shared_memory = true;
+        } else if (arg == "--shared-trigger") {
+            shared_trigger = true;
+        } else if (arg == "--low-latency") {
+            low_latency = true;
+        } else if (arg == "--max-in-flight" && i + 1 < argc) {
+            max_in_flight = strtoul(argv[++i], nullptr, 10);
+        } else if (arg[0] != '-' && target.empty()) {
+            target = arg;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (target.empty()) return summarize(path);
+
+    JournalReader reader;
+    std::string error;
+    if (reader.Open(path, error) != 0) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    std::unique_ptr<InterfaceBoard> board;
+    if (shared_memory) {
+        board.reset(new SharedMemoryBoard(target[0] == '/' ? target : "/" + target));
+    } else {
+        std::vector<std::unique_ptr<InterfaceBoard>> boards;
+        std::istringstream target_stream(target);
+        for (std::string port; std::getline(target_stream, port, ',');) {
+            if (port.empty()) continue;
+            if (tcp) boards.push_back(std::unique_ptr<InterfaceBoard>(new Arduino(port, std::unique_ptr<Link>(new TcpLink()))));
+            else boards.push_back(std::unique_ptr<InterfaceBoard>(new Arduino(port)));
+        }
+        if (boards.size() == 1) board = std::move(boards[0]);
+        else board.reset(new MultiBoard(std::move(boards), shared_trigger));
+    }
+    board->SetMaxPendingCommands(max_in_flight);
+    board->SetLowLatency(low_latency);
+    if (board->Open() != 0 || !board->DeviceIsOpen()) {
+        fprintf(stderr, "The board could not be opened.\n");
+        report_errors(*board);
+        return 1;
+    }
+
+    // Lateness of the commands relative to their recorded time
+    LatencyHistogram lag;
+    JournalRecord record;
+    std::vector<uint8_t> payload;
+    Batch batch;
+    unsigned int session = 0, commands = 0;
+    uint64_t failed = 0;
+    Clock::time_point origin = Clock::now();
+    auto start = origin;
+    while (reader.Next(record, payload)) {
+        if (record.type == JOURNAL_SESSION) {
+            ++session;
+            JournalSession recorded;
+            memcpy(&recorded, payload.data(), std::min(payload.size(), sizeof(recorded)));
+            if (only_session == 0 || only_session == session) {
+                if (recorded.channels > board->GetNumberOfChannels()) {
+                    fprintf(stderr, "warning: session %u used %u channels, the board has %u\n", session,
+                            recorded.channels, board->GetNumberOfChannels());
+                }
+                batch = Batch();
+                origin = Clock::now();
+            }
+            continue;
+        }
+        if (only_session != 0 && session != only_session) continue;
+        if (record.type == JOURNAL_LOST) {
+            fprintf(stderr, "warning: %u records of session %u were lost while recording\n", record.value, session);
+            continue;
+        }
+
+        if (!max_speed) {
+            auto due = origin + std::chrono::nanoseconds(record.time_ns);
+            auto now = Clock::now();
+            if (now < due) {
+                std::this_thread::sleep_until(due);
+                now = Clock::now();
+            }
+            lag.Record(std::chrono::duration_cast<std::chrono::microseconds>(now - due).count());
+        }
+        if (replay(*board, record, payload, batch, commands) != 0) ++failed;
+    }
+    if (board->Flush() != 0) ++failed;
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    printf("%-28s %u commands in %.3f s, %.0f commands/s\n", "replay", commands, seconds, commands / seconds);
+    if (!max_speed) {
+        printf("%-28s p50 %8llu us  p99 %8llu us  max %8llu us\n", "lag behind the journal",
+               (unsigned long long)lag.Percentile(0.5), (unsigned long long)lag.Percentile(0.99),
+               (unsigned long long)lag.Max());
+    }
+    BoardStatistics stats;
+    board->GetStatistics(stats);
+    printf("%-28s p50 %8llu us  p99 %8llu us  max %8llu us\n", "board write latency",
+           (unsigned long long)stats.write_latency_p50_us, (unsigned long long)stats.write_latency_p99_us,
+           (unsigned long long)stats.write_latency_max_us);
+    printf("%-28s %llu commands, %llu bytes, %llu resyncs\n", "board totals", (unsigned long long)stats.commands,
+           (unsigned long long)stats.bytes_sent, (unsigned long long)stats.resyncs);
+    if (failed > 0) fprintf(stderr, "%llu commands failed\n", (unsigned long long)failed);
+    return report_errors(*board) == 0 && failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,377 @@
+/* Server.cpp
+ *
+ * Copyright (C) 2020-2022 John Wigg, Philipp Mueller and Daniel Schroeder, Jena University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Makes the Arduino at a serial port, or the emulator in tools/emulator, reachable over TCP for
+// the "Network" device type. The framed protocol is passed through unchanged in both directions,
+// so acknowledgements, pipelining and attaching without a reset work as on the serial port. One
+// client is served at a time and further connections are refused while it is connected, unless
+// --take-over lets a new connection replace it. Connections whose peer stopped answering are
+// dropped after TCP_DEAD_TIMEOUT, so a client that lost its connection can reconnect.
+//
+// There is no authentication: whoever can connect controls the lasers. The server therefore
+// listens on the loopback interface unless another address is given explicitly.
+
+#include "Arduino.h"
+#include "TcpLink.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Address the server listens on without --listen, reachable from this computer only
+const char *const LOOPBACK_ADDRESS = "127.0.0.1";
+
+volatile sig_atomic_t running = 1;
+
+void on_signal(int) {
+    running = 0;
+}
+
+void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s PORT [--listen [ADDRESS:]TCP_PORT] [--take-over] [--low-latency]\n"
+            "  PORT          serial port of the Arduino or the emulator, Auto to search for it\n"
+            "  --listen      address and port to accept connections on, default %s:" TCP_DEFAULT_PORT ";\n"
+            "                a bare port listens on %s, * or :: as ADDRESS on all interfaces\n"
+            "  --take-over   a new connection replaces the connected client instead of being refused\n"
+            "  --low-latency use the low-latency serial mode\n"
+            "\n"
+            "There is no authentication or encryption: anyone who can connect can switch the lasers\n"
+            "on. Only listen on other interfaces than loopback in a trusted network, or restrict access\n"
+            "to the port with a firewall or an SSH tunnel.\n",
+            name, LOOPBACK_ADDRESS, LOOPBACK_ADDRESS);
+}
+
+std::string peer_name(const sockaddr_storage &address) {
+    char host[NI_MAXHOST], service[NI_MAXSERV];
+    if (getnameinfo(reinterpret_cast<const sockaddr *>(&address), sizeof(address), host, sizeof(host), service,
+                    sizeof(service), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        return "unknown";
+    }
+    return std::string(host) + ":" + service;
+}
+
+class Server {
+    public:
+        Server(const std::string &port, bool low_latency, bool take_over)
+            : port_(port), low_latency_(low_latency), take_over_(take_over) {}
+        int Listen(const std::string &address);
+        void Run();
+    private:
+        void SerialThread();
+        bool OpenSerial();
+        void Accept();
+        void DropClient(const char *reason);
+        void ForwardToSerial();
+
+        std::string port_;
+        bool low_latency_;
+        bool take_over_;
+        int listen_fd_ = -1;
+
+        // The serial thread reads from the port and reopens it; writes to it and closing it
+        // hold serial_mutex_.
+        SerialLink serial_{BAUD};
+        std::mutex serial_mutex_;
+        std::atomic<bool> serial_ok_{false};
+
+        // The client is replaced by the main thread while holding client_mutex_, and the serial
+        // thread sends to it while holding it.
+        std::mutex client_mutex_;
+        int client_fd_ = -1;
+        std::string client_name_;
+        Clock::time_point connected_;
+        uint64_t bytes_in_ = 0;
+        uint64_t bytes_out_ = 0;
+};
+
+int Server::Listen(const std::string &address) {
+    // A bare number is a port on the loopback interface, anything else a host with an optional
+    // port. "*" listens on all addresses.
+    std::string host = LOOPBACK_ADDRESS, service = TCP_DEFAULT_PORT;
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        if (address.find_first_not_of("0123456789") == std::string::npos) service = address;
+        else host = address;
+    } else if (address.find(':') != colon && address.front() != '[') {
+        host = address; // IPv6 address without a port
+    } else {
+        host = address.substr(0, colon);
+        service = address.substr(colon + 1);
+    }
+    if (!host.empty() && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+    if (host == "*") host.clear();
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *addresses = nullptr;
+    int ret = getaddrinfo(host.empty() ? nullptr : host.c_str(), service.c_str(), &hints, &addresses);
+    if (ret != 0) {
+        fprintf(stderr, "%s: %s\n", address.c_str(), gai_strerror(ret));
+        return 1;
+    }
+    for (addrinfo *candidate = addresses; candidate != nullptr && listen_fd_ == -1; candidate = candidate->ai_next) {
+        int fd = socket(candidate->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) continue;
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, candidate->ai_addr, candidate->ai_addrlen) == 0 && listen(fd, 4) == 0) {
+            listen_fd_ = fd;
+        } else {
+            close(fd);
+        }
+    }
+    freeaddrinfo(addresses);
+    if (listen_fd_ == -1) {
+        fprintf(stderr, "Could not listen on %s:%s: %s\n", host.c_str(), service.c_str(), strerror(errno));
+        return 1;
+    }
+    printf("Listening on %s:%s\n", host.empty() ? "*" : host.c_str(), service.c_str());
+    fflush(stdout);
+    return 0;
+}
+
+bool Server::OpenSerial() {
+    std::string port = port_;
+    if (port == AUTO_PORT) {
+        std::vector<std::string> ports = Arduino::FindPorts();
+        if (ports.empty()) return false;
+        port = ports[0];
+    }
+    std::lock_guard<std::mutex> lock(serial_mutex_);
+    try {
+        serial_.close();
+        serial_.setPort(port);
+        serial_.setTimeout(READ_TIMEOUT);
+        serial_.setLowLatency(low_latency_);
+        serial_.open();
+        serial_.flushInput();
+    } catch (...) {
+        return false;
+    }
+    printf("Opened %s\n", port.c_str());
+    fflush(stdout);
+    return true;
+}
+
+// Passes replies and telemetry to the client. Without a client, they are dropped. Reopens the
+// port if it fails and drops the client, whose reconnect then finds the board again.
+void Server::SerialThread() {
+    while (running) {
+        if (!serial_ok_) {
+            if (OpenSerial()) {
+                serial_ok_ = true;
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(RECONNECT_INTERVAL));
+            }
+            continue;
+        }
+
+        uint8_t buffer[1024];
+        size_t count = 0;
+        try {
+            if (!serial_.waitReadable()) continue;
+            size_t available = serial_.available();
+            if (available == 0) continue;
+            count = serial_.read(buffer, std::min(available, sizeof(buffer)));
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(serial_mutex_);
+                try {
+                    serial_.close();
+                } catch (...) {}
+            }
+            serial_ok_ = false;
+            printf("Lost the serial port\n");
+            fflush(stdout);
+            std::lock_guard<std::mutex> lock(client_mutex_);
+            DropClient("the serial port was lost");
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(client_mutex_);
+        if (client_fd_ == -1 || count == 0) continue;
+        size_t sent = 0;
+        while (sent < count) {
+            ssize_t ret = send(client_fd_, buffer + sent, count - sent, MSG_NOSIGNAL);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                break; // The main thread notices the broken connection.
+            }
+            sent += ret;
+        }
+        bytes_out_ += sent;
+    }
+}
+
+// Must be called while holding client_mutex_.
+void Server::DropClient(const char *reason) {
+    if (client_fd_ == -1) return;
+    double seconds = std::chrono::duration<double>(Clock::now() - connected_).count();
+    printf("Client %s disconnected, %s, after %.1f s: %llu bytes received, %llu bytes sent\n", client_name_.c_str(),
+           reason, seconds, (unsigned long long)bytes_in_, (unsigned long long)bytes_out_);
+    fflush(stdout);
+    close(client_fd_);
+    client_fd_ = -1;
+}
+
+// Takes the new connection if no client is connected, or with --take-over drops the current one.
+// Input still buffered for the old client is discarded, so the new one starts with a clean
+// stream.
+void Server::Accept() {
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    int fd = accept4(listen_fd_, reinterpret_cast<sockaddr *>(&address), &length, SOCK_CLOEXEC);
+    if (fd == -1) return;
+    int on = 1;
+    int idle_s = 1, interval_s = 1, probes = TCP_DEAD_TIMEOUT / 1000;
+    unsigned int user_timeout = TCP_DEAD_TIMEOUT;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle_s, sizeof(idle_s));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval_s, sizeof(interval_s));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+
+    std::lock_guard<std::mutex> lock(client_mutex_);
+    if (client_fd_ != -1 && !take_over_) {
+        printf("Refused %s, client %s is connected\n", peer_name(address).c_str(), client_name_.c_str());
+        fflush(stdout);
+        close(fd);
+        return;
+    }
+    DropClient("replaced by a new connection");
+    if (!serial_ok_) {
+        printf("Refused %s, the serial port is not open\n", peer_name(address).c_str());
+        fflush(stdout);
+        close(fd);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> serial_lock(serial_mutex_);
+        try {
+            serial_.flushInput();
+        } catch (...) {}
+    }
+    client_fd_ = fd;
+    client_name_ = peer_name(address);
+    connected_ = Clock::now();
+    bytes_in_ = 0;
+    bytes_out_ = 0;
+    printf("Client %s connected\n", client_name_.c_str());
+    fflush(stdout);
+}
+
+// Passes commands of the client to the board.
+void Server::ForwardToSerial() {
+    uint8_t buffer[1024];
+    ssize_t count = recv(client_fd_, buffer, sizeof(buffer), 0);
+    if (count <= 0) {
+        if (count < 0 && errno == EINTR) return;
+        std::lock_guard<std::mutex> lock(client_mutex_);
+        DropClient(count == 0 ? "closed by the client" : strerror(errno));
+        return;
+    }
+    bytes_in_ += count;
+
+    std::lock_guard<std::mutex> lock(serial_mutex_);
+    try {
+        serial::WriteBuffer data = {buffer, (size_t)count};
+        serial_.writeGather(&data, 1);
+    } catch (...) {
+        // The serial thread notices the failure and drops the client.
+    }
+}
+
+// Accepts connections and forwards the client's commands until a signal arrives.
+void Server::Run() {
+    std::thread serial_thread(&Server::SerialThread, this);
+    while (running) {
+        pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {client_fd_, POLLIN, 0}};
+        int ret = poll(fds, client_fd_ == -1 ? 1 : 2, 100);
+        if (ret <= 0) continue;
+        if (fds[1].revents && client_fd_ != -1) ForwardToSerial();
+        if (fds[0].revents & POLLIN) Accept();
+    }
+    {
+        std::lock_guard<std::mutex> lock(client_mutex_);
+        DropClient("the server stopped");
+    }
+    serial_thread.join();
+    close(listen_fd_);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string listen_address = TCP_DEFAULT_PORT;
+    bool low_latency = false;
+    bool take_over = false;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--listen" && i + 1 < argc) {
+            listen_address = argv[++i];
+        } else if (arg == "--take-over") {
+            take_over = true;
+        } else if (arg == "--low-latency") {
+            low_latency = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    Server server(argv[1], low_latency, take_over);
+    if (server.Listen(listen_address) != 0) return 1;
+    server.Run();
+    return 0;
+}